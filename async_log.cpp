@@ -0,0 +1,212 @@
+// async_log.cpp
+#include "async_log.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+
+using namespace bodhi;
+
+std::mutex AsyncLog::mutex;
+std::condition_variable AsyncLog::cv;
+std::deque<AsyncLog::Entry> AsyncLog::queue;
+std::vector<AsyncLog::Site *> AsyncLog::sites;
+std::thread AsyncLog::thread;
+bool AsyncLog::running = false;
+AsyncLog::emit_function AsyncLog::s_emit = nullptr;
+size_t AsyncLog::s_maxQueued = 4096;
+unsigned int AsyncLog::s_perSiteRate = 0;
+std::atomic<int> AsyncLog::s_maxLevel(INT32_MAX);
+std::atomic<uint64_t> AsyncLog::s_written(0);
+std::atomic<uint64_t> AsyncLog::s_suppressed(0);
+std::atomic<uint64_t> AsyncLog::s_dropped(0);
+
+namespace
+{
+  static std::atomic<int> droppedLevel(0);
+
+  static uint64_t nowSecs(void)
+  {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+  }
+
+  static void emitStderr(int level, const char *file, const char *func, int line, const char *uuid, const char *text)
+  {
+    fprintf(stderr, "%s:%d %s %s\n", file, line, uuid ? uuid : "", text);
+  }
+}
+
+void AsyncLog::start(emit_function emit, size_t maxQueued, unsigned int perSiteRate, int maxLevel)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  s_emit = emit;
+  s_maxQueued = maxQueued;
+  s_perSiteRate = perSiteRate;
+  s_maxLevel = maxLevel;
+  if (running)
+    return;
+  running = true;
+  thread = std::thread(&AsyncLog::run);
+}
+
+void AsyncLog::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+bool AsyncLog::admit(Site &site, int level)
+{
+  if (0 == s_perSiteRate)
+    return true;
+
+  // fixed one-second windows; a race on the reset lets a line or two extra through
+  uint64_t now = nowSecs();
+  uint64_t window = site.window.load(std::memory_order_relaxed);
+  if (window != now && site.window.compare_exchange_strong(window, now, std::memory_order_relaxed))
+    site.count.store(0, std::memory_order_relaxed);
+  if (site.count.fetch_add(1, std::memory_order_relaxed) < s_perSiteRate)
+    return true;
+
+  site.suppressed++;
+  site.level = level;
+  s_suppressed++;
+  if (!site.registered.exchange(true))
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    sites.push_back(&site);
+  }
+  return false;
+}
+
+void AsyncLog::printf(Site &site, int level, const char *uuid, const char *fmt, ...)
+{
+  if (!enabled(level) || !admit(site, level))
+    return;
+
+  char buf[2048];
+  va_list ap;
+  va_start(ap, fmt);
+  int n = vsnprintf(buf, sizeof(buf), fmt, ap);
+  va_end(ap);
+  if (n < 0)
+    return;
+  // callers end lines with a newline, as for switch_log_printf
+  size_t len = std::min<size_t>(n, sizeof(buf) - 1);
+  while (len > 0 && buf[len - 1] == '\n')
+    len--;
+  std::string text(buf, len);
+  enqueue(site, level, uuid, text);
+}
+
+void AsyncLog::write(Site &site, int level, const char *uuid, const char *text)
+{
+  if (!enabled(level) || !admit(site, level))
+    return;
+
+  std::string line(text);
+  while (!line.empty() && line.back() == '\n')
+    line.pop_back();
+  enqueue(site, level, uuid, line);
+}
+
+void AsyncLog::enqueue(Site &site, int level, const char *uuid, std::string &text)
+{
+  uint32_t suppressed = site.suppressed.exchange(0);
+  if (suppressed)
+    text += " [" + std::to_string(suppressed) + " similar lines suppressed]";
+
+  std::unique_lock<std::mutex> lk(mutex);
+  if (!running)
+  {
+    emit_function emit = s_emit ? s_emit : emitStderr;
+    lk.unlock();
+    emit(level, site.file, site.func, site.line, uuid, text.c_str());
+    s_written++;
+    return;
+  }
+  if (queue.size() >= s_maxQueued)
+  {
+    s_dropped++;
+    droppedLevel = level;
+    return;
+  }
+  queue.push_back({level, &site, uuid ? uuid : "", std::move(text)});
+  if (queue.size() == 1)
+    cv.notify_one();
+}
+
+void AsyncLog::summarize(bool all)
+{
+  // counts for sites that have gone quiet since, which no later line will carry
+  uint64_t now = all ? UINT64_MAX : nowSecs();
+  std::vector<Site *> quiet;
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    for (Site *site : sites)
+    {
+      if (site->suppressed.load() && site->window.load() < now)
+        quiet.push_back(site);
+    }
+  }
+  for (Site *site : quiet)
+  {
+    uint32_t n = site->suppressed.exchange(0);
+    if (!n)
+      continue;
+    std::string text = std::to_string(n) + " similar lines suppressed";
+    s_emit(site->level, site->file, site->func, site->line, nullptr, text.c_str());
+  }
+}
+
+void AsyncLog::run(void)
+{
+  static Site site(__FILE__, __func__, __LINE__);
+  uint64_t reportedDropped = 0;
+  auto lastSummary = std::chrono::steady_clock::now();
+  std::unique_lock<std::mutex> lk(mutex);
+  while (true)
+  {
+    cv.wait_for(lk, std::chrono::seconds(1), []
+                { return !running || !queue.empty(); });
+    std::deque<Entry> batch;
+    batch.swap(queue);
+    bool stopping = !running;
+    lk.unlock();
+
+    for (const Entry &e : batch)
+    {
+      s_emit(e.level, e.site->file, e.site->func, e.site->line, e.uuid.empty() ? nullptr : e.uuid.c_str(), e.text.c_str());
+      s_written++;
+    }
+    uint64_t dropped = s_dropped;
+    if (dropped != reportedDropped)
+    {
+      std::string text = "log queue full, " + std::to_string(dropped - reportedDropped) + " lines dropped";
+      s_emit(droppedLevel, site.file, site.func, site.line, nullptr, text.c_str());
+      reportedDropped = dropped;
+    }
+    if (stopping || std::chrono::steady_clock::now() - lastSummary >= std::chrono::seconds(1))
+    {
+      summarize(stopping);
+      lastSummary = std::chrono::steady_clock::now();
+    }
+
+    lk.lock();
+    if (stopping && queue.empty())
+      break;
+  }
+}
+
+AsyncLog::Stats AsyncLog::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  return {s_written, s_suppressed, s_dropped, queue.size()};
+}
@@ -0,0 +1,99 @@
+#ifndef __BODHI_ASYNC_LOG_HPP__
+#define __BODHI_ASYNC_LOG_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// log from a hot path: at most the configured rate per call site and second, the rest counted
+// and reported with the next line the site gets through (or on their own once it goes quiet)
+#define BODHI_LOG(uuid, level, ...)                                                   \
+  do                                                                                  \
+  {                                                                                   \
+    static bodhi::AsyncLog::Site bodhi_log_site_(__FILE__, __func__, __LINE__);       \
+    bodhi::AsyncLog::printf(bodhi_log_site_, (level), (uuid), __VA_ARGS__);           \
+  } while (0)
+
+namespace bodhi
+{
+
+  // Log lines from the media bug and service threads are rate-limited and level-filtered
+  // where they are logged, then handed to a background thread that writes them, so a
+  // flood of log I/O never stalls audio.  Levels are the host's: lower is more severe.
+  class AsyncLog
+  {
+  public:
+    typedef void (*emit_function)(int level, const char *file, const char *func, int line, const char *uuid, const char *text);
+
+    struct Site
+    {
+      Site(const char *file, const char *func, int line) : file(file), func(func), line(line), window(0), count(0), suppressed(0),
+                                                           level(0), registered(false) {}
+      const char *file;
+      const char *func;
+      int line;
+      std::atomic<uint64_t> window; // second the count is for
+      std::atomic<uint32_t> count;
+      std::atomic<uint32_t> suppressed;
+      std::atomic<int> level;
+      std::atomic<bool> registered;
+    };
+
+    struct Stats
+    {
+      uint64_t written;
+      uint64_t suppressed; // over the per-site rate
+      uint64_t dropped;    // queue full
+      uint64_t queued;
+    };
+
+    // lines logged before start() or after stop() are emitted on the caller's thread
+    static void start(emit_function emit, size_t maxQueued, unsigned int perSiteRate, int maxLevel);
+    static void stop(void);
+    static void setMaxLevel(int maxLevel) { s_maxLevel = maxLevel; }
+    static bool enabled(int level) { return level <= s_maxLevel; }
+
+    static void printf(Site &site, int level, const char *uuid, const char *fmt, ...)
+#ifdef __GNUC__
+        __attribute__((format(printf, 4, 5)))
+#endif
+        ;
+    // a line that is already formatted, e.g. from the lws logger
+    static void write(Site &site, int level, const char *uuid, const char *text);
+
+    static Stats getStats(void);
+
+  private:
+    struct Entry
+    {
+      int level;
+      Site *site;
+      std::string uuid;
+      std::string text;
+    };
+
+    static bool admit(Site &site, int level);
+    static void enqueue(Site &site, int level, const char *uuid, std::string &text);
+    static void summarize(bool all);
+    static void run(void);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::deque<Entry> queue;
+    static std::vector<Site *> sites; // ones that have had lines suppressed
+    static std::thread thread;
+    static bool running;
+    static emit_function s_emit;
+    static size_t s_maxQueued;
+    static unsigned int s_perSiteRate;
+    static std::atomic<int> s_maxLevel;
+    static std::atomic<uint64_t> s_written, s_suppressed, s_dropped;
+  };
+
+} // namespace bodhi
+#endif
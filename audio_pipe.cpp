@@ -1,642 +1,555 @@
 // audio_pipe.cpp
 #include "audio_pipe.hpp"
 
+#include <algorithm>
 #include <cassert>
-#include <iostream>
-#include <ctime>
-#include <sstream>
+#include <cstdint>
+#include <cstring>
+#include <strings.h>
+#include "buffer_pool.hpp"
+#include "drain.hpp"
+#include "journal.hpp"
+#include "transcript_ring.hpp"
 #include "utils.hpp"
 
 
 /* discard incoming text messages over the socket that are longer than this */
 #define MAX_RECV_BUF_SIZE (65 * 1024 * 10)
 #define RECV_BUF_REALLOC_SIZE (8 * 1024)
+/* a config message that nothing acknowledges this long after it was sent counts as not taken */
+#define RECONFIGURE_ACK_MS 5000
 
 using namespace bodhi;
 
-namespace
+Transport *AudioPipe::defaultTransport = nullptr;
+
+// instance members
+AudioPipe::AudioPipe(const char *uuid, const char *host, unsigned int port, const char *path,
+                     size_t bufLen, size_t minFreespace, const char *apiKey, const char *customerId, const int sampleRate,
+                     const char *modelName, notifyHandler_t callback, Transport *transport) : m_audio_buffer_write_offset(LWS_PRE), m_audio_buffer_max_len(bufLen),
+                                                                                              m_audio_buffer_min_freespace(minFreespace), m_state(LWS_CLIENT_IDLE), m_channels(1),
+                                                                                              m_transportData(nullptr), m_overrun_policy(OVERRUN_DROP_OLDEST), m_audio_max_age_bytes(SIZE_MAX),
+                                                                                              m_audio_buffer_cap_len(bufLen), m_audio_dropped_bytes(0), m_recv_buf(nullptr), m_recv_buf_ptr(nullptr),
+                                                                                              m_recv_buf_len(0), m_callback(callback), m_userData(nullptr), m_gracefulShutdown(false), m_finished(false), m_segmentOpen(false), m_peerTimedOut(false),
+                                                                                              m_reconfigureState(RECONFIGURE_NONE), m_reconfigureTimerSet(false), m_connectQueueMs(0), m_handshakeMs(0), m_backlogMs(0), m_rttMs(0), m_uuid(uuid),
+                                                                                              m_host(host), m_path(path), m_apiKey(apiKey), m_customerId(customerId), m_modelName(modelName),
+                                                                                              m_port(port), m_sslFlags(LCCSCF_USE_SSL), m_deflate(false), m_notifyWritten(false), m_tap(nullptr), m_tenant(nullptr), m_deltas(nullptr), m_sampleRate(sampleRate),
+                                                                                              m_openedAt(std::chrono::steady_clock::now()), m_drainCounted(true), m_audioBuffered(false), m_tenantHeld(false)
 {
-  static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
-  static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
+  m_transport = transport ? transport : defaultTransport;
+  assert(m_transport != nullptr);
+  m_audio_buffer = (uint8_t *)BufferPool::instance().acquire(m_audio_buffer_max_len);
+  m_closed = m_promise.get_future().share();
+  Drain::pipeOpened();
+}
+AudioPipe::~AudioPipe()
+{
+  leaveDrainCount();
+  releaseTenant();
+  m_transport->release(this);
+  if (m_tap)
+    m_tap->close();
+  delete m_deltas;
+  BufferPool::instance().release(m_audio_buffer, m_audio_buffer_max_len);
+  if (m_recv_buf)
+    free(m_recv_buf);
 }
 
-// static int dch_lws_http_basic_auth_gen(const char *apiKey, char *buf, size_t len) {
-// 	size_t n = strlen(apiKey);
+void *AudioPipe::operator new(size_t size)
+{
+  return BufferPool::instance().acquire(size);
+}
 
-// 	if (len < n + 7)
-// 		return 1;
+void AudioPipe::operator delete(void *ptr, size_t size)
+{
+  BufferPool::instance().release(ptr, size);
+}
 
-// 	strcpy(buf,"Token ");
-//   strcpy(buf + 6, apiKey);
-// 	return 0;
-// }
+bool AudioPipe::parseOverrunPolicy(const char *name, OverrunPolicy_t &policy)
+{
+  if (0 == strcasecmp(name, "reset"))
+    policy = OVERRUN_RESET;
+  else if (0 == strcasecmp(name, "drop-oldest"))
+    policy = OVERRUN_DROP_OLDEST;
+  else if (0 == strcasecmp(name, "max-age"))
+    policy = OVERRUN_MAX_AGE;
+  else if (0 == strcasecmp(name, "grow"))
+    policy = OVERRUN_GROW;
+  else
+    return false;
+  return true;
+}
 
-int AudioPipe::lws_callback(struct lws *wsi,
-                            enum lws_callback_reasons reason,
-                            void *user, void *in, size_t len)
+const char *AudioPipe::overrunPolicyName(OverrunPolicy_t policy)
 {
+  switch (policy)
+  {
+  case OVERRUN_RESET:
+    return "reset";
+  case OVERRUN_MAX_AGE:
+    return "max-age";
+  case OVERRUN_GROW:
+    return "grow";
+  default:
+    return "drop-oldest";
+  }
+}
 
-  struct AudioPipe::lws_per_vhost_data *vhd =
-      (struct AudioPipe::lws_per_vhost_data *)lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+void AudioPipe::setOverrunPolicy(OverrunPolicy_t policy, unsigned int maxAgeMs, size_t maxBufLen)
+{
+  std::lock_guard<std::mutex> lk(m_audio_mutex);
+  m_overrun_policy = policy;
+  m_audio_max_age_bytes = policy == OVERRUN_MAX_AGE ? std::max<size_t>((uint64_t)maxAgeMs * bytesPerSec() / 1000, m_audio_buffer_min_freespace) : SIZE_MAX;
+  m_audio_buffer_cap_len = policy == OVERRUN_GROW ? std::max(maxBufLen, m_audio_buffer_max_len) : m_audio_buffer_max_len;
+}
 
-  struct lws_vhost *vhost = lws_get_vhost(wsi);
-  AudioPipe **ppAp = (AudioPipe **)user;
+uint64_t AudioPipe::getDroppedMs(void)
+{
+  size_t perSec = bytesPerSec();
+  return perSec ? m_audio_dropped_bytes * 1000 / perSec : 0;
+}
 
-  switch (reason)
-  {
-  case LWS_CALLBACK_PROTOCOL_INIT:
-    vhd = (struct AudioPipe::lws_per_vhost_data *)lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi), lws_get_protocol(wsi), sizeof(struct AudioPipe::lws_per_vhost_data));
-    vhd->context = lws_get_context(wsi);
-    vhd->protocol = lws_get_protocol(wsi);
-    vhd->vhost = lws_get_vhost(wsi);
+void AudioPipe::binaryDrop(size_t len)
+{
+  size_t buffered = m_audio_buffer_write_offset - LWS_PRE;
+  size_t frame = 2 * m_channels;
+
+  // keep whole sample frames so channels stay interleaved correctly
+  len = std::min(buffered, (len + frame - 1) / frame * frame);
+  if (len < buffered)
+    memmove(m_audio_buffer + LWS_PRE, m_audio_buffer + LWS_PRE + len, buffered - len);
+  m_audio_buffer_write_offset -= len;
+  m_audioBuffered = m_audio_buffer_write_offset > LWS_PRE;
+  m_audio_dropped_bytes += len;
+}
 
-    break;
+void AudioPipe::binaryMakeSpace(size_t needed)
+{
+  size_t available = binarySpaceAvailable();
+  if (available >= needed)
+    return;
 
-  case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
+  if (m_overrun_policy == OVERRUN_GROW && m_audio_buffer_max_len < m_audio_buffer_cap_len)
   {
-    AudioPipe *ap = findPendingConnect(wsi);
-    unsigned char **p, *end;
-    if (ap)
-    {
-      p = (unsigned char **)in;
-      end = (*p) + len;
+    size_t newlen = std::min(m_audio_buffer_cap_len, std::max(m_audio_buffer_max_len * 2, m_audio_buffer_write_offset + needed));
+    uint8_t *buf = (uint8_t *)BufferPool::instance().acquire(newlen);
+    memcpy(buf, m_audio_buffer, m_audio_buffer_write_offset);
+    BufferPool::instance().release(m_audio_buffer, m_audio_buffer_max_len);
+    m_audio_buffer = buf;
+    m_audio_buffer_max_len = newlen;
+    lwsl_notice("AudioPipe::binaryMakeSpace %s grew audio buffer to %lu bytes\n", m_uuid.c_str(), newlen);
+    available = binarySpaceAvailable();
+    if (available >= needed)
+      return;
+  }
 
-      std::string apiKey = ap->getApiKey();
-      std::string customerId = ap->getCustomerId();
+  if (m_overrun_policy == OVERRUN_RESET)
+  {
+    binaryDrop(m_audio_buffer_write_offset - LWS_PRE);
+    return;
+  }
+  // drop back to 3/4 of the buffer, so a stalled pipe shifts it once per quarter buffer rather
+  // than on every frame
+  size_t buffered = m_audio_buffer_write_offset - LWS_PRE;
+  size_t keep = (m_audio_buffer_max_len - LWS_PRE) / 4 * 3;
+  binaryDrop(std::max(needed - available, buffered > keep ? buffered - keep : 0));
+}
 
-      if (lws_add_http_header_by_name(wsi, (unsigned char *)"x-customer-id:", (unsigned char *)customerId.c_str(), customerId.length(), p, end))
-        return -1;
+void AudioPipe::connect(void)
+{
+  m_connectStartedAt = std::chrono::steady_clock::now();
+  m_transport->connect(this);
+}
 
-      if (lws_add_http_header_by_name(wsi, (unsigned char *)"x-api-key:", (unsigned char *)apiKey.c_str(), apiKey.length(), p, end))
-        return -1;
-    }
-  }
-  break;
-
-  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
-    processPendingConnects(vhd);
-    processPendingDisconnects(vhd);
-    processPendingWrites();
-    break;
-  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+void AudioPipe::bufferForSending(const char *text)
+{
+  if (m_state != LWS_CLIENT_CONNECTED)
+    return;
   {
-    AudioPipe *ap = findAndRemovePendingConnect(wsi);
-    int rc = lws_http_client_http_response(wsi);
-    const char *msg = utils::http_status_text(rc);
-
-    lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc);
-    if (ap)
-    {
-        ap->m_state = LWS_CLIENT_FAILED;
-        std::stringstream json;
-        json << "{"
-             << "\"message\":\"" << msg << "\","
-             << "\"code\":" << rc << ","
-             << "\"timestamp\":\"" << utils::getCurrentTimestamp() << "\""
-             << "}";
-        ap->m_callback(ap->m_uuid.c_str(), AudioPipe::CONNECT_FAIL, json.str().c_str(), ap->isFinished());
-    }
-    else
-    {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi);
-    }
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    m_metadata.append(text);
   }
-  break;
+  m_transport->requestWrite(this);
+}
 
-  case LWS_CALLBACK_CLIENT_ESTABLISHED:
-  {
-    AudioPipe *ap = findAndRemovePendingConnect(wsi);
-    if (ap)
-    {
-      *ppAp = ap;
-      ap->m_vhd = vhd;
-      ap->m_state = LWS_CLIENT_CONNECTED;
-      ap->m_callback(ap->m_uuid.c_str(), AudioPipe::CONNECT_SUCCESS, NULL, ap->isFinished());
+void AudioPipe::unlockAudioBuffer()
+{
+  if (m_audio_buffer_write_offset > LWS_PRE && m_state == LWS_CLIENT_CONNECTED)
+    m_transport->requestWrite(this);
+  m_audio_mutex.unlock();
+}
 
-      // Construct the JSON string
-      std::string json = "{\"config\": {\"sample_rate\": " + std::to_string(ap->m_sampleRate) + ", \"transaction_id\": \"" + ap->m_uuid.c_str() + "\", \"model\": \"" + ap->m_modelName.c_str() + "\"}}";
+void AudioPipe::close()
+{
+  if (m_state != LWS_CLIENT_CONNECTED)
+    return;
+  m_state = LWS_CLIENT_DISCONNECTING;
+  m_transport->disconnect(this);
+}
 
-      // Send the JSON string
-      ap->bufferForSending(json.c_str());
-    }
-    else
+bool AudioPipe::reconfigure(const char *modelName)
+{
+  if (m_finished || m_state != LWS_CLIENT_CONNECTED)
+    return false;
+  {
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    m_requestedModel = InternedString(modelName);
+    if (m_segmentOpen)
     {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_ESTABLISHED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi);
+      // onReceive sends it when the segment completes
+      m_reconfigureState = RECONFIGURE_WAITING;
+      return true;
     }
+    m_reconfigureState = RECONFIGURE_SENT;
+    m_reconfigureTimerSet = false;
+    m_metadata.append(utils::buildConfigMessage(m_sampleRate, m_uuid, modelName));
   }
-  break;
-  case LWS_CALLBACK_CLIENT_CLOSED:
+  m_transport->requestWrite(this);
+  return true;
+}
+
+void AudioPipe::finish()
+{
+  if (m_finished)
+    return;
+  if (m_state == LWS_CLIENT_IDLE || m_state == LWS_CLIENT_CONNECTING)
   {
-    AudioPipe *ap = *ppAp;
-    if (!ap)
-    {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_CLOSED %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi);
-      return 0;
-    }
-    if (ap->m_state == LWS_CLIENT_DISCONNECTING)
-    {
-      // closed by us
+    // the transport drops a queued connect, and closes one that completes
+    m_finished = true;
+    return;
+  }
+  if (m_state != LWS_CLIENT_CONNECTED)
+    return;
+  m_finished = true;
+  bufferForSending("{\"eof\": \"1\"}");
+}
 
-      lwsl_debug("%s socket closed by us\n", ap->m_uuid.c_str());
-      ap->m_callback(ap->m_uuid.c_str(), AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, ap->isFinished());
-    }
-    else if (ap->m_state == LWS_CLIENT_CONNECTED)
-    {
-      // closed by far end
-      lwsl_info("%s socket closed by far end\n", ap->m_uuid.c_str());
-      ap->m_callback(ap->m_uuid.c_str(), AudioPipe::CONNECTION_DROPPED, NULL, ap->isFinished());
-    }
-    ap->m_state = LWS_CLIENT_DISCONNECTED;
-    ap->setClosed();
+std::string AudioPipe::getModelName(void)
+{
+  std::lock_guard<std::mutex> lk(m_text_mutex);
+  return m_modelName.str();
+}
 
-    // NB: after receiving any of the events above, any holder of a
-    // pointer or reference to this object must treat is as no longer valid
+void AudioPipe::setClosed()
+{
+  leaveDrainCount();
+  releaseTenant();
+  m_promise.set_value();
+}
 
-    //*ppAp = NULL;
-    // delete ap;
-  }
-  break;
+void AudioPipe::releaseTenant(void)
+{
+  if (m_tenantHeld.exchange(false))
+    Tenants::release(m_tenant);
+}
+
+void AudioPipe::leaveDrainCount(void)
+{
+  if (m_drainCounted.exchange(false))
+    Drain::pipeClosed(m_openedAt);
+}
+
+void AudioPipe::waitForClose()
+{
+  m_closed.wait();
+}
 
-  case LWS_CALLBACK_CLIENT_RECEIVE:
+void AudioPipe::onConnected(void)
+{
+  m_state = LWS_CLIENT_CONNECTED;
+  m_connectedAt = std::chrono::steady_clock::now();
+  long handshakeMs = std::chrono::duration_cast<std::chrono::milliseconds>(m_connectedAt - m_connectStartedAt).count() - m_connectQueueMs;
+  m_handshakeMs = std::max(0L, handshakeMs);
   {
-    AudioPipe *ap = *ppAp;
-    if (!ap)
-    {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi);
-      return 0;
-    }
+    std::lock_guard<std::mutex> lk(m_audio_mutex);
+    m_backlogMs = (uint64_t)(m_audio_buffer_write_offset - LWS_PRE) * 1000 / bytesPerSec();
+  }
+  if (m_finished)
+  {
+    close();
+    return;
+  }
+  m_callback(m_uuid.c_str(), m_userData, AudioPipe::CONNECT_SUCCESS, NULL, isFinished());
 
-    if (lws_frame_is_binary(wsi))
-    {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE received binary frame, discarding.\n");
-      return 0;
-    }
+  // Construct the JSON string
+  std::string json = utils::buildConfigMessage(m_sampleRate, m_uuid, getModelName());
 
-    if (lws_is_first_fragment(wsi))
-    {
-      // allocate a buffer for the entire chunk of memory needed
-      assert(nullptr == ap->m_recv_buf);
-      ap->m_recv_buf_len = len + lws_remaining_packet_payload(wsi);
-      ap->m_recv_buf = (uint8_t *)malloc(ap->m_recv_buf_len);
-      ap->m_recv_buf_ptr = ap->m_recv_buf;
-    }
+  // Send the JSON string
+  bufferForSending(json.c_str());
+}
 
-    size_t write_offset = ap->m_recv_buf_ptr - ap->m_recv_buf;
-    size_t remaining_space = ap->m_recv_buf_len - write_offset;
-    if (remaining_space < len)
-    {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE buffer realloc needed.\n");
-      size_t newlen = ap->m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
-      if (newlen > MAX_RECV_BUF_SIZE)
-      {
-        free(ap->m_recv_buf);
-        ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-        ap->m_recv_buf_len = 0;
-        lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE max buffer exceeded, truncating message.\n");
-      }
-      else
-      {
-        ap->m_recv_buf = (uint8_t *)realloc(ap->m_recv_buf, newlen);
-        if (nullptr != ap->m_recv_buf)
-        {
-          ap->m_recv_buf_len = newlen;
-          ap->m_recv_buf_ptr = ap->m_recv_buf + write_offset;
-        }
-      }
-    }
+long AudioPipe::getResultLatencyMs(const char *json)
+{
+  long audioEndMs = utils::getJsonInt(json, strlen(json), "audio_end_ms", -1);
+  if (audioEndMs < 0)
+    return -1;
+
+  // the backlog went out as soon as we connected, the rest in real time after it
+  long sentAtMs = std::max(0L, audioEndMs - (long)m_backlogMs);
+  long sinceConnectMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_connectedAt).count();
+  return std::max(0L, sinceConnectMs - sentAtMs);
+}
 
-    if (nullptr != ap->m_recv_buf)
-    {
-      if (len > 0)
-      {
-        memcpy(ap->m_recv_buf_ptr, in, len);
-        ap->m_recv_buf_ptr += len;
-      }
-      if (lws_is_final_fragment(wsi))
-      {
-        if (nullptr != ap->m_recv_buf)
-        {
-          std::string msg((char *)ap->m_recv_buf, ap->m_recv_buf_ptr - ap->m_recv_buf);
-          ap->m_callback(ap->m_uuid.c_str(), AudioPipe::MESSAGE, msg.c_str(), ap->isFinished());
-          if (nullptr != ap->m_recv_buf)
-            free(ap->m_recv_buf);
-        }
-        ap->m_recv_buf = ap->m_recv_buf_ptr = nullptr;
-        ap->m_recv_buf_len = 0;
-      }
-    }
+void AudioPipe::onConnectFail(int httpStatus)
+{
+  m_state = LWS_CLIENT_FAILED;
+  std::string json = utils::buildConnectFailMessage(httpStatus);
+  m_callback(m_uuid.c_str(), m_userData, AudioPipe::CONNECT_FAIL, json.c_str(), isFinished());
+  setClosed();
+}
+
+void AudioPipe::onConnectCancelled(void)
+{
+  m_state = LWS_CLIENT_DISCONNECTED;
+  setClosed();
+}
+
+void AudioPipe::onPong(uint32_t rttMs)
+{
+  m_rttMs = rttMs;
+  std::string ms = std::to_string(rttMs);
+  m_callback(m_uuid.c_str(), m_userData, AudioPipe::PONG, ms.c_str(), isFinished());
+}
+
+void AudioPipe::onReceive(const void *in, size_t len, bool isFirst, bool isFinal, size_t remaining)
+{
+  if (isFirst)
+  {
+    // allocate a buffer for the entire chunk of memory needed
+    assert(nullptr == m_recv_buf);
+    m_recv_buf_len = len + remaining;
+    m_recv_buf = (uint8_t *)malloc(m_recv_buf_len);
+    m_recv_buf_ptr = m_recv_buf;
   }
-  break;
 
-  case LWS_CALLBACK_CLIENT_WRITEABLE:
+  size_t write_offset = m_recv_buf_ptr - m_recv_buf;
+  size_t remaining_space = m_recv_buf_len - write_offset;
+  if (remaining_space < len)
   {
-    AudioPipe *ap = *ppAp;
-    if (!ap)
+    lwsl_err("AudioPipe::onReceive %s buffer realloc needed.\n", m_uuid.c_str());
+    size_t newlen = m_recv_buf_len + RECV_BUF_REALLOC_SIZE;
+    if (newlen > MAX_RECV_BUF_SIZE)
     {
-      lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE %s unable to find wsi %p..\n", ap->m_uuid.c_str(), wsi);
-      return 0;
+      free(m_recv_buf);
+      m_recv_buf = m_recv_buf_ptr = nullptr;
+      m_recv_buf_len = 0;
+      lwsl_err("AudioPipe::onReceive %s max buffer exceeded, truncating message.\n", m_uuid.c_str());
     }
-
-    // check for text frames to send
+    else
     {
-      std::lock_guard<std::mutex> lk(ap->m_text_mutex);
-      if (ap->m_metadata.length() > 0)
+      m_recv_buf = (uint8_t *)realloc(m_recv_buf, newlen);
+      if (nullptr != m_recv_buf)
       {
-        uint8_t buf[ap->m_metadata.length() + LWS_PRE];
-        memcpy(buf + LWS_PRE, ap->m_metadata.c_str(), ap->m_metadata.length());
-        int n = ap->m_metadata.length();
-        int m = lws_write(wsi, buf + LWS_PRE, n, LWS_WRITE_TEXT);
-        ap->m_metadata.clear();
-        if (m < n)
-        {
-          return -1;
-        }
-
-        // there may be audio data, but only one write per writeable event
-        // get it next time
-        lws_callback_on_writable(wsi);
-
-        return 0;
+        m_recv_buf_len = newlen;
+        m_recv_buf_ptr = m_recv_buf + write_offset;
       }
     }
+  }
 
-    if (ap->m_state == LWS_CLIENT_DISCONNECTING)
+  if (nullptr != m_recv_buf)
+  {
+    if (len > 0)
     {
-      lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
-      return -1;
+      memcpy(m_recv_buf_ptr, in, len);
+      m_recv_buf_ptr += len;
     }
-
-    // check for audio packets
+    if (isFinal)
     {
-      std::lock_guard<std::mutex> lk(ap->m_audio_mutex);
-      if (ap->m_audio_buffer_write_offset > LWS_PRE)
+      if (nullptr != m_recv_buf)
       {
-        size_t datalen = ap->m_audio_buffer_write_offset - LWS_PRE;
-        int sent = lws_write(wsi, (unsigned char *)ap->m_audio_buffer + LWS_PRE, datalen, LWS_WRITE_BINARY);
-        if (sent < datalen)
+        std::string msg((char *)m_recv_buf, m_recv_buf_ptr - m_recv_buf);
+        if (Journal::isOpen() || TranscriptRing::isOpen())
         {
-          lwsl_err("AudioPipe::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE %s attemped to send %lu only sent %d wsi %p..\n",
-                   ap->m_uuid.c_str(), datalen, sent, wsi);
+          uint64_t callMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - m_connectedAt).count();
+          if (Journal::isOpen())
+            Journal::append(m_uuid, callMs, msg.data(), msg.length());
+          if (TranscriptRing::isOpen())
+            TranscriptRing::publish(m_uuid, callMs, msg.data(), msg.length());
         }
-        ap->m_audio_buffer_write_offset = LWS_PRE;
+        handleMessage(msg);
+        if (nullptr != m_recv_buf)
+          free(m_recv_buf);
       }
+      m_recv_buf = m_recv_buf_ptr = nullptr;
+      m_recv_buf_len = 0;
     }
-
-    return 0;
   }
-  break;
-
-  default:
-    break;
-  }
-  return lws_callback_http_dummy(wsi, reason, user, in, len);
 }
 
-// static members
-static const lws_retry_bo_t retry = {
-    nullptr,    // retry_ms_table
-    0,          // retry_ms_table_count
-    0,          // conceal_count
-    UINT16_MAX, // secs_since_valid_ping
-    UINT16_MAX, // secs_since_valid_hangup
-    0           // jitter_percent
-};
-
-struct lws_context *AudioPipe::contexts[] = {
-    nullptr, nullptr, nullptr, nullptr, nullptr,
-    nullptr, nullptr, nullptr, nullptr, nullptr};
-unsigned int AudioPipe::numContexts = 0;
-unsigned int AudioPipe::nchild = 0;
-std::string AudioPipe::protocolName;
-std::mutex AudioPipe::mutex_connects;
-std::mutex AudioPipe::mutex_disconnects;
-std::mutex AudioPipe::mutex_writes;
-std::list<AudioPipe *> AudioPipe::pendingConnects;
-std::list<AudioPipe *> AudioPipe::pendingDisconnects;
-std::list<AudioPipe *> AudioPipe::pendingWrites;
-AudioPipe::log_emit_function AudioPipe::logger;
-std::mutex AudioPipe::mapMutex;
-std::unordered_map<std::thread::id, bool> AudioPipe::stopFlags;
-std::queue<std::thread::id> AudioPipe::threadIds;
-
-void AudioPipe::processPendingConnects(lws_per_vhost_data *vhd)
+void AudioPipe::handleMessage(const std::string &msg)
 {
-  std::list<AudioPipe *> connects;
+  if (m_tap)
+    m_tap->push(AudioTap::TAP_RESULT, (const uint8_t *)msg.data(), msg.length());
+  NotifyEvent_t reconfigured = MESSAGE;
+  bool sendConfig = false;
+  std::string model;
   {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    for (auto it = pendingConnects.begin(); it != pendingConnects.end(); ++it)
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    if (m_reconfigureState == RECONFIGURE_SENT)
     {
-      if ((*it)->m_state == LWS_CLIENT_IDLE)
+      // taken once the server acknowledges it or a result names the new model; results without
+      // a model may still be from the old one, and onTimer gives up if nothing answers
+      std::string echoed;
+      bool named = utils::getJsonString(msg.data(), msg.length(), "model", echoed);
+      if (utils::hasJsonKey(msg.c_str(), "error"))
+        reconfigured = RECONFIGURE_FAILED;
+      else if (named ? echoed == m_requestedModel.str()
+                     : !utils::hasJsonKey(msg.c_str(), "segment_id") && !utils::hasJsonKey(msg.c_str(), "text"))
+        reconfigured = RECONFIGURED;
+      if (reconfigured != MESSAGE)
       {
-        connects.push_back(*it);
-        (*it)->m_state = LWS_CLIENT_CONNECTING;
+        if (reconfigured == RECONFIGURED)
+          m_modelName = m_requestedModel;
+        m_reconfigureState = RECONFIGURE_NONE;
+        model = m_requestedModel.str();
       }
     }
-  }
-  for (auto it = connects.begin(); it != connects.end(); ++it)
-  {
-    AudioPipe *ap = *it;
-    ap->connect_client(vhd);
-  }
-}
-
-void AudioPipe::processPendingDisconnects(lws_per_vhost_data *vhd)
-{
-  std::list<AudioPipe *> disconnects;
-  {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    for (auto it = pendingDisconnects.begin(); it != pendingDisconnects.end(); ++it)
+    m_segmentOpen = !utils::isSegmentFinal(msg.data(), msg.length());
+    if (m_reconfigureState == RECONFIGURE_WAITING && !m_segmentOpen && !m_finished)
     {
-      if ((*it)->m_state == LWS_CLIENT_DISCONNECTING)
-        disconnects.push_back(*it);
+      m_metadata.append(utils::buildConfigMessage(m_sampleRate, m_uuid, m_requestedModel.str()));
+      m_reconfigureState = RECONFIGURE_SENT;
+      m_reconfigureTimerSet = false;
+      sendConfig = true;
     }
-    pendingDisconnects.clear();
-  }
-  for (auto it = disconnects.begin(); it != disconnects.end(); ++it)
-  {
-    AudioPipe *ap = *it;
-    lws_callback_on_writable(ap->m_wsi);
   }
-}
 
-void AudioPipe::processPendingWrites()
-{
-  std::list<AudioPipe *> writes;
+  // only an error answer is swallowed; results always go on to the callback
+  if (reconfigured == RECONFIGURE_FAILED)
   {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    for (auto it = pendingWrites.begin(); it != pendingWrites.end(); ++it)
-    {
-      if ((*it)->m_state == LWS_CLIENT_CONNECTED)
-        writes.push_back(*it);
-    }
-    pendingWrites.clear();
-  }
-  for (auto it = writes.begin(); it != writes.end(); ++it)
-  {
-    AudioPipe *ap = *it;
-    lws_callback_on_writable(ap->m_wsi);
+    lwsl_notice("AudioPipe::handleMessage %s model %s rejected: %s\n", m_uuid.c_str(), model.c_str(), msg.c_str());
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::RECONFIGURE_FAILED, model.c_str(), isFinished());
+    return;
   }
+  if (reconfigured == RECONFIGURED)
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::RECONFIGURED, model.c_str(), isFinished());
+  std::string delta;
+  if (m_deltas && m_deltas->encode(msg, delta))
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::MESSAGE, delta.c_str(), isFinished());
+  else
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::MESSAGE, msg.c_str(), isFinished());
+  if (sendConfig)
+    m_transport->requestWrite(this);
 }
 
-AudioPipe *AudioPipe::findAndRemovePendingConnect(struct lws *wsi)
+void AudioPipe::onTimer(void)
 {
-  AudioPipe *ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
-  std::list<AudioPipe *> toRemove;
-
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it)
+  std::string model;
   {
-    int state = (*it)->m_state;
-
-    if ((*it)->m_wsi == nullptr)
-      toRemove.push_back(*it);
-
-    if ((state == LWS_CLIENT_CONNECTING) &&
-        (*it)->m_wsi == wsi)
-      ap = *it;
-  }
-
-  for (auto it = toRemove.begin(); it != toRemove.end(); ++it)
-    pendingConnects.remove(*it);
-
-  if (ap)
-  {
-    pendingConnects.remove(ap);
+    std::lock_guard<std::mutex> lk(m_text_mutex);
+    if (m_reconfigureState != RECONFIGURE_SENT || !m_reconfigureTimerSet ||
+        std::chrono::steady_clock::now() - m_reconfigureSentAt < std::chrono::milliseconds(RECONFIGURE_ACK_MS))
+      return;
+    m_reconfigureState = RECONFIGURE_NONE;
+    model = m_requestedModel.str();
   }
-
-  return ap;
+  lwsl_notice("AudioPipe::onTimer %s model %s not acknowledged in %d ms\n", m_uuid.c_str(), model.c_str(), RECONFIGURE_ACK_MS);
+  m_callback(m_uuid.c_str(), m_userData, AudioPipe::RECONFIGURE_FAILED, model.c_str(), isFinished());
 }
 
-AudioPipe *AudioPipe::findPendingConnect(struct lws *wsi)
+AudioPipe::WriteResult_t AudioPipe::onWritable(FrameWriter &writer)
 {
-  AudioPipe *ap = NULL;
-  std::lock_guard<std::mutex> guard(mutex_connects);
-
-  for (auto it = pendingConnects.begin(); it != pendingConnects.end() && !ap; ++it)
+  // check for text frames to send
   {
-    int state = (*it)->m_state;
-    if ((state == LWS_CLIENT_CONNECTING) &&
-        (*it)->m_wsi == wsi)
-      ap = *it;
-  }
-  return ap;
-}
+    std::unique_lock<std::mutex> lk(m_text_mutex);
+    if (m_metadata.length() > 0)
+    {
+      uint8_t buf[m_metadata.length() + LWS_PRE];
+      memcpy(buf + LWS_PRE, m_metadata.c_str(), m_metadata.length());
+      int n = m_metadata.length();
+      int m = writer.write(buf + LWS_PRE, n, false);
+      m_metadata.clear();
+      if (m < n)
+      {
+        return WRITE_ERROR;
+      }
+      if (m_tap)
+        m_tap->push(AudioTap::TAP_SENT, buf + LWS_PRE, n);
+      // a config message just went out: time its answer from here
+      bool armTimer = m_reconfigureState == RECONFIGURE_SENT && !m_reconfigureTimerSet;
+      if (armTimer)
+      {
+        m_reconfigureTimerSet = true;
+        m_reconfigureSentAt = std::chrono::steady_clock::now();
+      }
+      lk.unlock();
+      if (armTimer)
+        m_transport->setTimer(this, RECONFIGURE_ACK_MS);
 
-void AudioPipe::addPendingConnect(AudioPipe *ap)
-{
-  {
-    std::lock_guard<std::mutex> guard(mutex_connects);
-    pendingConnects.push_back(ap);
-    lwsl_debug("%s after adding connect there are %lu pending connects\n",
-               ap->m_uuid.c_str(), pendingConnects.size());
-  }
-  lws_cancel_service(contexts[nchild++ % numContexts]);
-}
-void AudioPipe::addPendingDisconnect(AudioPipe *ap)
-{
-  ap->m_state = LWS_CLIENT_DISCONNECTING;
-  {
-    std::lock_guard<std::mutex> guard(mutex_disconnects);
-    pendingDisconnects.push_back(ap);
-    lwsl_debug("%s after adding disconnect there are %lu pending disconnects\n",
-               ap->m_uuid.c_str(), pendingDisconnects.size());
-  }
-  lws_cancel_service(ap->m_vhd->context);
-}
-void AudioPipe::addPendingWrite(AudioPipe *ap)
-{
-  {
-    std::lock_guard<std::mutex> guard(mutex_writes);
-    pendingWrites.push_back(ap);
+      // there may be audio data, but only one write per writeable event
+      // get it next time
+      return WRITE_MORE;
+    }
   }
-  lws_cancel_service(ap->m_vhd->context);
-}
 
-bool AudioPipe::lws_service_thread(unsigned int nServiceThread)
-{
-  struct lws_context_creation_info info;
-  std::thread::id this_id = std::this_thread::get_id();
-
-  const struct lws_protocols protocols[] = {
-      {
-          "",
-          AudioPipe::lws_callback,
-          sizeof(void *),
-          1024,
-      },
-      {NULL, NULL, 0, 0}};
-
-  memset(&info, 0, sizeof info);
-  info.port = CONTEXT_PORT_NO_LISTEN;
-  info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
-  info.protocols = protocols;
-  info.ka_time = nTcpKeepaliveSecs; // tcp keep-alive timer
-  info.ka_probes = 4;               // number of times to try ka before closing connection
-  info.ka_interval = 5;             // time between ka's
-  info.timeout_secs = 10;           // doc says timeout for "various processes involving network roundtrips"
-  info.keepalive_timeout = 5;       // seconds to allow remote client to hold on to an idle HTTP/1.1 connection
-  info.timeout_secs_ah_idle = 10;   // secs to allow a client to hold an ah without using it
-  info.retry_and_idle_policy = &retry;
-
-  lwsl_notice("AudioPipe::lws_service_thread creating context in service thread %d.\n", nServiceThread);
-
-  contexts[nServiceThread] = lws_create_context(&info);
-  if (!contexts[nServiceThread])
+  if (m_state == LWS_CLIENT_DISCONNECTING)
   {
-    lwsl_err("AudioPipe::lws_service_thread failed creating context in service thread %d..\n", nServiceThread);
-    return false;
+    return WRITE_CLOSE;
   }
 
-  int n;
-  do
-  {
-    n = lws_service(contexts[nServiceThread], 0);
-  } while (n >= 0 && !stopFlags[this_id]);
-
-  // Cleanup once work is done or stopped
+  // check for audio packets
+  const char *written = nullptr;
   {
-    std::lock_guard<std::mutex> lock(mapMutex);
-    stopFlags.erase(this_id);
+    std::lock_guard<std::mutex> lk(m_audio_mutex);
+    if (m_audio_buffer_write_offset > LWS_PRE)
+    {
+      size_t datalen = m_audio_buffer_write_offset - LWS_PRE;
+      // over the tenant's outbound rate: the audio waits for a later write (the next frame
+      // asks for one); what is left after finish() always goes
+      if (!m_finished && !Tenants::takeBytes(m_tenant, datalen))
+        written = "deferred";
+      else
+      {
+        int sent = writer.write(m_audio_buffer + LWS_PRE, datalen, true);
+        if (sent < (int)datalen)
+        {
+          lwsl_err("AudioPipe::onWritable %s attemped to send %lu only sent %d\n", m_uuid.c_str(), datalen, sent);
+        }
+        if (m_tap && sent > 0)
+          m_tap->push(AudioTap::TAP_AUDIO, m_audio_buffer + LWS_PRE, sent);
+        m_audio_buffer_write_offset = LWS_PRE;
+        m_audioBuffered = false;
+        written = "";
+      }
+    }
   }
+  // outside the lock: the writer refills the buffer from its handler
+  if (written && m_notifyWritten)
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::AUDIO_WRITTEN, *written ? written : NULL, isFinished());
 
-  lwsl_notice("AudioPipe::lws_service_thread ending in service thread %d\n", nServiceThread);
-  return true;
+  return WRITE_IDLE;
 }
 
-void AudioPipe::initialize(unsigned int nThreads, int loglevel, log_emit_function logger)
+void AudioPipe::onClosed(void)
 {
-  assert(nThreads > 0 && nThreads <= 10);
-
-  numContexts = nThreads;
-  lws_set_log_level(loglevel, logger);
-
-  lwsl_notice("AudioPipe::initialize starting %d threads\n", nThreads);
-  for (unsigned int i = 0; i < numContexts; i++)
+  if (m_state == LWS_CLIENT_DISCONNECTING)
   {
-    std::lock_guard<std::mutex> lock(mapMutex);
-    std::thread t(&AudioPipe::lws_service_thread, i);
-    stopFlags[t.get_id()] = false;
-    threadIds.push(t.get_id());
-    t.detach();
-  }
-}
+    // closed by us
 
-bool AudioPipe::deinitialize()
-{
-  lwsl_notice("AudioPipe::deinitialize\n");
-  std::lock_guard<std::mutex> lock(mapMutex);
-  if (!threadIds.empty())
-  {
-    std::thread::id id = threadIds.front();
-    threadIds.pop();
-    stopFlags[id] = true;
+    lwsl_debug("%s socket closed by us\n", m_uuid.c_str());
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::CONNECTION_CLOSED_GRACEFULLY, NULL, isFinished());
   }
-  /*
-    do
-    {
-      lwsl_notice("waiting for pending connects to complete\n");
-    } while (pendingConnects.size() > 0);
-    do
-    {
-      lwsl_notice("waiting for disconnects to complete\n");
-    } while (pendingDisconnects.size() > 0);
-  */
-  for (unsigned int i = 0; i < numContexts; i++)
+  else if (m_state == LWS_CLIENT_CONNECTED)
   {
-    lwsl_notice("AudioPipe::deinitialize destroying context %d of %d\n", i + 1, numContexts);
-    lws_context_destroy(contexts[i]);
+    // closed by far end, or by us when it stopped answering pings
+    lwsl_info("%s socket closed by far end%s\n", m_uuid.c_str(), m_peerTimedOut ? " (ping timeout)" : "");
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::CONNECTION_DROPPED, m_peerTimedOut ? "ping timeout" : NULL, isFinished());
   }
-  std::this_thread::sleep_for(std::chrono::seconds(2));
-  return true;
-}
-
-// instance members
-AudioPipe::AudioPipe(const char *uuid, const char *host, unsigned int port, const char *path,
-                     size_t bufLen, size_t minFreespace, const char *apiKey, const char *customerId, const int sampleRate,
-                     const char *modelName, notifyHandler_t callback) : m_uuid(uuid), m_host(host), m_port(port), m_path(path), m_finished(false),
-                                                                        m_audio_buffer_min_freespace(minFreespace), m_audio_buffer_max_len(bufLen), m_gracefulShutdown(false),
-                                                                        m_audio_buffer_write_offset(LWS_PRE), m_recv_buf(nullptr), m_recv_buf_ptr(nullptr),
-                                                                        m_state(LWS_CLIENT_IDLE), m_wsi(nullptr), m_vhd(nullptr), m_apiKey(apiKey),
-                                                                        m_customerId(customerId), m_sampleRate(sampleRate), m_modelName(modelName), m_callback(callback)
-{
-
-  m_audio_buffer = new uint8_t[m_audio_buffer_max_len];
-}
-AudioPipe::~AudioPipe()
-{
-  if (m_audio_buffer)
-    delete[] m_audio_buffer;
-  if (m_recv_buf)
-    delete[] m_recv_buf;
-}
+  LwsState_t state = m_state;
+  m_state = LWS_CLIENT_DISCONNECTED;
 
-void AudioPipe::connect(void)
-{
-  addPendingConnect(this);
-}
-
-bool AudioPipe::connect_client(struct lws_per_vhost_data *vhd)
-{
-  assert(m_audio_buffer != nullptr);
-  assert(m_vhd == nullptr);
-  struct lws_client_connect_info i;
-
-  memset(&i, 0, sizeof(i));
-  i.context = vhd->context;
-  i.port = m_port;
-  i.address = m_host.c_str();
-  i.path = m_path.c_str();
-  i.host = i.address;
-  i.origin = i.address;
-  i.ssl_connection = LCCSCF_USE_SSL;
-  // i.protocol = protocolName.c_str();
-  i.pwsi = &(m_wsi);
-
-  m_state = LWS_CLIENT_CONNECTING;
-  m_vhd = vhd;
-
-  m_wsi = lws_client_connect_via_info(&i);
-  lwsl_debug("%s attempting connection, wsi is %p\n", m_uuid.c_str(), m_wsi);
-
-  return nullptr != m_wsi;
-}
-
-void AudioPipe::bufferForSending(const char *text)
-{
-  if (m_state != LWS_CLIENT_CONNECTED)
-    return;
+  // a model switch was still in flight when the server went away
+  std::string model;
   {
     std::lock_guard<std::mutex> lk(m_text_mutex);
-    m_metadata.append(text);
+    if (m_reconfigureState != RECONFIGURE_NONE && state == LWS_CLIENT_CONNECTED)
+      model = m_requestedModel.str();
+    m_reconfigureState = RECONFIGURE_NONE;
   }
-  addPendingWrite(this);
-}
-
-void AudioPipe::unlockAudioBuffer()
-{
-  if (m_audio_buffer_write_offset > LWS_PRE)
-    addPendingWrite(this);
-  m_audio_mutex.unlock();
-}
+  if (!model.empty())
+    m_callback(m_uuid.c_str(), m_userData, AudioPipe::RECONFIGURE_FAILED, model.c_str(), isFinished());
+  setClosed();
 
-void AudioPipe::close()
-{
-  if (m_state != LWS_CLIENT_CONNECTED)
-    return;
-  addPendingDisconnect(this);
-}
-
-void AudioPipe::finish()
-{
-  if (m_finished || m_state != LWS_CLIENT_CONNECTED)
-    return;
-  m_finished = true;
-  bufferForSending("{\"eof\": \"1\"}");
-}
-
-void AudioPipe::waitForClose()
-{
-  std::shared_future<void> sf(m_promise.get_future());
-  sf.wait();
-  return;
+  // NB: after receiving any of the events above, any holder of a
+  // pointer or reference to this object must treat is as no longer valid
 }
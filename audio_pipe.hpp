@@ -1,16 +1,20 @@
 #ifndef __BODHI_AUDIO_PIPE_HPP__
 #define __BODHI_AUDIO_PIPE_HPP__
 
+#include <atomic>
 #include <string>
-#include <list>
 #include <mutex>
+#include <chrono>
 #include <future>
-#include <queue>
-#include <unordered_map>
-#include <thread>
 
 #include <libwebsockets.h>
 
+#include "audio_tap.hpp"
+#include "intern.hpp"
+#include "partial_delta.hpp"
+#include "tenants.hpp"
+#include "transport.hpp"
+
 namespace bodhi
 {
 
@@ -32,35 +36,80 @@ namespace bodhi
       CONNECT_FAIL,
       CONNECTION_DROPPED,
       CONNECTION_CLOSED_GRACEFULLY,
-      MESSAGE
+      MESSAGE,
+      RECONFIGURED,       // server took the new config; message is the model
+      RECONFIGURE_FAILED, // server rejected it or dropped; message is the requested model
+      PONG,               // websocket ping answered; message is the round trip in ms
+      AUDIO_WRITTEN       // buffered audio went to the transport, or ("deferred") was held back for
+                          // the tenant's rate; only with setNotifyWritten
     };
-    typedef void (*log_emit_function)(int level, const char *line);
-    typedef void (*notifyHandler_t)(const char *sessionId, NotifyEvent_t event, const char *message, bool finished);
-
-    struct lws_per_vhost_data
+    enum WriteResult_t
+    {
+      WRITE_IDLE,  // nothing left to send
+      WRITE_MORE,  // more queued, ask for another writeable callback
+      WRITE_CLOSE, // disconnect requested, close the connection normally
+      WRITE_ERROR  // write failed, drop the connection
+    };
+    enum OverrunPolicy_t
     {
-      struct lws_context *context;
-      struct lws_vhost *vhost;
-      const struct lws_protocols *protocol;
+      OVERRUN_RESET,       // discard everything buffered
+      OVERRUN_DROP_OLDEST, // discard just enough of the oldest audio to make room
+      OVERRUN_MAX_AGE,     // as drop-oldest, and never hold more than a max age of audio
+      OVERRUN_GROW         // grow the buffer up to a cap, then drop-oldest
     };
+    typedef void (*log_emit_function)(int level, const char *line);
+    typedef void (*notifyHandler_t)(const char *sessionId, void *userData, NotifyEvent_t event, const char *message, bool finished);
 
-    static void initialize(unsigned int nThreads, int loglevel, log_emit_function logger);
-    static bool deinitialize();
-    static bool lws_service_thread(unsigned int nServiceThread);
+    // transport used by pipes constructed without an explicit one
+    static void setDefaultTransport(Transport *transport) { defaultTransport = transport; }
+    static Transport *getDefaultTransport(void) { return defaultTransport; }
 
     // constructor
     AudioPipe(const char *uuid, const char *host, unsigned int port, const char *path,
-              size_t bufLen, size_t minFreespace, const char *apiKey, const char *customerId, const int sampleRate, const char *modelName, notifyHandler_t callback);
+              size_t bufLen, size_t minFreespace, const char *apiKey, const char *customerId, const int sampleRate, const char *modelName,
+              notifyHandler_t callback, Transport *transport = nullptr);
     ~AudioPipe();
 
+    // pipes and their audio buffers come from the BufferPool
+    static void *operator new(size_t size);
+    static void operator delete(void *ptr, size_t size);
+
     LwsState_t getLwsState(void) { return m_state; }
-    std::string &getApiKey(void)
+    void setLwsState(LwsState_t state) { m_state = state; }
+    const std::string &getUuid(void) { return m_uuid; }
+    // passed back to the notify handler, to tell apart several pipes on one session
+    void setUserData(void *userData) { m_userData = userData; }
+    const std::string &getHost(void) { return m_host.str(); }
+    unsigned int getPort(void) { return m_port; }
+    const std::string &getPath(void) { return m_path.str(); }
+    const std::string &getApiKey(void) { return m_apiKey.str(); }
+    const std::string &getCustomerId(void) { return m_customerId.str(); }
+    // LCCSCF_* flags used for the client connection (defaults to LCCSCF_USE_SSL)
+    void setSslFlags(int flags) { m_sslFlags = flags; }
+    int getSslFlags(void) { return m_sslFlags; }
+    // offer permessage-deflate when connecting, if the transport supports it
+    void setDeflate(bool deflate) { m_deflate = deflate; }
+    bool getDeflate(void) { return m_deflate; }
+    // record what is sent and received; the pipe closes the tap when it is destroyed
+    void setTap(AudioTap *tap) { m_tap = tap; }
+    // customer the pipe's connects and outbound audio are charged to (see Tenants); the pipe
+    // takes over the acquired tenant and releases it when its connection is gone
+    void setTenant(Tenants::Tenant *tenant)
     {
-      return m_apiKey;
+      m_tenant = tenant;
+      m_tenantHeld = tenant != nullptr;
     }
-    std::string &getCustomerId(void)
+    // stop counting against the tenant's pipe cap before the connection is gone, e.g. when a
+    // replacement is starting; what the pipe still sends is charged to the tenant
+    void releaseTenant(void);
+    Tenants::Tenant *getTenant(void) { return m_tenant; }
+    // report each audio write as AUDIO_WRITTEN, for a writer that refills the buffer as it drains
+    void setNotifyWritten(bool notify) { m_notifyWritten = notify; }
+    // deliver partial results as deltas against the previous partial of their segment
+    void setDeltaPartials(bool deltas)
     {
-      return m_customerId;
+      delete m_deltas;
+      m_deltas = deltas ? new PartialDelta() : nullptr;
     }
     void connect(void);
     void bufferForSending(const char *text);
@@ -79,85 +128,150 @@ namespace bodhi
     void binaryWritePtrAdd(size_t len)
     {
       m_audio_buffer_write_offset += len;
+      m_audioBuffered = true;
+      // past the age cap, drop back to 3/4 of it so the buffer is not shifted on every frame
+      if (m_overrun_policy == OVERRUN_MAX_AGE && m_audio_buffer_write_offset - LWS_PRE > m_audio_max_age_bytes)
+        binaryDrop(m_audio_buffer_write_offset - LWS_PRE - m_audio_max_age_bytes / 4 * 3);
     }
-    void binaryWritePtrResetToZero(void)
-    {
-      m_audio_buffer_write_offset = 0;
-    }
+    // apply the overrun policy until at least `needed` bytes are free; call with the audio buffer locked
+    void binaryMakeSpace(size_t needed);
+
+    // overrun handling; maxAgeMs applies to OVERRUN_MAX_AGE, maxBufLen to OVERRUN_GROW
+    void setOverrunPolicy(OverrunPolicy_t policy, unsigned int maxAgeMs, size_t maxBufLen);
+    OverrunPolicy_t getOverrunPolicy(void) { return m_overrun_policy; }
+    void setChannels(int channels) { m_channels = channels; }
+    uint64_t getDroppedMs(void);
+    static bool parseOverrunPolicy(const char *name, OverrunPolicy_t &policy);
+    static const char *overrunPolicyName(OverrunPolicy_t policy);
     void lockAudioBuffer(void)
     {
       m_audio_mutex.lock();
     }
     void unlockAudioBuffer(void);
 
+    // switch model on the open connection: the config message is sent at the next segment
+    // boundary (immediately if no segment is in progress); false if not connected
+    bool reconfigure(const char *modelName);
+    // a copy: a reconfigure on the service thread may release the current name
+    std::string getModelName(void);
+
+    // audio written but not yet sent; kept by the frame and write paths, so it is read without the audio lock
+    bool hasBufferedAudio(void) { return m_audioBuffered; }
+    // time the connect waited for admission (see ConnectScheduler)
+    void setConnectQueueMs(uint32_t ms) { m_connectQueueMs = ms; }
+    uint32_t getConnectQueueMs(void) { return m_connectQueueMs; }
+    // time from the connect starting to the upgrade, less the admission queue
+    uint32_t getHandshakeMs(void) { return m_handshakeMs; }
+    // last websocket ping round trip, 0 before the first pong
+    uint32_t getRttMs(void) { return m_rttMs; }
+    // how long after its audio was sent a result arrived, from its audio_end_ms; -1 if unknown
+    long getResultLatencyMs(const char *json);
+
     void close();
     void finish();
+    // returns once the connection is gone; safe to call more than once
     void waitForClose();
-    void setClosed() { m_promise.set_value(); }
+    void setClosed();
     bool isFinished() { return m_finished; }
 
+    // transport-owned per-pipe state
+    void *getTransportData(void) { return m_transportData; }
+    void setTransportData(void *data) { m_transportData = data; }
+
+    // handlers called by the transport, from its service thread
+    void onConnected(void);
+    void onConnectFail(int httpStatus);
+    // finished before the transport started connecting
+    void onConnectCancelled(void);
+    void onPong(uint32_t rttMs);
+    // the timer set with Transport::setTimer: gives up on an unanswered config message
+    void onTimer(void);
+    // the peer stopped answering pings; the transport is closing the connection
+    void onPeerTimeout(void) { m_peerTimedOut = true; }
+    void onReceive(const void *in, size_t len, bool isFirst, bool isFinal, size_t remaining);
+    WriteResult_t onWritable(FrameWriter &writer);
+    void onClosed(void);
+
     // no default constructor or copying
     AudioPipe() = delete;
     AudioPipe(const AudioPipe &) = delete;
     void operator=(const AudioPipe &) = delete;
 
   private:
-    static int lws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
-    static unsigned int nchild;
-    static struct lws_context *contexts[];
-    static unsigned int numContexts;
-    static std::string protocolName;
-    static std::mutex mutex_connects;
-    static std::mutex mutex_disconnects;
-    static std::mutex mutex_writes;
-    static std::list<AudioPipe *> pendingConnects;
-    static std::list<AudioPipe *> pendingDisconnects;
-    static std::list<AudioPipe *> pendingWrites;
-    static log_emit_function logger;
-
-    static std::mutex mapMutex;
-    static std::unordered_map<std::thread::id, bool> stopFlags;
-    static std::queue<std::thread::id> threadIds;
-
-    static AudioPipe *findAndRemovePendingConnect(struct lws *wsi);
-    static AudioPipe *findPendingConnect(struct lws *wsi);
-    static void addPendingConnect(AudioPipe *ap);
-    static void addPendingDisconnect(AudioPipe *ap);
-    static void addPendingWrite(AudioPipe *ap);
-    static void processPendingConnects(lws_per_vhost_data *vhd);
-    static void processPendingDisconnects(lws_per_vhost_data *vhd);
-    static void processPendingWrites(void);
-
-    bool connect_client(struct lws_per_vhost_data *vhd);
+    enum ReconfigureState_t
+    {
+      RECONFIGURE_NONE,
+      RECONFIGURE_WAITING, // for the current segment to end
+      RECONFIGURE_SENT     // for the server's answer
+    };
 
-    LwsState_t m_state;
-    std::string m_uuid;
-    std::string m_host;
-    unsigned int m_port;
-    std::string m_path;
-    std::string m_metadata;
-    std::mutex m_text_mutex;
+    static Transport *defaultTransport;
+
+    void binaryDrop(size_t len);
+    // counted by Drain until the connection closes
+    void leaveDrainCount(void);
+    void handleMessage(const std::string &msg);
+    size_t bytesPerSec(void) { return (size_t)m_sampleRate * 2 * m_channels; }
+
+    // frame path: written by the media bug thread, drained by the transport
     std::mutex m_audio_mutex;
-    int m_sslFlags;
-    struct lws *m_wsi;
     uint8_t *m_audio_buffer;
-    size_t m_audio_buffer_max_len;
     size_t m_audio_buffer_write_offset;
+    size_t m_audio_buffer_max_len;
     size_t m_audio_buffer_min_freespace;
+    LwsState_t m_state;
+    int m_channels;
+    Transport *m_transport;
+    void *m_transportData;
+    OverrunPolicy_t m_overrun_policy;
+    size_t m_audio_max_age_bytes;
+    size_t m_audio_buffer_cap_len;
+    uint64_t m_audio_dropped_bytes;
+
+    // text frames and results
+    std::mutex m_text_mutex;
+    std::string m_metadata;
     uint8_t *m_recv_buf;
     uint8_t *m_recv_buf_ptr;
     size_t m_recv_buf_len;
-    struct lws_per_vhost_data *m_vhd;
     notifyHandler_t m_callback;
-    log_emit_function m_logger;
-    std::string m_apiKey;
-    std::string m_customerId;
-    std::string m_modelName;
-    int m_sampleRate;
+    void *m_userData;
     bool m_gracefulShutdown;
     bool m_finished;
-    std::string m_bugname;
+    bool m_segmentOpen;
+    bool m_peerTimedOut;
+    ReconfigureState_t m_reconfigureState;
+    InternedString m_requestedModel;
+    std::chrono::steady_clock::time_point m_reconfigureSentAt; // when the config message went out
+    bool m_reconfigureTimerSet;
+    std::chrono::steady_clock::time_point m_connectStartedAt;
+    std::chrono::steady_clock::time_point m_connectedAt;
+    uint32_t m_connectQueueMs;
+    uint32_t m_handshakeMs;
+    size_t m_backlogMs; // audio buffered when the connection came up
+    uint32_t m_rttMs;
+
+    // connection setup; shared strings live in the intern table
+    std::string m_uuid;
+    InternedString m_host;
+    InternedString m_path;
+    InternedString m_apiKey;
+    InternedString m_customerId;
+    InternedString m_modelName;
+    unsigned int m_port;
+    int m_sslFlags;
+    bool m_deflate;
+    bool m_notifyWritten;
+    AudioTap *m_tap;
+    Tenants::Tenant *m_tenant;
+    PartialDelta *m_deltas;
+    int m_sampleRate;
+    std::chrono::steady_clock::time_point m_openedAt;
+    std::atomic<bool> m_drainCounted;
+    std::atomic<bool> m_audioBuffered; // see hasBufferedAudio
+    std::atomic<bool> m_tenantHeld;    // the pipe still counts against m_tenant's pipe cap
     std::promise<void> m_promise;
+    std::shared_future<void> m_closed; // of m_promise, so any number of callers may wait
   };
 
 } // namespace bodhi
@@ -0,0 +1,267 @@
+// audio_tap.cpp
+#include "audio_tap.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libwebsockets.h>
+
+#include "buffer_pool.hpp"
+#include "utils.hpp"
+
+#define TAP_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+/* how often the writer drains the rings when nothing closes */
+#define TAP_DRAIN_MS 100
+#define WAV_HEADER_LEN 44
+
+using namespace bodhi;
+
+std::mutex AudioTaps::mutex;
+std::condition_variable AudioTaps::cv;
+std::vector<AudioTap *> AudioTaps::taps;
+std::thread AudioTaps::thread;
+std::atomic<bool> AudioTaps::running(false);
+std::string AudioTaps::dir;
+size_t AudioTaps::ringBytes = 0;
+std::atomic<uint64_t> AudioTaps::s_opened(0);
+std::atomic<uint64_t> AudioTaps::s_bytes(0);
+std::atomic<uint64_t> AudioTaps::s_records(0);
+std::atomic<uint64_t> AudioTaps::s_dropped(0);
+
+namespace
+{
+  static void putLe(uint8_t *p, uint32_t v, int bytes)
+  {
+    for (int i = 0; i < bytes; i++)
+      p[i] = (v >> (8 * i)) & 0xff;
+  }
+
+  static void wavHeader(uint8_t *h, int sampleRate, int channels, uint32_t dataLen)
+  {
+    memcpy(h, "RIFF", 4);
+    putLe(h + 4, 36 + dataLen, 4);
+    memcpy(h + 8, "WAVEfmt ", 8);
+    putLe(h + 16, 16, 4);
+    putLe(h + 20, 1, 2); // PCM
+    putLe(h + 22, channels, 2);
+    putLe(h + 24, sampleRate, 4);
+    putLe(h + 28, sampleRate * 2 * channels, 4);
+    putLe(h + 32, 2 * channels, 2);
+    putLe(h + 34, 16, 2);
+    memcpy(h + 36, "data", 4);
+    putLe(h + 40, dataLen, 4);
+  }
+}
+
+AudioTap::AudioTap(const std::string &path, int sampleRate, int channels, uint8_t *ring, size_t ringBytes)
+    : m_path(path), m_sampleRate(sampleRate), m_channels(channels), m_ring(ring), m_ringBytes(ringBytes), m_head(0), m_tail(0),
+      m_dropped(0), m_closed(false), m_openedAt(std::chrono::steady_clock::now()), m_opened(false), m_finished(false), m_wavFd(-1),
+      m_sidecar(nullptr), m_audioBytes(0)
+{
+}
+
+void AudioTap::push(RecordType_t type, const uint8_t *data, size_t len)
+{
+  uint64_t need = sizeof(RecordHeader) + TAP_ALIGN(len);
+  uint64_t head = m_head.load(std::memory_order_relaxed);
+  if (need > m_ringBytes - (head - m_tail.load(std::memory_order_acquire)))
+  {
+    m_dropped++;
+    AudioTaps::s_dropped++;
+    return;
+  }
+
+  RecordHeader hdr = {(uint32_t)len, (uint16_t)type, 0,
+                      (uint64_t)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_openedAt).count()};
+  // records are 8-byte aligned and the ring is a power of two, so a header never wraps
+  size_t mask = m_ringBytes - 1;
+  memcpy(m_ring + (head & mask), &hdr, sizeof(hdr));
+  size_t pos = (head + sizeof(hdr)) & mask;
+  size_t first = std::min(len, m_ringBytes - pos);
+  memcpy(m_ring + pos, data, first);
+  memcpy(m_ring, data + first, len - first);
+  m_head.store(head + need, std::memory_order_release);
+}
+
+void AudioTap::copyOut(uint64_t pos, void *dst, size_t len)
+{
+  size_t off = pos & (m_ringBytes - 1);
+  size_t first = std::min(len, m_ringBytes - off);
+  memcpy(dst, m_ring + off, first);
+  memcpy((uint8_t *)dst + first, m_ring, len - first);
+}
+
+void AudioTap::drain(void)
+{
+  if (!m_opened)
+  {
+    m_opened = true;
+    std::string wav = m_path + ".wav", sidecar = m_path + ".jsonl";
+    m_wavFd = ::open(wav.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    m_sidecar = fopen(sidecar.c_str(), "we");
+    if (m_wavFd < 0 || !m_sidecar)
+      lwsl_err("AudioTap::drain cannot create %s: %s\n", m_path.c_str(), strerror(errno));
+    uint8_t h[WAV_HEADER_LEN];
+    wavHeader(h, m_sampleRate, m_channels, 0);
+    if (m_wavFd >= 0 && WAV_HEADER_LEN != ::write(m_wavFd, h, WAV_HEADER_LEN))
+    {
+      ::close(m_wavFd);
+      m_wavFd = -1;
+    }
+    uint64_t wallUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count() -
+                      std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - m_openedAt).count();
+    if (m_sidecar)
+      fprintf(m_sidecar, "{\"type\": \"start\", \"wall_us\": %lu, \"sample_rate\": %d, \"channels\": %d}\n",
+              (unsigned long)wallUs, m_sampleRate, m_channels);
+  }
+
+  uint64_t head = m_head.load(std::memory_order_acquire);
+  uint64_t tail = m_tail.load(std::memory_order_relaxed);
+  uint64_t bytesPerSec = (uint64_t)m_sampleRate * 2 * m_channels;
+  while (tail < head)
+  {
+    RecordHeader hdr;
+    copyOut(tail, &hdr, sizeof(hdr));
+    m_scratch.resize(hdr.len);
+    copyOut(tail + sizeof(hdr), m_scratch.data(), hdr.len);
+    m_tail.store(tail += sizeof(hdr) + TAP_ALIGN(hdr.len), std::memory_order_release);
+    AudioTaps::s_records++;
+
+    if (hdr.type == TAP_AUDIO)
+    {
+      if (m_sidecar)
+        fprintf(m_sidecar, "{\"t_us\": %lu, \"type\": \"audio\", \"offset_ms\": %lu, \"bytes\": %u}\n",
+                (unsigned long)hdr.tUs, (unsigned long)(m_audioBytes * 1000 / bytesPerSec), hdr.len);
+      if (m_wavFd >= 0 && (ssize_t)hdr.len != ::write(m_wavFd, m_scratch.data(), hdr.len))
+        lwsl_err("AudioTap::drain %s.wav: %s\n", m_path.c_str(), strerror(errno));
+      m_audioBytes += hdr.len;
+      AudioTaps::s_bytes += hdr.len;
+    }
+    else if (m_sidecar)
+    {
+      std::string text = utils::escapeJson(std::string((const char *)m_scratch.data(), hdr.len));
+      fprintf(m_sidecar, "{\"t_us\": %lu, \"type\": \"%s\", \"offset_ms\": %lu, \"text\": \"%s\"}\n", (unsigned long)hdr.tUs,
+              hdr.type == TAP_SENT ? "sent" : "result", (unsigned long)(m_audioBytes * 1000 / bytesPerSec), text.c_str());
+    }
+  }
+  if (m_sidecar)
+    fflush(m_sidecar);
+}
+
+void AudioTap::finish(void)
+{
+  drain();
+  m_finished = true;
+  if (m_wavFd >= 0)
+  {
+    uint8_t h[WAV_HEADER_LEN];
+    wavHeader(h, m_sampleRate, m_channels, (uint32_t)std::min<uint64_t>(m_audioBytes, UINT32_MAX - 36));
+    if (WAV_HEADER_LEN != pwrite(m_wavFd, h, WAV_HEADER_LEN, 0))
+      lwsl_err("AudioTap::finish %s.wav: %s\n", m_path.c_str(), strerror(errno));
+    ::close(m_wavFd);
+    m_wavFd = -1;
+  }
+  if (m_sidecar)
+  {
+    uint64_t bytesPerSec = (uint64_t)m_sampleRate * 2 * m_channels;
+    fprintf(m_sidecar, "{\"type\": \"end\", \"audio_ms\": %lu, \"dropped\": %lu}\n", (unsigned long)(m_audioBytes * 1000 / bytesPerSec),
+            (unsigned long)m_dropped.load());
+    fclose(m_sidecar);
+    m_sidecar = nullptr;
+  }
+}
+
+void AudioTaps::start(const std::string &directory, size_t bytes)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (running)
+    return;
+  if (0 != mkdir(directory.c_str(), 0755) && errno != EEXIST)
+  {
+    lwsl_err("AudioTaps::start cannot create %s: %s\n", directory.c_str(), strerror(errno));
+    return;
+  }
+  dir = directory;
+  // a power of two, so records can be placed with a mask
+  ringBytes = 4096;
+  while (ringBytes < bytes)
+    ringBytes <<= 1;
+  running = true;
+  thread = std::thread(&AudioTaps::run);
+}
+
+void AudioTaps::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+AudioTap *AudioTaps::open(const std::string &name, int sampleRate, int channels)
+{
+  if (!running)
+    return nullptr;
+  uint8_t *ring = (uint8_t *)BufferPool::instance().acquire(ringBytes);
+  AudioTap *tap = new AudioTap(dir + "/" + name, sampleRate, channels, ring, ringBytes);
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    taps.push_back(tap);
+  }
+  s_opened++;
+  return tap;
+}
+
+void AudioTaps::run(void)
+{
+  std::unique_lock<std::mutex> lk(mutex);
+  while (true)
+  {
+    cv.wait_for(lk, std::chrono::milliseconds(TAP_DRAIN_MS));
+    bool stopping = !running;
+    std::vector<AudioTap *> current(taps);
+    lk.unlock();
+
+    std::vector<AudioTap *> done;
+    for (AudioTap *tap : current)
+    {
+      // closed is read before draining, so nothing pushed before the close is missed
+      bool closed = tap->m_closed;
+      if (closed || stopping)
+      {
+        tap->finish();
+        done.push_back(tap);
+      }
+      else
+        tap->drain();
+    }
+
+    lk.lock();
+    for (AudioTap *tap : done)
+    {
+      taps.erase(std::find(taps.begin(), taps.end(), tap));
+      // a pipe still holding the tap at shutdown keeps the object; only its files are finished
+      if (tap->m_closed)
+      {
+        BufferPool::instance().release(tap->m_ring, tap->m_ringBytes);
+        delete tap;
+      }
+    }
+    if (stopping)
+      break;
+  }
+}
+
+AudioTaps::Stats AudioTaps::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  return {taps.size(), s_opened, s_bytes, s_records, s_dropped};
+}
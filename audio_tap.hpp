@@ -0,0 +1,113 @@
+#ifndef __BODHI_AUDIO_TAP_HPP__
+#define __BODHI_AUDIO_TAP_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Copy of what one pipe actually sent, for replaying a disputed transcript: the audio
+  // exactly as written to the socket (after resampling and any overrun drops) and the text
+  // frames and results around it.  The transport's service thread pushes records into a
+  // single-producer ring allocated when the tap is opened, so the frame path neither blocks
+  // nor allocates; a full ring drops the record and counts it.  The AudioTaps thread drains
+  // the ring to <name>.wav and a <name>.jsonl sidecar with the timing of every record.
+  class AudioTap
+  {
+  public:
+    enum RecordType_t
+    {
+      TAP_AUDIO,  // binary frame sent
+      TAP_SENT,   // text frame sent (config, eof)
+      TAP_RESULT  // message received
+    };
+
+    // service thread of the pipe only
+    void push(RecordType_t type, const uint8_t *data, size_t len);
+    // the pipe is done with the tap; the writer finishes the files and frees it
+    void close(void) { m_closed = true; }
+
+  private:
+    friend class AudioTaps;
+
+    struct RecordHeader
+    {
+      uint32_t len;
+      uint16_t type;
+      uint16_t reserved;
+      uint64_t tUs; // since the tap was opened
+    };
+
+    AudioTap(const std::string &path, int sampleRate, int channels, uint8_t *ring, size_t ringBytes);
+
+    // writer thread
+    void drain(void);
+    void finish(void);
+    void copyOut(uint64_t pos, void *dst, size_t len);
+
+    std::string m_path; // without extension
+    int m_sampleRate;
+    int m_channels;
+    uint8_t *m_ring;
+    size_t m_ringBytes; // a power of two
+    std::atomic<uint64_t> m_head; // written by the producer
+    std::atomic<uint64_t> m_tail; // consumed by the writer
+    std::atomic<uint64_t> m_dropped;
+    std::atomic<bool> m_closed;
+    std::chrono::steady_clock::time_point m_openedAt;
+
+    // writer thread only
+    bool m_opened;
+    bool m_finished;
+    int m_wavFd;
+    FILE *m_sidecar;
+    uint64_t m_audioBytes;
+    std::vector<uint8_t> m_scratch;
+  };
+
+  // Registry of open taps and the thread that writes them out.
+  class AudioTaps
+  {
+  public:
+    struct Stats
+    {
+      uint64_t active;
+      uint64_t opened;
+      uint64_t bytes;   // audio written to disk
+      uint64_t records;
+      uint64_t dropped; // ring full
+    };
+
+    static void start(const std::string &dir, size_t ringBytes);
+    static void stop(void);
+    static bool isRunning(void) { return running; }
+
+    // a tap writing <dir>/<name>.wav and .jsonl; nullptr if taps are not configured
+    static AudioTap *open(const std::string &name, int sampleRate, int channels);
+    static Stats getStats(void);
+
+  private:
+    friend class AudioTap;
+
+    static void run(void);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::vector<AudioTap *> taps;
+    static std::thread thread;
+    static std::atomic<bool> running;
+    static std::string dir;
+    static size_t ringBytes;
+    static std::atomic<uint64_t> s_opened, s_bytes, s_records, s_dropped;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,104 @@
+#ifndef __BODHI_RING_H__
+#define __BODHI_RING_H__
+
+/*
+ * Shared-memory transcript ring.  mod_bodhi_transcribe publishes every result it receives
+ * into a POSIX shared memory object (MOD_AUDIO_FORK_SHM_RING) that co-located processes map
+ * read-only.  There is one writer and any number of readers; readers take no locks and
+ * the writer never waits for them, so a reader that falls a whole ring behind loses records
+ * (and is told so) rather than slowing the module down.
+ *
+ * Layout: a struct bodhi_ring_header, then data_len bytes of records at header_len.
+ * Records are 8-byte aligned and addressed by a 64-bit position that only grows; a record at
+ * position p starts at data + (p & (data_len - 1)) and may wrap around the end of the data.
+ * Each is a struct bodhi_ring_record, call_id_len bytes of call id, text_len bytes of UTF-8
+ * text, then padding to length.
+ *
+ * The writer advances reserved past a record before copying it in, and head once it is
+ * complete.  A reader copies a record out and then checks that reserved has not come within
+ * data_len of it; if it has, the copy may be torn and the reader resumes from tail, the oldest
+ * record the writer has left intact.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define BODHI_RING_MAGIC "BODHIRNG"
+#define BODHI_RING_VERSION 1
+#define BODHI_RING_ALIGN(n) (((n) + 7) & ~(uint64_t)7)
+
+/* record types, from the result's "type" */
+#define BODHI_RING_TYPE_OTHER 0
+#define BODHI_RING_TYPE_PARTIAL 1
+#define BODHI_RING_TYPE_COMPLETE 2
+
+struct bodhi_ring_header {
+	char magic[8];        /* stored last when the ring is created */
+	uint32_t version;
+	uint32_t header_len;  /* offset of the record data */
+	uint64_t data_len;    /* a power of two */
+	uint64_t created_us;
+	uint64_t writer_pid;
+	uint32_t closed;      /* set when the writer has gone; no further records will come */
+	uint32_t pad;
+	/* positions; read and written with atomics */
+	uint64_t tail;        /* oldest record not yet overwritten */
+	uint64_t reserved;    /* the writer may be copying up to here */
+	uint64_t head;        /* records are complete up to here */
+	uint64_t records;     /* published since created */
+};
+
+struct bodhi_ring_record {
+	uint32_t length;      /* whole record including this header and padding */
+	uint16_t type;        /* BODHI_RING_TYPE_* */
+	uint8_t eos;
+	uint8_t call_id_len;
+	int32_t segment_id;   /* -1 if absent */
+	uint32_t text_len;
+	uint64_t seq;         /* record number since the ring was created */
+	uint64_t recv_us;     /* wall clock when the result was received */
+	int64_t call_ms;      /* time since the pipe connected */
+	int64_t audio_end_ms; /* the result's audio_end_ms, -1 if absent */
+};
+
+/* reader library (bodhi_ring_reader.c) */
+
+typedef struct bodhi_ring_reader bodhi_ring_reader_t;
+
+typedef struct {
+	const struct bodhi_ring_record *record;
+	const char *call_id; /* not NUL terminated: record->call_id_len bytes */
+	const char *text;    /* NUL terminated, record->text_len bytes */
+} bodhi_ring_result_t;
+
+/* maps the ring read-only; NULL (and errno) if it does not exist or is not a ring yet.
+   Reading starts with the next record published */
+bodhi_ring_reader_t *bodhi_ring_attach(const char *name);
+void bodhi_ring_detach(bodhi_ring_reader_t *reader);
+
+/* move to the oldest record still in the ring, or past the newest */
+void bodhi_ring_seek_oldest(bodhi_ring_reader_t *reader);
+void bodhi_ring_seek_newest(bodhi_ring_reader_t *reader);
+
+/* 1 with the next record in result, valid until the following call; 0 when there is nothing
+   new; -1 when the writer lapped the reader, which then resumes from the oldest record */
+int bodhi_ring_next(bodhi_ring_reader_t *reader, bodhi_ring_result_t *result);
+
+/* times the reader was lapped, and the records it lost */
+uint64_t bodhi_ring_overruns(const bodhi_ring_reader_t *reader);
+uint64_t bodhi_ring_lost(const bodhi_ring_reader_t *reader);
+
+/* nonzero once the writer has closed the ring */
+int bodhi_ring_closed(const bodhi_ring_reader_t *reader);
+
+const struct bodhi_ring_header *bodhi_ring_get_header(const bodhi_ring_reader_t *reader);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
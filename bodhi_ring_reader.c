@@ -0,0 +1,199 @@
+/*
+ * bodhi_ring_reader.c
+ *
+ * Reader for the shared-memory transcript ring (see bodhi_ring.h).  Plain C with no
+ * dependencies beyond libc (and librt on older glibc), so it can be compiled into any
+ * consumer process.
+ */
+#include "bodhi_ring.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct bodhi_ring_reader {
+	int fd;
+	void *map;
+	size_t map_len;
+	const struct bodhi_ring_header *header;
+	const uint8_t *data;
+	uint64_t mask;
+	uint64_t pos;
+	uint64_t next_seq;
+	int have_seq;
+	uint64_t overruns;
+	uint64_t lost;
+	uint8_t *buf;
+	size_t buf_len;
+};
+
+static void copy_out(const bodhi_ring_reader_t *r, uint64_t pos, void *dst, size_t len)
+{
+	uint64_t off = pos & r->mask;
+	uint64_t first = r->header->data_len - off;
+
+	if (first >= len) {
+		memcpy(dst, r->data + off, len);
+	} else {
+		memcpy(dst, r->data + off, first);
+		memcpy((uint8_t *)dst + first, r->data, len - first);
+	}
+}
+
+/* true if nothing at or after pos has been overwritten since it was copied out */
+static int intact(const bodhi_ring_reader_t *r, uint64_t pos)
+{
+	uint64_t reserved;
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	reserved = __atomic_load_n(&r->header->reserved, __ATOMIC_RELAXED);
+	return reserved - pos <= r->header->data_len;
+}
+
+static int lapped(bodhi_ring_reader_t *r)
+{
+	r->overruns++;
+	r->pos = __atomic_load_n(&r->header->tail, __ATOMIC_ACQUIRE);
+	return -1;
+}
+
+bodhi_ring_reader_t *bodhi_ring_attach(const char *name)
+{
+	char path[256];
+	struct stat st;
+	const struct bodhi_ring_header *h;
+	bodhi_ring_reader_t *r;
+	void *map;
+	int fd;
+
+	snprintf(path, sizeof(path), "%s%s", '/' == *name ? "" : "/", name);
+	if ((fd = shm_open(path, O_RDONLY, 0)) < 0)
+		return NULL;
+	if (0 != fstat(fd, &st) || (size_t)st.st_size < sizeof(*h)) {
+		close(fd);
+		errno = EAGAIN;
+		return NULL;
+	}
+	if (MAP_FAILED == (map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0))) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+
+	h = (const struct bodhi_ring_header *)map;
+	if (0 != memcmp(h->magic, BODHI_RING_MAGIC, sizeof(h->magic))) {
+		munmap(map, st.st_size);
+		close(fd);
+		errno = EAGAIN; /* not initialised yet */
+		return NULL;
+	}
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	if (BODHI_RING_VERSION != h->version || 0 == h->data_len || 0 != (h->data_len & (h->data_len - 1)) ||
+		h->header_len + h->data_len > (uint64_t)st.st_size) {
+		munmap(map, st.st_size);
+		close(fd);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	if (NULL == (r = (bodhi_ring_reader_t *)calloc(1, sizeof(*r)))) {
+		munmap(map, st.st_size);
+		close(fd);
+		return NULL;
+	}
+	r->fd = fd;
+	r->map = map;
+	r->map_len = st.st_size;
+	r->header = h;
+	r->data = (const uint8_t *)map + h->header_len;
+	r->mask = h->data_len - 1;
+	bodhi_ring_seek_newest(r);
+	return r;
+}
+
+void bodhi_ring_detach(bodhi_ring_reader_t *r)
+{
+	if (!r)
+		return;
+	munmap(r->map, r->map_len);
+	close(r->fd);
+	free(r->buf);
+	free(r);
+}
+
+void bodhi_ring_seek_oldest(bodhi_ring_reader_t *r)
+{
+	r->pos = __atomic_load_n(&r->header->tail, __ATOMIC_ACQUIRE);
+	r->have_seq = 0;
+}
+
+void bodhi_ring_seek_newest(bodhi_ring_reader_t *r)
+{
+	r->pos = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+	r->have_seq = 0;
+}
+
+int bodhi_ring_next(bodhi_ring_reader_t *r, bodhi_ring_result_t *result)
+{
+	struct bodhi_ring_record rec;
+	uint64_t head = __atomic_load_n(&r->header->head, __ATOMIC_ACQUIRE);
+
+	if (r->pos == head)
+		return 0;
+
+	/* a torn header can hold any length: check it before trusting it */
+	copy_out(r, r->pos, &rec, sizeof(rec));
+	if (rec.length < sizeof(rec) || rec.length > head - r->pos ||
+		sizeof(rec) + rec.call_id_len + (uint64_t)rec.text_len > rec.length || !intact(r, r->pos))
+		return lapped(r);
+
+	if (r->buf_len < (size_t)rec.length + 1) {
+		uint8_t *buf = (uint8_t *)realloc(r->buf, rec.length + 1);
+		if (!buf)
+			return 0;
+		r->buf = buf;
+		r->buf_len = rec.length + 1;
+	}
+	copy_out(r, r->pos, r->buf, rec.length);
+	if (!intact(r, r->pos))
+		return lapped(r);
+
+	r->pos += rec.length;
+	memcpy(&rec, r->buf, sizeof(rec));
+	if (r->have_seq && rec.seq > r->next_seq)
+		r->lost += rec.seq - r->next_seq;
+	r->next_seq = rec.seq + 1;
+	r->have_seq = 1;
+
+	r->buf[sizeof(rec) + rec.call_id_len + rec.text_len] = '\0';
+	result->record = (const struct bodhi_ring_record *)r->buf;
+	result->call_id = (const char *)r->buf + sizeof(rec);
+	result->text = (const char *)r->buf + sizeof(rec) + rec.call_id_len;
+	return 1;
+}
+
+uint64_t bodhi_ring_overruns(const bodhi_ring_reader_t *r)
+{
+	return r->overruns;
+}
+
+uint64_t bodhi_ring_lost(const bodhi_ring_reader_t *r)
+{
+	return r->lost;
+}
+
+int bodhi_ring_closed(const bodhi_ring_reader_t *r)
+{
+	return 0 != __atomic_load_n(&r->header->closed, __ATOMIC_ACQUIRE);
+}
+
+const struct bodhi_ring_header *bodhi_ring_get_header(const bodhi_ring_reader_t *r)
+{
+	return r->header;
+}
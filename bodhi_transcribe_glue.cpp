@@ -12,18 +12,35 @@
 #include <cstdlib>
 #include <fstream>
 #include <sstream>
-#include <regex>
 #include <iostream>
 #include <unordered_map>
 
 #include "mod_bodhi_transcribe.h"
 #include "simple_buffer.h"
 #include "parser.hpp"
+#include "async_log.hpp"
+#include "audio_tap.hpp"
 #include "audio_pipe.hpp"
+#include "buffer_pool.hpp"
+#include "dns_cache.hpp"
+#include "drain.hpp"
+#include "endpoint_pool.hpp"
+#include "file_transcriber.hpp"
+#include "intern.hpp"
+#include "journal.hpp"
+#include "result_sink.hpp"
+#include "lws_transport.hpp"
+#include "tenants.hpp"
+#include "transcript_ring.hpp"
 #include "utils.hpp"
 
 #define RTP_PACKETIZATION_PERIOD 20
 #define FRAME_SIZE_8000 320 /*which means each 20ms frame as 320 bytes at 8 khz (1 channel only)*/
+#define DEFAULT_ENDPOINT "wss://bodhi.navana.ai:443"
+
+extern "C" switch_status_t bodhi_transcribe_session_init(switch_core_session_t *session,
+                                                         responseHandler_t responseHandler, uint32_t samples_per_second, uint32_t channels,
+                                                         char *modelName, int interim, char *bugname, void **ppUserData);
 
 namespace
 {
@@ -34,26 +51,151 @@ namespace
   static int nAudioBufferSecs = std::max(1, std::min(requestedBufferSecs ? ::atoi(requestedBufferSecs) : 2, 5));
   static const char *requestedNumServiceThreads = std::getenv("MOD_AUDIO_FORK_SERVICE_THREADS");
   static unsigned int nServiceThreads = std::max(1, std::min(requestedNumServiceThreads ? ::atoi(requestedNumServiceThreads) : 1, 5));
+  static const char *requestedOverrunPolicy = std::getenv("MOD_AUDIO_FORK_OVERRUN_POLICY");
+  static bodhi::AudioPipe::OverrunPolicy_t defaultOverrunPolicy = bodhi::AudioPipe::OVERRUN_DROP_OLDEST;
+  static const char *requestedMaxAudioAgeMs = std::getenv("MOD_AUDIO_FORK_MAX_AUDIO_AGE_MS");
+  static unsigned int nMaxAudioAgeMs = std::max(100, requestedMaxAudioAgeMs ? ::atoi(requestedMaxAudioAgeMs) : 1000);
+  static const char *requestedMaxBufferSecs = std::getenv("MOD_AUDIO_FORK_MAX_BUFFER_SECS");
+  static int nMaxBufferSecs = std::max(nAudioBufferSecs, std::min(requestedMaxBufferSecs ? ::atoi(requestedMaxBufferSecs) : 10, 30));
+  static const char *requestedPoolCachedMb = std::getenv("MOD_AUDIO_FORK_POOL_MAX_CACHED_MB");
+  static unsigned int nPoolCachedMb = std::max(0, requestedPoolCachedMb ? ::atoi(requestedPoolCachedMb) : 64);
+  static const char *requestedPoolHugePages = std::getenv("MOD_AUDIO_FORK_POOL_HUGE_PAGES");
+  static bool poolHugePages = requestedPoolHugePages && switch_true(requestedPoolHugePages);
+  static const char *requestedSinkQueue = std::getenv("MOD_AUDIO_FORK_RESULT_SINK_QUEUE");
+  static size_t nSinkQueue = std::max(1000, requestedSinkQueue ? ::atoi(requestedSinkQueue) : 100000);
+  static const char *journalDir = std::getenv("MOD_AUDIO_FORK_JOURNAL_DIR");
+  static const char *requestedEndpoints = std::getenv("MOD_AUDIO_FORK_ENDPOINTS");
+  // hot-path logging: lines per call site and second (0 for no limit), queue to the writer thread,
+  // most verbose level passed on, and the lws levels logged
+  static const char *requestedLogRate = std::getenv("MOD_AUDIO_FORK_LOG_RATE");
+  static unsigned int nLogRate = std::max(0, requestedLogRate ? ::atoi(requestedLogRate) : 10);
+  static const char *requestedLogQueue = std::getenv("MOD_AUDIO_FORK_LOG_QUEUE");
+  static size_t nLogQueue = std::max(256, requestedLogQueue ? ::atoi(requestedLogQueue) : 4096);
+  static const char *requestedLogLevel = std::getenv("MOD_AUDIO_FORK_LOG_LEVEL");
+  static const char *requestedLwsLogMask = std::getenv("MOD_AUDIO_FORK_LWS_LOG_MASK");
+  static int nLwsLogMask = requestedLwsLogMask ? (int)::strtol(requestedLwsLogMask, nullptr, 0) : (LLL_ERR | LLL_WARN | LLL_NOTICE);
+  // file transcription: files streamed at once, and the sample rate assumed for raw (headerless) files
+  static const char *requestedFileMaxActive = std::getenv("MOD_AUDIO_FORK_FILE_MAX_ACTIVE");
+  static unsigned int nFileMaxActive = std::max(1, requestedFileMaxActive ? ::atoi(requestedFileMaxActive) : 16);
+  static const char *requestedFileRawRate = std::getenv("MOD_AUDIO_FORK_FILE_RAW_RATE");
+  static int nFileRawRate = requestedFileRawRate ? ::atoi(requestedFileRawRate) : 8000;
+  // audio taps (BODHI_AUDIO_TAP=true): where they are written, and the ring each one is drained from
+  static const char *tapDir = std::getenv("MOD_AUDIO_FORK_TAP_DIR");
+  static const char *requestedTapRingKb = std::getenv("MOD_AUDIO_FORK_TAP_RING_KB");
+  static size_t nTapRingKb = std::max(64, std::min(requestedTapRingKb ? ::atoi(requestedTapRingKb) : 1024, 65536));
+  // per-customer limits (see bodhi::Tenants::configure), and the node-wide outbound kbps they share
+  static const char *requestedTenantLimits = std::getenv("MOD_AUDIO_FORK_TENANT_LIMITS");
+  static const char *requestedTenantTotalKbps = std::getenv("MOD_AUDIO_FORK_TENANT_TOTAL_KBPS");
+  static unsigned int nTenantTotalKbps = std::max(0, requestedTenantTotalKbps ? ::atoi(requestedTenantTotalKbps) : 0);
+  // partial results as deltas (see bodhi::PartialDelta); BODHI_DELTA_PARTIALS overrides it per session
+  static const char *requestedDeltaPartials = std::getenv("MOD_AUDIO_FORK_DELTA_PARTIALS");
+  static bool deltaPartials = requestedDeltaPartials && switch_true(requestedDeltaPartials);
+  static const char *requestedJournalSegmentMb = std::getenv("MOD_AUDIO_FORK_JOURNAL_SEGMENT_MB");
+  static size_t nJournalSegmentMb = std::max(1, std::min(requestedJournalSegmentMb ? ::atoi(requestedJournalSegmentMb) : 64, 1024));
+  // shared-memory transcript ring for co-located readers (bodhi_ring.h): its name and record space
+  static const char *shmRingName = std::getenv("MOD_AUDIO_FORK_SHM_RING");
+  static const char *requestedShmRingMb = std::getenv("MOD_AUDIO_FORK_SHM_RING_MB");
+  static size_t nShmRingMb = std::max(1, std::min(requestedShmRingMb ? ::atoi(requestedShmRingMb) : 16, 1024));
   static unsigned int idxCallCount = 0;
   static uint32_t playCount = 0;
 
+  // idle speex resamplers keyed by (input rate, output rate, channels), reset and handed to the next call
+  static const size_t MAX_IDLE_RESAMPLERS_PER_KEY = 64;
+  static std::mutex resamplerMutex;
+  static std::unordered_map<uint64_t, std::vector<SpeexResamplerState *>> idleResamplers;
+  static uint64_t resamplersCreated = 0;
+  static uint64_t resamplersReused = 0;
+  static uint64_t resamplersInUse = 0;
+  static uint64_t resamplersIdle = 0;
+
+  static uint64_t resamplerKey(uint32_t inRate, uint32_t outRate, uint32_t channels)
+  {
+    return ((uint64_t)inRate << 32) | ((uint64_t)outRate << 8) | channels;
+  }
+
+  static SpeexResamplerState *acquireResampler(uint32_t channels, uint32_t inRate, uint32_t outRate, int *err)
+  {
+    {
+      std::lock_guard<std::mutex> lk(resamplerMutex);
+      auto it = idleResamplers.find(resamplerKey(inRate, outRate, channels));
+      if (it != idleResamplers.end() && !it->second.empty())
+      {
+        SpeexResamplerState *resampler = it->second.back();
+        it->second.pop_back();
+        resamplersIdle--;
+        resamplersReused++;
+        resamplersInUse++;
+        *err = 0;
+        return resampler;
+      }
+    }
+    SpeexResamplerState *resampler = speex_resampler_init(channels, inRate, outRate, SWITCH_RESAMPLE_QUALITY, err);
+    if (0 == *err)
+    {
+      std::lock_guard<std::mutex> lk(resamplerMutex);
+      resamplersCreated++;
+      resamplersInUse++;
+    }
+    return resampler;
+  }
+
+  static void releaseResampler(SpeexResamplerState *resampler, uint32_t channels)
+  {
+    spx_uint32_t inRate, outRate;
+    speex_resampler_get_rate(resampler, &inRate, &outRate);
+    speex_resampler_reset_mem(resampler);
+    {
+      std::lock_guard<std::mutex> lk(resamplerMutex);
+      resamplersInUse--;
+      std::vector<SpeexResamplerState *> &idle = idleResamplers[resamplerKey(inRate, outRate, channels)];
+      if (!bodhi::Drain::isDraining() && idle.size() < MAX_IDLE_RESAMPLERS_PER_KEY)
+      {
+        idle.push_back(resampler);
+        resamplersIdle++;
+        return;
+      }
+    }
+    speex_resampler_destroy(resampler);
+  }
+
+  static void destroyIdleResamplers(void)
+  {
+    std::lock_guard<std::mutex> lk(resamplerMutex);
+    for (auto &it : idleResamplers)
+    {
+      for (SpeexResamplerState *resampler : it.second)
+        speex_resampler_destroy(resampler);
+    }
+    idleResamplers.clear();
+    resamplersIdle = 0;
+  }
+
   static void reaper(private_t *tech_pvt)
   {
     std::shared_ptr<bodhi::AudioPipe> pAp;
     pAp.reset((bodhi::AudioPipe *)tech_pvt->pAudioPipe);
     tech_pvt->pAudioPipe = nullptr;
+    // results keep coming until the close, so the sinks stay open until then
+    std::vector<bodhi::ResultSink *> sinks;
+    for (int i = 0; i < MAX_RESULT_SINKS && tech_pvt->resultSinks[i]; i++)
+    {
+      sinks.push_back(static_cast<bodhi::ResultSink *>(tech_pvt->resultSinks[i]));
+      bodhi::ResultSinks::hold(sinks.back());
+    }
 
-    std::thread t([pAp, tech_pvt]
+    std::thread t([pAp, tech_pvt, sinks]
                   {
       pAp->finish();
       pAp->waitForClose();
-      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "%s (%u) got remote close\n", tech_pvt->sessionId, tech_pvt->id); });
+      BODHI_LOG(pAp->getUuid().c_str(), SWITCH_LOG_DEBUG, "(%u) got remote close\n", tech_pvt->id);
+      for (bodhi::ResultSink *sink : sinks)
+        bodhi::ResultSinks::put(sink); });
     t.detach();
   }
 
   static void destroy_tech_pvt(private_t *tech_pvt)
   {
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "%s (%u) destroy_tech_pvt\n", tech_pvt->sessionId, tech_pvt->id);
+    BODHI_LOG(NULL, SWITCH_LOG_INFO, "(%u) destroy_tech_pvt\n", tech_pvt->id);
     if (tech_pvt)
     {
       if (tech_pvt->pAudioPipe)
@@ -62,118 +204,245 @@ namespace
         delete p;
         tech_pvt->pAudioPipe = nullptr;
       }
-      if (tech_pvt->resampler)
-      {
-        speex_resampler_destroy(tech_pvt->resampler);
-        tech_pvt->resampler = NULL;
-      }
+      bodhi::EndpointPool::release(tech_pvt->endpoint);
+      tech_pvt->endpoint = -1;
+      bodhi::Tenants::release(static_cast<bodhi::Tenants::Tenant *>(tech_pvt->tenant));
+      tech_pvt->tenant = nullptr;
+      // left in place: a reaped pipe's last results still go to them, on the reaper's references
+      for (int i = 0; i < MAX_RESULT_SINKS && tech_pvt->resultSinks[i]; i++)
+        bodhi::ResultSinks::put(static_cast<bodhi::ResultSink *>(tech_pvt->resultSinks[i]));
     }
   }
 
-  std::string encodeURIComponent(std::string decoded)
+  static void destroy_capture(capture_t *cap)
   {
+    if (cap->resampler)
+    {
+      releaseResampler(cap->resampler, cap->channels);
+      cap->resampler = NULL;
+    }
+    if (cap->mutex)
+    {
+      switch_mutex_destroy(cap->mutex);
+      cap->mutex = nullptr;
+    }
+  }
 
-    std::ostringstream oss;
-    std::regex r("[!'\\(\\)*-.0-9A-Za-z_~:]");
-
-    for (char &c : decoded)
+  // BODHI_RESULT_SINKS: comma-separated list of event, udp:<host>:<port>, unix:<path> or file:<path>
+  static void initResultSinks(switch_core_session_t *session, private_t *tech_pvt, const char *spec)
+  {
+    std::stringstream ss(spec);
+    std::string target;
+    int n = 0;
+    tech_pvt->skip_event_sink = 1;
+    while (std::getline(ss, target, ','))
     {
-      if (std::regex_match((std::string){c}, r))
+      target.erase(0, target.find_first_not_of(' '));
+      target.erase(target.find_last_not_of(' ') + 1);
+      if (target == "event")
       {
-        oss << c;
+        tech_pvt->skip_event_sink = 0;
+        continue;
       }
-      else
+      std::string error;
+      bodhi::ResultSink *sink = bodhi::ResultSinks::get(target, error);
+      if (!sink)
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "%s\n", error.c_str());
+      else if (n == MAX_RESULT_SINKS)
       {
-        oss << "%" << std::uppercase << std::hex << (0xff & c);
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "ignoring result sink %s, at most %d allowed\n", target.c_str(), MAX_RESULT_SINKS);
+        bodhi::ResultSinks::put(sink);
       }
+      else
+        tech_pvt->resultSinks[n++] = sink;
+    }
+    if (0 == n && tech_pvt->skip_event_sink)
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "no usable result sink in %s, using events\n", spec);
+      tech_pvt->skip_event_sink = 0;
     }
-    return oss.str();
   }
 
-  static void eventCallback(const char *sessionId, bodhi::AudioPipe::NotifyEvent_t event, const char *message, bool finished)
+  static void deliverResult(switch_core_session_t *session, private_t *tech_pvt, const char *message, bool finished)
+  {
+    if (tech_pvt->resultSinks[0])
+    {
+      std::string record = std::string("{\"uuid\": \"") + switch_core_session_get_uuid(session) + "\", \"bugname\": \"" +
+                           utils::escapeJson(tech_pvt->bugname) + "\", \"finished\": " + (finished ? "true" : "false") + ", \"result\": " + message + "}";
+      for (int i = 0; i < MAX_RESULT_SINKS && tech_pvt->resultSinks[i]; i++)
+        bodhi::ResultSinks::deliver(static_cast<bodhi::ResultSink *>(tech_pvt->resultSinks[i]), record);
+    }
+    if (!tech_pvt->skip_event_sink)
+      tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_RESULTS, message, tech_pvt->bugname, finished);
+  }
+
+  static void notifyReconfigure(switch_core_session_t *session, responseHandler_t responseHandler, const char *bugname,
+                                const char *modelName, const char *status)
+  {
+    std::string json = std::string("{\"model\": \"") + utils::escapeJson(modelName) + "\", \"status\": \"" + status + "\"}";
+    responseHandler(session, TRANSCRIBE_EVENT_RECONFIGURE, json.c_str(), bugname, 0);
+  }
+
+  static bool has_pipe(capture_t *cap, const char *bugname);
+
+  // fallback for a model switch the open connection could not take: replace the pipe with a new connection
+  static switch_status_t replace_pipe(switch_core_session_t *session, responseHandler_t responseHandler, const char *bugname, const char *modelName)
+  {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = (switch_media_bug_t *)switch_channel_get_private(channel, MY_BUG_NAME);
+    capture_t *cap = bug ? (capture_t *)switch_core_media_bug_get_user_data(bug) : nullptr;
+    // the pipe may have been stopped meanwhile
+    if (!cap || !has_pipe(cap, bugname))
+      return SWITCH_STATUS_FALSE;
+
+    std::string name(bugname), model(modelName);
+    void *pUserData = cap;
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "%s: reconnecting with model %s\n", bugname, modelName);
+    notifyReconfigure(session, responseHandler, bugname, modelName, "reconnecting");
+    return bodhi_transcribe_session_init(session, responseHandler, cap->samples_per_second, cap->channels, &model[0], 0, &name[0], &pUserData);
+  }
+
+  // replace_pipe for a failure reported on a service thread: done on a thread of its own, as the reaper does
+  static void restart_pipe(const char *sessionId, private_t *tech_pvt, const char *modelName)
+  {
+    std::string uuid(sessionId), bugname(tech_pvt->bugname), model(modelName);
+    responseHandler_t responseHandler = tech_pvt->responseHandler;
+
+    std::thread t([uuid, bugname, model, responseHandler]
+                  {
+      switch_core_session_t *session = switch_core_session_locate(uuid.c_str());
+      if (!session)
+        return;
+      if (SWITCH_STATUS_SUCCESS != replace_pipe(session, responseHandler, bugname.c_str(), model.c_str()))
+        notifyReconfigure(session, responseHandler, bugname.c_str(), model.c_str(), "failed");
+      switch_core_session_rwunlock(session); });
+    t.detach();
+  }
+
+  static void eventCallback(const char *sessionId, void *userData, bodhi::AudioPipe::NotifyEvent_t event, const char *message, bool finished)
   {
     switch_core_session_t *session = switch_core_session_locate(sessionId);
     if (session)
     {
-      switch_channel_t *channel = switch_core_session_get_channel(session);
-      switch_media_bug_t *bug = (switch_media_bug_t *)switch_channel_get_private(channel, MY_BUG_NAME);
-      if (bug)
+      // userData is the pipe's private_t, allocated from the session pool: valid while we hold the session
+      private_t *tech_pvt = (private_t *)userData;
+      if (tech_pvt)
       {
-        private_t *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-        if (tech_pvt)
+        switch (event)
+        {
+        case bodhi::AudioPipe::CONNECT_SUCCESS:
+        {
+          // time spent waiting for connect admission during a burst of starts
+          bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+          uint32_t queueMs = pAudioPipe ? pAudioPipe->getConnectQueueMs() : 0;
+          bodhi::EndpointPool::reportConnect(tech_pvt->endpoint, true, pAudioPipe ? pAudioPipe->getHandshakeMs() : 0);
+          std::string json = "{\"queue_ms\": " + std::to_string(queueMs) + "}";
+          switch_channel_set_variable_printf(switch_core_session_get_channel(session), (std::string(tech_pvt->bugname) + "_connect_queue_ms").c_str(),
+                                             "%u", queueMs);
+          BODHI_LOG(sessionId, SWITCH_LOG_INFO, "connection successful after %u ms in connect queue\n", queueMs);
+          tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_SUCCESS, json.c_str(), tech_pvt->bugname, finished);
+        }
+        break;
+        case bodhi::AudioPipe::CONNECT_FAIL:
         {
-          switch (event)
+          // first thing: we can no longer access the AudioPipe
+          std::stringstream json;
+          tech_pvt->pAudioPipe = nullptr;
+          bodhi::EndpointPool::reportConnect(tech_pvt->endpoint, false, 0);
+          tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, message, tech_pvt->bugname, finished);
+          BODHI_LOG(sessionId, SWITCH_LOG_DEBUG, "connection failed: %s\n", message);
+        }
+        break;
+        case bodhi::AudioPipe::CONNECTION_DROPPED:
+          // first thing: we can no longer access the AudioPipe
+          tech_pvt->pAudioPipe = nullptr;
+          if (!finished)
+            bodhi::EndpointPool::reportDrop(tech_pvt->endpoint);
+          if (message)
           {
-          case bodhi::AudioPipe::CONNECT_SUCCESS:
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "connection successful\n");
-            tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_SUCCESS, NULL, tech_pvt->bugname, finished);
-            break;
-          case bodhi::AudioPipe::CONNECT_FAIL:
+            // the peer stopped answering pings
+            std::string json = std::string("{\"reason\": \"") + message + "\"}";
+            tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_DISCONNECT, json.c_str(), tech_pvt->bugname, finished);
+            BODHI_LOG(sessionId, SWITCH_LOG_NOTICE, "(%u) connection dropped: %s\n", tech_pvt->id, message);
+          }
+          else
           {
-            // first thing: we can no longer access the AudioPipe
-            std::stringstream json;
-            tech_pvt->pAudioPipe = nullptr;
-            tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, message, tech_pvt->bugname, finished);
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "connection failed: %s\n", message);
+            tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_DISCONNECT, NULL, tech_pvt->bugname, finished);
+            BODHI_LOG(sessionId, SWITCH_LOG_DEBUG, "connection dropped from far end\n");
           }
           break;
-          case bodhi::AudioPipe::CONNECTION_DROPPED:
-            // first thing: we can no longer access the AudioPipe
-            tech_pvt->pAudioPipe = nullptr;
-            tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_DISCONNECT, NULL, tech_pvt->bugname, finished);
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "connection dropped from far end\n");
-            break;
-          case bodhi::AudioPipe::CONNECTION_CLOSED_GRACEFULLY:
-            // first thing: we can no longer access the AudioPipe
-            tech_pvt->pAudioPipe = nullptr;
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "connection closed gracefully\n");
-            break;
-          case bodhi::AudioPipe::MESSAGE:
-           if (utils::hasJsonKey(message, "error")) {
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "bodhi error received: %s\n", message);
-                tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, message, tech_pvt->bugname, finished);
-            } else {
-                tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_RESULTS, message, tech_pvt->bugname, finished);
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "bodhi message: %s\n", message);
-            }
-            break;
-
-          default:
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "got unexpected msg from bodhi %d:%s\n", event, message);
-            break;
+        case bodhi::AudioPipe::CONNECTION_CLOSED_GRACEFULLY:
+          // first thing: we can no longer access the AudioPipe
+          tech_pvt->pAudioPipe = nullptr;
+          BODHI_LOG(sessionId, SWITCH_LOG_DEBUG, "connection closed gracefully\n");
+          break;
+        case bodhi::AudioPipe::MESSAGE:
+         if (utils::hasJsonKey(message, "error")) {
+              BODHI_LOG(sessionId, SWITCH_LOG_ERROR, "bodhi error received: %s\n", message);
+              tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, message, tech_pvt->bugname, finished);
+          } else {
+              bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+              long latencyMs = pAudioPipe ? pAudioPipe->getResultLatencyMs(message) : -1;
+              if (latencyMs >= 0)
+                bodhi::EndpointPool::reportResultLatency(tech_pvt->endpoint, latencyMs);
+              deliverResult(session, tech_pvt, message, finished);
+              BODHI_LOG(sessionId, SWITCH_LOG_DEBUG, "bodhi message: %s\n", message);
           }
+          break;
+        case bodhi::AudioPipe::PONG:
+        {
+          uint32_t rttMs = ::atoi(message);
+          tech_pvt->rtt_samples++;
+          tech_pvt->rtt_total_ms += rttMs;
+          tech_pvt->rtt_max_ms = std::max(tech_pvt->rtt_max_ms, rttMs);
+          bodhi::EndpointPool::reportRtt(tech_pvt->endpoint, rttMs);
+        }
+        break;
+        case bodhi::AudioPipe::RECONFIGURED:
+          BODHI_LOG(sessionId, SWITCH_LOG_INFO, "(%u) switched to model %s\n", tech_pvt->id, message);
+          notifyReconfigure(session, tech_pvt->responseHandler, tech_pvt->bugname, message, "applied");
+          break;
+        case bodhi::AudioPipe::RECONFIGURE_FAILED:
+          BODHI_LOG(sessionId, SWITCH_LOG_NOTICE, "(%u) model switch to %s not taken on open connection\n", tech_pvt->id, message);
+          if (!finished)
+            restart_pipe(sessionId, tech_pvt, message);
+          else
+            notifyReconfigure(session, tech_pvt->responseHandler, tech_pvt->bugname, message, "failed");
+          break;
+
+        default:
+          BODHI_LOG(sessionId, SWITCH_LOG_DEBUG, "got unexpected msg from bodhi %d:%s\n", event, message);
+          break;
         }
       }
       switch_core_session_rwunlock(session);
     }
   }
+
   switch_status_t fork_data_init(private_t *tech_pvt, switch_core_session_t *session,
-                                 int sampling, int desiredSampling, int channels, char *modelName, int interim,
+                                 int desiredSampling, int channels, char *modelName, int interim,
                                  char *bugname, responseHandler_t responseHandler)
   {
 
-    int err;
     switch_codec_implementation_t read_impl;
     switch_channel_t *channel = switch_core_session_get_channel(session);
 
     switch_core_session_get_read_impl(session, &read_impl);
 
     memset(tech_pvt, 0, sizeof(private_t));
+    tech_pvt->endpoint = -1;
 
-    std::string path;
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "path: %s\n", path.c_str());
-
-    strncpy(tech_pvt->sessionId, switch_core_session_get_uuid(session), MAX_SESSION_ID);
-    strncpy(tech_pvt->host, "bodhi.navana.ai", MAX_WS_URL_LEN);
-    tech_pvt->port = 443;
-    strncpy(tech_pvt->path, path.c_str(), MAX_PATH_LEN);
-    tech_pvt->sampling = desiredSampling;
     tech_pvt->responseHandler = responseHandler;
-    tech_pvt->channels = channels;
+    strncpy(tech_pvt->bugname, bugname, MAX_BUG_LEN);
     tech_pvt->id = ++idxCallCount;
     tech_pvt->buffer_overrun_notified = 0;
 
-    size_t buflen = LWS_PRE + (FRAME_SIZE_8000 * desiredSampling / 8000 * channels * 1000 / RTP_PACKETIZATION_PERIOD * nAudioBufferSecs);
+    const char *resultSinks = switch_channel_get_variable(channel, "BODHI_RESULT_SINKS");
+    if (resultSinks)
+      initResultSinks(session, tech_pvt, resultSinks);
+
+    size_t bytesPerSec = FRAME_SIZE_8000 * desiredSampling / 8000 * channels * 1000 / RTP_PACKETIZATION_PERIOD;
+    size_t buflen = LWS_PRE + (bytesPerSec * nAudioBufferSecs);
 
     const char *apiKey = switch_channel_get_variable(channel, "BODHI_API_KEY");
     const char *customerId = switch_channel_get_variable(channel, "BODHI_CUSTOMER_ID");
@@ -199,23 +468,98 @@ namespace
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "no BODHI_CUSTOMER_ID provided\n");
     }
 
-    bodhi::AudioPipe *ap = new bodhi::AudioPipe(tech_pvt->sessionId, tech_pvt->host, tech_pvt->port, tech_pvt->path,
+    // handed to the pipe, which releases it when its connection is gone; destroy_tech_pvt
+    // releases it if the pipe was never made
+    std::string error;
+    tech_pvt->tenant = bodhi::Tenants::acquire(customerId ? customerId : "", true, error);
+    if (!tech_pvt->tenant)
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "%s: %s\n", bugname, error.c_str());
+      responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, "{\"reason\": \"customer pipe limit\"}", bugname, 0);
+      return SWITCH_STATUS_FALSE;
+    }
+
+    bodhi::Endpoint endpoint;
+    tech_pvt->endpoint = bodhi::EndpointPool::pick(endpoint);
+    if (tech_pvt->endpoint < 0)
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "no ASR endpoint configured\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) endpoint %s:%u%s\n", tech_pvt->id,
+                      endpoint.host.c_str(), endpoint.port, endpoint.path.c_str());
+
+    bodhi::AudioPipe *ap = new bodhi::AudioPipe(switch_core_session_get_uuid(session), endpoint.host.c_str(), endpoint.port, endpoint.path.c_str(),
                                                 buflen, read_impl.decoded_bytes_per_packet, apiKey, customerId,
                                                 desiredSampling, modelName, eventCallback);
     if (!ap)
     {
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error allocating AudioPipe\n");
+      bodhi::EndpointPool::release(tech_pvt->endpoint);
+      tech_pvt->endpoint = -1;
       return SWITCH_STATUS_FALSE;
     }
+    ap->setSslFlags(endpoint.tls ? LCCSCF_USE_SSL : 0);
+    ap->setTenant(static_cast<bodhi::Tenants::Tenant *>(tech_pvt->tenant));
+    tech_pvt->tenant = nullptr;
+    ap->setDeflate(switch_true(switch_channel_get_variable(channel, "BODHI_DEFLATE")));
+    const char *requestedDeltas = switch_channel_get_variable(channel, "BODHI_DELTA_PARTIALS");
+    ap->setDeltaPartials(requestedDeltas ? switch_true(requestedDeltas) : deltaPartials);
 
+    bodhi::AudioPipe::OverrunPolicy_t overrunPolicy = defaultOverrunPolicy;
+    const char *requestedPolicy = switch_channel_get_variable(channel, "BODHI_OVERRUN_POLICY");
+    if (requestedPolicy && !bodhi::AudioPipe::parseOverrunPolicy(requestedPolicy, overrunPolicy))
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "invalid BODHI_OVERRUN_POLICY %s, using %s\n",
+                        requestedPolicy, bodhi::AudioPipe::overrunPolicyName(overrunPolicy));
+    }
+    if (switch_true(switch_channel_get_variable(channel, "BODHI_AUDIO_TAP")))
+    {
+      std::string name = std::string(switch_core_session_get_uuid(session)) + "-" + bugname + "-" + std::to_string(tech_pvt->id);
+      bodhi::AudioTap *tap = bodhi::AudioTaps::open(name, desiredSampling, channels);
+      if (tap)
+        ap->setTap(tap);
+      else
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "BODHI_AUDIO_TAP set but MOD_AUDIO_FORK_TAP_DIR is not\n");
+    }
+    ap->setChannels(channels);
+    ap->setOverrunPolicy(overrunPolicy, nMaxAudioAgeMs, LWS_PRE + (bytesPerSec * nMaxBufferSecs));
+
+    ap->setUserData(tech_pvt);
     tech_pvt->pAudioPipe = static_cast<void *>(ap);
 
-    switch_mutex_init(&tech_pvt->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) fork_data_init\n", tech_pvt->id);
+
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  static void notifyBufferOverrun(switch_core_session_t *session, private_t *tech_pvt, bodhi::AudioPipe *pAudioPipe)
+  {
+    // audio held while the connect waits in the queue ages out quietly; it is still counted in dropped ms
+    if (pAudioPipe->getLwsState() != bodhi::AudioPipe::LWS_CLIENT_CONNECTED)
+      return;
+    if (!tech_pvt->buffer_overrun_notified)
+    {
+      tech_pvt->buffer_overrun_notified = 1;
+      std::string json = std::string("{\"policy\": \"") + bodhi::AudioPipe::overrunPolicyName(pAudioPipe->getOverrunPolicy()) + "\"}";
+      tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_BUFFER_OVERRUN, json.c_str(), tech_pvt->bugname, 0);
+    }
+    BODHI_LOG(switch_core_session_get_uuid(session), SWITCH_LOG_WARNING, "(%u) dropping packets!\n", tech_pvt->id);
+  }
+
+  static switch_status_t capture_init(capture_t *cap, switch_core_session_t *session, int sampling, int desiredSampling, int channels)
+  {
+    int err;
+
+    memset(cap, 0, sizeof(capture_t));
+    cap->samples_per_second = sampling;
+    cap->channels = channels;
+    switch_mutex_init(&cap->mutex, SWITCH_MUTEX_NESTED, switch_core_session_get_pool(session));
 
     if (desiredSampling != sampling)
     {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) resampling from %u to %u\n", tech_pvt->id, sampling, desiredSampling);
-      tech_pvt->resampler = speex_resampler_init(channels, sampling, desiredSampling, SWITCH_RESAMPLE_QUALITY, &err);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "resampling from %u to %u\n", sampling, desiredSampling);
+      cap->resampler = acquireResampler(channels, sampling, desiredSampling, &err);
       if (0 != err)
       {
         switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error initializing resampler: %s.\n", speex_resampler_strerror(err));
@@ -224,35 +568,134 @@ namespace
     }
     else
     {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) no resampling needed for this call\n", tech_pvt->id);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "no resampling needed for this call\n");
     }
+    return SWITCH_STATUS_SUCCESS;
+  }
 
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) fork_data_init\n", tech_pvt->id);
+  static bool has_pipe(capture_t *cap, const char *bugname)
+  {
+    bool found = false;
+    switch_mutex_lock(cap->mutex);
+    for (int i = 0; i < MAX_PIPES_PER_SESSION && !found; i++)
+      found = cap->pipes[i] && 0 == strcmp(cap->pipes[i]->bugname, bugname);
+    switch_mutex_unlock(cap->mutex);
+    return found;
+  }
 
-    return SWITCH_STATUS_SUCCESS;
+  // close one pipe and get its final responses; call with the capture mutex held
+  static void stop_pipe(switch_core_session_t *session, capture_t *cap, int slot)
+  {
+    private_t *tech_pvt = cap->pipes[slot];
+    bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+
+    cap->pipes[slot] = NULL;
+    if (tech_pvt->rtt_samples)
+    {
+      switch_channel_t *channel = switch_core_session_get_channel(session);
+      switch_channel_set_variable_printf(channel, (std::string(tech_pvt->bugname) + "_rtt_ms").c_str(), "%u",
+                                         (unsigned int)(tech_pvt->rtt_total_ms / tech_pvt->rtt_samples));
+      switch_channel_set_variable_printf(channel, (std::string(tech_pvt->bugname) + "_rtt_max_ms").c_str(), "%u", tech_pvt->rtt_max_ms);
+    }
+    if (pAudioPipe)
+    {
+      switch_channel_t *channel = switch_core_session_get_channel(session);
+      uint64_t droppedMs = pAudioPipe->getDroppedMs();
+      switch_channel_set_variable_printf(channel, (std::string(tech_pvt->bugname) + "_dropped_ms").c_str(), "%lu", (unsigned long)droppedMs);
+      if (droppedMs)
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "(%u) dropped %lu ms of audio on buffer overruns\n",
+                          tech_pvt->id, (unsigned long)droppedMs);
+      reaper(tech_pvt);
+    }
+    destroy_tech_pvt(tech_pvt);
   }
 
-  void lws_logger(int level, const char *line)
+  // audio is buffered from the start, so nothing is lost while the connect is queued or in progress
+  static bool takes_audio(bodhi::AudioPipe *pAudioPipe)
+  {
+    if (!pAudioPipe)
+      return false;
+    bodhi::AudioPipe::LwsState_t state = pAudioPipe->getLwsState();
+    return !pAudioPipe->isFinished() &&
+           (state == bodhi::AudioPipe::LWS_CLIENT_IDLE || state == bodhi::AudioPipe::LWS_CLIENT_CONNECTING || state == bodhi::AudioPipe::LWS_CLIENT_CONNECTED);
+  }
+
+  // copy one frame of (resampled) audio into a pipe; call with the capture mutex held
+  static bool write_to_pipe(switch_core_session_t *session, private_t *tech_pvt, const uint8_t *data, size_t len)
+  {
+    bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+    if (!takes_audio(pAudioPipe))
+      return false;
+
+    pAudioPipe->lockAudioBuffer();
+    size_t needed = std::max(len, pAudioPipe->binaryMinSpace());
+    if (pAudioPipe->binarySpaceAvailable() < needed)
+    {
+      notifyBufferOverrun(session, tech_pvt, pAudioPipe);
+      pAudioPipe->binaryMakeSpace(needed);
+    }
+    len = std::min(len, pAudioPipe->binarySpaceAvailable());
+    memcpy(pAudioPipe->binaryWritePtr(), data, len);
+    pAudioPipe->binaryWritePtrAdd(len);
+    pAudioPipe->unlockAudioBuffer();
+    return true;
+  }
+
+  // FileTranscriber results: to the job's result sink if it has one, else as events without a channel
+  static void fileCallback(const std::string &id, const std::string &path, void *userData, bodhi::FileTranscriber::Event_t event, const char *json)
+  {
+    bodhi::ResultSink *sink = static_cast<bodhi::ResultSink *>(userData);
+    if (sink)
+    {
+      std::string record = "{\"job\": \"" + id + "\", \"path\": \"" + utils::escapeJson(path) + "\", \"finished\": " +
+                           (event == bodhi::FileTranscriber::FILE_RESULT ? "false" : "true") + ", \"result\": " + json + "}";
+      bodhi::ResultSinks::deliver(sink, record);
+      if (event == bodhi::FileTranscriber::FILE_RESULT)
+        return;
+    }
+
+    switch_event_t *e;
+    const char *eventName = event == bodhi::FileTranscriber::FILE_RESULT ? TRANSCRIBE_EVENT_RESULTS : TRANSCRIBE_EVENT_FILE_DONE;
+    if (SWITCH_STATUS_SUCCESS != switch_event_create_subclass(&e, SWITCH_EVENT_CUSTOM, eventName))
+      return;
+    switch_event_add_header_string(e, SWITCH_STACK_BOTTOM, "transcription-vendor", "bodhi");
+    switch_event_add_header_string(e, SWITCH_STACK_BOTTOM, "transcription-job", id.c_str());
+    switch_event_add_header_string(e, SWITCH_STACK_BOTTOM, "transcription-file", path.c_str());
+    switch_event_add_header_string(e, SWITCH_STACK_BOTTOM, "transcription-session-finished",
+                                   event == bodhi::FileTranscriber::FILE_RESULT ? "false" : "true");
+    switch_event_add_body(e, "%s", json);
+    switch_event_fire(&e);
+    if (event == bodhi::FileTranscriber::FILE_FAILED)
+      BODHI_LOG(id.c_str(), SWITCH_LOG_WARNING, "transcription of %s failed: %s\n", path.c_str(), json);
+  }
+
+  // writer thread side of AsyncLog
+  void log_emit(int level, const char *file, const char *func, int line, const char *uuid, const char *text)
   {
-    switch_log_level_t llevel = SWITCH_LOG_DEBUG;
+    switch_log_printf(SWITCH_CHANNEL_ID_LOG, file, func, line, uuid, (switch_log_level_t)level, "%s\n", text);
+  }
 
+  // called from the lws service threads for the levels in nLwsLogMask
+  void lws_logger(int level, const char *line)
+  {
     switch (level)
     {
     case LLL_ERR:
-      llevel = SWITCH_LOG_ERROR;
+      BODHI_LOG(NULL, SWITCH_LOG_ERROR, "%s", line);
       break;
     case LLL_WARN:
-      llevel = SWITCH_LOG_WARNING;
+      BODHI_LOG(NULL, SWITCH_LOG_WARNING, "%s", line);
       break;
     case LLL_NOTICE:
-      llevel = SWITCH_LOG_NOTICE;
+      BODHI_LOG(NULL, SWITCH_LOG_NOTICE, "%s", line);
       break;
     case LLL_INFO:
-      llevel = SWITCH_LOG_INFO;
+      BODHI_LOG(NULL, SWITCH_LOG_INFO, "%s", line);
       break;
+    default:
+      BODHI_LOG(NULL, SWITCH_LOG_DEBUG, "%s", line);
       break;
     }
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "%s\n", line);
   }
 }
 
@@ -260,13 +703,80 @@ extern "C"
 {
   switch_status_t bodhi_transcribe_init()
   {
+    int logLevel = requestedLogLevel ? switch_log_str2level(requestedLogLevel) : SWITCH_LOG_DEBUG;
+    bodhi::AsyncLog::start(log_emit, nLogQueue, nLogRate, logLevel);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: audio buffer (in secs):    %d secs\n", nAudioBufferSecs);
     switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_transcribe: lws service threads:       %d\n", nServiceThreads);
 
-    int logs = LLL_ERR | LLL_WARN | LLL_NOTICE || LLL_INFO | LLL_PARSER | LLL_HEADER | LLL_EXT | LLL_CLIENT | LLL_LATENCY | LLL_DEBUG;
+    std::string error;
+    if (requestedEndpoints && !bodhi::EndpointPool::configure(requestedEndpoints, error))
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: invalid MOD_AUDIO_FORK_ENDPOINTS (%s), using %s\n",
+                        error.c_str(), DEFAULT_ENDPOINT);
+    if (!requestedEndpoints || !error.empty())
+      bodhi::EndpointPool::configure(DEFAULT_ENDPOINT, error);
+    bodhi::EndpointPool::start();
+    for (const bodhi::EndpointPool::EndpointStats &e : bodhi::EndpointPool::getStats())
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: endpoint:                 %s (weight %u)\n", e.name.c_str(), e.weight);
+
+    bodhi::LwsTransport::initialize(nServiceThreads, nLwsLogMask, lws_logger);
+    bodhi::AudioPipe::setDefaultTransport(bodhi::LwsTransport::instance());
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "LwsTransport::initialize completed\n");
+
+    if (requestedOverrunPolicy && !bodhi::AudioPipe::parseOverrunPolicy(requestedOverrunPolicy, defaultOverrunPolicy))
+    {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_WARNING, "mod_bodhi_transcribe: invalid MOD_AUDIO_FORK_OVERRUN_POLICY %s\n", requestedOverrunPolicy);
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: overrun policy:           %s (max age %u ms, max buffer %d secs)\n",
+                      bodhi::AudioPipe::overrunPolicyName(defaultOverrunPolicy), nMaxAudioAgeMs, nMaxBufferSecs);
 
-    bodhi::AudioPipe::initialize(nServiceThreads, logs, lws_logger);
-    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "AudioPipe::initialize completed\n");
+    if (requestedTenantLimits || nTenantTotalKbps)
+    {
+      if (bodhi::Tenants::configure(requestedTenantLimits ? requestedTenantLimits : "", nTenantTotalKbps, error))
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: tenant limits:            %s (%u kbps shared)\n",
+                          requestedTenantLimits ? requestedTenantLimits : "none", nTenantTotalKbps);
+      else
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: invalid MOD_AUDIO_FORK_TENANT_LIMITS (%s), no limits applied\n",
+                          error.c_str());
+    }
+
+    bodhi::ResultSinks::start(nSinkQueue);
+    if (!bodhi::FileTranscriber::isSupportedRate(nFileRawRate))
+    {
+      switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: invalid MOD_AUDIO_FORK_FILE_RAW_RATE (%s), using 8000\n",
+                        requestedFileRawRate);
+      nFileRawRate = 8000;
+    }
+    bodhi::FileTranscriber::start(nFileMaxActive, nAudioBufferSecs, fileCallback);
+
+    if (journalDir && *journalDir)
+    {
+      if (bodhi::Journal::open(journalDir, nJournalSegmentMb * 1024 * 1024, nSinkQueue))
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: transcript journal:       %s (%u MB segments)\n",
+                          journalDir, (unsigned int)nJournalSegmentMb);
+      else
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: cannot open transcript journal in %s\n", journalDir);
+    }
+    if (shmRingName && *shmRingName)
+    {
+      if (bodhi::TranscriptRing::open(shmRingName, nShmRingMb * 1024 * 1024))
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: transcript ring:          %s (%u MB)\n",
+                          shmRingName, (unsigned int)nShmRingMb);
+      else
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: cannot create transcript ring %s\n", shmRingName);
+    }
+
+    bodhi::BufferPool::instance().configure((size_t)nPoolCachedMb * 1024 * 1024, poolHugePages);
+    if (tapDir && *tapDir)
+    {
+      bodhi::AudioTaps::start(tapDir, nTapRingKb * 1024);
+      if (bodhi::AudioTaps::isRunning())
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: audio taps:               %s (%u KB rings)\n",
+                          tapDir, (unsigned int)nTapRingKb);
+      else
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "mod_bodhi_transcribe: cannot write audio taps to %s\n", tapDir);
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: buffer pool:              %u MB cached max%s\n",
+                      nPoolCachedMb, poolHugePages ? ", huge pages" : "");
 
     const char *apiKey = std::getenv("BODHI_API_KEY");
     if (NULL == apiKey)
@@ -297,7 +807,16 @@ extern "C"
   switch_status_t bodhi_transcribe_cleanup()
   {
     bool cleanup = false;
-    cleanup = bodhi::AudioPipe::deinitialize();
+    bodhi::FileTranscriber::stop();
+    cleanup = bodhi::LwsTransport::deinitialize();
+    bodhi::AudioTaps::stop();
+    bodhi::ResultSinks::stop();
+    bodhi::EndpointPool::stop();
+    bodhi::Journal::close();
+    bodhi::TranscriptRing::close();
+    destroyIdleResamplers();
+    bodhi::BufferPool::instance().trim();
+    bodhi::AsyncLog::stop();
     if (cleanup == true)
     {
       return SWITCH_STATUS_SUCCESS;
@@ -305,27 +824,272 @@ extern "C"
     return SWITCH_STATUS_FALSE;
   }
 
+  switch_status_t bodhi_transcribe_stats(switch_stream_handle_t *stream)
+  {
+    bodhi::BufferPool::Stats pool = bodhi::BufferPool::instance().getStats();
+    cJSON *json = cJSON_CreateObject();
+    cJSON *memory = cJSON_CreateObject();
+    cJSON *jPool = cJSON_CreateObject();
+    cJSON *jResamplers = cJSON_CreateObject();
+
+    cJSON_AddNumberToObject(jPool, "bytes_in_use", pool.bytesInUse);
+    cJSON_AddNumberToObject(jPool, "bytes_cached", pool.bytesCached);
+    cJSON_AddNumberToObject(jPool, "bytes_huge_page", pool.bytesHugePage);
+    cJSON_AddNumberToObject(jPool, "bytes_arena", pool.bytesArena);
+    cJSON_AddNumberToObject(jPool, "allocs", pool.allocs);
+    cJSON_AddNumberToObject(jPool, "cache_hits", pool.hits);
+    {
+      std::lock_guard<std::mutex> lk(resamplerMutex);
+      cJSON_AddNumberToObject(jResamplers, "in_use", resamplersInUse);
+      cJSON_AddNumberToObject(jResamplers, "idle", resamplersIdle);
+      cJSON_AddNumberToObject(jResamplers, "created", resamplersCreated);
+      cJSON_AddNumberToObject(jResamplers, "reused", resamplersReused);
+    }
+    cJSON_AddNumberToObject(memory, "interned_strings", bodhi::InternedString::tableSize());
+    cJSON_AddItemToObject(memory, "pool", jPool);
+    cJSON_AddItemToObject(memory, "resamplers", jResamplers);
+    cJSON_AddItemToObject(json, "memory", memory);
+
+    bodhi::ResultSinks::Stats sinks = bodhi::ResultSinks::getStats();
+    cJSON *jSinks = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jSinks, "queued", sinks.queued);
+    cJSON_AddNumberToObject(jSinks, "delivered", sinks.delivered);
+    cJSON_AddNumberToObject(jSinks, "dropped", sinks.dropped);
+    cJSON_AddNumberToObject(jSinks, "failed", sinks.failed);
+    cJSON_AddNumberToObject(jSinks, "batches", sinks.batches);
+    cJSON_AddNumberToObject(jSinks, "open", sinks.open);
+    cJSON_AddItemToObject(json, "result_sinks", jSinks);
+
+    bodhi::ConnectScheduler::Stats connects = bodhi::LwsTransport::getConnectStats();
+    cJSON *jConnects = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jConnects, "waiting", connects.waiting);
+    cJSON_AddNumberToObject(jConnects, "in_flight", connects.inFlight);
+    cJSON_AddNumberToObject(jConnects, "admitted", connects.admitted);
+    cJSON_AddNumberToObject(jConnects, "deferred", connects.deferred);
+    cJSON_AddNumberToObject(jConnects, "max_queue_ms", connects.maxQueueMs);
+    cJSON_AddNumberToObject(jConnects, "avg_queue_ms", connects.admitted ? connects.totalQueueMs / connects.admitted : 0);
+    cJSON_AddItemToObject(json, "connects", jConnects);
+
+    bodhi::DnsCache::Stats dns = bodhi::DnsCache::getStats();
+    cJSON *jDns = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jDns, "entries", dns.entries);
+    cJSON_AddNumberToObject(jDns, "hits", dns.hits);
+    cJSON_AddNumberToObject(jDns, "misses", dns.misses);
+    cJSON_AddNumberToObject(jDns, "hit_rate", dns.hits + dns.misses ? (double)dns.hits / (dns.hits + dns.misses) : 0);
+    cJSON_AddNumberToObject(jDns, "resolves", dns.resolves);
+    cJSON_AddNumberToObject(jDns, "failures", dns.failures);
+    cJSON_AddItemToObject(json, "dns", jDns);
+
+    if (bodhi::LwsTransport::deflateEnabled())
+    {
+      bodhi::LwsTransport::DeflateStats deflate = bodhi::LwsTransport::getDeflateStats();
+      uint64_t kb = (deflate.rxBytes + deflate.txBytes) / 1024;
+      cJSON *jDeflate = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jDeflate, "offered", deflate.offered);
+      cJSON_AddNumberToObject(jDeflate, "negotiated", deflate.negotiated);
+      cJSON_AddNumberToObject(jDeflate, "rx_wire_bytes", deflate.rxWireBytes);
+      cJSON_AddNumberToObject(jDeflate, "rx_bytes", deflate.rxBytes);
+      cJSON_AddNumberToObject(jDeflate, "rx_ratio", deflate.rxWireBytes ? (double)deflate.rxBytes / deflate.rxWireBytes : 0);
+      cJSON_AddNumberToObject(jDeflate, "tx_bytes", deflate.txBytes);
+      cJSON_AddNumberToObject(jDeflate, "tx_wire_bytes", deflate.txWireBytes);
+      cJSON_AddNumberToObject(jDeflate, "tx_ratio", deflate.txWireBytes ? (double)deflate.txBytes / deflate.txWireBytes : 0);
+      cJSON_AddNumberToObject(jDeflate, "cpu_ms", deflate.cpuUs / 1000);
+      cJSON_AddNumberToObject(jDeflate, "cpu_us_per_kb", kb ? (double)deflate.cpuUs / kb : 0);
+      cJSON_AddItemToObject(json, "deflate", jDeflate);
+    }
+
+    cJSON *jEndpoints = cJSON_CreateArray();
+    for (const bodhi::EndpointPool::EndpointStats &e : bodhi::EndpointPool::getStats())
+    {
+      cJSON *jEndpoint = cJSON_CreateObject();
+      cJSON_AddStringToObject(jEndpoint, "endpoint", e.name.c_str());
+      cJSON_AddNumberToObject(jEndpoint, "weight", e.weight);
+      cJSON_AddNumberToObject(jEndpoint, "active", e.active);
+      cJSON_AddNumberToObject(jEndpoint, "connects", e.connects);
+      cJSON_AddNumberToObject(jEndpoint, "failures", e.failures);
+      cJSON_AddNumberToObject(jEndpoint, "failure_rate", e.failureRate);
+      cJSON_AddNumberToObject(jEndpoint, "handshake_ms", e.handshakeMs);
+      cJSON_AddNumberToObject(jEndpoint, "result_latency_ms", e.resultLatencyMs);
+      cJSON_AddNumberToObject(jEndpoint, "rtt_ms", e.rttMs);
+      cJSON_AddBoolToObject(jEndpoint, "ejected", e.ejected);
+      cJSON_AddNumberToObject(jEndpoint, "ejections", e.ejections);
+      cJSON_AddItemToArray(jEndpoints, jEndpoint);
+    }
+    cJSON_AddItemToObject(json, "endpoints", jEndpoints);
+
+    if (bodhi::AudioTaps::isRunning())
+    {
+      bodhi::AudioTaps::Stats taps = bodhi::AudioTaps::getStats();
+      cJSON *jTaps = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jTaps, "active", taps.active);
+      cJSON_AddNumberToObject(jTaps, "opened", taps.opened);
+      cJSON_AddNumberToObject(jTaps, "bytes", taps.bytes);
+      cJSON_AddNumberToObject(jTaps, "records", taps.records);
+      cJSON_AddNumberToObject(jTaps, "dropped", taps.dropped);
+      cJSON_AddItemToObject(json, "taps", jTaps);
+    }
+
+    bodhi::FileTranscriber::Stats files = bodhi::FileTranscriber::getStats();
+    cJSON *jFiles = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jFiles, "queued", files.queued);
+    cJSON_AddNumberToObject(jFiles, "active", files.active);
+    cJSON_AddNumberToObject(jFiles, "completed", files.completed);
+    cJSON_AddNumberToObject(jFiles, "failed", files.failed);
+    cJSON_AddNumberToObject(jFiles, "audio_ms", files.audioMs);
+    cJSON_AddNumberToObject(jFiles, "bytes", files.bytes);
+    cJSON_AddItemToObject(json, "files", jFiles);
+
+    cJSON *jTenants = cJSON_CreateArray();
+    for (const bodhi::Tenants::TenantStats &t : bodhi::Tenants::getStats())
+    {
+      cJSON *jTenant = cJSON_CreateObject();
+      cJSON_AddStringToObject(jTenant, "customer_id", t.name.c_str());
+      cJSON_AddNumberToObject(jTenant, "pipes", t.pipes);
+      cJSON_AddNumberToObject(jTenant, "max_pipes", t.maxPipes);
+      cJSON_AddNumberToObject(jTenant, "rejected", t.rejected);
+      cJSON_AddNumberToObject(jTenant, "connects", t.connects);
+      cJSON_AddNumberToObject(jTenant, "connects_deferred", t.connectsDeferred);
+      cJSON_AddNumberToObject(jTenant, "bytes_sent", t.bytes);
+      cJSON_AddNumberToObject(jTenant, "writes_deferred", t.writesDeferred);
+      cJSON_AddNumberToObject(jTenant, "bytes_borrowed", t.bytesBorrowed);
+      cJSON_AddNumberToObject(jTenant, "kbps", t.kbps);
+      cJSON_AddNumberToObject(jTenant, "allowed_kbps", t.allowedKbps);
+      cJSON_AddItemToArray(jTenants, jTenant);
+    }
+    cJSON_AddItemToObject(json, "tenants", jTenants);
+
+    bodhi::AsyncLog::Stats log = bodhi::AsyncLog::getStats();
+    cJSON *jLog = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jLog, "written", log.written);
+    cJSON_AddNumberToObject(jLog, "suppressed", log.suppressed);
+    cJSON_AddNumberToObject(jLog, "dropped", log.dropped);
+    cJSON_AddNumberToObject(jLog, "queued", log.queued);
+    cJSON_AddItemToObject(json, "log", jLog);
+
+    if (bodhi::Journal::isOpen())
+    {
+      bodhi::Journal::Stats journal = bodhi::Journal::getStats();
+      cJSON *jJournal = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jJournal, "records", journal.records);
+      cJSON_AddNumberToObject(jJournal, "bytes", journal.bytes);
+      cJSON_AddNumberToObject(jJournal, "dropped", journal.dropped);
+      cJSON_AddNumberToObject(jJournal, "segments", journal.segments);
+      cJSON_AddItemToObject(json, "journal", jJournal);
+    }
+    bodhi::PartialDelta::Stats deltas = bodhi::PartialDelta::getStats();
+    cJSON *jDeltas = cJSON_CreateObject();
+    cJSON_AddNumberToObject(jDeltas, "partials", deltas.partials);
+    cJSON_AddNumberToObject(jDeltas, "bytes_in", deltas.bytesIn);
+    cJSON_AddNumberToObject(jDeltas, "bytes_out", deltas.bytesOut);
+    cJSON_AddItemToObject(json, "delta_partials", jDeltas);
+
+    if (bodhi::TranscriptRing::isOpen())
+    {
+      bodhi::TranscriptRing::Stats ring = bodhi::TranscriptRing::getStats();
+      cJSON *jRing = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jRing, "records", ring.records);
+      cJSON_AddNumberToObject(jRing, "bytes", ring.bytes);
+      cJSON_AddNumberToObject(jRing, "overwritten", ring.overwritten);
+      cJSON_AddNumberToObject(jRing, "dropped", ring.dropped);
+      cJSON_AddNumberToObject(jRing, "size", ring.dataLen);
+      cJSON_AddItemToObject(json, "shm_ring", jRing);
+    }
+
+    char *out = cJSON_Print(json);
+    stream->write_function(stream, "%s\n", out);
+    free(out);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
+
   switch_status_t bodhi_transcribe_session_init(switch_core_session_t *session,
                                              responseHandler_t responseHandler, uint32_t samples_per_second, uint32_t channels,
                                              char *modelName, int interim, char *bugname, void **ppUserData)
   {
-    int err;
+    capture_t *cap = (capture_t *)*ppUserData;
+    bool created = false;
+
+    // while draining, only a pipe replacing one of the same name (a model switch) may start
+    if (bodhi::Drain::isDraining() && !(cap && has_pipe(cap, bugname)))
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "%s: draining, not starting transcription\n", bugname);
+      responseHandler(session, TRANSCRIBE_EVENT_CONNECT_FAIL, "{\"reason\": \"draining\"}", bugname, 0);
+      return SWITCH_STATUS_FALSE;
+    }
+
+    // one capture (media bug, resampler) per session, shared by every named pipe
+    if (!cap)
+    {
+      cap = (capture_t *)switch_core_session_alloc(session, sizeof(capture_t));
+      if (!cap)
+      {
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
+        return SWITCH_STATUS_FALSE;
+      }
+      if (SWITCH_STATUS_SUCCESS != capture_init(cap, session, samples_per_second, 8000, channels))
+      {
+        destroy_capture(cap);
+        return SWITCH_STATUS_FALSE;
+      }
+      created = true;
+    }
+    else if ((int)channels != cap->channels)
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING,
+                        "%s: session is already captured as %s, ignoring requested mix\n", bugname, cap->channels == 2 ? "stereo" : "mono");
+    }
+
+    // a pipe of the same name is stopped first, so its customer's pipe slot is free for the replacement
+    if (!created)
+    {
+      switch_mutex_lock(cap->mutex);
+      for (int i = 0; i < MAX_PIPES_PER_SESSION; i++)
+      {
+        if (cap->pipes[i] && 0 == strcmp(cap->pipes[i]->bugname, bugname))
+        {
+          switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "%s: replacing running pipe\n", bugname);
+          // the old connection may take a while to close; its pipe slot goes to the replacement now
+          if (cap->pipes[i]->pAudioPipe)
+            static_cast<bodhi::AudioPipe *>(cap->pipes[i]->pAudioPipe)->releaseTenant();
+          stop_pipe(session, cap, i);
+        }
+      }
+      switch_mutex_unlock(cap->mutex);
+    }
 
-    // allocate per-session data structure
+    // allocate per-pipe data structure
     private_t *tech_pvt = (private_t *)switch_core_session_alloc(session, sizeof(private_t));
-    if (!tech_pvt)
+    if (!tech_pvt ||
+        SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, session, 8000, cap->channels, modelName, interim, bugname, responseHandler))
     {
-      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "error allocating memory!\n");
+      if (tech_pvt)
+        destroy_tech_pvt(tech_pvt);
+      if (created)
+        destroy_capture(cap);
       return SWITCH_STATUS_FALSE;
     }
 
-    if (SWITCH_STATUS_SUCCESS != fork_data_init(tech_pvt, session, samples_per_second, 8000, channels, modelName, interim, bugname, responseHandler))
+    switch_mutex_lock(cap->mutex);
+    int slot = -1;
+    for (int i = 0; i < MAX_PIPES_PER_SESSION && slot < 0; i++)
     {
+      if (!cap->pipes[i])
+        slot = i;
+    }
+    if (slot < 0)
+    {
+      switch_mutex_unlock(cap->mutex);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR,
+                        "%s: session already has %d pipes\n", bugname, MAX_PIPES_PER_SESSION);
       destroy_tech_pvt(tech_pvt);
+      if (created)
+        destroy_capture(cap);
       return SWITCH_STATUS_FALSE;
     }
+    cap->pipes[slot] = tech_pvt;
+    switch_mutex_unlock(cap->mutex);
 
-    *ppUserData = tech_pvt;
+    *ppUserData = cap;
 
     bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
     switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "connecting now\n");
@@ -344,78 +1108,134 @@ extern "C"
       switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "bodhi_transcribe_session_stop: no bug - websocket conection already closed\n");
       return SWITCH_STATUS_FALSE;
     }
-    private_t *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-    uint32_t id = tech_pvt->id;
+    capture_t *cap = (capture_t *)switch_core_media_bug_get_user_data(bug);
+    if (!cap)
+      return SWITCH_STATUS_FALSE;
 
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "(%u) bodhi_transcribe_session_stop\n", id);
+    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "bodhi_transcribe_session_stop %s\n", bugname ? bugname : "(all)");
 
-    if (!tech_pvt)
-      return SWITCH_STATUS_FALSE;
+    // close the named pipe, or all of them, and get final responses
+    switch_mutex_lock(cap->mutex);
+    bool found = false;
+    int remaining = 0;
+    for (int i = 0; i < MAX_PIPES_PER_SESSION; i++)
+    {
+      if (!cap->pipes[i])
+        continue;
+      if (!bugname || 0 == strcmp(cap->pipes[i]->bugname, bugname))
+      {
+        uint32_t id = cap->pipes[i]->id;
+        stop_pipe(session, cap, i);
+        found = true;
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "(%u) bodhi_transcribe_session_stop\n", id);
+      }
+      else
+        remaining++;
+    }
+    if (remaining)
+    {
+      switch_mutex_unlock(cap->mutex);
+      if (!found)
+        switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "bodhi_transcribe_session_stop: no pipe named %s\n", bugname);
+      return found ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+    }
 
-    // close connection and get final responses
-    switch_mutex_lock(tech_pvt->mutex);
-    switch_channel_set_private(channel, bugname, NULL);
+    // last pipe gone: remove the bug and release the capture
+    switch_channel_set_private(channel, MY_BUG_NAME, NULL);
     if (!channelIsClosing)
       switch_core_media_bug_remove(session, &bug);
+    switch_mutex_unlock(cap->mutex);
+    destroy_capture(cap);
 
-    bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+    return found ? SWITCH_STATUS_SUCCESS : SWITCH_STATUS_FALSE;
+  }
 
-    if (pAudioPipe)
-      reaper(tech_pvt);
-    destroy_tech_pvt(tech_pvt);
-    switch_mutex_unlock(tech_pvt->mutex);
-    switch_mutex_destroy(tech_pvt->mutex);
-    tech_pvt->mutex = nullptr;
-    switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_NOTICE, "(%u) bodhi_transcribe_session_stop\n", id);
+  switch_status_t bodhi_transcribe_session_reconfigure(switch_core_session_t *session, char *modelName, char *bugname)
+  {
+    switch_channel_t *channel = switch_core_session_get_channel(session);
+    switch_media_bug_t *bug = (switch_media_bug_t *)switch_channel_get_private(channel, MY_BUG_NAME);
+    if (!bug)
+    {
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "bodhi_transcribe_session_reconfigure: not transcribing\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    capture_t *cap = (capture_t *)switch_core_media_bug_get_user_data(bug);
+    if (!bugname)
+      bugname = (char *)MY_BUG_NAME;
 
-    return SWITCH_STATUS_SUCCESS;
+    switch_mutex_lock(cap->mutex);
+    private_t *tech_pvt = NULL;
+    for (int i = 0; i < MAX_PIPES_PER_SESSION && !tech_pvt; i++)
+    {
+      if (cap->pipes[i] && 0 == strcmp(cap->pipes[i]->bugname, bugname))
+        tech_pvt = cap->pipes[i];
+    }
+    if (!tech_pvt)
+    {
+      switch_mutex_unlock(cap->mutex);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_WARNING, "bodhi_transcribe_session_reconfigure: no pipe named %s\n", bugname);
+      return SWITCH_STATUS_FALSE;
+    }
+
+    // keep the connection: the new config goes out at the next segment boundary
+    bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+    if (pAudioPipe && pAudioPipe->reconfigure(modelName))
+    {
+      switch_mutex_unlock(cap->mutex);
+      switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_INFO, "(%u) switching %s to model %s\n", tech_pvt->id, bugname, modelName);
+      return SWITCH_STATUS_SUCCESS;
+    }
+    responseHandler_t responseHandler = tech_pvt->responseHandler;
+    switch_mutex_unlock(cap->mutex);
+
+    // not connected (yet, or any more): start over with the new model
+    return replace_pipe(session, responseHandler, bugname, modelName);
   }
 
   switch_bool_t bodhi_transcribe_frame(switch_core_session_t *session, switch_media_bug_t *bug)
   {
-    private_t *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
-    size_t inuse = 0;
-    bool dirty = false;
-    char *p = (char *)"{\"msg\": \"buffer overrun\"}";
+    capture_t *cap = (capture_t *)switch_core_media_bug_get_user_data(bug);
 
-    if (!tech_pvt)
+    if (!cap)
       return SWITCH_TRUE;
 
-    if (switch_mutex_trylock(tech_pvt->mutex) == SWITCH_STATUS_SUCCESS)
+    if (switch_mutex_trylock(cap->mutex) == SWITCH_STATUS_SUCCESS)
     {
-      if (!tech_pvt->pAudioPipe)
+      private_t *only = NULL;
+      int active = 0;
+      for (int i = 0; i < MAX_PIPES_PER_SESSION; i++)
       {
-        switch_mutex_unlock(tech_pvt->mutex);
-        return SWITCH_TRUE;
+        private_t *tech_pvt = cap->pipes[i];
+        if (tech_pvt && takes_audio(static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe)))
+        {
+          only = tech_pvt;
+          active++;
+        }
       }
-      bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
-      if (pAudioPipe->getLwsState() != bodhi::AudioPipe::LWS_CLIENT_CONNECTED)
+      if (0 == active)
       {
-        switch_mutex_unlock(tech_pvt->mutex);
+        switch_mutex_unlock(cap->mutex);
         return SWITCH_TRUE;
       }
 
-      pAudioPipe->lockAudioBuffer();
-      size_t available = pAudioPipe->binarySpaceAvailable();
-      if (NULL == tech_pvt->resampler)
+      if (1 == active && NULL == cap->resampler)
       {
+        // single pipe, no resampling: read straight into its buffer
+        private_t *tech_pvt = only;
+        bodhi::AudioPipe *pAudioPipe = static_cast<bodhi::AudioPipe *>(tech_pvt->pAudioPipe);
+        pAudioPipe->lockAudioBuffer();
+        size_t available = pAudioPipe->binarySpaceAvailable();
         switch_frame_t frame = {0};
         frame.data = pAudioPipe->binaryWritePtr();
         frame.buflen = available;
         while (true)
         {
 
-          // check if buffer would be overwritten; dump packets if so
+          // check if buffer would be overwritten; apply the overrun policy if so
           if (available < pAudioPipe->binaryMinSpace())
           {
-            if (!tech_pvt->buffer_overrun_notified)
-            {
-              tech_pvt->buffer_overrun_notified = 1;
-              tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_BUFFER_OVERRUN, NULL, tech_pvt->bugname, 0);
-            }
-            switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n",
-                              tech_pvt->id);
-            pAudioPipe->binaryWritePtrResetToZero();
+            notifyBufferOverrun(session, tech_pvt, pAudioPipe);
+            pAudioPipe->binaryMakeSpace(pAudioPipe->binaryMinSpace());
 
             frame.data = pAudioPipe->binaryWritePtr();
             frame.buflen = available = pAudioPipe->binarySpaceAvailable();
@@ -429,55 +1249,164 @@ extern "C"
             pAudioPipe->binaryWritePtrAdd(frame.datalen);
             frame.buflen = available = pAudioPipe->binarySpaceAvailable();
             frame.data = pAudioPipe->binaryWritePtr();
-            dirty = true;
           }
         }
+        pAudioPipe->unlockAudioBuffer();
       }
       else
       {
+        // read and resample once, then copy the frame to every active pipe
         uint8_t data[SWITCH_RECOMMENDED_BUFFER_SIZE];
+        spx_int16_t resampled[SWITCH_RECOMMENDED_BUFFER_SIZE];
         switch_frame_t frame = {0};
         frame.data = data;
         frame.buflen = SWITCH_RECOMMENDED_BUFFER_SIZE;
         while (switch_core_media_bug_read(bug, &frame, SWITCH_TRUE) == SWITCH_STATUS_SUCCESS)
         {
-          if (frame.datalen)
+          if (!frame.datalen)
+            continue;
+
+          const uint8_t *out = data;
+          size_t len = frame.datalen;
+          if (cap->resampler)
           {
-            spx_uint32_t out_len = available >> 1; // space for samples which are 2 bytes
+            spx_uint32_t out_len = SWITCH_RECOMMENDED_BUFFER_SIZE / cap->channels; // samples per channel
             spx_uint32_t in_len = frame.samples;
+            speex_resampler_process_interleaved_int(cap->resampler, (const spx_int16_t *)frame.data, &in_len, resampled, &out_len);
+            out = (const uint8_t *)resampled;
+            // bytes written = num samples * 2 * num channels
+            len = out_len * 2 * cap->channels;
+          }
+          if (0 == len)
+            continue;
 
-            speex_resampler_process_interleaved_int(tech_pvt->resampler,
-                                                    (const spx_int16_t *)frame.data,
-                                                    (spx_uint32_t *)&in_len,
-                                                    (spx_int16_t *)((char *)pAudioPipe->binaryWritePtr()),
-                                                    &out_len);
-
-            if (out_len > 0)
-            {
-              // bytes written = num samples * 2 * num channels
-              size_t bytes_written = out_len << tech_pvt->channels;
-              pAudioPipe->binaryWritePtrAdd(bytes_written);
-              available = pAudioPipe->binarySpaceAvailable();
-              dirty = true;
-            }
-            if (available < pAudioPipe->binaryMinSpace())
-            {
-              if (!tech_pvt->buffer_overrun_notified)
-              {
-                tech_pvt->buffer_overrun_notified = 1;
-                switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "(%u) dropping packets!\n",
-                                  tech_pvt->id);
-                tech_pvt->responseHandler(session, TRANSCRIBE_EVENT_BUFFER_OVERRUN, NULL, tech_pvt->bugname, 0);
-              }
-              break;
-            }
+          for (int i = 0; i < MAX_PIPES_PER_SESSION; i++)
+          {
+            if (cap->pipes[i])
+              write_to_pipe(session, cap->pipes[i], out, len);
           }
         }
       }
 
-      pAudioPipe->unlockAudioBuffer();
-      switch_mutex_unlock(tech_pvt->mutex);
+      switch_mutex_unlock(cap->mutex);
     }
     return SWITCH_TRUE;
   }
+
+  switch_status_t bodhi_transcribe_file(const char *path, const char *modelName, const char *sinkTarget, switch_stream_handle_t *stream)
+  {
+    if (bodhi::Drain::isDraining())
+    {
+      stream->write_function(stream, "-ERR draining\n");
+      return SWITCH_STATUS_FALSE;
+    }
+    if (!defaultApiKey)
+    {
+      stream->write_function(stream, "-ERR BODHI_API_KEY env var not set\n");
+      return SWITCH_STATUS_FALSE;
+    }
+
+    bodhi::FileTranscriber::Request request;
+    char uuid[SWITCH_UUID_FORMATTED_LENGTH + 1];
+    request.id = switch_uuid_str(uuid, sizeof(uuid));
+    request.path = path;
+    request.model = modelName;
+    request.apiKey = defaultApiKey;
+    request.customerId = defaultCustomerId ? defaultCustomerId : "";
+    request.rawSampleRate = nFileRawRate;
+    request.userData = nullptr;
+    request.sink = nullptr;
+
+    std::string error;
+    if (sinkTarget && strcmp(sinkTarget, "event"))
+    {
+      request.userData = request.sink = bodhi::ResultSinks::get(sinkTarget, error);
+      if (!request.sink)
+      {
+        stream->write_function(stream, "-ERR %s\n", error.c_str());
+        return SWITCH_STATUS_FALSE;
+      }
+    }
+    if (!bodhi::FileTranscriber::submit(request, error))
+    {
+      stream->write_function(stream, "-ERR %s\n", error.c_str());
+      return SWITCH_STATUS_FALSE;
+    }
+    switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_INFO, "queued file transcription %s of %s with model %s\n", request.id.c_str(), path, modelName);
+    stream->write_function(stream, "+OK %s\n", request.id.c_str());
+    return SWITCH_STATUS_SUCCESS;
+  }
+
+  void bodhi_transcribe_batch_begin(void)
+  {
+    bodhi::LwsTransport::beginBatch();
+  }
+
+  void bodhi_transcribe_batch_end(void)
+  {
+    bodhi::LwsTransport::endBatch();
+  }
+
+  switch_bool_t bodhi_transcribe_draining(void)
+  {
+    return bodhi::Drain::isDraining() ? SWITCH_TRUE : SWITCH_FALSE;
+  }
+
+  switch_status_t bodhi_transcribe_drain(const char *command, switch_stream_handle_t *stream)
+  {
+    if (0 == strcasecmp(command, "on"))
+    {
+      if (bodhi::Drain::begin())
+      {
+        // hand idle memory back and stop caching what the closing pipes release
+        bodhi::BufferPool::instance().configure(0, poolHugePages);
+        destroyIdleResamplers();
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: draining, refusing new sessions\n");
+      }
+      stream->write_function(stream, "+OK draining, %lu pipes open\n", (unsigned long)bodhi::Drain::getStatus().pipes);
+      return SWITCH_STATUS_SUCCESS;
+    }
+    if (0 == strcasecmp(command, "off"))
+    {
+      if (bodhi::Drain::end())
+      {
+        bodhi::BufferPool::instance().configure((size_t)nPoolCachedMb * 1024 * 1024, poolHugePages);
+        switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: drain ended, accepting sessions\n");
+      }
+      stream->write_function(stream, "+OK accepting sessions\n");
+      return SWITCH_STATUS_SUCCESS;
+    }
+    if (strcasecmp(command, "status"))
+      return SWITCH_STATUS_FALSE;
+
+    bodhi::Drain::Status drain = bodhi::Drain::getStatus();
+    bodhi::FileTranscriber::Stats files = bodhi::FileTranscriber::getStats();
+    cJSON *json = cJSON_CreateObject();
+    cJSON_AddBoolToObject(json, "draining", drain.draining);
+    cJSON_AddBoolToObject(json, "drained", drain.draining && 0 == drain.pipes && 0 == files.queued);
+    cJSON_AddNumberToObject(json, "draining_ms", drain.drainingMs);
+    cJSON_AddNumberToObject(json, "pipes", drain.pipes);
+    cJSON_AddNumberToObject(json, "closed", drain.closed);
+    cJSON_AddNumberToObject(json, "connects_waiting", bodhi::LwsTransport::getConnectStats().waiting);
+    cJSON *jContexts = cJSON_CreateArray();
+    std::vector<unsigned int> connections = bodhi::LwsTransport::getContextConnections();
+    for (size_t i = 0; i < connections.size(); i++)
+    {
+      cJSON *jContext = cJSON_CreateObject();
+      cJSON_AddNumberToObject(jContext, "context", i);
+      cJSON_AddNumberToObject(jContext, "connections", connections[i]);
+      cJSON_AddItemToArray(jContexts, jContext);
+    }
+    cJSON_AddItemToObject(json, "contexts", jContexts);
+    cJSON_AddNumberToObject(json, "files_queued", files.queued);
+    cJSON_AddNumberToObject(json, "files_active", files.active);
+    cJSON_AddNumberToObject(json, "avg_pipe_lifetime_ms", drain.avgLifetimeMs);
+    cJSON_AddNumberToObject(json, "estimated_drain_ms", drain.estimateMs);
+
+    char *out = cJSON_Print(json);
+    stream->write_function(stream, "%s\n", out);
+    free(out);
+    cJSON_Delete(json);
+    return SWITCH_STATUS_SUCCESS;
+  }
 }
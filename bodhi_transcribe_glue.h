@@ -3,9 +3,16 @@
 
 switch_status_t bodhi_transcribe_init();
 switch_status_t bodhi_transcribe_cleanup();
+switch_status_t bodhi_transcribe_stats(switch_stream_handle_t *stream);
 switch_status_t bodhi_transcribe_session_init(switch_core_session_t *session, responseHandler_t responseHandler, 
 		uint32_t samples_per_second, uint32_t channels, char* modelName, int interim, char* bugname, void **ppUserData);
 switch_status_t bodhi_transcribe_session_stop(switch_core_session_t *session, int channelIsClosing, char* bugname);
+switch_status_t bodhi_transcribe_session_reconfigure(switch_core_session_t *session, char* modelName, char* bugname);
+switch_status_t bodhi_transcribe_file(const char *path, const char *modelName, const char *sinkTarget, switch_stream_handle_t *stream);
+switch_status_t bodhi_transcribe_drain(const char *command, switch_stream_handle_t *stream);
+switch_bool_t bodhi_transcribe_draining(void);
+void bodhi_transcribe_batch_begin(void);
+void bodhi_transcribe_batch_end(void);
 switch_bool_t bodhi_transcribe_frame(switch_core_session_t *session, switch_media_bug_t *bug);
 
 #endif
\ No newline at end of file
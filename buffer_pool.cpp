@@ -0,0 +1,253 @@
+// buffer_pool.cpp
+#include "buffer_pool.hpp"
+
+#include <cstdlib>
+#include <new>
+#include <sys/mman.h>
+
+#define MIN_CLASS_SHIFT 8  /* 256 bytes */
+#define MAX_CLASS_SHIFT 23 /* 8 MB */
+#define MMAP_CLASS_SHIFT 21 /* 2 MB, the x86_64 huge page size; also the arena size */
+#define ARENA_SIZE ((size_t)1 << MMAP_CLASS_SHIFT)
+
+using namespace bodhi;
+
+BufferPool &BufferPool::instance(void)
+{
+  // never destroyed: reaper threads may still be releasing pipes while the module unloads
+  static BufferPool *pool = new BufferPool();
+  return *pool;
+}
+
+BufferPool::BufferPool() : m_classes(MAX_CLASS_SHIFT - MIN_CLASS_SHIFT + 1), m_maxCachedBytes(64 * 1024 * 1024), m_hugePages(false)
+{
+  for (auto &sc : m_classes)
+    sc.arena = 0;
+  m_stats = Stats();
+}
+
+BufferPool::~BufferPool()
+{
+  m_maxCachedBytes = 0;
+  trim();
+}
+
+void BufferPool::configure(size_t maxCachedBytes, bool hugePages)
+{
+  {
+    std::lock_guard<std::mutex> lk(m_mutex);
+    m_maxCachedBytes = maxCachedBytes;
+    m_hugePages = hugePages;
+  }
+  trim();
+}
+
+int BufferPool::classOf(size_t size)
+{
+  if (size > ((size_t)1 << MAX_CLASS_SHIFT))
+    return -1;
+  int shift = MIN_CLASS_SHIFT;
+  while (((size_t)1 << shift) < size)
+    shift++;
+  return shift - MIN_CLASS_SHIFT;
+}
+
+size_t BufferPool::classSize(int idx)
+{
+  return (size_t)1 << (idx + MIN_CLASS_SHIFT);
+}
+
+void *BufferPool::mapArena(bool &huge)
+{
+  void *ptr;
+#ifdef MAP_HUGETLB
+  // huge pages are naturally aligned, which is what finds a block's arena
+  ptr = mmap(nullptr, ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+  if (ptr != MAP_FAILED)
+  {
+    huge = true;
+    return ptr;
+  }
+#endif
+  // no reserved huge pages: map twice the size and keep an aligned arena out of it
+  ptr = mmap(nullptr, 2 * ARENA_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+  uintptr_t raw = (uintptr_t)ptr;
+  uintptr_t base = (raw + ARENA_SIZE - 1) & ~(uintptr_t)(ARENA_SIZE - 1);
+  if (base > raw)
+    munmap(ptr, base - raw);
+  if (raw + ARENA_SIZE > base)
+    munmap((void *)(base + ARENA_SIZE), raw + ARENA_SIZE - base);
+#ifdef MADV_HUGEPAGE
+  madvise((void *)base, ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+  huge = false;
+  return (void *)base;
+}
+
+void *BufferPool::carve(int idx)
+{
+  SizeClass &sc = m_classes[idx];
+  size_t len = classSize(idx);
+  Arena *arena = sc.arena ? &m_arenas[sc.arena] : nullptr;
+  if (!arena || arena->next + len > ARENA_SIZE)
+  {
+    // the full arena stays mapped until its blocks come back
+    bool huge;
+    void *base = mapArena(huge);
+    if (!base)
+      return malloc(len);
+    sc.arena = (uintptr_t)base;
+    arena = &m_arenas[sc.arena];
+    arena->idx = idx;
+    arena->next = 0;
+    arena->live = 0;
+    arena->huge = huge;
+    m_stats.bytesArena += ARENA_SIZE;
+    if (huge)
+      m_stats.bytesHugePage += ARENA_SIZE;
+  }
+  void *ptr = (void *)(sc.arena + arena->next);
+  arena->next += len;
+  arena->live++;
+  return ptr;
+}
+
+void *BufferPool::allocate(size_t size)
+{
+  if (size < ARENA_SIZE)
+    return m_hugePages ? carve(classOf(size)) : malloc(size);
+
+  void *ptr = MAP_FAILED;
+#ifdef MAP_HUGETLB
+  if (m_hugePages)
+  {
+    ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (ptr != MAP_FAILED)
+    {
+      m_hugeBlocks.insert(ptr);
+      m_stats.bytesHugePage += size;
+      return ptr;
+    }
+  }
+#endif
+  ptr = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (ptr == MAP_FAILED)
+    return nullptr;
+#ifdef MADV_HUGEPAGE
+  // no reserved huge pages: let transparent huge pages back it if they are enabled
+  if (m_hugePages)
+    madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+  return ptr;
+}
+
+void BufferPool::deallocate(void *ptr, size_t size)
+{
+  if (size < ARENA_SIZE)
+  {
+    // arenas are never shared with malloc, so an aligned base found in the map is the block's own
+    auto it = m_arenas.empty() ? m_arenas.end() : m_arenas.find((uintptr_t)ptr & ~(uintptr_t)(ARENA_SIZE - 1));
+    if (it == m_arenas.end())
+    {
+      free(ptr);
+      return;
+    }
+    if (--it->second.live)
+      return;
+    SizeClass &sc = m_classes[it->second.idx];
+    if (sc.arena == it->first)
+      sc.arena = 0;
+    m_stats.bytesArena -= ARENA_SIZE;
+    if (it->second.huge)
+      m_stats.bytesHugePage -= ARENA_SIZE;
+    munmap((void *)it->first, ARENA_SIZE);
+    m_arenas.erase(it);
+    return;
+  }
+  if (m_hugeBlocks.erase(ptr))
+    m_stats.bytesHugePage -= size;
+  munmap(ptr, size);
+}
+
+void *BufferPool::acquire(size_t size)
+{
+  int idx = classOf(size);
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_stats.allocs++;
+  if (idx < 0)
+  {
+    // bigger than any class: not pooled
+    void *ptr = allocate(size);
+    if (!ptr)
+      throw std::bad_alloc();
+    m_stats.bytesInUse += size;
+    return ptr;
+  }
+
+  size_t len = classSize(idx);
+  SizeClass &sc = m_classes[idx];
+  void *ptr;
+  if (!sc.free.empty())
+  {
+    ptr = sc.free.back();
+    sc.free.pop_back();
+    m_stats.bytesCached -= len;
+    m_stats.hits++;
+  }
+  else if (!(ptr = allocate(len)))
+  {
+    throw std::bad_alloc();
+  }
+  m_stats.bytesInUse += len;
+  return ptr;
+}
+
+void BufferPool::release(void *ptr, size_t size)
+{
+  if (!ptr)
+    return;
+  int idx = classOf(size);
+  std::lock_guard<std::mutex> lk(m_mutex);
+  if (idx < 0)
+  {
+    m_stats.bytesInUse -= size;
+    deallocate(ptr, size);
+    return;
+  }
+
+  size_t len = classSize(idx);
+  m_stats.bytesInUse -= len;
+  if (m_stats.bytesCached + len > m_maxCachedBytes)
+  {
+    deallocate(ptr, len);
+    return;
+  }
+  m_classes[idx].free.push_back(ptr);
+  m_stats.bytesCached += len;
+}
+
+void BufferPool::trim(void)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+
+  // free the largest classes first until the cache fits within the limit again
+  for (int idx = m_classes.size() - 1; idx >= 0 && m_stats.bytesCached > m_maxCachedBytes; idx--)
+  {
+    SizeClass &sc = m_classes[idx];
+    size_t len = classSize(idx);
+    while (!sc.free.empty() && m_stats.bytesCached > m_maxCachedBytes)
+    {
+      deallocate(sc.free.back(), len);
+      sc.free.pop_back();
+      m_stats.bytesCached -= len;
+    }
+  }
+}
+
+BufferPool::Stats BufferPool::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  return m_stats;
+}
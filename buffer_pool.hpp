@@ -0,0 +1,83 @@
+#ifndef __BODHI_BUFFER_POOL_HPP__
+#define __BODHI_BUFFER_POOL_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Process-wide pool of power-of-two size classes for pipe objects and audio buffers, so
+  // that call churn recycles the same blocks instead of fragmenting the FreeSWITCH heap.
+  // Classes of 2 MB and up are mmap'd and can be backed by huge pages; with huge pages on,
+  // smaller classes are carved out of 2 MB arenas, one class per arena, and an arena is
+  // unmapped when the last block carved from it goes back.  Freed blocks are cached per
+  // class up to a total byte limit; anything over that goes back to the system.
+  class BufferPool
+  {
+  public:
+    struct Stats
+    {
+      uint64_t bytesInUse;    // handed out, rounded up to the size class
+      uint64_t bytesCached;   // freed and kept for reuse
+      uint64_t bytesHugePage; // mapped with MAP_HUGETLB, counting whole arenas
+      uint64_t bytesArena;    // mapped for arenas, carved or not
+      uint64_t allocs;
+      uint64_t hits; // allocs satisfied from the cache
+    };
+
+    static BufferPool &instance(void);
+
+    // maxCachedBytes caps idle memory; hugePages asks for MAP_HUGETLB (or transparent huge
+    // pages) on the large classes and arenas for the small ones
+    void configure(size_t maxCachedBytes, bool hugePages);
+
+    // callers must pass the same size to release() that they passed to acquire()
+    void *acquire(size_t size);
+    void release(void *ptr, size_t size);
+    void trim(void);
+
+    Stats getStats(void);
+
+  private:
+    struct SizeClass
+    {
+      std::vector<void *> free;
+      uintptr_t arena; // being carved, or 0
+    };
+
+    struct Arena
+    {
+      int idx;     // the one class it is carved for
+      size_t next; // offset of the next block to carve
+      size_t live; // blocks carved and not yet given back to the system
+      bool huge;   // MAP_HUGETLB rather than madvise
+    };
+
+    BufferPool();
+    ~BufferPool();
+    BufferPool(const BufferPool &) = delete;
+    void operator=(const BufferPool &) = delete;
+
+    static int classOf(size_t size);
+    static size_t classSize(int idx);
+    void *allocate(size_t size);
+    void deallocate(void *ptr, size_t size);
+    void *carve(int idx);
+    void *mapArena(bool &huge);
+
+    std::mutex m_mutex;
+    std::vector<SizeClass> m_classes;
+    std::unordered_set<void *> m_hugeBlocks;
+    std::unordered_map<uintptr_t, Arena> m_arenas; // by 2 MB-aligned base
+    size_t m_maxCachedBytes;
+    bool m_hugePages;
+    Stats m_stats;
+  };
+
+} // namespace bodhi
+#endif
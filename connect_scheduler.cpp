@@ -0,0 +1,106 @@
+// connect_scheduler.cpp
+#include "connect_scheduler.hpp"
+
+#include <algorithm>
+
+using namespace bodhi;
+
+ConnectScheduler::ConnectScheduler(unsigned int nContexts) : m_inFlightPerContext(std::max(1u, nContexts), 0), m_inFlight(0), m_tokens(0),
+                                                             m_lastRefill(Clock::now()), m_rand(std::random_device()())
+{
+  m_config = {0, 0, 0, 0, 0};
+  m_stats = {0, 0, 0, 0, 0, 0};
+}
+
+void ConnectScheduler::configure(const Config &config)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  m_config = config;
+  m_config.burst = std::max(1u, m_config.burst);
+  m_tokens = m_config.burst;
+  m_lastRefill = Clock::now();
+}
+
+void ConnectScheduler::enqueue(Ticket &ticket, Clock::time_point now)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  ticket.queuedAt = ticket.notBefore = now;
+  ticket.context = -1;
+  if (m_config.jitterMs)
+    ticket.notBefore += std::chrono::milliseconds(m_rand() % (m_config.jitterMs + 1));
+  m_stats.waiting++;
+}
+
+void ConnectScheduler::refill(Clock::time_point now)
+{
+  if (!m_config.ratePerSec)
+    return;
+  double secs = std::chrono::duration<double>(now - m_lastRefill).count();
+  m_tokens = std::min<double>(m_config.burst, m_tokens + secs * m_config.ratePerSec);
+  m_lastRefill = now;
+}
+
+ConnectScheduler::Admit_t ConnectScheduler::admit(Ticket &ticket, unsigned int context, Clock::time_point now, Clock::duration &wait)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  context = std::min<unsigned int>(context, m_inFlightPerContext.size() - 1);
+  wait = Clock::duration::zero();
+
+  if ((m_config.maxInFlight && m_inFlight >= m_config.maxInFlight) ||
+      (m_config.maxInFlightPerContext && m_inFlightPerContext[context] >= m_config.maxInFlightPerContext))
+  {
+    m_stats.deferred++;
+    return ADMIT_BLOCKED;
+  }
+  if (now < ticket.notBefore)
+  {
+    wait = ticket.notBefore - now;
+    return ADMIT_LATER;
+  }
+  refill(now);
+  if (m_config.ratePerSec && m_tokens < 1.0)
+  {
+    m_stats.deferred++;
+    wait = std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1.0 - m_tokens) / m_config.ratePerSec));
+    return ADMIT_BLOCKED;
+  }
+
+  if (m_config.ratePerSec)
+    m_tokens -= 1.0;
+  m_inFlight++;
+  m_inFlightPerContext[context]++;
+  ticket.context = context;
+
+  uint64_t queuedMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - ticket.queuedAt).count();
+  m_stats.waiting--;
+  m_stats.admitted++;
+  m_stats.totalQueueMs += queuedMs;
+  m_stats.maxQueueMs = std::max(m_stats.maxQueueMs, queuedMs);
+  return ADMIT_NOW;
+}
+
+void ConnectScheduler::complete(Ticket &ticket)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  if (ticket.context == -2)
+    return;
+  if (ticket.context < 0)
+  {
+    m_stats.waiting--;
+  }
+  else
+  {
+    m_inFlight--;
+    m_inFlightPerContext[ticket.context]--;
+  }
+  // count each ticket once
+  ticket.context = -2;
+}
+
+ConnectScheduler::Stats ConnectScheduler::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(m_mutex);
+  Stats stats = m_stats;
+  stats.inFlight = m_inFlight;
+  return stats;
+}
@@ -0,0 +1,85 @@
+#ifndef __BODHI_CONNECT_SCHEDULER_HPP__
+#define __BODHI_CONNECT_SCHEDULER_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Admission control for websocket handshakes.  A burst of starts (e.g. after a carrier
+  // failover) is spread out instead of firing every handshake at once: connects are held
+  // to a global and a per-context in-flight cap, paced by a token bucket, and each gets a
+  // random start delay of up to jitterMs.  The transport keeps the queue and asks admit()
+  // for each waiting connect; the scheduler only keeps the counts.
+  class ConnectScheduler
+  {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Config
+    {
+      unsigned int maxInFlight;           // handshakes in progress, all contexts; 0 for no cap
+      unsigned int maxInFlightPerContext; // handshakes in progress on one context; 0 for no cap
+      unsigned int ratePerSec;            // sustained connect rate; 0 for no pacing
+      unsigned int burst;                 // connects allowed back to back
+      unsigned int jitterMs;              // max random delay added to each connect
+    };
+
+    struct Stats
+    {
+      uint64_t waiting;     // queued, not yet admitted
+      uint64_t inFlight;    // admitted, handshake not finished
+      uint64_t admitted;
+      uint64_t deferred;    // admit() calls turned down for a cap or the rate
+      uint64_t maxQueueMs;  // longest wait before admission
+      uint64_t totalQueueMs;
+    };
+
+    // per-connect state, owned by the transport's connection object
+    struct Ticket
+    {
+      Clock::time_point queuedAt;
+      Clock::time_point notBefore;
+      int context; // -1 until admitted
+    };
+
+    enum Admit_t
+    {
+      ADMIT_NOW,
+      ADMIT_LATER,  // not before `wait`; later connects may still be admitted
+      ADMIT_BLOCKED // a cap or the bucket is exhausted; no connect can be admitted now
+    };
+
+    explicit ConnectScheduler(unsigned int nContexts);
+
+    void configure(const Config &config);
+    const Config &getConfig(void) const { return m_config; }
+
+    void enqueue(Ticket &ticket, Clock::time_point now);
+    // takes an in-flight slot and a token when the connect may start on `context` now; for
+    // ADMIT_LATER and a rate-limited ADMIT_BLOCKED, `wait` is how long until it might
+    Admit_t admit(Ticket &ticket, unsigned int context, Clock::time_point now, Clock::duration &wait);
+    // handshake done (either way), or the connect was dropped from the queue
+    void complete(Ticket &ticket);
+
+    Stats getStats(void);
+
+  private:
+    void refill(Clock::time_point now);
+
+    std::mutex m_mutex;
+    Config m_config;
+    std::vector<unsigned int> m_inFlightPerContext;
+    unsigned int m_inFlight;
+    double m_tokens;
+    Clock::time_point m_lastRefill;
+    std::minstd_rand m_rand;
+    Stats m_stats;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,189 @@
+// dns_cache.cpp
+#include "dns_cache.hpp"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cstring>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include <libwebsockets.h>
+
+using namespace bodhi;
+
+std::mutex DnsCache::mutex;
+std::condition_variable DnsCache::cv;
+std::unordered_map<std::string, DnsCache::Entry> DnsCache::entries;
+std::deque<std::string> DnsCache::queue;
+std::thread DnsCache::thread;
+bool DnsCache::running = false;
+DnsCache::Clock::duration DnsCache::ttl = std::chrono::seconds(60);
+DnsCache::Stats DnsCache::stats = {0, 0, 0, 0, 0};
+
+void DnsCache::start(unsigned int ttlSecs)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (running || 0 == ttlSecs)
+    return;
+  ttl = std::chrono::seconds(ttlSecs);
+  running = true;
+  thread = std::thread(&DnsCache::run);
+}
+
+void DnsCache::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+
+  std::lock_guard<std::mutex> lk(mutex);
+  entries.clear();
+  queue.clear();
+}
+
+void DnsCache::queueLocked(const std::string &host, Entry &entry)
+{
+  if (entry.queued)
+    return;
+  entry.queued = true;
+  queue.push_back(host);
+  cv.notify_one();
+}
+
+bool DnsCache::lookup(const std::string &host, std::string &address)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!running)
+    return false;
+
+  Clock::time_point now = Clock::now();
+  auto it = entries.find(host);
+  if (it == entries.end())
+  {
+    Entry entry = {std::vector<std::string>(), 0, now, now, false};
+    it = entries.emplace(host, entry).first;
+  }
+  Entry &entry = it->second;
+  entry.lastUsed = now;
+  if (entry.addresses.empty() || now >= entry.expires)
+  {
+    stats.misses++;
+    queueLocked(host, entry);
+    return false;
+  }
+  stats.hits++;
+  address = entry.addresses[entry.next++ % entry.addresses.size()];
+  return true;
+}
+
+void DnsCache::reportFailure(const std::string &host, const std::string &address)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  auto it = entries.find(host);
+  if (it == entries.end())
+    return;
+  std::vector<std::string> &addresses = it->second.addresses;
+  auto pos = std::find(addresses.begin(), addresses.end(), address);
+  if (pos == addresses.end())
+    return;
+  stats.failures++;
+  addresses.erase(pos);
+  if (addresses.empty())
+    queueLocked(host, it->second);
+}
+
+DnsCache::Stats DnsCache::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  Stats s = stats;
+  s.entries = entries.size();
+  return s;
+}
+
+bool DnsCache::resolve(const std::string &host, std::vector<std::string> &addresses)
+{
+  struct addrinfo hints, *res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  int rc = getaddrinfo(host.c_str(), nullptr, &hints, &res);
+  if (0 != rc)
+  {
+    lwsl_err("DnsCache::resolve %s: %s\n", host.c_str(), gai_strerror(rc));
+    return false;
+  }
+  for (struct addrinfo *ai = res; ai; ai = ai->ai_next)
+  {
+    char buf[INET6_ADDRSTRLEN];
+    const void *addr = ai->ai_family == AF_INET6 ? (const void *)&((struct sockaddr_in6 *)ai->ai_addr)->sin6_addr
+                                                 : (const void *)&((struct sockaddr_in *)ai->ai_addr)->sin_addr;
+    if (inet_ntop(ai->ai_family, addr, buf, sizeof(buf)) &&
+        std::find(addresses.begin(), addresses.end(), buf) == addresses.end())
+      addresses.push_back(buf);
+  }
+  freeaddrinfo(res);
+  return !addresses.empty();
+}
+
+void DnsCache::run(void)
+{
+  std::unique_lock<std::mutex> lk(mutex);
+  while (running)
+  {
+    cv.wait_for(lk, std::chrono::seconds(1), []
+                { return !running || !queue.empty(); });
+    if (!running)
+      break;
+
+    // refresh names in use ahead of expiry; forget ones nobody has asked for in a while
+    Clock::time_point now = Clock::now();
+    for (auto it = entries.begin(); it != entries.end();)
+    {
+      Entry &entry = it->second;
+      if (now - entry.lastUsed > 2 * ttl && now >= entry.expires && !entry.queued)
+      {
+        it = entries.erase(it);
+        continue;
+      }
+      if (!entry.addresses.empty() && entry.expires - now < ttl / 5 && now - entry.lastUsed < 2 * ttl)
+        queueLocked(it->first, entry);
+      ++it;
+    }
+
+    while (!queue.empty() && running)
+    {
+      std::string host = queue.front();
+      queue.pop_front();
+      lk.unlock();
+
+      std::vector<std::string> addresses;
+      bool ok = resolve(host, addresses);
+
+      lk.lock();
+      stats.resolves++;
+      auto it = entries.find(host);
+      if (it == entries.end())
+        continue;
+      Entry &entry = it->second;
+      entry.queued = false;
+      if (ok)
+      {
+        entry.addresses.swap(addresses);
+        entry.expires = Clock::now() + ttl;
+      }
+      else
+      {
+        // keep serving what we had rather than sending every connect to the resolver
+        stats.failures++;
+        if (!entry.addresses.empty())
+          entry.expires = Clock::now() + ttl / 2;
+      }
+    }
+  }
+}
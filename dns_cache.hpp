@@ -0,0 +1,70 @@
+#ifndef __BODHI_DNS_CACHE_HPP__
+#define __BODHI_DNS_CACHE_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Module-wide cache of resolved service addresses, so a connect never waits on the
+  // resolver.  Names are resolved on a background thread, refreshed ahead of their TTL
+  // while they are in use, and their addresses handed out in rotation.  The transport
+  // connects to the cached address and still sends the hostname for SNI and Host.
+  class DnsCache
+  {
+  public:
+    struct Stats
+    {
+      uint64_t hits;
+      uint64_t misses;
+      uint64_t resolves;
+      uint64_t failures; // resolves that failed, and addresses reported unreachable
+      uint64_t entries;
+    };
+
+    static void start(unsigned int ttlSecs);
+    static void stop(void);
+
+    // a cached address for host, rotating over all it resolved to; false on a miss (the
+    // caller connects by name) and the name is queued for resolving
+    static bool lookup(const std::string &host, std::string &address);
+    // a connect to address failed: stop handing it out until the name is resolved again
+    static void reportFailure(const std::string &host, const std::string &address);
+    static Stats getStats(void);
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Entry
+    {
+      std::vector<std::string> addresses;
+      size_t next;
+      Clock::time_point expires;
+      Clock::time_point lastUsed;
+      bool queued;
+    };
+
+    static void run(void);
+    static bool resolve(const std::string &host, std::vector<std::string> &addresses);
+    static void queueLocked(const std::string &host, Entry &entry);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::unordered_map<std::string, Entry> entries;
+    static std::deque<std::string> queue;
+    static std::thread thread;
+    static bool running;
+    static Clock::duration ttl;
+    static Stats stats;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,92 @@
+// drain.cpp
+#include "drain.hpp"
+
+#include <algorithm>
+
+#include <libwebsockets.h>
+
+/* weight of the newest lifetime in the moving average */
+#define LIFETIME_ALPHA 0.05
+/* closes seen since the drain began before their rate is trusted */
+#define MIN_CLOSED_FOR_RATE 5
+
+using namespace bodhi;
+
+std::mutex Drain::mutex;
+std::atomic<bool> Drain::draining(false);
+Drain::Clock::time_point Drain::drainStartedAt;
+Drain::Clock::time_point Drain::lastOpenedAt;
+uint64_t Drain::pipes = 0;
+uint64_t Drain::closed = 0;
+double Drain::avgLifetimeMs = 0;
+
+bool Drain::begin(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (draining)
+    return false;
+  draining = true;
+  drainStartedAt = Clock::now();
+  closed = 0;
+  lwsl_notice("Drain::begin %lu pipes open\n", (unsigned long)pipes);
+  return true;
+}
+
+bool Drain::end(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!draining)
+    return false;
+  draining = false;
+  lwsl_notice("Drain::end %lu pipes open\n", (unsigned long)pipes);
+  return true;
+}
+
+void Drain::pipeOpened(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  pipes++;
+  lastOpenedAt = Clock::now();
+}
+
+void Drain::pipeClosed(Clock::time_point openedAt)
+{
+  double lifetimeMs = std::chrono::duration<double, std::milli>(Clock::now() - openedAt).count();
+  std::lock_guard<std::mutex> lk(mutex);
+  pipes--;
+  avgLifetimeMs = avgLifetimeMs > 0 ? avgLifetimeMs + LIFETIME_ALPHA * (lifetimeMs - avgLifetimeMs) : lifetimeMs;
+  if (!draining)
+    return;
+  closed++;
+  if (0 == pipes)
+    lwsl_notice("Drain::pipeClosed drained after %lu ms\n",
+                (unsigned long)std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - drainStartedAt).count());
+}
+
+Drain::Status Drain::getStatus(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  Clock::time_point now = Clock::now();
+  Status status = {draining, pipes, 0, 0, (uint64_t)avgLifetimeMs, -1};
+  if (draining)
+  {
+    status.closed = closed;
+    status.drainingMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - drainStartedAt).count();
+  }
+  if (0 == pipes)
+  {
+    status.estimateMs = 0;
+    return status;
+  }
+
+  // the youngest pipe is expected to live an average lifetime; nothing opens while draining
+  if (avgLifetimeMs > 0)
+  {
+    int64_t youngestMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - lastOpenedAt).count();
+    status.estimateMs = std::max<int64_t>(0, (int64_t)avgLifetimeMs - youngestMs);
+  }
+  // the rest close at the rate seen so far; take the longer of the two
+  if (draining && closed >= MIN_CLOSED_FOR_RATE)
+    status.estimateMs = std::max<int64_t>(status.estimateMs, status.drainingMs * pipes / closed);
+  return status;
+}
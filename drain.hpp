@@ -0,0 +1,53 @@
+#ifndef __BODHI_DRAIN_HPP__
+#define __BODHI_DRAIN_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+namespace bodhi
+{
+
+  // Taking the module out of rotation.  While draining, new sessions and file jobs are refused
+  // and the memory pools stop caching, but every pipe already open runs until its connection
+  // closes.  Pipes are counted from construction to close.  Their lifetimes, and the rate they
+  // close at once the drain has begun, give an estimate of the time left.
+  class Drain
+  {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Status
+    {
+      bool draining;
+      uint64_t pipes;         // open now
+      uint64_t closed;        // since the drain began
+      uint64_t drainingMs;    // since the drain began
+      uint64_t avgLifetimeMs; // moving average over all pipes, 0 before the first closes
+      int64_t estimateMs;     // until the last pipe closes; -1 with nothing to go on yet
+    };
+
+    // false if already in that state
+    static bool begin(void);
+    static bool end(void);
+    static bool isDraining(void) { return draining; }
+
+    // AudioPipe, from construction until its connection closes (or it is destroyed unconnected)
+    static void pipeOpened(void);
+    static void pipeClosed(Clock::time_point openedAt);
+
+    static Status getStatus(void);
+
+  private:
+    static std::mutex mutex;
+    static std::atomic<bool> draining;
+    static Clock::time_point drainStartedAt;
+    static Clock::time_point lastOpenedAt;
+    static uint64_t pipes;
+    static uint64_t closed;
+    static double avgLifetimeMs;
+  };
+
+} // namespace bodhi
+#endif
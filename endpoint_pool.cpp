@@ -0,0 +1,329 @@
+// endpoint_pool.cpp
+#include "endpoint_pool.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <libwebsockets.h>
+
+#include "utils.hpp"
+
+/* moving average weight of a new sample */
+#define EWMA_ALPHA 0.2
+/* failures in a row, or failure rate over at least EJECT_MIN_CONNECTS, that eject an endpoint */
+#define EJECT_CONSECUTIVE_FAILURES 3
+#define EJECT_FAILURE_RATE 0.5
+#define EJECT_MIN_CONNECTS 10
+#define PROBE_TIMEOUT_MS 1000
+#define PROBE_MIN_SECS 2
+#define PROBE_MAX_SECS 30
+
+using namespace bodhi;
+
+std::mutex EndpointPool::mutex;
+std::condition_variable EndpointPool::cv;
+std::vector<EndpointPool::State> EndpointPool::endpoints;
+std::thread EndpointPool::thread;
+bool EndpointPool::running = false;
+unsigned int EndpointPool::next = 0;
+
+namespace
+{
+  static double ewma(double avg, double sample)
+  {
+    return avg < 0 ? sample : avg + EWMA_ALPHA * (sample - avg);
+  }
+
+  static std::string endpointName(const Endpoint &e)
+  {
+    std::string host = e.host.find(':') != std::string::npos ? "[" + e.host + "]" : e.host;
+    return std::string(e.tls ? "wss://" : "ws://") + host + ":" + std::to_string(e.port) + e.path;
+  }
+}
+
+bool EndpointPool::configure(const std::string &spec, std::string &error)
+{
+  std::vector<State> parsed;
+  std::stringstream ss(spec);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    if (item.empty())
+      continue;
+    std::string entry = item;
+
+    State state = {Endpoint(), 0, 0, 0, 0, -1, -1, -1, 0, false, 0, 0, Clock::now()};
+    Endpoint &e = state.endpoint;
+    e.tls = true;
+    e.weight = 1;
+
+    size_t semi = item.find(';');
+    if (semi != std::string::npos)
+    {
+      std::string option = item.substr(semi + 1);
+      item.erase(semi);
+      int weight = 0 == option.compare(0, 7, "weight=") ? ::atoi(option.c_str() + 7) : 0;
+      if (weight < 1)
+      {
+        error = "invalid endpoint option " + option;
+        return false;
+      }
+      e.weight = weight;
+    }
+    if (0 == item.compare(0, 6, "wss://"))
+      item.erase(0, 6);
+    else if (0 == item.compare(0, 5, "ws://"))
+    {
+      item.erase(0, 5);
+      e.tls = false;
+    }
+    size_t slash = item.find('/');
+    if (slash != std::string::npos)
+    {
+      e.path = item.substr(slash);
+      item.erase(slash);
+    }
+    // an IPv6 address is bracketed, as in a URL; the host is kept without the brackets
+    std::string port = std::to_string(e.tls ? 443 : 80);
+    bool valid = utils::splitHostPort(item, e.host, port);
+    e.port = ::atoi(port.c_str());
+    if (!valid || e.host.empty() || e.port == 0 || e.port > 65535)
+    {
+      error = "invalid endpoint " + entry;
+      return false;
+    }
+    parsed.push_back(state);
+  }
+  if (parsed.empty())
+  {
+    error = "no endpoints configured";
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(mutex);
+  endpoints.swap(parsed);
+  return true;
+}
+
+void EndpointPool::start(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (running)
+    return;
+  running = true;
+  thread = std::thread(&EndpointPool::run);
+}
+
+void EndpointPool::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+int EndpointPool::pick(Endpoint &endpoint)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (endpoints.empty())
+    return -1;
+
+  // lowest (latency x load / weight) among healthy endpoints; an endpoint without samples
+  // yet counts as fastest so it gets tried.  If every endpoint is ejected, use the one
+  // due to be probed soonest rather than failing the call outright.
+  int best = -1;
+  double bestScore = 0;
+  size_t n = endpoints.size();
+  unsigned int start = next++;
+  for (size_t k = 0; k < n; k++)
+  {
+    size_t i = (start + k) % n;
+    const State &s = endpoints[i];
+    if (s.ejected)
+      continue;
+    double latency = std::max(0.0, s.handshakeMs) + std::max(0.0, s.resultLatencyMs) + std::max(0.0, s.rttMs);
+    double score = (latency + 1.0) * (s.active + 1) / s.endpoint.weight;
+    if (best < 0 || score < bestScore)
+    {
+      best = i;
+      bestScore = score;
+    }
+  }
+  if (best < 0)
+  {
+    best = start % n;
+    for (size_t i = 0; i < n; i++)
+    {
+      if (endpoints[i].nextProbe < endpoints[best].nextProbe)
+        best = i;
+    }
+  }
+  endpoints[best].active++;
+  endpoint = endpoints[best].endpoint;
+  return best;
+}
+
+void EndpointPool::release(int index)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (index >= 0 && index < (int)endpoints.size() && endpoints[index].active > 0)
+    endpoints[index].active--;
+}
+
+void EndpointPool::fail(State &s)
+{
+  s.failures++;
+  s.consecutiveFailures++;
+  s.failureRate = s.failureRate + EWMA_ALPHA * (1.0 - s.failureRate);
+  if (!s.ejected && (s.consecutiveFailures >= EJECT_CONSECUTIVE_FAILURES ||
+                     (s.connects >= EJECT_MIN_CONNECTS && s.failureRate > EJECT_FAILURE_RATE)))
+  {
+    s.ejected = true;
+    s.ejections++;
+    s.failedProbes = 0;
+    s.nextProbe = Clock::now() + std::chrono::seconds(PROBE_MIN_SECS);
+    lwsl_notice("EndpointPool ejecting %s after %u failures in a row, failure rate %.2f\n",
+                endpointName(s.endpoint).c_str(), s.consecutiveFailures, s.failureRate);
+    cv.notify_all();
+  }
+}
+
+void EndpointPool::reportConnect(int index, bool ok, unsigned int handshakeMs)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (index < 0 || index >= (int)endpoints.size())
+    return;
+  State &s = endpoints[index];
+  s.connects++;
+  if (!ok)
+  {
+    fail(s);
+    return;
+  }
+  s.consecutiveFailures = 0;
+  s.failureRate = s.failureRate * (1.0 - EWMA_ALPHA);
+  // a connect made while every endpoint was ejected
+  s.ejected = false;
+  s.failedProbes = 0;
+  s.handshakeMs = ewma(s.handshakeMs, handshakeMs);
+}
+
+void EndpointPool::reportDrop(int index)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (index >= 0 && index < (int)endpoints.size())
+    fail(endpoints[index]);
+}
+
+void EndpointPool::reportResultLatency(int index, unsigned int latencyMs)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (index >= 0 && index < (int)endpoints.size())
+    endpoints[index].resultLatencyMs = ewma(endpoints[index].resultLatencyMs, latencyMs);
+}
+
+void EndpointPool::reportRtt(int index, unsigned int rttMs)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (index >= 0 && index < (int)endpoints.size())
+    endpoints[index].rttMs = ewma(endpoints[index].rttMs, rttMs);
+}
+
+std::vector<EndpointPool::EndpointStats> EndpointPool::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  std::vector<EndpointStats> stats;
+  for (const State &s : endpoints)
+  {
+    stats.push_back({endpointName(s.endpoint), s.endpoint.weight, s.active, s.connects, s.failures,
+                     std::max(0.0, s.handshakeMs), std::max(0.0, s.resultLatencyMs), std::max(0.0, s.rttMs), s.failureRate, s.ejected, s.ejections});
+  }
+  return stats;
+}
+
+bool EndpointPool::probe(const Endpoint &endpoint)
+{
+  struct addrinfo hints, *res = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  std::string port = std::to_string(endpoint.port);
+  if (0 != getaddrinfo(endpoint.host.c_str(), port.c_str(), &hints, &res))
+    return false;
+
+  bool ok = false;
+  for (struct addrinfo *ai = res; ai && !ok; ai = ai->ai_next)
+  {
+    int fd = socket(ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      continue;
+    if (0 == ::connect(fd, ai->ai_addr, ai->ai_addrlen))
+      ok = true;
+    else if (errno == EINPROGRESS)
+    {
+      struct pollfd pfd = {fd, POLLOUT, 0};
+      int err = 0;
+      socklen_t len = sizeof(err);
+      ok = 1 == poll(&pfd, 1, PROBE_TIMEOUT_MS) && 0 == getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len) && 0 == err;
+    }
+    ::close(fd);
+  }
+  freeaddrinfo(res);
+  return ok;
+}
+
+void EndpointPool::run(void)
+{
+  std::unique_lock<std::mutex> lk(mutex);
+  while (running)
+  {
+    cv.wait_for(lk, std::chrono::seconds(1));
+    if (!running)
+      break;
+
+    Clock::time_point now = Clock::now();
+    for (size_t i = 0; i < endpoints.size() && running; i++)
+    {
+      if (!endpoints[i].ejected || now < endpoints[i].nextProbe)
+        continue;
+      Endpoint endpoint = endpoints[i].endpoint;
+      lk.unlock();
+      bool ok = probe(endpoint);
+      lk.lock();
+      if (i >= endpoints.size())
+        break;
+
+      State &s = endpoints[i];
+      if (ok)
+      {
+        // back in rotation; the next failures eject it again
+        lwsl_notice("EndpointPool %s answered probe, readmitting\n", endpointName(s.endpoint).c_str());
+        s.ejected = false;
+        s.failedProbes = 0;
+        s.consecutiveFailures = 0;
+        s.failureRate = 0;
+      }
+      else
+      {
+        // doubles with each failed probe of this ejection: 4, 8, 16, then every 30 seconds
+        s.failedProbes++;
+        unsigned int secs = std::min<unsigned int>(PROBE_MAX_SECS, PROBE_MIN_SECS << std::min(s.failedProbes, 4u));
+        s.nextProbe = Clock::now() + std::chrono::seconds(secs);
+      }
+    }
+  }
+}
@@ -0,0 +1,95 @@
+#ifndef __BODHI_ENDPOINT_POOL_HPP__
+#define __BODHI_ENDPOINT_POOL_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bodhi
+{
+
+  struct Endpoint
+  {
+    std::string host;
+    unsigned int port;
+    std::string path;
+    bool tls;
+    unsigned int weight;
+  };
+
+  // The ASR gateways a call may be sent to.  Each endpoint keeps moving averages of its
+  // handshake time, websocket ping round trip, result latency and failure rate; pick() chooses by weighted least
+  // latency, scaled by the calls already on the endpoint.  An endpoint that keeps failing is
+  // ejected and probed with a TCP connect from a background thread until it answers again.
+  class EndpointPool
+  {
+  public:
+    struct EndpointStats
+    {
+      std::string name;
+      unsigned int weight;
+      unsigned int active;
+      uint64_t connects;
+      uint64_t failures;
+      double handshakeMs;
+      double resultLatencyMs;
+      double rttMs;
+      double failureRate;
+      bool ejected;
+      uint64_t ejections;
+    };
+
+    // comma-separated [ws://|wss://]host[:port][/path][;weight=n]; wss and port 443 by default
+    static bool configure(const std::string &spec, std::string &error);
+    static void start(void);
+    static void stop(void);
+
+    // choose an endpoint for a new connection; release() it when the connection is done
+    static int pick(Endpoint &endpoint);
+    static void release(int index);
+
+    static void reportConnect(int index, bool ok, unsigned int handshakeMs);
+    static void reportDrop(int index);
+    static void reportResultLatency(int index, unsigned int latencyMs);
+    static void reportRtt(int index, unsigned int rttMs);
+
+    static std::vector<EndpointStats> getStats(void);
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct State
+    {
+      Endpoint endpoint;
+      unsigned int active;
+      uint64_t connects;
+      uint64_t failures;
+      unsigned int consecutiveFailures;
+      double handshakeMs;     // moving averages; < 0 until the first sample
+      double resultLatencyMs;
+      double rttMs;
+      double failureRate;
+      bool ejected;
+      uint64_t ejections;
+      unsigned int failedProbes; // since it was last ejected; sets the probe backoff
+      Clock::time_point nextProbe;
+    };
+
+    static void fail(State &state);
+    static void run(void);
+    static bool probe(const Endpoint &endpoint);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::vector<State> endpoints;
+    static std::thread thread;
+    static bool running;
+    static unsigned int next;
+  };
+
+} // namespace bodhi
+#endif
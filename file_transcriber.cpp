@@ -0,0 +1,458 @@
+// file_transcriber.cpp
+#include "file_transcriber.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "endpoint_pool.hpp"
+#include "utils.hpp"
+
+/* retry interval for a job whose write was held back for its tenant's outbound rate */
+#define DEFER_RETRY_MS 20
+/* time allowed after eof for the last results before the connection is closed from our end */
+#define FINISH_TIMEOUT_SECS 30
+
+using namespace bodhi;
+
+std::mutex FileTranscriber::mutex;
+std::condition_variable FileTranscriber::cv;
+std::deque<FileTranscriber::Job *> FileTranscriber::queued;
+std::list<FileTranscriber::Job *> FileTranscriber::active;
+std::thread FileTranscriber::thread;
+bool FileTranscriber::running = false;
+bool FileTranscriber::woken = false;
+unsigned int FileTranscriber::s_maxActive = 16;
+unsigned int FileTranscriber::s_bufferSecs = 2;
+FileTranscriber::handler_t FileTranscriber::s_handler = nullptr;
+std::atomic<uint64_t> FileTranscriber::s_active(0);
+std::atomic<uint64_t> FileTranscriber::s_completed(0);
+std::atomic<uint64_t> FileTranscriber::s_failed(0);
+std::atomic<uint64_t> FileTranscriber::s_audioMs(0);
+std::atomic<uint64_t> FileTranscriber::s_bytes(0);
+
+void FileTranscriber::start(unsigned int maxActive, unsigned int bufferSecs, handler_t handler)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  s_maxActive = std::max(1U, maxActive);
+  s_bufferSecs = std::max(1U, bufferSecs);
+  s_handler = handler;
+  if (running)
+    return;
+  running = true;
+  thread = std::thread(&FileTranscriber::run);
+}
+
+void FileTranscriber::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+bool FileTranscriber::mapAudio(Job *job, std::string &error)
+{
+  int fd = ::open(job->request.path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0)
+  {
+    error = "cannot open " + job->request.path + ": " + strerror(errno);
+    return false;
+  }
+  struct stat st;
+  if (0 != fstat(fd, &st) || st.st_size < 2)
+  {
+    ::close(fd);
+    error = job->request.path + " is empty";
+    return false;
+  }
+  void *map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (MAP_FAILED == map)
+  {
+    error = "cannot map " + job->request.path + ": " + strerror(errno);
+    return false;
+  }
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  job->map = map;
+  job->mapLen = st.st_size;
+
+  const uint8_t *p = (const uint8_t *)map;
+  size_t size = st.st_size;
+  job->data = p;
+  job->len = size;
+  job->sampleRate = job->request.rawSampleRate;
+  job->channels = 1;
+  if (size > 12 && 0 == memcmp(p, "RIFF", 4) && 0 == memcmp(p + 8, "WAVE", 4))
+  {
+    bool haveFormat = false;
+    size_t pos = 12;
+    job->len = 0;
+    while (pos + 8 <= size)
+    {
+      uint32_t chunkLen;
+      memcpy(&chunkLen, p + pos + 4, 4);
+      if (0 == memcmp(p + pos, "fmt ", 4) && chunkLen >= 16 && pos + 24 <= size)
+      {
+        uint16_t format, channels, bits;
+        uint32_t rate;
+        memcpy(&format, p + pos + 8, 2);
+        memcpy(&channels, p + pos + 10, 2);
+        memcpy(&rate, p + pos + 12, 4);
+        memcpy(&bits, p + pos + 22, 2);
+        if (format != 1 || bits != 16 || channels < 1 || channels > 2 || !isSupportedRate(rate))
+        {
+          error = job->request.path + ": only 16-bit PCM mono or stereo wav at 8 to 48 kHz is supported";
+          return false;
+        }
+        job->sampleRate = rate;
+        job->channels = channels;
+        haveFormat = true;
+      }
+      else if (0 == memcmp(p + pos, "data", 4))
+      {
+        job->data = p + pos + 8;
+        job->len = std::min<size_t>(chunkLen, size - pos - 8);
+        break;
+      }
+      pos += 8 + chunkLen + (chunkLen & 1);
+    }
+    if (!haveFormat || 0 == job->len)
+    {
+      error = job->request.path + ": no audio found in wav file";
+      return false;
+    }
+  }
+  // whole sample frames only
+  job->len -= job->len % (2 * job->channels);
+  return true;
+}
+
+bool FileTranscriber::submit(const Request &request, std::string &error)
+{
+  Job *job = new Job();
+  job->request = request;
+  job->map = nullptr;
+  job->mapLen = 0;
+  job->cursor = 0;
+  job->ap = nullptr;
+  job->endpoint = -1;
+  job->state = JOB_QUEUED;
+  job->closing = false;
+  job->deferred = false;
+  job->retryAt = Clock::time_point();
+  if (!mapAudio(job, error))
+  {
+    if (job->map)
+      munmap(job->map, job->mapLen);
+    ResultSinks::put(job->request.sink);
+    delete job;
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!running)
+  {
+    munmap(job->map, job->mapLen);
+    ResultSinks::put(job->request.sink);
+    delete job;
+    error = "file transcription is not running";
+    return false;
+  }
+  queued.push_back(job);
+  woken = true;
+  cv.notify_all();
+  return true;
+}
+
+bool FileTranscriber::connectJob(Job *job)
+{
+  Endpoint endpoint;
+  job->endpoint = EndpointPool::pick(endpoint);
+  if (job->endpoint < 0)
+  {
+    job->reason = "no ASR endpoint configured";
+    return false;
+  }
+  size_t bytesPerSec = job->sampleRate * 2 * job->channels;
+  job->ap = new AudioPipe(job->request.id.c_str(), endpoint.host.c_str(), endpoint.port, endpoint.path.c_str(),
+                          LWS_PRE + bytesPerSec * s_bufferSecs, bytesPerSec / 50, job->request.apiKey.c_str(),
+                          job->request.customerId.c_str(), job->sampleRate, job->request.model.c_str(), eventCallback);
+  job->ap->setSslFlags(endpoint.tls ? LCCSCF_USE_SSL : 0);
+  job->ap->setChannels(job->channels);
+  job->ap->setUserData(job);
+  job->ap->setNotifyWritten(true);
+  // charged to the customer's connect and outbound rates; files have their own cap on jobs.
+  // The pipe releases it when its connection is gone
+  std::string error;
+  job->ap->setTenant(Tenants::acquire(job->request.customerId, false, error));
+  job->state = JOB_CONNECTING;
+  job->startedAt = Clock::now();
+  job->ap->connect();
+  return true;
+}
+
+void FileTranscriber::eventCallback(const char *sessionId, void *userData, AudioPipe::NotifyEvent_t event, const char *message, bool finished)
+{
+  Job *job = static_cast<Job *>(userData);
+  switch (event)
+  {
+  case AudioPipe::CONNECT_SUCCESS:
+    EndpointPool::reportConnect(job->endpoint, true, job->ap->getHandshakeMs());
+    job->state = JOB_STREAMING;
+    break;
+  case AudioPipe::CONNECT_FAIL:
+    EndpointPool::reportConnect(job->endpoint, false, 0);
+    job->reason = message ? message : "connect failed";
+    job->state = JOB_FAILED;
+    break;
+  case AudioPipe::CONNECTION_DROPPED:
+    // the service closes the connection itself once it has answered the eof
+    if (!finished)
+    {
+      EndpointPool::reportDrop(job->endpoint);
+      job->reason = message ? message : "connection dropped";
+      job->state = JOB_FAILED;
+    }
+    else
+      job->state = JOB_DONE;
+    break;
+  case AudioPipe::CONNECTION_CLOSED_GRACEFULLY:
+    job->state = job->closing ? JOB_FAILED : JOB_DONE;
+    break;
+  case AudioPipe::MESSAGE:
+    s_handler(job->request.id, job->request.path, job->request.userData, FILE_RESULT, message);
+    return;
+  case AudioPipe::PONG:
+    EndpointPool::reportRtt(job->endpoint, ::atoi(message));
+    return;
+  case AudioPipe::AUDIO_WRITTEN:
+    // room in the buffer again, or a write for the feeder to retry after a while; it is woken
+    // once for a job's first deferral and then keeps its own timer
+    if (message && job->deferred.exchange(true))
+      return;
+    break;
+  default:
+    return;
+  }
+  wakeFeeder();
+}
+
+void FileTranscriber::wakeFeeder(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    woken = true;
+  }
+  cv.notify_all();
+}
+
+bool FileTranscriber::pump(Job *job, int state)
+{
+  switch (state)
+  {
+  case JOB_STREAMING:
+  {
+    // as much as the buffer takes; it empties only as fast as the socket does.  Unlocking asks
+    // for a write of whatever is buffered, which also retries one held back for the rate
+    AudioPipe *ap = job->ap;
+    size_t n = 0;
+    ap->lockAudioBuffer();
+    if (job->cursor < job->len)
+    {
+      size_t frame = 2 * job->channels;
+      n = std::min(ap->binarySpaceAvailable(), job->len - job->cursor);
+      n -= n % frame;
+      if (n > 0)
+      {
+        memcpy(ap->binaryWritePtr(), job->data + job->cursor, n);
+        ap->binaryWritePtrAdd(n);
+        job->cursor += n;
+        s_bytes += n;
+      }
+    }
+    ap->unlockAudioBuffer();
+    if (n > 0)
+      return true;
+    if (job->cursor < job->len || ap->hasBufferedAudio())
+      return false;
+    {
+      // all audio handed to the transport; eof goes out behind it
+      int streaming = JOB_STREAMING;
+      if (!job->state.compare_exchange_strong(streaming, JOB_FINISHING))
+        return true;
+      job->finishedAt = Clock::now();
+      job->ap->finish();
+    }
+    return true;
+  }
+  case JOB_FINISHING:
+    if (!job->closing && Clock::now() - job->finishedAt >= std::chrono::seconds(FINISH_TIMEOUT_SECS))
+    {
+      job->reason = "no close from the service after eof";
+      job->closing = true;
+      job->ap->close();
+    }
+    return false;
+  case JOB_DONE:
+  case JOB_FAILED:
+    complete(job);
+    return true;
+  default:
+    return false;
+  }
+}
+
+void FileTranscriber::complete(Job *job)
+{
+  uint64_t elapsedMs = job->ap ? std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - job->startedAt).count() : 0;
+  if (job->ap)
+  {
+    job->ap->waitForClose();
+    delete job->ap;
+    job->ap = nullptr;
+  }
+  EndpointPool::release(job->endpoint);
+  munmap(job->map, job->mapLen);
+
+  bool done = job->state == JOB_DONE;
+  uint64_t bytesPerSec = (uint64_t)job->sampleRate * 2 * job->channels;
+  uint64_t audioMs = job->cursor * 1000 / bytesPerSec;
+  s_audioMs += audioMs;
+  (done ? s_completed : s_failed)++;
+
+  std::string json = "{\"job\": \"" + utils::escapeJson(job->request.id) + "\", \"path\": \"" + utils::escapeJson(job->request.path) +
+                     "\", \"status\": \"" + (done ? "done" : "failed") + "\", \"audio_ms\": " + std::to_string(audioMs) +
+                     ", \"total_ms\": " + std::to_string((uint64_t)job->len * 1000 / bytesPerSec) + ", \"elapsed_ms\": " + std::to_string(elapsedMs) +
+                     ", \"speed\": ";
+  char speed[32];
+  snprintf(speed, sizeof(speed), "%.1f", elapsedMs ? (double)audioMs / elapsedMs : 0.0);
+  json += speed;
+  if (!done)
+    json += ", \"reason\": \"" + utils::escapeJson(job->reason) + "\"";
+  json += "}";
+  s_handler(job->request.id, job->request.path, job->request.userData, done ? FILE_DONE : FILE_FAILED, json.c_str());
+  ResultSinks::put(job->request.sink);
+  delete job;
+}
+
+void FileTranscriber::run(void)
+{
+  std::unique_lock<std::mutex> lk(mutex);
+  while (running)
+  {
+    while (active.size() < s_maxActive && !queued.empty())
+    {
+      Job *job = queued.front();
+      queued.pop_front();
+      lk.unlock();
+      if (connectJob(job))
+      {
+        active.push_back(job);
+        s_active++;
+      }
+      else
+      {
+        job->state = JOB_FAILED;
+        complete(job);
+      }
+      lk.lock();
+    }
+    woken = false;
+    lk.unlock();
+
+    // nothing to do until a pipe reports a write or a state change, short of a finish
+    // deadline or a deferred write's retry
+    bool progress = false, haveDeadline = false;
+    Clock::time_point now = Clock::now(), deadline;
+    auto wakeAt = [&](Clock::time_point at)
+    {
+      if (!haveDeadline || at < deadline)
+        deadline = at;
+      haveDeadline = true;
+    };
+    for (auto it = active.begin(); it != active.end();)
+    {
+      Job *job = *it;
+      int state = job->state;
+      if (state == JOB_STREAMING && job->deferred)
+      {
+        if (job->retryAt == Clock::time_point())
+          job->retryAt = now + std::chrono::milliseconds(DEFER_RETRY_MS);
+        if (now < job->retryAt)
+        {
+          wakeAt(job->retryAt);
+          ++it;
+          continue;
+        }
+        // pump's unlockAudioBuffer asks for the write again
+        job->retryAt = Clock::time_point();
+        job->deferred = false;
+      }
+
+      // a job seen as done here is freed by pump
+      progress |= pump(job, state);
+      if (state == JOB_DONE || state == JOB_FAILED)
+      {
+        it = active.erase(it);
+        s_active--;
+        continue;
+      }
+      if (state == JOB_FINISHING && !job->closing)
+        wakeAt(job->finishedAt + std::chrono::seconds(FINISH_TIMEOUT_SECS));
+      ++it;
+    }
+
+    lk.lock();
+    if (progress)
+      continue;
+    auto ready = []
+    { return !running || woken || (!queued.empty() && active.size() < s_maxActive); };
+    if (haveDeadline)
+      cv.wait_until(lk, deadline, ready);
+    else
+      cv.wait(lk, ready);
+  }
+  std::deque<Job *> waiting;
+  waiting.swap(queued);
+  lk.unlock();
+
+  for (Job *job : waiting)
+  {
+    job->reason = "shutdown";
+    job->state = JOB_FAILED;
+    complete(job);
+  }
+  for (Job *job : active)
+  {
+    int state = job->state;
+    if (state != JOB_DONE && state != JOB_FAILED)
+    {
+      job->reason = "shutdown";
+      job->closing = true;
+      if (state == JOB_CONNECTING)
+        job->ap->finish();
+      else
+        job->ap->close();
+      job->state = JOB_FAILED;
+    }
+    complete(job);
+  }
+  active.clear();
+  s_active = 0;
+}
+
+FileTranscriber::Stats FileTranscriber::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  return {queued.size(), s_active, s_completed, s_failed, s_audioMs, s_bytes};
+}
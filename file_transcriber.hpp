@@ -0,0 +1,126 @@
+#ifndef __BODHI_FILE_TRANSCRIBER_HPP__
+#define __BODHI_FILE_TRANSCRIBER_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "audio_pipe.hpp"
+#include "result_sink.hpp"
+
+namespace bodhi
+{
+
+  // Transcribes recordings instead of live calls.  A file is mapped into memory and streamed
+  // through an ordinary AudioPipe as fast as the connection drains it: the pipe wakes the
+  // feeder each time the transport has taken what was buffered, and the feeder refills it, so
+  // the pace is set by websocket backpressure rather than the clock.  Up to maxActive files run at once, spread
+  // over the transport's service threads like calls; the rest wait their turn.
+  class FileTranscriber
+  {
+  public:
+    enum Event_t
+    {
+      FILE_RESULT, // json is a result from the ASR service
+      FILE_DONE,   // json describes the finished job
+      FILE_FAILED  // json describes the failed job, with a reason
+    };
+    typedef void (*handler_t)(const std::string &id, const std::string &path, void *userData, Event_t event, const char *json);
+
+    struct Request
+    {
+      std::string id;
+      std::string path; // 16-bit PCM wav, or raw 16-bit mono at rawSampleRate
+      std::string model;
+      std::string apiKey;
+      std::string customerId;
+      int rawSampleRate;
+      void *userData;   // passed back to the handler
+      ResultSink *sink; // from ResultSinks::get, or nullptr; put back when the job is over
+    };
+
+    struct Stats
+    {
+      uint64_t queued;
+      uint64_t active;
+      uint64_t completed;
+      uint64_t failed;
+      uint64_t audioMs; // of audio sent
+      uint64_t bytes;
+    };
+
+    static void start(unsigned int maxActive, unsigned int bufferSecs, handler_t handler);
+    // jobs still running are closed and reported as failed
+    static void stop(void);
+
+    // maps the file and queues the job; false with a reason if the file cannot be used.  Takes
+    // over request.sink either way
+    static bool submit(const Request &request, std::string &error);
+
+    static Stats getStats(void);
+
+    // rates a file (or rawSampleRate) may be at: 8 to 48 kHz, as for calls
+    static bool isSupportedRate(uint32_t rate) { return rate >= 8000 && rate <= 48000; }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    enum JobState_t
+    {
+      JOB_QUEUED,
+      JOB_CONNECTING,
+      JOB_STREAMING,
+      JOB_FINISHING, // eof sent, waiting for the last results and the close
+      JOB_DONE,
+      JOB_FAILED
+    };
+
+    struct Job
+    {
+      Request request;
+      void *map;
+      size_t mapLen;
+      const uint8_t *data; // audio within the mapping
+      size_t len;
+      size_t cursor;
+      int sampleRate;
+      int channels;
+      AudioPipe *ap;
+      int endpoint;
+      std::atomic<int> state;
+      std::atomic<bool> closing;  // closed from our end; a graceful close is then a failure
+      std::atomic<bool> deferred; // last write held back for the tenant's rate: retry on a timer
+      Clock::time_point retryAt;  // of the deferred write; feeder thread only
+      std::string reason;
+      Clock::time_point startedAt;
+      Clock::time_point finishedAt;
+    };
+
+    static bool mapAudio(Job *job, std::string &error);
+    static bool connectJob(Job *job);
+    static bool pump(Job *job, int state);
+    static void complete(Job *job);
+    static void eventCallback(const char *sessionId, void *userData, AudioPipe::NotifyEvent_t event, const char *message, bool finished);
+    static void wakeFeeder(void);
+    static void run(void);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::deque<Job *> queued;
+    static std::list<Job *> active; // feeder thread only
+    static std::thread thread;
+    static bool running;
+    static bool woken; // a job has something for the feeder since it last looked
+    static unsigned int s_maxActive;
+    static unsigned int s_bufferSecs;
+    static handler_t s_handler;
+    static std::atomic<uint64_t> s_active, s_completed, s_failed, s_audioMs, s_bytes;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,83 @@
+// intern.cpp
+#include "intern.hpp"
+
+#include <mutex>
+#include <unordered_map>
+
+using namespace bodhi;
+
+namespace
+{
+  // heap allocated and never destroyed: pipes may outlive static destruction at unload
+  static std::mutex &tableMutex(void)
+  {
+    static std::mutex *m = new std::mutex();
+    return *m;
+  }
+  static std::unordered_map<std::string, unsigned int> &table(void)
+  {
+    static std::unordered_map<std::string, unsigned int> *t = new std::unordered_map<std::string, unsigned int>();
+    return *t;
+  }
+  static const std::string empty;
+}
+
+InternedString::InternedString(const char *value) : m_entry(nullptr)
+{
+  if (!value || !*value)
+    return;
+  std::lock_guard<std::mutex> lk(tableMutex());
+  auto it = table().emplace(value, 0).first;
+  it->second++;
+  m_entry = &*it;
+}
+
+InternedString::InternedString(const InternedString &other) : m_entry(other.m_entry)
+{
+  if (m_entry)
+  {
+    std::lock_guard<std::mutex> lk(tableMutex());
+    m_entry->second++;
+  }
+}
+
+InternedString &InternedString::operator=(const InternedString &other)
+{
+  if (m_entry != other.m_entry)
+  {
+    release();
+    m_entry = other.m_entry;
+    if (m_entry)
+    {
+      std::lock_guard<std::mutex> lk(tableMutex());
+      m_entry->second++;
+    }
+  }
+  return *this;
+}
+
+InternedString::~InternedString()
+{
+  release();
+}
+
+void InternedString::release(void)
+{
+  if (!m_entry)
+    return;
+  std::lock_guard<std::mutex> lk(tableMutex());
+  if (0 == --m_entry->second)
+    table().erase(table().find(m_entry->first));
+  m_entry = nullptr;
+}
+
+const std::string &InternedString::str(void) const
+{
+  return m_entry ? m_entry->first : empty;
+}
+
+size_t InternedString::tableSize(void)
+{
+  std::lock_guard<std::mutex> lk(tableMutex());
+  return table().size();
+}
@@ -0,0 +1,38 @@
+#ifndef __BODHI_INTERN_HPP__
+#define __BODHI_INTERN_HPP__
+
+#include <cstddef>
+#include <string>
+#include <utility>
+
+namespace bodhi
+{
+
+  // Reference-counted handle to a string in a module-wide table.  Values that are the same
+  // for many sessions (host, path, model, credentials) are stored once and shared; the entry
+  // is freed when the last handle goes away.
+  class InternedString
+  {
+  public:
+    InternedString() : m_entry(nullptr) {}
+    explicit InternedString(const char *value);
+    InternedString(const InternedString &other);
+    InternedString &operator=(const InternedString &other);
+    ~InternedString();
+
+    const std::string &str(void) const;
+    const char *c_str(void) const { return str().c_str(); }
+
+    // number of distinct strings currently interned
+    static size_t tableSize(void);
+
+  private:
+    typedef std::pair<const std::string, unsigned int> Entry;
+
+    void release(void);
+
+    Entry *m_entry;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,317 @@
+// journal.cpp
+#include "journal.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libwebsockets.h>
+
+#include "utils.hpp"
+
+#define JOURNAL_ALIGN(n) (((n) + 7) & ~(size_t)7)
+
+using namespace bodhi;
+
+std::mutex Journal::mutex;
+std::condition_variable Journal::cv;
+std::vector<Journal::Pending> Journal::queue;
+std::thread Journal::thread;
+std::atomic<bool> Journal::running(false);
+size_t Journal::maxQueued = 0;
+Journal::Stats Journal::stats = {0, 0, 0, 0};
+std::string Journal::dir;
+size_t Journal::segmentBytes = 0;
+int Journal::fd = -1;
+uint8_t *Journal::base = nullptr;
+size_t Journal::offset = 0;
+
+namespace
+{
+  static uint64_t nowUs(void)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+}
+
+bool Journal::open(const std::string &directory, size_t bytes, size_t max)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (running)
+    return true;
+  if (0 != mkdir(directory.c_str(), 0755) && errno != EEXIST)
+  {
+    lwsl_err("Journal::open cannot create %s: %s\n", directory.c_str(), strerror(errno));
+    return false;
+  }
+  dir = directory;
+  segmentBytes = std::max(bytes, (size_t)64 * 1024);
+  maxQueued = max;
+  running = true;
+  thread = std::thread(&Journal::run);
+  return true;
+}
+
+void Journal::close(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+}
+
+void Journal::append(const std::string &callId, uint64_t callMs, const char *json, size_t len)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running || queue.size() >= maxQueued)
+    {
+      stats.dropped++;
+      return;
+    }
+    queue.push_back({callId, std::string(json, len), nowUs(), callMs});
+  }
+  cv.notify_one();
+}
+
+Journal::Stats Journal::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  return stats;
+}
+
+void Journal::run(void)
+{
+  std::vector<Pending> batch;
+  std::unique_lock<std::mutex> lk(mutex);
+  while (true)
+  {
+    cv.wait(lk, []
+            { return !running || !queue.empty(); });
+    if (queue.empty() && !running)
+      break;
+    batch.swap(queue);
+    lk.unlock();
+
+    for (const Pending &rec : batch)
+      write(rec);
+    batch.clear();
+
+    lk.lock();
+  }
+  lk.unlock();
+  closeSegment();
+}
+
+bool Journal::openSegment(uint64_t createdUs)
+{
+  // names must be unique and sort in write order
+  static uint64_t lastCreatedUs = 0;
+  createdUs = lastCreatedUs = std::max(createdUs, lastCreatedUs + 1);
+
+  char name[64];
+  snprintf(name, sizeof(name), "/journal-%020llu.bjl", (unsigned long long)createdUs);
+  std::string path = dir + name;
+
+  fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0 || 0 != ftruncate(fd, segmentBytes))
+  {
+    lwsl_err("Journal::openSegment %s: %s\n", path.c_str(), strerror(errno));
+    if (fd >= 0)
+      ::close(fd);
+    fd = -1;
+    return false;
+  }
+  base = (uint8_t *)mmap(nullptr, segmentBytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (base == MAP_FAILED)
+  {
+    lwsl_err("Journal::openSegment mmap %s: %s\n", path.c_str(), strerror(errno));
+    ::close(fd);
+    fd = -1;
+    base = nullptr;
+    return false;
+  }
+
+  JournalSegmentHeader *hdr = (JournalSegmentHeader *)base;
+  memcpy(hdr->magic, BODHI_JOURNAL_SEGMENT_MAGIC, sizeof(hdr->magic));
+  hdr->version = BODHI_JOURNAL_VERSION;
+  hdr->headerLen = sizeof(JournalSegmentHeader);
+  hdr->createdUs = createdUs;
+  offset = sizeof(JournalSegmentHeader);
+
+  std::lock_guard<std::mutex> lk(mutex);
+  stats.segments++;
+  return true;
+}
+
+void Journal::closeSegment(void)
+{
+  if (!base)
+    return;
+
+  // every segment keeps room for its end record
+  JournalRecordHeader *end = (JournalRecordHeader *)(base + offset);
+  memset(end, 0, sizeof(*end));
+  end->length = sizeof(*end);
+  __atomic_store_n(&end->magic, BODHI_JOURNAL_END_MAGIC, __ATOMIC_RELEASE);
+  offset += sizeof(*end);
+
+  msync(base, offset, MS_ASYNC);
+  munmap(base, segmentBytes);
+  if (0 != ftruncate(fd, offset))
+    lwsl_err("Journal::closeSegment ftruncate: %s\n", strerror(errno));
+  ::close(fd);
+  base = nullptr;
+  fd = -1;
+}
+
+void Journal::write(const Pending &rec)
+{
+  size_t callIdLen = std::min(rec.callId.length(), (size_t)UINT16_MAX);
+  size_t len = JOURNAL_ALIGN(sizeof(JournalRecordHeader) + callIdLen + rec.json.length());
+  size_t capacity = segmentBytes - sizeof(JournalSegmentHeader) - sizeof(JournalRecordHeader);
+  if (len > capacity)
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    stats.dropped++;
+    return;
+  }
+  if (base && offset + len > segmentBytes - sizeof(JournalRecordHeader))
+    closeSegment();
+  if (!base && !openSegment(rec.recvUs))
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    stats.dropped++;
+    return;
+  }
+
+  JournalRecordHeader *hdr = (JournalRecordHeader *)(base + offset);
+  uint8_t *p = (uint8_t *)(hdr + 1);
+  memcpy(p, rec.callId.data(), callIdLen);
+  memcpy(p + callIdLen, rec.json.data(), rec.json.length());
+  hdr->length = len;
+  hdr->recvUs = rec.recvUs;
+  hdr->callMs = rec.callMs;
+  hdr->segmentId = utils::getJsonInt(rec.json.data(), rec.json.length(), "segment_id", -1);
+  hdr->callIdLen = callIdLen;
+  hdr->reserved = 0;
+  hdr->jsonLen = rec.json.length();
+  hdr->reserved2 = 0;
+  // publish last so a concurrent reader never sees a partial record
+  __atomic_store_n(&hdr->magic, BODHI_JOURNAL_RECORD_MAGIC, __ATOMIC_RELEASE);
+  offset += len;
+
+  std::lock_guard<std::mutex> lk(mutex);
+  stats.records++;
+  stats.bytes += len;
+}
+
+JournalReader::JournalReader() : m_fd(-1), m_base(nullptr), m_len(0), m_offset(0), m_sealed(false)
+{
+}
+
+JournalReader::~JournalReader()
+{
+  close();
+}
+
+bool JournalReader::open(const std::string &path)
+{
+  close();
+  m_fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (m_fd < 0 || !refresh())
+  {
+    close();
+    return false;
+  }
+  const JournalSegmentHeader *hdr = (const JournalSegmentHeader *)m_base;
+  if (0 != memcmp(hdr->magic, BODHI_JOURNAL_SEGMENT_MAGIC, sizeof(hdr->magic)) || hdr->version != BODHI_JOURNAL_VERSION)
+  {
+    close();
+    return false;
+  }
+  m_offset = hdr->headerLen;
+  return true;
+}
+
+void JournalReader::close(void)
+{
+  if (m_base)
+    munmap((void *)m_base, m_len);
+  if (m_fd >= 0)
+    ::close(m_fd);
+  m_fd = -1;
+  m_base = nullptr;
+  m_len = m_offset = 0;
+  m_sealed = false;
+}
+
+bool JournalReader::refresh(void)
+{
+  struct stat st;
+  if (m_fd < 0 || 0 != fstat(m_fd, &st))
+    return false;
+  size_t len = st.st_size;
+  if (len == m_len && m_base)
+    return true;
+  if (m_base)
+    munmap((void *)m_base, m_len);
+  m_base = nullptr;
+  m_len = len;
+  if (len < sizeof(JournalSegmentHeader))
+    return false;
+  void *p = mmap(nullptr, len, PROT_READ, MAP_SHARED, m_fd, 0);
+  if (p == MAP_FAILED)
+    return false;
+  m_base = (const uint8_t *)p;
+  return true;
+}
+
+bool JournalReader::next(Record &rec)
+{
+  if (!m_base || m_sealed || m_offset + sizeof(JournalRecordHeader) > m_len)
+    return false;
+  const JournalRecordHeader *hdr = (const JournalRecordHeader *)(m_base + m_offset);
+  uint32_t magic = __atomic_load_n(&hdr->magic, __ATOMIC_ACQUIRE);
+  if (magic == BODHI_JOURNAL_END_MAGIC)
+  {
+    m_sealed = true;
+    return false;
+  }
+  if (magic != BODHI_JOURNAL_RECORD_MAGIC || m_offset + hdr->length > m_len)
+    return false;
+  rec.header = hdr;
+  rec.callId = (const char *)(hdr + 1);
+  rec.json = rec.callId + hdr->callIdLen;
+  m_offset += hdr->length;
+  return true;
+}
+
+std::vector<std::string> JournalReader::listSegments(const std::string &dir)
+{
+  std::vector<std::string> segments;
+  DIR *d = opendir(dir.c_str());
+  if (!d)
+    return segments;
+  struct dirent *e;
+  while ((e = readdir(d)) != nullptr)
+  {
+    size_t n = strlen(e->d_name);
+    if (n > 12 && 0 == strncmp(e->d_name, "journal-", 8) && 0 == strcmp(e->d_name + n - 4, ".bjl"))
+      segments.push_back(dir + "/" + e->d_name);
+  }
+  closedir(d);
+  std::sort(segments.begin(), segments.end());
+  return segments;
+}
@@ -0,0 +1,133 @@
+#ifndef __BODHI_JOURNAL_HPP__
+#define __BODHI_JOURNAL_HPP__
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bodhi
+{
+
+  // On-disk format.  A journal directory holds segment files named journal-<first record
+  // time in usecs>.bjl, each a JournalSegmentHeader followed by 8-byte aligned records.  A
+  // record's magic is stored last, so a reader that finds a zero magic has reached the end of
+  // what has been written so far.  A closed segment ends with an end record and is truncated
+  // to its used length.
+#define BODHI_JOURNAL_SEGMENT_MAGIC "BODHIJNL"
+#define BODHI_JOURNAL_RECORD_MAGIC 0x31524a42 /* "BJR1" */
+#define BODHI_JOURNAL_END_MAGIC 0x444e4542    /* "BEND" */
+#define BODHI_JOURNAL_VERSION 1
+
+  struct JournalSegmentHeader
+  {
+    char magic[8];
+    uint32_t version;
+    uint32_t headerLen;
+    uint64_t createdUs;
+    uint64_t reserved[5];
+  };
+
+  struct JournalRecordHeader
+  {
+    uint32_t magic;
+    uint32_t length;    // whole record including this header and padding
+    uint64_t recvUs;    // wall clock when the result was received
+    uint64_t callMs;    // time since the pipe connected
+    int32_t segmentId;  // from the result's segment_id, -1 if absent
+    uint16_t callIdLen; // call id bytes follow the header, then jsonLen bytes of result
+    uint16_t reserved;
+    uint32_t jsonLen;
+    uint32_t reserved2;
+  };
+
+  // Append-only transcript journal.  append() only queues the record (it is called from the
+  // transport's service threads); a background thread copies records into mmap'd segment
+  // files and rotates them at segmentBytes.
+  class Journal
+  {
+  public:
+    struct Stats
+    {
+      uint64_t records;
+      uint64_t bytes;
+      uint64_t dropped; // queue full or record larger than a segment
+      uint64_t segments;
+    };
+
+    static bool open(const std::string &dir, size_t segmentBytes, size_t maxQueued);
+    static void close(void);
+    static bool isOpen(void) { return running; }
+
+    static void append(const std::string &callId, uint64_t callMs, const char *json, size_t len);
+    static Stats getStats(void);
+
+  private:
+    struct Pending
+    {
+      std::string callId;
+      std::string json;
+      uint64_t recvUs;
+      uint64_t callMs;
+    };
+
+    static void run(void);
+    static bool openSegment(uint64_t nowUs);
+    static void closeSegment(void);
+    static void write(const Pending &rec);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::vector<Pending> queue;
+    static std::thread thread;
+    static std::atomic<bool> running;
+    static size_t maxQueued;
+    static Stats stats;
+
+    // writer thread only
+    static std::string dir;
+    static size_t segmentBytes;
+    static int fd;
+    static uint8_t *base;
+    static size_t offset;
+  };
+
+  // Sequential reader over one segment; reopen or call refresh() to pick up appended records.
+  class JournalReader
+  {
+  public:
+    struct Record
+    {
+      const JournalRecordHeader *header;
+      const char *callId;
+      const char *json;
+    };
+
+    JournalReader();
+    ~JournalReader();
+    bool open(const std::string &path);
+    void close(void);
+    // remap if the file has grown (or been truncated on rotation)
+    bool refresh(void);
+    // false at the current end of written data
+    bool next(Record &rec);
+    // the end record has been read, so nothing more will be appended
+    bool isSealed(void) { return m_sealed; }
+
+    // segment files in a directory, oldest first
+    static std::vector<std::string> listSegments(const std::string &dir);
+
+  private:
+    int m_fd;
+    const uint8_t *m_base;
+    size_t m_len;
+    size_t m_offset;
+    bool m_sealed;
+  };
+
+} // namespace bodhi
+#endif
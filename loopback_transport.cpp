@@ -0,0 +1,302 @@
+// loopback_transport.cpp
+#include "loopback_transport.hpp"
+#include "audio_pipe.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+using namespace bodhi;
+
+namespace
+{
+  // max writes serviced per pipe before yielding to the next queued op
+  static const int MAX_WRITES_PER_OP = 16;
+
+  struct MockAsrState
+  {
+    bool configured;
+    bool eof;
+    int sampleRate;
+    uint64_t audioBytes;
+    uint64_t lastPartialMs;
+    uint64_t segmentStartMs;
+    unsigned int segment;
+  };
+
+  static std::string mockResult(AudioPipe *ap, MockAsrState *s, const char *type, uint64_t audioMs, bool eos)
+  {
+    return "{\"call_id\": \"" + ap->getUuid() + "\", \"segment_id\": " + std::to_string(s->segment) +
+           ", \"eos\": " + (eos ? "true" : "false") + ", \"type\": \"" + type + "\", \"text\": \"" +
+           std::to_string((audioMs - s->segmentStartMs) / 300) + " words\", \"audio_end_ms\": " + std::to_string(audioMs) + "}";
+  }
+
+  class LoopbackFrameWriter : public FrameWriter
+  {
+  public:
+    LoopbackFrameWriter(AudioPipe *ap, void *&state, LoopbackTransport::Peer *peer, LoopbackTransport::PeerOutput &out)
+        : m_ap(ap), m_state(state), m_peer(peer), m_out(out), m_bytes(0) {}
+    int write(uint8_t *buf, size_t len, bool binary)
+    {
+      if (binary)
+        m_peer->onBinary(m_ap, m_state, buf, len, m_out);
+      else
+        m_peer->onText(m_ap, m_state, (const char *)buf, len, m_out);
+      m_bytes += len;
+      return len;
+    }
+    size_t bytes(void) { return m_bytes; }
+
+  private:
+    AudioPipe *m_ap;
+    void *&m_state;
+    LoopbackTransport::Peer *m_peer;
+    LoopbackTransport::PeerOutput &m_out;
+    size_t m_bytes;
+  };
+}
+
+void LoopbackTransport::MockAsrPeer::onText(AudioPipe *ap, void *&state, const char *data, size_t len, PeerOutput &out)
+{
+  MockAsrState *s = (MockAsrState *)state;
+  std::string msg(data, len);
+  if (!s)
+  {
+    s = new MockAsrState();
+    memset(s, 0, sizeof(*s));
+    s->sampleRate = 8000;
+    state = s;
+  }
+  if (!s->configured)
+  {
+    size_t pos = msg.find("\"sample_rate\":");
+    if (pos != std::string::npos)
+      s->sampleRate = std::max(1, ::atoi(msg.c_str() + pos + 14));
+    s->configured = true;
+    return;
+  }
+  if (msg.find("\"eof\"") != std::string::npos && !s->eof)
+  {
+    s->eof = true;
+    out.messages.push_back(mockResult(ap, s, "complete", s->audioBytes * 1000 / (s->sampleRate * 2), true));
+    out.close = true;
+  }
+}
+
+void LoopbackTransport::MockAsrPeer::onBinary(AudioPipe *ap, void *&state, const uint8_t *data, size_t len, PeerOutput &out)
+{
+  MockAsrState *s = (MockAsrState *)state;
+  if (!s || !s->configured || s->eof)
+    return;
+  s->audioBytes += len;
+  uint64_t audioMs = s->audioBytes * 1000 / (s->sampleRate * 2);
+  if (audioMs - s->segmentStartMs >= m_segmentMs)
+  {
+    out.messages.push_back(mockResult(ap, s, "complete", audioMs, false));
+    s->segment++;
+    s->segmentStartMs = s->lastPartialMs = audioMs;
+  }
+  else if (audioMs - s->lastPartialMs >= m_partialEveryMs)
+  {
+    out.messages.push_back(mockResult(ap, s, "partial", audioMs, false));
+    s->lastPartialMs = audioMs;
+  }
+}
+
+void LoopbackTransport::MockAsrPeer::onRelease(void *state)
+{
+  delete (MockAsrState *)state;
+}
+
+LoopbackTransport::LoopbackTransport(unsigned int nThreads, Peer *peer) : m_peer(peer), m_next(0), m_bytesSent(0), m_framesSent(0)
+{
+  for (unsigned int i = 0; i < std::max(1u, nThreads); i++)
+  {
+    Worker *w = new Worker();
+    m_workers.push_back(w);
+    w->thread = std::thread(&LoopbackTransport::run, this, w);
+  }
+}
+
+LoopbackTransport::~LoopbackTransport()
+{
+  for (Worker *w : m_workers)
+  {
+    {
+      std::lock_guard<std::mutex> lk(w->mutex);
+      w->stop = true;
+    }
+    w->cv.notify_all();
+    w->thread.join();
+    delete w;
+  }
+}
+
+void LoopbackTransport::run(Worker *w)
+{
+  std::unique_lock<std::mutex> lk(w->mutex);
+  while (true)
+  {
+    // due timers queue up behind the ops already waiting
+    auto due = std::min_element(w->timers.begin(), w->timers.end());
+    if (due != w->timers.end() && due->first <= Clock::now())
+    {
+      w->ops.push_back({OP_TIMER, due->second});
+      w->timers.erase(due);
+      continue;
+    }
+    if (due != w->timers.end())
+      w->cv.wait_until(lk, due->first, [w]
+                       { return w->stop || !w->ops.empty(); });
+    else
+      w->cv.wait(lk, [w]
+                 { return w->stop || !w->ops.empty(); });
+    if (w->stop)
+      break;
+    if (w->ops.empty())
+      continue;
+
+    Op op = w->ops.front();
+    w->ops.pop_front();
+    if (op.kind == OP_WRITE)
+      op.conn->writeQueued = false;
+    w->current = op.conn;
+    lk.unlock();
+
+    if (!op.conn->closed)
+    {
+      if (op.kind == OP_CONNECT)
+      {
+        op.conn->ap->setLwsState(AudioPipe::LWS_CLIENT_CONNECTING);
+        op.conn->ap->onConnected();
+      }
+      else if (op.kind == OP_TIMER)
+      {
+        op.conn->ap->onTimer();
+      }
+      else
+      {
+        service(op.conn);
+      }
+    }
+
+    lk.lock();
+    w->current = nullptr;
+    w->cv.notify_all();
+  }
+}
+
+void LoopbackTransport::service(Connection *conn)
+{
+  for (int i = 0; i < MAX_WRITES_PER_OP && !conn->closed; i++)
+  {
+    PeerOutput out;
+    LoopbackFrameWriter writer(conn->ap, conn->peerState, m_peer, out);
+    AudioPipe::WriteResult_t rc = conn->ap->onWritable(writer);
+    if (writer.bytes())
+    {
+      m_bytesSent += writer.bytes();
+      m_framesSent++;
+    }
+    deliver(conn, out);
+    if (conn->closed)
+      return;
+    if (rc == AudioPipe::WRITE_CLOSE || rc == AudioPipe::WRITE_ERROR)
+    {
+      conn->closed = true;
+      conn->ap->onClosed();
+      return;
+    }
+    if (rc != AudioPipe::WRITE_MORE)
+      return;
+  }
+  if (!conn->closed)
+    enqueue(conn, OP_WRITE);
+}
+
+void LoopbackTransport::deliver(Connection *conn, PeerOutput &out)
+{
+  for (auto &msg : out.messages)
+    conn->ap->onReceive(msg.data(), msg.length(), true, true, 0);
+  if (out.close)
+  {
+    conn->closed = true;
+    conn->ap->onClosed();
+  }
+}
+
+void LoopbackTransport::enqueue(Connection *conn, OpKind_t kind)
+{
+  Worker *w = m_workers[conn->worker];
+  {
+    std::lock_guard<std::mutex> lk(w->mutex);
+    if (kind == OP_WRITE)
+    {
+      if (conn->writeQueued)
+        return;
+      conn->writeQueued = true;
+    }
+    w->ops.push_back({kind, conn});
+  }
+  w->cv.notify_all();
+}
+
+void LoopbackTransport::connect(AudioPipe *ap)
+{
+  Connection *conn = new Connection();
+  conn->ap = ap;
+  conn->worker = m_next++ % m_workers.size();
+  conn->writeQueued = false;
+  conn->closed = false;
+  conn->peerState = nullptr;
+  ap->setTransportData(conn);
+  enqueue(conn, OP_CONNECT);
+}
+
+void LoopbackTransport::requestWrite(AudioPipe *ap)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  if (conn)
+    enqueue(conn, OP_WRITE);
+}
+
+void LoopbackTransport::setTimer(AudioPipe *ap, unsigned int ms)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  if (!conn)
+    return;
+  Worker *w = m_workers[conn->worker];
+  std::lock_guard<std::mutex> lk(w->mutex);
+  w->timers.erase(std::remove_if(w->timers.begin(), w->timers.end(), [conn](const std::pair<Clock::time_point, Connection *> &t)
+                                 { return t.second == conn; }),
+                  w->timers.end());
+  w->timers.emplace_back(Clock::now() + std::chrono::milliseconds(ms), conn);
+}
+
+void LoopbackTransport::disconnect(AudioPipe *ap)
+{
+  // the pipe is now LWS_CLIENT_DISCONNECTING, so the next onWritable asks us to close
+  requestWrite(ap);
+}
+
+void LoopbackTransport::release(AudioPipe *ap)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  if (!conn)
+    return;
+  Worker *w = m_workers[conn->worker];
+  {
+    std::unique_lock<std::mutex> lk(w->mutex);
+    w->cv.wait(lk, [w, conn]
+               { return w->current != conn; });
+    w->ops.erase(std::remove_if(w->ops.begin(), w->ops.end(), [conn](const Op &op)
+                                { return op.conn == conn; }),
+                 w->ops.end());
+    w->timers.erase(std::remove_if(w->timers.begin(), w->timers.end(), [conn](const std::pair<Clock::time_point, Connection *> &t)
+                                   { return t.second == conn; }),
+                    w->timers.end());
+  }
+  m_peer->onRelease(conn->peerState);
+  ap->setTransportData(nullptr);
+  delete conn;
+}
@@ -0,0 +1,114 @@
+#ifndef __BODHI_LOOPBACK_TRANSPORT_HPP__
+#define __BODHI_LOOPBACK_TRANSPORT_HPP__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "transport.hpp"
+
+namespace bodhi
+{
+
+  // In-process transport with no sockets: frames written by a pipe are handed to a Peer
+  // on one of a small set of worker threads, and the peer's replies are fed straight back
+  // into AudioPipe::onReceive.  Used to exercise and profile the streaming engine at large
+  // session counts without FreeSWITCH or a network.
+  class LoopbackTransport : public Transport
+  {
+  public:
+    struct PeerOutput
+    {
+      std::vector<std::string> messages;
+      bool close = false;
+    };
+
+    // stand-in for the ASR service; called on the worker thread that owns the pipe
+    class Peer
+    {
+    public:
+      virtual ~Peer() {}
+      virtual void onText(AudioPipe *ap, void *&state, const char *data, size_t len, PeerOutput &out) = 0;
+      virtual void onBinary(AudioPipe *ap, void *&state, const uint8_t *data, size_t len, PeerOutput &out) = 0;
+      virtual void onRelease(void *state) = 0;
+    };
+
+    // mimics bodhi: a partial every partialEveryMs of audio, a complete every segmentMs, and a
+    // final complete followed by a close after eof.  Results carry "audio_end_ms".
+    class MockAsrPeer : public Peer
+    {
+    public:
+      MockAsrPeer(unsigned int partialEveryMs = 500, unsigned int segmentMs = 3000) : m_partialEveryMs(partialEveryMs), m_segmentMs(segmentMs) {}
+      void onText(AudioPipe *ap, void *&state, const char *data, size_t len, PeerOutput &out);
+      void onBinary(AudioPipe *ap, void *&state, const uint8_t *data, size_t len, PeerOutput &out);
+      void onRelease(void *state);
+
+    private:
+      unsigned int m_partialEveryMs;
+      unsigned int m_segmentMs;
+    };
+
+    LoopbackTransport(unsigned int nThreads, Peer *peer);
+    ~LoopbackTransport();
+
+    const char *name() const { return "loopback"; }
+    void connect(AudioPipe *ap);
+    void requestWrite(AudioPipe *ap);
+    void setTimer(AudioPipe *ap, unsigned int ms);
+    void disconnect(AudioPipe *ap);
+    void release(AudioPipe *ap);
+
+    uint64_t getBytesSent(void) { return m_bytesSent; }
+    uint64_t getFramesSent(void) { return m_framesSent; }
+
+  private:
+    struct Connection
+    {
+      AudioPipe *ap;
+      unsigned int worker;
+      bool writeQueued;
+      bool closed;
+      void *peerState;
+    };
+    enum OpKind_t
+    {
+      OP_CONNECT,
+      OP_WRITE,
+      OP_TIMER
+    };
+    struct Op
+    {
+      OpKind_t kind;
+      Connection *conn;
+    };
+    typedef std::chrono::steady_clock Clock;
+    struct Worker
+    {
+      std::mutex mutex;
+      std::condition_variable cv;
+      std::deque<Op> ops;
+      std::vector<std::pair<Clock::time_point, Connection *>> timers; // at most one per connection
+      Connection *current = nullptr;
+      bool stop = false;
+      std::thread thread;
+    };
+
+    void run(Worker *w);
+    void enqueue(Connection *conn, OpKind_t kind);
+    void service(Connection *conn);
+    void deliver(Connection *conn, PeerOutput &out);
+
+    Peer *m_peer;
+    std::vector<Worker *> m_workers;
+    std::atomic<unsigned int> m_next;
+    std::atomic<uint64_t> m_bytesSent;
+    std::atomic<uint64_t> m_framesSent;
+  };
+
+} // namespace bodhi
+#endif
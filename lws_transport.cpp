@@ -0,0 +1,835 @@
+// lws_transport.cpp
+#include "lws_transport.hpp"
+#include "audio_pipe.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstring>
+#include <chrono>
+#include <strings.h>
+#include <time.h>
+#include <vector>
+#include "dns_cache.hpp"
+#include "tenants.hpp"
+#include "utils.hpp"
+
+using namespace bodhi;
+
+namespace
+{
+  static const char *requestedTcpKeepaliveSecs = std::getenv("MOD_AUDIO_FORK_TCP_KEEPALIVE_SECS");
+  static int nTcpKeepaliveSecs = requestedTcpKeepaliveSecs ? ::atoi(requestedTcpKeepaliveSecs) : 55;
+
+  // connect admission; 0 turns a limit off
+  static const char *requestedConnectMaxInFlight = std::getenv("MOD_AUDIO_FORK_CONNECT_MAX_INFLIGHT");
+  static int nConnectMaxInFlight = std::max(0, requestedConnectMaxInFlight ? ::atoi(requestedConnectMaxInFlight) : 200);
+  static const char *requestedConnectMaxInFlightPerThread = std::getenv("MOD_AUDIO_FORK_CONNECT_MAX_INFLIGHT_PER_THREAD");
+  static int nConnectMaxInFlightPerThread = std::max(0, requestedConnectMaxInFlightPerThread ? ::atoi(requestedConnectMaxInFlightPerThread) : 100);
+  static const char *requestedConnectRate = std::getenv("MOD_AUDIO_FORK_CONNECT_RATE");
+  static int nConnectRate = std::max(0, requestedConnectRate ? ::atoi(requestedConnectRate) : 100);
+  static const char *requestedConnectBurst = std::getenv("MOD_AUDIO_FORK_CONNECT_BURST");
+  static int nConnectBurst = std::max(1, requestedConnectBurst ? ::atoi(requestedConnectBurst) : 50);
+  static const char *requestedConnectJitterMs = std::getenv("MOD_AUDIO_FORK_CONNECT_JITTER_MS");
+  static int nConnectJitterMs = std::max(0, requestedConnectJitterMs ? ::atoi(requestedConnectJitterMs) : 0);
+
+  // websocket pings: RTT per pipe, and a peer that misses this many pongs in a row is dropped; 0 secs turns them off
+  static const char *requestedWsPingSecs = std::getenv("MOD_AUDIO_FORK_WS_PING_SECS");
+  static int nWsPingSecs = std::max(0, requestedWsPingSecs ? ::atoi(requestedWsPingSecs) : 5);
+  static const char *requestedWsPingMisses = std::getenv("MOD_AUDIO_FORK_WS_PING_MISSES");
+  static int nWsPingMisses = std::max(1, requestedWsPingMisses ? ::atoi(requestedWsPingMisses) : 3);
+
+  // permessage-deflate: off, on, or no_context_takeover (a fresh window per message, less memory
+  // held per connection but a lower ratio); sessions opt in with AudioPipe::setDeflate
+  static const char *requestedDeflate = std::getenv("MOD_AUDIO_FORK_DEFLATE");
+  static bool deflateOn = requestedDeflate && 0 != strcasecmp(requestedDeflate, "off") && 0 != strcmp(requestedDeflate, "0");
+  static bool deflateNoContextTakeover = requestedDeflate && 0 == strcasecmp(requestedDeflate, "no_context_takeover");
+
+  static std::atomic<uint64_t> deflateOffered(0), deflateNegotiated(0);
+  static std::atomic<uint64_t> deflateRxWireBytes(0), deflateRxBytes(0), deflateTxBytes(0), deflateTxWireBytes(0), deflateCpuUs(0);
+
+  // set around lws_client_connect_via_info, to tell whether it failed with or without a callback
+  static thread_local void *connectingInline = nullptr;
+  static thread_local bool connectFailedInline = false;
+
+  // connects made inside beginBatch()/endBatch() on this thread, waking the service threads at the end
+  static thread_local unsigned int batchDepth = 0;
+  static thread_local uint32_t batchContexts = 0; // contexts given a connect in the batch
+
+  static uint64_t threadCpuUs(void)
+  {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+  }
+
+  // resolved address cache; 0 leaves resolution to lws on every connect
+  static const char *requestedDnsTtlSecs = std::getenv("MOD_AUDIO_FORK_DNS_TTL_SECS");
+  static int nDnsTtlSecs = std::max(0, requestedDnsTtlSecs ? ::atoi(requestedDnsTtlSecs) : 60);
+
+  class LwsFrameWriter : public FrameWriter
+  {
+  public:
+    LwsFrameWriter(struct lws *wsi) : m_wsi(wsi) {}
+    int write(uint8_t *buf, size_t len, bool binary)
+    {
+      return lws_write(m_wsi, buf, len, binary ? LWS_WRITE_BINARY : LWS_WRITE_TEXT);
+    }
+
+  private:
+    struct lws *m_wsi;
+  };
+}
+
+// static int dch_lws_http_basic_auth_gen(const char *apiKey, char *buf, size_t len) {
+// 	size_t n = strlen(apiKey);
+
+// 	if (len < n + 7)
+// 		return 1;
+
+// 	strcpy(buf,"Token ");
+//   strcpy(buf + 6, apiKey);
+// 	return 0;
+// }
+
+int LwsTransport::lws_callback(struct lws *wsi,
+                               enum lws_callback_reasons reason,
+                               void *user, void *in, size_t len)
+{
+
+  struct LwsTransport::lws_per_vhost_data *vhd =
+      (struct LwsTransport::lws_per_vhost_data *)lws_protocol_vh_priv_get(lws_get_vhost(wsi), lws_get_protocol(wsi));
+
+  Connection **ppConn = (Connection **)user;
+
+  switch (reason)
+  {
+  case LWS_CALLBACK_PROTOCOL_INIT:
+    vhd = (struct LwsTransport::lws_per_vhost_data *)lws_protocol_vh_priv_zalloc(lws_get_vhost(wsi), lws_get_protocol(wsi), sizeof(struct LwsTransport::lws_per_vhost_data));
+    vhd->context = lws_get_context(wsi);
+    vhd->protocol = lws_get_protocol(wsi);
+    vhd->vhost = lws_get_vhost(wsi);
+
+    break;
+
+  case LWS_CALLBACK_CLIENT_APPEND_HANDSHAKE_HEADER:
+  {
+    // bound to the wsi when it was created, so handshake callbacks need no lookup
+    Connection *conn = (Connection *)lws_get_opaque_user_data(wsi);
+    unsigned char **p, *end;
+    if (conn)
+    {
+      p = (unsigned char **)in;
+      end = (*p) + len;
+
+      const std::string &apiKey = conn->ap->getApiKey();
+      const std::string &customerId = conn->ap->getCustomerId();
+
+      if (lws_add_http_header_by_name(wsi, (unsigned char *)"x-customer-id:", (unsigned char *)customerId.c_str(), customerId.length(), p, end))
+        return -1;
+
+      if (lws_add_http_header_by_name(wsi, (unsigned char *)"x-api-key:", (unsigned char *)apiKey.c_str(), apiKey.length(), p, end))
+        return -1;
+    }
+  }
+  break;
+
+  case LWS_CALLBACK_CLIENT_CONFIRM_EXTENSION_SUPPORTED:
+  {
+    // only offer deflate for pipes that asked for it; nonzero leaves the extension out
+    Connection *conn = (Connection *)lws_get_opaque_user_data(wsi);
+    if (!conn || !conn->ap->getDeflate() || 0 != strcmp((const char *)in, "permessage-deflate"))
+      return 1;
+    deflateOffered++;
+    return 0;
+  }
+
+  case LWS_CALLBACK_EVENT_WAIT_CANCELLED:
+    // also woken for every write request; the connect queue is only walked when due
+    if (connectsDue[contextIndex(vhd->context)].exchange(false))
+      processPendingConnects(vhd);
+    processPendingDisconnects(vhd);
+    processPendingWrites();
+    break;
+  case LWS_CALLBACK_CLIENT_CONNECTION_ERROR:
+  {
+    Connection *conn = (Connection *)lws_get_opaque_user_data(wsi);
+    int rc = lws_http_client_http_response(wsi);
+    if (conn)
+    {
+      std::lock_guard<std::mutex> guard(mutex_connects);
+      removePendingConnect(conn);
+    }
+    if (conn && conn == connectingInline)
+      connectFailedInline = true;
+
+    lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR: %s, response status %d\n", in ? (char *)in : "(null)", rc);
+    if (conn)
+    {
+      if (!conn->address.empty())
+        DnsCache::reportFailure(conn->ap->getHost(), conn->address);
+      // a handshake slot is free: let the next queued connect go
+      scheduler.complete(conn->ticket);
+      wakeQueuedConnects();
+      uncountConnection(conn);
+      conn->ap->onConnectFail(rc);
+    }
+    else
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_CONNECTION_ERROR unable to find wsi %p..\n", wsi);
+    }
+  }
+  break;
+
+  case LWS_CALLBACK_CLIENT_ESTABLISHED:
+  {
+    Connection *conn = (Connection *)lws_get_opaque_user_data(wsi);
+    if (conn)
+    {
+      {
+        std::lock_guard<std::mutex> guard(mutex_connects);
+        removePendingConnect(conn);
+      }
+      *ppConn = conn;
+      conn->vhd = vhd;
+      scheduler.complete(conn->ticket);
+      wakeQueuedConnects();
+      if (conn->ap->getDeflate() && deflateOn)
+      {
+        // negotiation is per connection, so audio frames go through the compressor too: keep
+        // that cheap, and small when memory is what no_context_takeover is meant to save
+        lws_set_extension_option(wsi, "permessage-deflate", "compression_level", "1");
+        if (deflateNoContextTakeover)
+          lws_set_extension_option(wsi, "permessage-deflate", "mem_level", "1");
+      }
+      if (nWsPingSecs)
+        lws_sul_schedule(vhd->context, 0, &conn->pingSul, onPingTimer, (lws_usec_t)nWsPingSecs * LWS_US_PER_SEC);
+      conn->ap->onConnected();
+      // stopped while the connect was queued or in progress: close straight away
+      if (conn->ap->getLwsState() == AudioPipe::LWS_CLIENT_DISCONNECTING)
+        lws_callback_on_writable(wsi);
+    }
+    else
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_ESTABLISHED unable to find wsi %p..\n", wsi);
+    }
+  }
+  break;
+  case LWS_CALLBACK_CLIENT_CLOSED:
+  {
+    Connection *conn = *ppConn;
+    if (!conn)
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_CLOSED unable to find wsi %p..\n", wsi);
+      return 0;
+    }
+    *ppConn = nullptr;
+    lws_sul_cancel(&conn->pingSul);
+    lws_sul_cancel(&conn->timerSul);
+    uncountConnection(conn);
+    conn->ap->onClosed();
+  }
+  break;
+
+  case LWS_CALLBACK_CLIENT_RECEIVE:
+  {
+    Connection *conn = *ppConn;
+    if (!conn)
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE unable to find wsi %p..\n", wsi);
+      return 0;
+    }
+
+    if (lws_frame_is_binary(wsi))
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_RECEIVE received binary frame, discarding.\n");
+      return 0;
+    }
+
+    conn->ap->onReceive(in, len, lws_is_first_fragment(wsi), lws_is_final_fragment(wsi), lws_remaining_packet_payload(wsi));
+  }
+  break;
+
+  case LWS_CALLBACK_CLIENT_RECEIVE_PONG:
+  {
+    Connection *conn = *ppConn;
+    int64_t sentUs;
+    if (!conn || len != sizeof(sentUs))
+      return 0;
+
+    // the pong echoes the send time we put in the ping
+    memcpy(&sentUs, in, sizeof(sentUs));
+    int64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+    conn->pingsUnanswered = 0;
+    conn->ap->onPong((uint32_t)(std::max<int64_t>(0, nowUs - sentUs) / 1000));
+  }
+  break;
+
+  case LWS_CALLBACK_CLIENT_WRITEABLE:
+  {
+    Connection *conn = *ppConn;
+    if (!conn)
+    {
+      lwsl_err("LwsTransport::lws_service_thread LWS_CALLBACK_CLIENT_WRITEABLE unable to find wsi %p..\n", wsi);
+      return 0;
+    }
+
+    if (conn->pingDue)
+    {
+      // one write per writeable callback: the pipe's frames go next time
+      uint8_t buf[LWS_PRE + sizeof(int64_t)];
+      int64_t nowUs = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+      memcpy(buf + LWS_PRE, &nowUs, sizeof(nowUs));
+      conn->pingDue = false;
+      if (lws_write(wsi, buf + LWS_PRE, sizeof(nowUs), LWS_WRITE_PING) < (int)sizeof(nowUs))
+        return -1;
+      lws_callback_on_writable(wsi);
+      return 0;
+    }
+
+    LwsFrameWriter writer(wsi);
+    switch (conn->ap->onWritable(writer))
+    {
+    case AudioPipe::WRITE_MORE:
+      lws_callback_on_writable(wsi);
+      break;
+    case AudioPipe::WRITE_CLOSE:
+      lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+      return -1;
+    case AudioPipe::WRITE_ERROR:
+      return -1;
+    default:
+      break;
+    }
+
+    return 0;
+  }
+  break;
+
+  default:
+    break;
+  }
+  return lws_callback_http_dummy(wsi, reason, user, in, len);
+}
+
+int LwsTransport::deflate_callback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                                   enum lws_extension_callback_reasons reason, void *user, void *in, size_t len)
+{
+  if (reason == LWS_EXT_CB_CLIENT_CONSTRUCT)
+    deflateNegotiated++;
+  if (reason != LWS_EXT_CB_PAYLOAD_RX && reason != LWS_EXT_CB_PAYLOAD_TX)
+    return lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+
+  // eb_in is consumed as eb_out is produced, possibly over several calls per frame
+  struct lws_ext_pm_deflate_rx_ebufs *pmdrx = (struct lws_ext_pm_deflate_rx_ebufs *)in;
+  int inLen = pmdrx->eb_in.len;
+  uint64_t startUs = threadCpuUs();
+  int n = lws_extension_callback_pm_deflate(context, ext, wsi, reason, user, in, len);
+  if (n == PMDR_DID_NOTHING || n == PMDR_FAILED)
+    return n;
+
+  deflateCpuUs += threadCpuUs() - startUs;
+  uint64_t consumed = std::max(0, inLen - pmdrx->eb_in.len);
+  uint64_t produced = std::max(0, pmdrx->eb_out.len);
+  if (reason == LWS_EXT_CB_PAYLOAD_RX)
+  {
+    deflateRxWireBytes += consumed;
+    deflateRxBytes += produced;
+  }
+  else
+  {
+    deflateTxBytes += consumed;
+    deflateTxWireBytes += produced;
+  }
+  return n;
+}
+
+bool LwsTransport::deflateEnabled(void)
+{
+  return deflateOn;
+}
+
+LwsTransport::DeflateStats LwsTransport::getDeflateStats(void)
+{
+  return {deflateOffered, deflateNegotiated, deflateRxWireBytes, deflateRxBytes, deflateTxBytes, deflateTxWireBytes, deflateCpuUs};
+}
+
+// static members
+// lws' own validity pings stay off: we send our own (onPingTimer) to measure RTT
+static const lws_retry_bo_t retry = {
+    nullptr,    // retry_ms_table
+    0,          // retry_ms_table_count
+    0,          // conceal_count
+    UINT16_MAX, // secs_since_valid_ping
+    UINT16_MAX, // secs_since_valid_hangup
+    0           // jitter_percent
+};
+
+struct lws_context *LwsTransport::contexts[] = {
+    nullptr, nullptr, nullptr, nullptr, nullptr,
+    nullptr, nullptr, nullptr, nullptr, nullptr};
+unsigned int LwsTransport::numContexts = 0;
+std::atomic<unsigned int> LwsTransport::contextConnections[sizeof(contexts) / sizeof(contexts[0])];
+unsigned int LwsTransport::nchild = 0;
+std::mutex LwsTransport::mutex_connects;
+std::mutex LwsTransport::mutex_disconnects;
+std::mutex LwsTransport::mutex_writes;
+std::list<LwsTransport::Connection *> LwsTransport::pendingConnects[sizeof(contexts) / sizeof(contexts[0])];
+std::atomic<bool> LwsTransport::connectsDue[sizeof(contexts) / sizeof(contexts[0])];
+std::list<LwsTransport::Connection *> LwsTransport::pendingDisconnects;
+std::list<LwsTransport::Connection *> LwsTransport::pendingWrites;
+ConnectScheduler LwsTransport::scheduler(sizeof(contexts) / sizeof(contexts[0]));
+std::mutex LwsTransport::mapMutex;
+std::unordered_map<std::thread::id, bool> LwsTransport::stopFlags;
+std::queue<std::thread::id> LwsTransport::threadIds;
+
+LwsTransport *LwsTransport::instance(void)
+{
+  static LwsTransport transport;
+  return &transport;
+}
+
+void LwsTransport::processPendingConnects(lws_per_vhost_data *vhd)
+{
+  unsigned int context = contextIndex(vhd->context);
+  ConnectScheduler::Clock::time_point now = ConnectScheduler::Clock::now();
+  ConnectScheduler::Clock::duration retry = ConnectScheduler::Clock::duration::max();
+  std::list<Connection *> connects;
+  std::list<Connection *> cancelled;
+  {
+    std::lock_guard<std::mutex> guard(mutex_connects);
+    std::vector<Connection *> waiting;
+    for (auto it = pendingConnects[context].begin(); it != pendingConnects[context].end(); ++it)
+    {
+      if ((*it)->ap->getLwsState() != AudioPipe::LWS_CLIENT_IDLE)
+        continue;
+      if ((*it)->ap->isFinished())
+        cancelled.push_back(*it);
+      else
+        waiting.push_back(*it);
+    }
+    for (auto it = cancelled.begin(); it != cancelled.end(); ++it)
+    {
+      removePendingConnect(*it);
+      scheduler.complete((*it)->ticket);
+    }
+
+    // sessions whose audio is already buffering go first, then in arrival order
+    std::stable_partition(waiting.begin(), waiting.end(), [](Connection *conn)
+                          { return conn->ap->hasBufferedAudio(); });
+    for (auto it = waiting.begin(); it != waiting.end(); ++it)
+    {
+      // a customer over its own connect rate waits without holding up the others
+      ConnectScheduler::Clock::duration wait = Tenants::connectWait((*it)->ap->getTenant(), now);
+      if (wait > ConnectScheduler::Clock::duration::zero())
+      {
+        retry = std::min(retry, wait);
+        continue;
+      }
+      ConnectScheduler::Admit_t admit = scheduler.admit((*it)->ticket, context, now, wait);
+      if (admit == ConnectScheduler::ADMIT_NOW)
+      {
+        Tenants::takeConnect((*it)->ap->getTenant());
+        connects.push_back(*it);
+        (*it)->ap->setLwsState(AudioPipe::LWS_CLIENT_CONNECTING);
+        (*it)->ap->setConnectQueueMs(std::chrono::duration_cast<std::chrono::milliseconds>(now - (*it)->ticket.queuedAt).count());
+        continue;
+      }
+      if (wait > ConnectScheduler::Clock::duration::zero())
+        retry = std::min(retry, wait);
+      if (admit == ConnectScheduler::ADMIT_BLOCKED)
+        break;
+    }
+  }
+  for (auto it = cancelled.begin(); it != cancelled.end(); ++it)
+  {
+    (*it)->ap->onConnectCancelled();
+  }
+  for (auto it = connects.begin(); it != connects.end(); ++it)
+  {
+    connect_client(*it, vhd);
+  }
+  // held back by the rate or jitter: look again when the first one is due (a cap frees up
+  // when a handshake completes, which wakes the service loop)
+  if (retry != ConnectScheduler::Clock::duration::max())
+  {
+    lws_usec_t us = std::chrono::duration_cast<std::chrono::microseconds>(retry).count() + 1000;
+    lws_sul_schedule(vhd->context, 0, &vhd->sul, onConnectTimer, us);
+  }
+}
+
+void LwsTransport::onConnectTimer(lws_sorted_usec_list_t *sul)
+{
+  lws_per_vhost_data *vhd = lws_container_of(sul, lws_per_vhost_data, sul);
+  processPendingConnects(vhd);
+}
+
+void LwsTransport::onPingTimer(lws_sorted_usec_list_t *sul)
+{
+  Connection *conn = lws_container_of(sul, Connection, pingSul);
+
+  // counted when due rather than when written, so a path that stops draining is caught too
+  if (conn->pingsUnanswered >= (unsigned int)nWsPingMisses)
+  {
+    lwsl_notice("LwsTransport::onPingTimer %s no pong to %u pings, dropping connection\n", conn->ap->getUuid().c_str(), conn->pingsUnanswered);
+    conn->ap->onPeerTimeout();
+    lws_set_timeout(conn->wsi, PENDING_TIMEOUT_USER_OK, LWS_TO_KILL_ASYNC);
+    return;
+  }
+  conn->pingsUnanswered++;
+  conn->pingDue = true;
+  lws_callback_on_writable(conn->wsi);
+  lws_sul_schedule(conn->vhd->context, 0, &conn->pingSul, onPingTimer, (lws_usec_t)nWsPingSecs * LWS_US_PER_SEC);
+}
+
+void LwsTransport::onPipeTimer(lws_sorted_usec_list_t *sul)
+{
+  Connection *conn = lws_container_of(sul, Connection, timerSul);
+  conn->ap->onTimer();
+}
+
+void LwsTransport::processPendingDisconnects(lws_per_vhost_data *vhd)
+{
+  std::list<Connection *> disconnects;
+  {
+    std::lock_guard<std::mutex> guard(mutex_disconnects);
+    for (auto it = pendingDisconnects.begin(); it != pendingDisconnects.end(); ++it)
+    {
+      if ((*it)->ap->getLwsState() == AudioPipe::LWS_CLIENT_DISCONNECTING)
+        disconnects.push_back(*it);
+    }
+    pendingDisconnects.clear();
+  }
+  for (auto it = disconnects.begin(); it != disconnects.end(); ++it)
+  {
+    lws_callback_on_writable((*it)->wsi);
+  }
+}
+
+void LwsTransport::processPendingWrites()
+{
+  std::list<Connection *> writes;
+  {
+    std::lock_guard<std::mutex> guard(mutex_writes);
+    for (auto it = pendingWrites.begin(); it != pendingWrites.end(); ++it)
+    {
+      if ((*it)->ap->getLwsState() == AudioPipe::LWS_CLIENT_CONNECTED)
+        writes.push_back(*it);
+    }
+    pendingWrites.clear();
+  }
+  for (auto it = writes.begin(); it != writes.end(); ++it)
+  {
+    lws_callback_on_writable((*it)->wsi);
+  }
+}
+
+void LwsTransport::removePendingConnect(Connection *conn)
+{
+  if (!conn->pending)
+    return;
+  pendingConnects[conn->queue].erase(conn->pendingIt);
+  conn->pending = false;
+}
+
+void LwsTransport::wakeQueuedConnects(void)
+{
+  std::vector<unsigned int> queued;
+  {
+    std::lock_guard<std::mutex> guard(mutex_connects);
+    for (unsigned int i = 0; i < numContexts; i++)
+    {
+      if (!pendingConnects[i].empty())
+        queued.push_back(i);
+    }
+  }
+  for (auto it = queued.begin(); it != queued.end(); ++it)
+  {
+    connectsDue[*it] = true;
+    lws_cancel_service(contexts[*it]);
+  }
+}
+
+unsigned int LwsTransport::contextIndex(struct lws_context *context)
+{
+  return std::find(contexts, contexts + numContexts, context) - contexts;
+}
+
+void LwsTransport::uncountConnection(Connection *conn)
+{
+  if (conn->context < 0)
+    return;
+  contextConnections[conn->context]--;
+  conn->context = -1;
+}
+
+std::vector<unsigned int> LwsTransport::getContextConnections(void)
+{
+  std::vector<unsigned int> counts;
+  for (unsigned int i = 0; i < numContexts; i++)
+    counts.push_back(contextConnections[i]);
+  return counts;
+}
+
+void LwsTransport::connect(AudioPipe *ap)
+{
+  Connection *conn = new Connection();
+  conn->ap = ap;
+  conn->wsi = nullptr;
+  conn->vhd = nullptr;
+  conn->context = -1;
+  conn->queue = nchild++ % numContexts;
+  ap->setTransportData(conn);
+  scheduler.enqueue(conn->ticket, ConnectScheduler::Clock::now());
+  {
+    std::lock_guard<std::mutex> guard(mutex_connects);
+    std::list<Connection *> &queue = pendingConnects[conn->queue];
+    conn->pendingIt = queue.insert(queue.end(), conn);
+    conn->pending = true;
+    lwsl_debug("%s after adding connect there are %lu pending connects on context %u\n",
+               ap->getUuid().c_str(), queue.size(), conn->queue);
+  }
+  connectsDue[conn->queue] = true;
+  if (batchDepth)
+  {
+    batchContexts |= 1u << conn->queue;
+    return;
+  }
+  lws_cancel_service(contexts[conn->queue]);
+}
+
+void LwsTransport::beginBatch(void)
+{
+  if (0 == batchDepth++)
+    batchContexts = 0;
+}
+
+void LwsTransport::endBatch(void)
+{
+  if (0 == batchDepth || --batchDepth)
+    return;
+  // each context given a connect is woken once, and admits its queue up to its in-flight cap
+  for (unsigned int i = 0; i < numContexts; i++)
+  {
+    if (batchContexts & (1u << i))
+      lws_cancel_service(contexts[i]);
+  }
+  batchContexts = 0;
+}
+void LwsTransport::disconnect(AudioPipe *ap)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  {
+    std::lock_guard<std::mutex> guard(mutex_disconnects);
+    pendingDisconnects.push_back(conn);
+    lwsl_debug("%s after adding disconnect there are %lu pending disconnects\n",
+               ap->getUuid().c_str(), pendingDisconnects.size());
+  }
+  lws_cancel_service(conn->vhd->context);
+}
+void LwsTransport::requestWrite(AudioPipe *ap)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  {
+    std::lock_guard<std::mutex> guard(mutex_writes);
+    pendingWrites.push_back(conn);
+  }
+  lws_cancel_service(conn->vhd->context);
+}
+void LwsTransport::setTimer(AudioPipe *ap, unsigned int ms)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  if (conn && conn->vhd)
+    lws_sul_schedule(conn->vhd->context, 0, &conn->timerSul, onPipeTimer, (lws_usec_t)ms * 1000);
+}
+void LwsTransport::release(AudioPipe *ap)
+{
+  Connection *conn = (Connection *)ap->getTransportData();
+  if (!conn)
+    return;
+  {
+    std::lock_guard<std::mutex> guard(mutex_connects);
+    // still queued or mid-handshake
+    if (conn->pending)
+    {
+      removePendingConnect(conn);
+      scheduler.complete(conn->ticket);
+    }
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_disconnects);
+    pendingDisconnects.remove(conn);
+  }
+  {
+    std::lock_guard<std::mutex> guard(mutex_writes);
+    pendingWrites.remove(conn);
+  }
+  // destroyed without the close reaching the pipe (the transport shutting down)
+  uncountConnection(conn);
+  ap->setTransportData(nullptr);
+  delete conn;
+}
+
+bool LwsTransport::connect_client(Connection *conn, struct lws_per_vhost_data *vhd)
+{
+  AudioPipe *ap = conn->ap;
+  assert(conn->vhd == nullptr);
+  struct lws_client_connect_info i;
+
+  memset(&i, 0, sizeof(i));
+  i.context = vhd->context;
+  i.port = ap->getPort();
+  // connect to a cached address if there is one; SNI, certificate check and Host use the name
+  i.address = DnsCache::lookup(ap->getHost(), conn->address) ? conn->address.c_str() : ap->getHost().c_str();
+  i.path = ap->getPath().c_str();
+  i.host = ap->getHost().c_str();
+  i.origin = i.host;
+  i.ssl_connection = ap->getSslFlags();
+  // i.protocol = protocolName.c_str();
+  i.pwsi = &(conn->wsi);
+  i.opaque_user_data = conn;
+
+  ap->setLwsState(AudioPipe::LWS_CLIENT_CONNECTING);
+  conn->vhd = vhd;
+  conn->context = contextIndex(vhd->context);
+  contextConnections[conn->context]++;
+
+  connectingInline = conn;
+  connectFailedInline = false;
+  struct lws *wsi = lws_client_connect_via_info(&i);
+  connectingInline = nullptr;
+  if (wsi)
+  {
+    lwsl_debug("%s attempting connection, wsi is %p\n", ap->getUuid().c_str(), wsi);
+    return true;
+  }
+  if (connectFailedInline)
+    return false; // reported through LWS_CALLBACK_CLIENT_CONNECTION_ERROR, conn may be gone
+
+  // failed before a wsi existed, so no callback will come
+  lwsl_err("LwsTransport::connect_client %s failed before connecting\n", ap->getUuid().c_str());
+  {
+    std::lock_guard<std::mutex> guard(mutex_connects);
+    removePendingConnect(conn);
+  }
+  scheduler.complete(conn->ticket);
+  uncountConnection(conn);
+  ap->onConnectFail(0);
+  return false;
+}
+
+bool LwsTransport::lws_service_thread(unsigned int nServiceThread)
+{
+  struct lws_context_creation_info info;
+  std::thread::id this_id = std::this_thread::get_id();
+
+  const struct lws_protocols protocols[] = {
+      {
+          "",
+          LwsTransport::lws_callback,
+          sizeof(void *),
+          1024,
+      },
+      {NULL, NULL, 0, 0}};
+  static const struct lws_extension extensions[] = {
+      {"permessage-deflate", LwsTransport::deflate_callback, "permessage-deflate; client_max_window_bits"},
+      {NULL, NULL, NULL}};
+  static const struct lws_extension extensionsNoTakeover[] = {
+      {"permessage-deflate", LwsTransport::deflate_callback,
+       "permessage-deflate; client_no_context_takeover; server_no_context_takeover; client_max_window_bits"},
+      {NULL, NULL, NULL}};
+
+  memset(&info, 0, sizeof info);
+  info.port = CONTEXT_PORT_NO_LISTEN;
+  info.options = LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+  info.protocols = protocols;
+  info.ka_time = nTcpKeepaliveSecs; // tcp keep-alive timer
+  info.ka_probes = 4;               // number of times to try ka before closing connection
+  info.ka_interval = 5;             // time between ka's
+  info.timeout_secs = 10;           // doc says timeout for "various processes involving network roundtrips"
+  info.keepalive_timeout = 5;       // seconds to allow remote client to hold on to an idle HTTP/1.1 connection
+  info.timeout_secs_ah_idle = 10;   // secs to allow a client to hold an ah without using it
+  info.retry_and_idle_policy = &retry;
+  if (deflateOn)
+    info.extensions = deflateNoContextTakeover ? extensionsNoTakeover : extensions;
+
+  lwsl_notice("LwsTransport::lws_service_thread creating context in service thread %d.\n", nServiceThread);
+
+  contexts[nServiceThread] = lws_create_context(&info);
+  if (!contexts[nServiceThread])
+  {
+    lwsl_err("LwsTransport::lws_service_thread failed creating context in service thread %d..\n", nServiceThread);
+    return false;
+  }
+
+  int n;
+  do
+  {
+    n = lws_service(contexts[nServiceThread], 0);
+  } while (n >= 0 && !stopFlags[this_id]);
+
+  // Cleanup once work is done or stopped
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    stopFlags.erase(this_id);
+  }
+
+  lwsl_notice("LwsTransport::lws_service_thread ending in service thread %d\n", nServiceThread);
+  return true;
+}
+
+void LwsTransport::initialize(unsigned int nThreads, int loglevel, log_emit_function logger)
+{
+  assert(nThreads > 0 && nThreads <= 10);
+
+  numContexts = nThreads;
+  lws_set_log_level(loglevel, logger);
+
+  ConnectScheduler::Config config = {(unsigned int)nConnectMaxInFlight, (unsigned int)nConnectMaxInFlightPerThread,
+                                     (unsigned int)nConnectRate, (unsigned int)nConnectBurst, (unsigned int)nConnectJitterMs};
+  scheduler.configure(config);
+  DnsCache::start(nDnsTtlSecs);
+  if (deflateOn)
+    lwsl_notice("LwsTransport::initialize permessage-deflate available%s\n", deflateNoContextTakeover ? ", no context takeover" : "");
+  lwsl_notice("LwsTransport::initialize websocket ping every %d secs, peer dropped after %d missed\n", nWsPingSecs, nWsPingMisses);
+
+  lwsl_notice("LwsTransport::initialize starting %d threads\n", nThreads);
+  for (unsigned int i = 0; i < numContexts; i++)
+  {
+    std::lock_guard<std::mutex> lock(mapMutex);
+    std::thread t(&LwsTransport::lws_service_thread, i);
+    stopFlags[t.get_id()] = false;
+    threadIds.push(t.get_id());
+    t.detach();
+  }
+}
+
+bool LwsTransport::deinitialize()
+{
+  lwsl_notice("LwsTransport::deinitialize\n");
+  std::lock_guard<std::mutex> lock(mapMutex);
+  if (!threadIds.empty())
+  {
+    std::thread::id id = threadIds.front();
+    threadIds.pop();
+    stopFlags[id] = true;
+  }
+  /*
+    do
+    {
+      lwsl_notice("waiting for pending connects to complete\n");
+    } while (pendingConnects.size() > 0);
+    do
+    {
+      lwsl_notice("waiting for disconnects to complete\n");
+    } while (pendingDisconnects.size() > 0);
+  */
+  for (unsigned int i = 0; i < numContexts; i++)
+  {
+    lwsl_notice("LwsTransport::deinitialize destroying context %d of %d\n", i + 1, numContexts);
+    lws_context_destroy(contexts[i]);
+  }
+  std::this_thread::sleep_for(std::chrono::seconds(2));
+  DnsCache::stop();
+  return true;
+}
@@ -0,0 +1,130 @@
+#ifndef __BODHI_LWS_TRANSPORT_HPP__
+#define __BODHI_LWS_TRANSPORT_HPP__
+
+#include <atomic>
+#include <list>
+#include <string>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
+#include <thread>
+#include <vector>
+
+#include <libwebsockets.h>
+
+#include "connect_scheduler.hpp"
+#include "transport.hpp"
+
+namespace bodhi
+{
+
+  // libwebsockets client transport: a fixed set of lws contexts, each serviced by
+  // its own thread, shared by all pipes.
+  class LwsTransport : public Transport
+  {
+  public:
+    typedef void (*log_emit_function)(int level, const char *line);
+
+    struct lws_per_vhost_data
+    {
+      struct lws_context *context;
+      struct lws_vhost *vhost;
+      const struct lws_protocols *protocol;
+      lws_sorted_usec_list_t sul; // retries connects held back by the scheduler
+    };
+
+    static void initialize(unsigned int nThreads, int loglevel, log_emit_function logger);
+    static bool deinitialize();
+    static bool lws_service_thread(unsigned int nServiceThread);
+    static LwsTransport *instance(void);
+    static ConnectScheduler::Stats getConnectStats(void) { return scheduler.getStats(); }
+
+    // permessage-deflate totals; wire bytes are compressed, the others as the pipe sees them
+    struct DeflateStats
+    {
+      uint64_t offered;
+      uint64_t negotiated;
+      uint64_t rxWireBytes;
+      uint64_t rxBytes;
+      uint64_t txBytes;
+      uint64_t txWireBytes;
+      uint64_t cpuUs; // service thread CPU spent compressing and inflating
+    };
+    static bool deflateEnabled(void);
+    static DeflateStats getDeflateStats(void);
+    // connections on each service thread's context, from the start of the handshake until closed
+    static std::vector<unsigned int> getContextConnections(void);
+    // connects made by the calling thread in between are queued, and the service threads woken
+    // once at endBatch() rather than once per connect; batches may nest
+    static void beginBatch(void);
+    static void endBatch(void);
+
+    const char *name() const { return "lws"; }
+    void connect(AudioPipe *ap);
+    void requestWrite(AudioPipe *ap);
+    void setTimer(AudioPipe *ap, unsigned int ms);
+    void disconnect(AudioPipe *ap);
+    void release(AudioPipe *ap);
+
+  private:
+    // per-pipe connection state, stored as the pipe's transport data
+    struct Connection
+    {
+      AudioPipe *ap;
+      struct lws *wsi;
+      struct lws_per_vhost_data *vhd;
+      ConnectScheduler::Ticket ticket;
+      std::string address; // cached address connected to, empty when connecting by name
+      lws_sorted_usec_list_t pingSul; // next websocket ping while connected
+      lws_sorted_usec_list_t timerSul; // the pipe's own timer (setTimer)
+      unsigned int pingsUnanswered;
+      bool pingDue;
+      // place in pendingConnects[queue] while queued or mid-handshake, for constant time removal
+      std::list<Connection *>::iterator pendingIt;
+      bool pending;
+      unsigned int queue; // the context whose service thread admits it
+      int context; // index counted in contextConnections, -1 when not counted
+    };
+
+    static int lws_callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len);
+    static unsigned int nchild;
+    static struct lws_context *contexts[];
+    static unsigned int numContexts;
+    static std::atomic<unsigned int> contextConnections[];
+    static std::mutex mutex_connects;
+    static std::mutex mutex_disconnects;
+    static std::mutex mutex_writes;
+    // connects waiting for admission, one queue per context; connectsDue is set when the
+    // queue needs another look, so other wakeups of the service thread skip it
+    static std::list<Connection *> pendingConnects[];
+    static std::atomic<bool> connectsDue[];
+    static std::list<Connection *> pendingDisconnects;
+    static std::list<Connection *> pendingWrites;
+
+    static ConnectScheduler scheduler;
+
+    static std::mutex mapMutex;
+    static std::unordered_map<std::thread::id, bool> stopFlags;
+    static std::queue<std::thread::id> threadIds;
+
+    // with mutex_connects held
+    static void removePendingConnect(Connection *conn);
+    // service thread, before the pipe hears of the close (which may free conn)
+    static void uncountConnection(Connection *conn);
+    // a handshake slot freed up: look at every queue still holding connects
+    static void wakeQueuedConnects(void);
+    static unsigned int contextIndex(struct lws_context *context);
+    static void processPendingConnects(lws_per_vhost_data *vhd);
+    static void onConnectTimer(lws_sorted_usec_list_t *sul);
+    static void onPingTimer(lws_sorted_usec_list_t *sul);
+    static void onPipeTimer(lws_sorted_usec_list_t *sul);
+    static int deflate_callback(struct lws_context *context, const struct lws_extension *ext, struct lws *wsi,
+                                enum lws_extension_callback_reasons reason, void *user, void *in, size_t len);
+    static void processPendingDisconnects(lws_per_vhost_data *vhd);
+    static void processPendingWrites(void);
+
+    static bool connect_client(Connection *conn, struct lws_per_vhost_data *vhd);
+  };
+
+} // namespace bodhi
+#endif
@@ -14,6 +14,17 @@ SWITCH_MODULE_DEFINITION(mod_bodhi_transcribe, mod_bodhi_transcribe_load, mod_bo
 
 static switch_status_t do_stop(switch_core_session_t *session, char *bugname);
 
+/* when set, only connect/disconnect events carry the full channel data */
+static switch_bool_t lean_events = SWITCH_FALSE;
+
+static int wants_channel_data(const char *eventName)
+{
+	return !lean_events ||
+		   !strcmp(eventName, TRANSCRIBE_EVENT_CONNECT_SUCCESS) ||
+		   !strcmp(eventName, TRANSCRIBE_EVENT_CONNECT_FAIL) ||
+		   !strcmp(eventName, TRANSCRIBE_EVENT_DISCONNECT);
+}
+
 static void responseHandler(switch_core_session_t *session,
 							const char *eventName, const char *json, const char *bugname, int finished)
 {
@@ -21,7 +32,10 @@ static void responseHandler(switch_core_session_t *session,
 	switch_channel_t *channel = switch_core_session_get_channel(session);
 
 	switch_event_create_subclass(&event, SWITCH_EVENT_CUSTOM, eventName);
-	switch_channel_event_set_data(channel, event);
+	if (wants_channel_data(eventName))
+		switch_channel_event_set_data(channel, event);
+	else
+		switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "Unique-ID", switch_core_session_get_uuid(session));
 	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "transcription-vendor", "bodhi");
 	switch_event_add_header_string(event, SWITCH_STACK_BOTTOM, "transcription-session-finished", finished ? "true" : "false");
 	if (finished)
@@ -47,10 +61,9 @@ static switch_bool_t capture_callback(switch_media_bug_t *bug, void *user_data,
 
 	case SWITCH_ABC_TYPE_CLOSE:
 	{
-		private_t *tech_pvt = (private_t *)switch_core_media_bug_get_user_data(bug);
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Got SWITCH_ABC_TYPE_CLOSE.\n");
 
-		bodhi_transcribe_session_stop(session, 1, tech_pvt->bugname);
+		bodhi_transcribe_session_stop(session, 1, NULL);
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "Finished SWITCH_ABC_TYPE_CLOSE.\n");
 	}
 	break;
@@ -75,24 +88,25 @@ static switch_status_t start_capture(switch_core_session_t *session, switch_medi
 	switch_media_bug_t *bug;
 	switch_status_t status;
 	switch_codec_implementation_t read_impl = {0};
-	void *pUserData;
+	void *pUserData = NULL;
 	uint32_t samples_per_second;
 
-	if (switch_channel_get_private(channel, MY_BUG_NAME))
+	switch_core_session_get_read_impl(session, &read_impl);
+	samples_per_second = !strcasecmp(read_impl.iananame, "g722") ? read_impl.actual_samples_per_second : read_impl.samples_per_second;
+
+	/* one media bug per session: further pipes (or a restart of the same bugname) share it */
+	if ((bug = switch_channel_get_private(channel, MY_BUG_NAME)))
 	{
-		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "removing bug from previous transcribe\n");
-		do_stop(session, bugname);
+		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_DEBUG, "adding %s to existing transcribe bug\n", bugname);
+		pUserData = switch_core_media_bug_get_user_data(bug);
+		return bodhi_transcribe_session_init(session, responseHandler, samples_per_second, flags & SMBF_STEREO ? 2 : 1, modelName, interim, bugname, &pUserData);
 	}
 
-	switch_core_session_get_read_impl(session, &read_impl);
-
 	if (switch_channel_pre_answer(channel) != SWITCH_STATUS_SUCCESS)
 	{
 		return SWITCH_STATUS_FALSE;
 	}
 
-	samples_per_second = !strcasecmp(read_impl.iananame, "g722") ? read_impl.actual_samples_per_second : read_impl.samples_per_second;
-
 	if (SWITCH_STATUS_FALSE == bodhi_transcribe_session_init(session, responseHandler, samples_per_second, flags & SMBF_STEREO ? 2 : 1, modelName, interim, bugname, &pUserData))
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_ERROR, "Error initializing bodhi speech session.\n");
@@ -125,13 +139,47 @@ static switch_status_t do_stop(switch_core_session_t *session, char *bugname)
 	return status;
 }
 
-#define TRANSCRIBE_API_SYNTAX "<uuid> [start|stop] modelName [interim] [stereo|mono]"
+/* run one start|stop|reconfigure on a located session; argv as for uuid_bodhi_transcribe */
+static switch_status_t run_command(switch_core_session_t *lsession, int argc, char **argv)
+{
+	switch_status_t status = SWITCH_STATUS_FALSE;
+	switch_media_bug_flag_t flags = SMBF_READ_STREAM /* | SMBF_WRITE_STREAM | SMBF_READ_PING */;
+
+	if (!strcasecmp(argv[1], "stop"))
+	{
+		char *bugname = argc > 2 ? argv[2] : NULL;
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(lsession), SWITCH_LOG_DEBUG, "stop transcribing\n");
+		status = do_stop(lsession, bugname);
+	}
+	else if (!strcasecmp(argv[1], "start"))
+	{
+		char *modelName = argv[2];
+		int interim = argc > 3 && !strcmp(argv[3], "interim");
+		char *bugname = argc > 5 ? argv[5] : MY_BUG_NAME;
+		if (argc > 4 && !strcmp(argv[4], "stereo"))
+		{
+			flags |= SMBF_WRITE_STREAM;
+			flags |= SMBF_STEREO;
+		}
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(lsession), SWITCH_LOG_DEBUG, "start transcribing %s %s\n", modelName, interim ? "interim" : "complete");
+		status = start_capture(lsession, flags, modelName, interim, bugname);
+	}
+	else if (!strcasecmp(argv[1], "reconfigure"))
+	{
+		char *modelName = argv[2];
+		char *bugname = argc > 3 ? argv[3] : NULL;
+		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(lsession), SWITCH_LOG_DEBUG, "reconfigure transcribing %s\n", modelName);
+		status = bodhi_transcribe_session_reconfigure(lsession, modelName, bugname);
+	}
+	return status;
+}
+
+#define TRANSCRIBE_API_SYNTAX "<uuid> [start|stop|reconfigure] modelName [interim] [stereo|mono] [bugname]"
 SWITCH_STANDARD_API(bodhi_transcribe_function)
 {
 	char *mycmd = NULL, *argv[6] = {0};
 	int argc = 0;
 	switch_status_t status = SWITCH_STATUS_FALSE;
-	switch_media_bug_flag_t flags = SMBF_READ_STREAM /* | SMBF_WRITE_STREAM | SMBF_READ_PING */;
 
 	if (!zstr(cmd) && (mycmd = strdup(cmd)))
 	{
@@ -141,6 +189,7 @@ SWITCH_STANDARD_API(bodhi_transcribe_function)
 	if (zstr(cmd) ||
 		(!strcasecmp(argv[1], "stop") && argc < 2) ||
 		(!strcasecmp(argv[1], "start") && argc < 3) ||
+		(!strcasecmp(argv[1], "reconfigure") && argc < 3) ||
 		zstr(argv[0]))
 	{
 		switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_ERROR, "Error with command-new %s %s %s.\n", cmd, argv[0], argv[1]);
@@ -153,25 +202,7 @@ SWITCH_STANDARD_API(bodhi_transcribe_function)
 
 		if ((lsession = switch_core_session_locate(argv[0])))
 		{
-			if (!strcasecmp(argv[1], "stop"))
-			{
-				char *bugname = argc > 2 ? argv[2] : MY_BUG_NAME;
-				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "stop transcribing\n");
-				status = do_stop(lsession, bugname);
-			}
-			else if (!strcasecmp(argv[1], "start"))
-			{
-				char *modelName = argv[2];
-				int interim = argc > 3 && !strcmp(argv[3], "interim");
-				char *bugname = argc > 5 ? argv[5] : MY_BUG_NAME;
-				if (argc > 4 && !strcmp(argv[4], "stereo"))
-				{
-					flags |= SMBF_WRITE_STREAM;
-					flags |= SMBF_STEREO;
-				}
-				switch_log_printf(SWITCH_CHANNEL_SESSION_LOG(session), SWITCH_LOG_DEBUG, "start transcribing %s %s\n", modelName, interim ? "interim" : "complete");
-				status = start_capture(lsession, flags, modelName, interim, bugname);
-			}
+			status = run_command(lsession, argc, argv);
 			switch_core_session_rwunlock(lsession);
 		}
 	}
@@ -180,6 +211,10 @@ SWITCH_STANDARD_API(bodhi_transcribe_function)
 	{
 		stream->write_function(stream, "+OK Success\n");
 	}
+	else if (!strcasecmp(argv[1], "start") && bodhi_transcribe_draining())
+	{
+		stream->write_function(stream, "-ERR draining\n");
+	}
 	else
 	{
 		stream->write_function(stream, "-ERR Operation Failed\n");
@@ -191,6 +226,117 @@ done:
 	return SWITCH_STATUS_SUCCESS;
 }
 
+#define TRANSCRIBE_BATCH_API_SYNTAX "<uuid> [start|stop|reconfigure] ... [; <uuid> [start|stop|reconfigure] ...]..."
+SWITCH_STANDARD_API(bodhi_transcribe_batch_function)
+{
+	char *mycmd = NULL, *line, *next;
+	int total = 0, ok = 0;
+	switch_stream_handle_t results = {0};
+
+	if (zstr(cmd) || !(mycmd = strdup(cmd)))
+	{
+		stream->write_function(stream, "-USAGE: %s\n", TRANSCRIBE_BATCH_API_SYNTAX);
+		return SWITCH_STATUS_SUCCESS;
+	}
+	SWITCH_STANDARD_STREAM(results);
+
+	/* connects queue up as the sessions start and are handed to the service threads together */
+	bodhi_transcribe_batch_begin();
+	for (line = mycmd; line; line = next)
+	{
+		char *argv[6] = {0};
+		int argc;
+		switch_core_session_t *lsession;
+		switch_status_t status = SWITCH_STATUS_FALSE;
+		const char *reason = "failed";
+
+		if ((next = strpbrk(line, ";\n")))
+		{
+			*next++ = '\0';
+		}
+		argc = switch_separate_string(line, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+		if (argc == 0)
+		{
+			continue;
+		}
+		total++;
+		if (argc < 2 || (strcasecmp(argv[1], "stop") && argc < 3) ||
+			(strcasecmp(argv[1], "stop") && strcasecmp(argv[1], "start") && strcasecmp(argv[1], "reconfigure")))
+		{
+			reason = "invalid command";
+		}
+		else if (!(lsession = switch_core_session_locate(argv[0])))
+		{
+			reason = "no such channel";
+		}
+		else
+		{
+			status = run_command(lsession, argc, argv);
+			switch_core_session_rwunlock(lsession);
+			if (status != SWITCH_STATUS_SUCCESS && !strcasecmp(argv[1], "start") && bodhi_transcribe_draining())
+			{
+				reason = "draining";
+			}
+		}
+
+		if (status == SWITCH_STATUS_SUCCESS)
+		{
+			ok++;
+			results.write_function(&results, "+OK %s\n", argv[0]);
+		}
+		else
+		{
+			results.write_function(&results, "-ERR %s %s\n", argv[0], reason);
+		}
+	}
+	bodhi_transcribe_batch_end();
+
+	stream->write_function(stream, "%s %d of %d\n%s", ok == total ? "+OK" : "-ERR", ok, total, (char *)results.data);
+	switch_safe_free(results.data);
+	switch_safe_free(mycmd);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define TRANSCRIBE_FILE_API_SYNTAX "<path> <modelName> [event|file:<path>|udp:<host>:<port>|unix:<path>]"
+SWITCH_STANDARD_API(bodhi_transcribe_file_function)
+{
+	char *mycmd = NULL, *argv[3] = {0};
+	int argc = 0;
+
+	if (!zstr(cmd) && (mycmd = strdup(cmd)))
+	{
+		argc = switch_separate_string(mycmd, ' ', argv, (sizeof(argv) / sizeof(argv[0])));
+	}
+
+	if (argc < 2)
+	{
+		stream->write_function(stream, "-USAGE: %s\n", TRANSCRIBE_FILE_API_SYNTAX);
+	}
+	else
+	{
+		bodhi_transcribe_file(argv[0], argv[1], argc > 2 ? argv[2] : NULL, stream);
+	}
+
+	switch_safe_free(mycmd);
+	return SWITCH_STATUS_SUCCESS;
+}
+
+#define TRANSCRIBE_DRAIN_API_SYNTAX "on|off|status"
+SWITCH_STANDARD_API(bodhi_transcribe_drain_function)
+{
+	if (zstr(cmd) || SWITCH_STATUS_SUCCESS != bodhi_transcribe_drain(cmd, stream))
+	{
+		stream->write_function(stream, "-USAGE: %s\n", TRANSCRIBE_DRAIN_API_SYNTAX);
+	}
+	return SWITCH_STATUS_SUCCESS;
+}
+
+SWITCH_STANDARD_API(bodhi_transcribe_stats_function)
+{
+	bodhi_transcribe_stats(stream);
+	return SWITCH_STATUS_SUCCESS;
+}
+
 SWITCH_MODULE_LOAD_FUNCTION(mod_bodhi_transcribe_load)
 {
 	switch_api_interface_t *api_interface;
@@ -207,6 +353,9 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_bodhi_transcribe_load)
 
 	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "Bodhi Speech Transcription API loading..\n");
 
+	lean_events = switch_true(getenv("MOD_AUDIO_FORK_LEAN_EVENTS"));
+	switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_NOTICE, "mod_bodhi_transcribe: lean events:              %s\n", lean_events ? "on" : "off");
+
 	if (SWITCH_STATUS_FALSE == bodhi_transcribe_init())
 	{
 		switch_log_printf(SWITCH_CHANNEL_LOG, SWITCH_LOG_CRIT, "Failed initializing bodhi speech interface\n");
@@ -217,6 +366,13 @@ SWITCH_MODULE_LOAD_FUNCTION(mod_bodhi_transcribe_load)
 	SWITCH_ADD_API(api_interface, "uuid_bodhi_transcribe", "Bodhi Speech Transcription API", bodhi_transcribe_function, TRANSCRIBE_API_SYNTAX);
 	switch_console_set_complete("add uuid_bodhi_transcribe start modelName");
 	switch_console_set_complete("add uuid_bodhi_transcribe stop ");
+	SWITCH_ADD_API(api_interface, "bodhi_transcribe_batch", "Bodhi Speech Transcription API for many channels", bodhi_transcribe_batch_function, TRANSCRIBE_BATCH_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "bodhi_transcribe_file", "Bodhi file transcription", bodhi_transcribe_file_function, TRANSCRIBE_FILE_API_SYNTAX);
+	SWITCH_ADD_API(api_interface, "bodhi_transcribe_drain", "Bodhi drain for maintenance", bodhi_transcribe_drain_function, TRANSCRIBE_DRAIN_API_SYNTAX);
+	switch_console_set_complete("add bodhi_transcribe_drain on");
+	switch_console_set_complete("add bodhi_transcribe_drain off");
+	switch_console_set_complete("add bodhi_transcribe_drain status");
+	SWITCH_ADD_API(api_interface, "bodhi_transcribe_stats", "Bodhi Speech Transcription statistics", bodhi_transcribe_stats_function, "");
 
 	/* indicate that the module should continue to be loaded */
 	return SWITCH_STATUS_SUCCESS;
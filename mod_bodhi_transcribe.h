@@ -14,34 +14,45 @@
 #define TRANSCRIBE_EVENT_CONNECT_FAIL    "bodhi_transcribe::connect_failed"
 #define TRANSCRIBE_EVENT_BUFFER_OVERRUN  "bodhi_transcribe::buffer_overrun"
 #define TRANSCRIBE_EVENT_DISCONNECT      "bodhi_transcribe::disconnect"
+#define TRANSCRIBE_EVENT_RECONFIGURE     "bodhi_transcribe::reconfigure"
+#define TRANSCRIBE_EVENT_FILE_DONE       "bodhi_transcribe::file_done"
 
 #define MAX_LANG (12)
-#define MAX_SESSION_ID (256)
 #define MAX_API_KEY (256)
-#define MAX_WS_URL_LEN (512)
-#define MAX_PATH_LEN (4096)
 #define MAX_BUG_LEN (64)
+#define MAX_RESULT_SINKS (4)
+#define MAX_PIPES_PER_SESSION (4)
 
 typedef void (*responseHandler_t)(switch_core_session_t* session, const char* eventName, const char* json, const char* bugname, int finished);
 
+/* per-pipe state; connection strings are held (interned) by the AudioPipe */
 struct private_data {
-	switch_mutex_t *mutex;
-	char sessionId[MAX_SESSION_ID];
-  SpeexResamplerState *resampler;
-  responseHandler_t responseHandler;
   void *pAudioPipe;
-  int ws_state;
-  char host[MAX_WS_URL_LEN];
-  unsigned int port;
-  char path[MAX_PATH_LEN];
-  char bugname[MAX_BUG_LEN+1];
-  int sampling;
-  int  channels;
   unsigned int id;
+  int endpoint; /* index in the endpoint pool, -1 once released */
+  void *tenant; /* customer the pipe counts against, NULL once handed to the AudioPipe or released */
+  uint32_t rtt_samples; /* websocket ping round trips */
+  uint32_t rtt_max_ms;
+  uint64_t rtt_total_ms;
   int buffer_overrun_notified:1;
-  int is_finished:1;
+  int skip_event_sink:1;
+  responseHandler_t responseHandler;
+  void *resultSinks[MAX_RESULT_SINKS];
+  char bugname[MAX_BUG_LEN+1];
 };
 
 typedef struct private_data private_t;
 
+/* per-session state behind the one media bug: audio is read and resampled once per frame,
+   then copied into each pipe */
+struct capture_data {
+  switch_mutex_t *mutex;
+  SpeexResamplerState *resampler;
+  uint32_t samples_per_second; /* the channel's read rate, before resampling */
+  int channels;
+  private_t *pipes[MAX_PIPES_PER_SESSION];
+};
+
+typedef struct capture_data capture_t;
+
 #endif
\ No newline at end of file
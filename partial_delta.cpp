@@ -0,0 +1,61 @@
+// partial_delta.cpp
+#include "partial_delta.hpp"
+
+/* segments tracked at once; results rarely interleave more than two */
+#define MAX_OPEN_SEGMENTS 8
+
+using namespace bodhi;
+
+std::atomic<uint64_t> PartialDelta::partials(0);
+std::atomic<uint64_t> PartialDelta::bytesIn(0);
+std::atomic<uint64_t> PartialDelta::bytesOut(0);
+
+bool PartialDelta::encode(const std::string &msg, std::string &out)
+{
+  if (!utils::parseResult(msg.data(), msg.length(), m_fields) || m_fields.segmentId < 0)
+    return false;
+  if (m_fields.complete || m_fields.eos)
+  {
+    m_lastText.erase(m_fields.segmentId);
+    return false;
+  }
+  if (!m_fields.partial || m_fields.textStart < 0)
+    return false;
+
+  size_t closeAt = msg.rfind('}');
+  if (closeAt == std::string::npos || closeAt < (size_t)m_fields.textEnd)
+    return false;
+
+  if (m_lastText.size() >= MAX_OPEN_SEGMENTS && !m_lastText.count(m_fields.segmentId))
+    m_lastText.clear();
+  std::string &last = m_lastText[m_fields.segmentId];
+  const std::string &text = m_fields.text;
+  size_t keep = utils::utf8CommonPrefix(last.data(), last.length(), text.data(), text.length());
+  size_t keepChars = 0;
+  for (size_t i = 0; i < keep; i++)
+  {
+    if ((text[i] & 0xc0) != 0x80)
+      keepChars++;
+  }
+
+  out.clear();
+  out.reserve(msg.length() + 48);
+  out.append(msg, 0, m_fields.textStart);
+  out.append(utils::escapeJson(text.substr(keep)));
+  out.append(msg, m_fields.textEnd, closeAt - m_fields.textEnd);
+  out.append(", \"keep_bytes\": ").append(std::to_string(keep));
+  out.append(", \"keep_chars\": ").append(std::to_string(keepChars));
+  out.append(msg, closeAt, std::string::npos);
+  last = text;
+
+  partials++;
+  bytesIn += msg.length();
+  bytesOut += out.length();
+  return true;
+}
+
+PartialDelta::Stats PartialDelta::getStats(void)
+{
+  Stats stats = {partials, bytesIn, bytesOut};
+  return stats;
+}
@@ -0,0 +1,44 @@
+#ifndef __BODHI_PARTIAL_DELTA_HPP__
+#define __BODHI_PARTIAL_DELTA_HPP__
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+
+#include "utils.hpp"
+
+namespace bodhi
+{
+
+  // Turns a pipe's partial results into deltas.  Each partial repeats the whole hypothesis of
+  // its segment; encoded, its "text" holds only what follows the part it shares with the
+  // previous partial of the segment, and "keep_bytes"/"keep_chars" say how much of that one
+  // to keep (in UTF-8 bytes and in code points).  Results that close a segment, and results
+  // without a segment_id or text, pass through whole.  Used from the pipe's service thread.
+  class PartialDelta
+  {
+  public:
+    struct Stats
+    {
+      uint64_t partials;
+      uint64_t bytesIn;  // the partials as received
+      uint64_t bytesOut; // as delivered
+    };
+
+    // true with the delta in out, false to deliver msg as it is
+    bool encode(const std::string &msg, std::string &out);
+
+    static Stats getStats(void);
+
+  private:
+    std::unordered_map<long, std::string> m_lastText; // by segment_id
+    utils::ResultFields m_fields;
+
+    static std::atomic<uint64_t> partials;
+    static std::atomic<uint64_t> bytesIn;
+    static std::atomic<uint64_t> bytesOut;
+  };
+
+} // namespace bodhi
+#endif
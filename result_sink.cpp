@@ -0,0 +1,341 @@
+// result_sink.cpp
+#include "result_sink.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <libwebsockets.h>
+
+#include "utils.hpp"
+
+/* max records sent or written per system call */
+#define SINK_BATCH_SIZE 64
+/* a sink that failed to open is tried again after this long */
+#define SINK_RETRY_MS 1000
+
+using namespace bodhi;
+
+std::mutex ResultSinks::mutex;
+std::condition_variable ResultSinks::cv;
+std::deque<std::pair<ResultSink *, std::string>> ResultSinks::queue;
+std::map<std::string, ResultSink *> ResultSinks::sinks;
+std::vector<ResultSink *> ResultSinks::idle;
+std::thread ResultSinks::thread;
+size_t ResultSinks::maxQueued = 0;
+bool ResultSinks::running = false;
+ResultSinks::Stats ResultSinks::stats = {0, 0, 0, 0, 0, 0};
+
+bool ResultSink::openDue(void)
+{
+  std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+  if (now < m_retryAt)
+    return false;
+  m_retryAt = now + std::chrono::milliseconds(SINK_RETRY_MS);
+  return true;
+}
+
+DatagramSink::DatagramSink(const std::string &target) : ResultSink(target), m_fd(-1)
+{
+}
+
+DatagramSink::~DatagramSink()
+{
+  if (m_fd >= 0)
+    ::close(m_fd);
+}
+
+bool DatagramSink::open(void)
+{
+  const std::string &t = target();
+  if (0 == t.compare(0, 5, "unix:"))
+  {
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, t.c_str() + 5, sizeof(addr.sun_path) - 1);
+    m_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (m_fd >= 0 && 0 == ::connect(m_fd, (struct sockaddr *)&addr, sizeof(addr)))
+      return true;
+  }
+  else
+  {
+    // udp:<host>:<port>, an IPv6 address in brackets
+    std::string host, port;
+    utils::splitHostPort(t.substr(4), host, port);
+    struct addrinfo hints, *res = nullptr;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    if (0 == getaddrinfo(host.c_str(), port.c_str(), &hints, &res))
+    {
+      m_fd = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+      bool ok = m_fd >= 0 && 0 == ::connect(m_fd, res->ai_addr, res->ai_addrlen);
+      freeaddrinfo(res);
+      if (ok)
+        return true;
+    }
+  }
+  lwsl_err("DatagramSink::open %s failed: %s\n", t.c_str(), strerror(errno));
+  if (m_fd >= 0)
+    ::close(m_fd);
+  m_fd = -1;
+  return false;
+}
+
+size_t DatagramSink::write(const std::vector<std::string> &records)
+{
+  // a unix socket reader may not have been listening yet, or may have restarted
+  if (m_fd < 0 && (!openDue() || !open()))
+    return 0;
+
+  size_t delivered = 0;
+  struct mmsghdr msgs[SINK_BATCH_SIZE];
+  struct iovec iovs[SINK_BATCH_SIZE];
+  for (size_t i = 0; i < records.size(); i += SINK_BATCH_SIZE)
+  {
+    unsigned int n = std::min<size_t>(SINK_BATCH_SIZE, records.size() - i);
+    memset(msgs, 0, sizeof(msgs[0]) * n);
+    for (unsigned int j = 0; j < n; j++)
+    {
+      iovs[j].iov_base = (void *)records[i + j].data();
+      iovs[j].iov_len = records[i + j].length();
+      msgs[j].msg_hdr.msg_iov = &iovs[j];
+      msgs[j].msg_hdr.msg_iovlen = 1;
+    }
+    // never wait on a slow reader; what it cannot take now is counted as failed
+    int sent = sendmmsg(m_fd, msgs, n, MSG_DONTWAIT);
+    if (sent > 0)
+      delivered += sent;
+    if (sent < (int)n)
+    {
+      if (sent < 0 && (errno == ECONNREFUSED || errno == ENOENT || errno == ENOTCONN))
+      {
+        ::close(m_fd);
+        m_fd = -1;
+      }
+      break;
+    }
+  }
+  return delivered;
+}
+
+FileSink::FileSink(const std::string &target) : ResultSink(target), m_fd(-1)
+{
+}
+
+FileSink::~FileSink()
+{
+  if (m_fd >= 0)
+    ::close(m_fd);
+}
+
+size_t FileSink::write(const std::vector<std::string> &records)
+{
+  // e.g. its directory is created after the first session names it
+  if (m_fd < 0 && openDue())
+  {
+    m_fd = ::open(target().c_str() + 5, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+    if (m_fd < 0)
+      lwsl_err("FileSink::write %s failed to open: %s\n", target().c_str(), strerror(errno));
+  }
+  if (m_fd < 0)
+    return 0;
+
+  static char newline = '\n';
+  struct iovec iovs[SINK_BATCH_SIZE * 2];
+  for (size_t i = 0; i < records.size(); i += SINK_BATCH_SIZE)
+  {
+    unsigned int n = std::min<size_t>(SINK_BATCH_SIZE, records.size() - i);
+    size_t total = 0;
+    for (unsigned int j = 0; j < n; j++)
+    {
+      iovs[2 * j].iov_base = (void *)records[i + j].data();
+      iovs[2 * j].iov_len = records[i + j].length();
+      iovs[2 * j + 1].iov_base = &newline;
+      iovs[2 * j + 1].iov_len = 1;
+      total += records[i + j].length() + 1;
+    }
+    // O_APPEND keeps each writev contiguous in the file; a short write is reported as an error
+    if (writev(m_fd, iovs, n * 2) != (ssize_t)total)
+      return i;
+  }
+  return records.size();
+}
+
+void ResultSinks::start(size_t max)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (running)
+    return;
+  maxQueued = max;
+  running = true;
+  thread = std::thread(&ResultSinks::run);
+}
+
+void ResultSinks::stop(void)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running)
+      return;
+    running = false;
+  }
+  cv.notify_all();
+  thread.join();
+
+  std::lock_guard<std::mutex> lk(mutex);
+  for (auto &it : sinks)
+    delete it.second;
+  sinks.clear();
+  idle.clear();
+}
+
+ResultSink *ResultSinks::get(const std::string &target, std::string &error)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  auto it = sinks.find(target);
+  if (it != sinks.end())
+  {
+    it->second->m_refs++;
+    return it->second;
+  }
+
+  ResultSink *sink = nullptr;
+  std::string host, port;
+  if (0 == target.compare(0, 5, "unix:") && target.length() > 5)
+    sink = new DatagramSink(target);
+  else if (0 == target.compare(0, 4, "udp:") && utils::splitHostPort(target.substr(4), host, port) && !host.empty() && !port.empty())
+    sink = new DatagramSink(target);
+  else if (0 == target.compare(0, 5, "file:") && target.length() > 5)
+    sink = new FileSink(target);
+  else
+  {
+    error = "unknown result sink " + target;
+    return nullptr;
+  }
+  sink->m_refs = 1;
+  sinks[target] = sink;
+  return sink;
+}
+
+void ResultSinks::put(ResultSink *sink)
+{
+  if (!sink)
+    return;
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    // taken again and put back before the dispatcher got to it: already listed
+    if (--sink->m_refs || sink->m_idle)
+      return;
+    sink->m_idle = true;
+    idle.push_back(sink);
+  }
+  cv.notify_one();
+}
+
+void ResultSinks::hold(ResultSink *sink)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  sink->m_refs++;
+}
+
+bool ResultSinks::closeIdle(void)
+{
+  // each sink is listed once (m_idle); one taken again since stays open, one still flushing is
+  // looked at again after its next batch
+  size_t open = sinks.size();
+  idle.erase(std::remove_if(idle.begin(), idle.end(), [](ResultSink *sink)
+                            {
+                              if (sink->m_refs)
+                              {
+                                sink->m_idle = false;
+                                return true;
+                              }
+                              if (sink->m_queued)
+                                return false;
+                              sinks.erase(sink->target());
+                              delete sink;
+                              return true; }),
+             idle.end());
+  return sinks.size() != open;
+}
+
+void ResultSinks::deliver(ResultSink *sink, const std::string &record)
+{
+  {
+    std::lock_guard<std::mutex> lk(mutex);
+    if (!running || queue.size() >= maxQueued)
+    {
+      stats.dropped++;
+      return;
+    }
+    queue.emplace_back(sink, record);
+    sink->m_queued++;
+    stats.queued++;
+  }
+  cv.notify_one();
+}
+
+ResultSinks::Stats ResultSinks::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  stats.open = sinks.size();
+  return stats;
+}
+
+void ResultSinks::run(void)
+{
+  std::deque<std::pair<ResultSink *, std::string>> batch;
+  std::map<ResultSink *, std::vector<std::string>> bySink;
+  std::unique_lock<std::mutex> lk(mutex);
+  while (true)
+  {
+    cv.wait(lk, []
+            { return !running || !queue.empty() || !idle.empty(); });
+    if (queue.empty() && !running)
+      break;
+    if (queue.empty())
+    {
+      // only sinks put back, with nothing left to write
+      if (closeIdle())
+        bySink.clear();
+      continue;
+    }
+    batch.swap(queue);
+    lk.unlock();
+
+    // keep per-sink order, one write call per sink per batch
+    for (auto &rec : batch)
+      bySink[rec.first].push_back(std::move(rec.second));
+    uint64_t delivered = 0, failed = 0;
+    for (auto &it : bySink)
+    {
+      if (it.second.empty())
+        continue;
+      size_t n = it.first->write(it.second);
+      delivered += n;
+      failed += it.second.size() - n;
+    }
+    batch.clear();
+
+    lk.lock();
+    for (auto &it : bySink)
+    {
+      it.first->m_queued -= it.second.size();
+      it.second.clear();
+    }
+    // the entries of closed sinks would dangle
+    if (closeIdle())
+      bySink.clear();
+    stats.delivered += delivered;
+    stats.failed += failed;
+    stats.batches++;
+  }
+}
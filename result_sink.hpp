@@ -0,0 +1,117 @@
+#ifndef __BODHI_RESULT_SINK_HPP__
+#define __BODHI_RESULT_SINK_HPP__
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Destination for transcription results other than the FreeSWITCH event bus.  A sink is
+  // shared by every session naming the same target and is only written from the dispatcher
+  // thread, a batch at a time.  It is opened there too, on the first write, and reopened
+  // after a failure at most once per SINK_RETRY_MS.
+  class ResultSink
+  {
+  public:
+    virtual ~ResultSink() {}
+    const std::string &target(void) const { return m_target; }
+    // returns the number of records delivered, in order from the front
+    virtual size_t write(const std::vector<std::string> &records) = 0;
+
+  protected:
+    explicit ResultSink(const std::string &target) : m_target(target), m_refs(0), m_queued(0), m_idle(false) {}
+    // false while a failed open is too recent to try again
+    bool openDue(void);
+
+  private:
+    friend class ResultSinks;
+
+    std::string m_target;
+    std::chrono::steady_clock::time_point m_retryAt;
+    // ResultSinks::mutex
+    unsigned int m_refs; // get() and hold() calls not yet put() back
+    size_t m_queued;     // records queued or being written
+    bool m_idle;         // in ResultSinks::idle
+  };
+
+  // one datagram per record to udp:<host>:<port> or unix:<path>
+  class DatagramSink : public ResultSink
+  {
+  public:
+    DatagramSink(const std::string &target);
+    ~DatagramSink();
+    size_t write(const std::vector<std::string> &records);
+
+  private:
+    bool open(void);
+
+    int m_fd;
+  };
+
+  // newline-delimited records appended to file:<path>
+  class FileSink : public ResultSink
+  {
+  public:
+    FileSink(const std::string &target);
+    ~FileSink();
+    size_t write(const std::vector<std::string> &records);
+
+  private:
+    int m_fd;
+  };
+
+  // Registry of sinks and the background thread that delivers to them.  deliver() never
+  // blocks on I/O: records are queued and written in batches, and dropped (and counted)
+  // once maxQueued records are waiting.  Sinks are counted: the dispatcher closes one once
+  // every get() of it has been put() back and its queued records are written.
+  class ResultSinks
+  {
+  public:
+    struct Stats
+    {
+      uint64_t queued;
+      uint64_t delivered;
+      uint64_t dropped;
+      uint64_t failed; // records a sink could not take
+      uint64_t batches;
+      uint64_t open; // sinks in use or still flushing
+    };
+
+    static void start(size_t maxQueued);
+    static void stop(void);
+
+    // returns the sink for a udp:, unix: or file: target, creating it on first use; put() it
+    // back when no more records will be delivered to it
+    static ResultSink *get(const std::string &target, std::string &error);
+    static void put(ResultSink *sink);
+    // another reference to a sink already held, put() back the same way
+    static void hold(ResultSink *sink);
+    static void deliver(ResultSink *sink, const std::string &record);
+    static Stats getStats(void);
+
+  private:
+    static void run(void);
+    // with mutex held: closes the sinks put back that have nothing left to write; true if any
+    static bool closeIdle(void);
+
+    static std::mutex mutex;
+    static std::condition_variable cv;
+    static std::deque<std::pair<ResultSink *, std::string>> queue;
+    static std::map<std::string, ResultSink *> sinks;
+    static std::vector<ResultSink *> idle; // put() back by their last user
+    static std::thread thread;
+    static size_t maxQueued;
+    static bool running;
+    static Stats stats;
+  };
+
+} // namespace bodhi
+#endif
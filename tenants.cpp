@@ -0,0 +1,320 @@
+// tenants.cpp
+#include "tenants.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <sstream>
+
+using namespace bodhi;
+
+/* outbound bucket depth: a tenant under its rate may send this much back to back */
+#define BURST_SECS 1.0
+/* the reported outbound rate is measured over windows of this length */
+#define RATE_WINDOW_SECS 1.0
+
+class Tenants::Tenant
+{
+public:
+  Tenant(const std::string &name, const Limits &limits)
+      : name(name), limits(limits), pipes(0), rejected(0), connects(0), connectsDeferred(0), bytes(0), writesDeferred(0),
+        bytesBorrowed(0), windowBytes(0), windowKbps(0), bytesPerSec(limits.kbps * 1000.0 / 8), byteTokens(bytesPerSec * BURST_SECS),
+        capTokens(byteTokens), connectTokens(std::max(1u, limits.connectsPerSec)), lastRefill(Clock::now()), windowStart(lastRefill)
+  {
+  }
+
+  // with mutex held; rolls the rate window over as bytes are sent, so reading it changes nothing
+  void measure(Clock::time_point now)
+  {
+    double secs = std::chrono::duration<double>(now - windowStart).count();
+    if (secs < RATE_WINDOW_SECS)
+      return;
+    windowKbps = (bytes - windowBytes) * 8 / 1000.0 / secs;
+    windowBytes = bytes;
+    windowStart = now;
+  }
+
+  // with mutex held
+  double kbps(Clock::time_point now) const
+  {
+    // nothing sent to roll the window over: the rate is what the open window holds so far
+    double secs = std::chrono::duration<double>(now - windowStart).count();
+    if (secs < 2 * RATE_WINDOW_SECS)
+      return windowKbps;
+    return (bytes - windowBytes) * 8 / 1000.0 / secs;
+  }
+
+  // with mutex held
+  void refill(Clock::time_point now)
+  {
+    double secs = std::chrono::duration<double>(now - lastRefill).count();
+    lastRefill = now;
+    if (bytesPerSec > 0)
+      byteTokens = std::min(bytesPerSec * BURST_SECS, byteTokens + secs * bytesPerSec);
+    if (limits.kbps)
+    {
+      double capBytesPerSec = limits.kbps * 1000.0 / 8;
+      capTokens = std::min(capBytesPerSec * BURST_SECS, capTokens + secs * capBytesPerSec);
+    }
+    if (limits.connectsPerSec)
+      connectTokens = std::min((double)std::max(1u, limits.connectsPerSec), connectTokens + secs * limits.connectsPerSec);
+  }
+
+  const std::string name;
+  Limits limits;
+
+  // Tenants::mutex
+  unsigned int pipes;
+  uint64_t rejected;
+
+  // buckets and counters: this tenant's mutex
+  std::mutex mutex;
+  uint64_t connects;
+  uint64_t connectsDeferred;
+  uint64_t bytes;
+  uint64_t writesDeferred;
+  uint64_t bytesBorrowed;
+  uint64_t windowBytes; // bytes when the rate window started
+  double windowKbps;    // rate over the last whole window
+  double bytesPerSec;  // 0 for no cap
+  double byteTokens;   // may go below zero: a frame is sent whole once any allowance is left
+  double capTokens;    // at limits.kbps, which borrowing from the node must stay within
+  double connectTokens;
+  Clock::time_point lastRefill;
+  Clock::time_point windowStart;
+};
+
+std::mutex Tenants::mutex;
+std::unordered_map<std::string, std::unique_ptr<Tenants::Tenant>> Tenants::tenants;
+std::unordered_map<std::string, Tenants::Limits> Tenants::limits;
+Tenants::Limits Tenants::defaultLimits = {0, 0, 0, 1};
+unsigned int Tenants::totalKbps = 0;
+std::mutex Tenants::nodeMutex;
+double Tenants::nodeBytesPerSec = 0;
+double Tenants::nodeTokens = 0;
+Tenants::Clock::time_point Tenants::nodeRefill;
+
+bool Tenants::configure(const std::string &spec, unsigned int total, std::string &error)
+{
+  std::unordered_map<std::string, Limits> parsed;
+  Limits parsedDefault = {0, 0, 0, 1};
+  std::stringstream ss(spec);
+  std::string item;
+  while (std::getline(ss, item, ','))
+  {
+    item.erase(0, item.find_first_not_of(" \t"));
+    item.erase(item.find_last_not_of(" \t") + 1);
+    if (item.empty())
+      continue;
+
+    std::stringstream options(item);
+    std::string name, option;
+    std::getline(options, name, ';');
+    Limits l = {0, 0, 0, 1};
+    while (std::getline(options, option, ';'))
+    {
+      size_t eq = option.find('=');
+      int value = eq == std::string::npos ? -1 : ::atoi(option.c_str() + eq + 1);
+      std::string key = option.substr(0, eq);
+      if (value < 0 || (key == "weight" && value < 1))
+        key.clear();
+      if (key == "pipes")
+        l.maxPipes = value;
+      else if (key == "cps")
+        l.connectsPerSec = value;
+      else if (key == "kbps")
+        l.kbps = value;
+      else if (key == "weight")
+        l.weight = value;
+      else
+      {
+        error = "invalid tenant option " + option + " for " + name;
+        return false;
+      }
+    }
+    if (name.empty())
+    {
+      error = "invalid tenant " + item;
+      return false;
+    }
+    if (name == "*")
+      parsedDefault = l;
+    else
+      parsed[name] = l;
+  }
+
+  {
+    std::lock_guard<std::mutex> lk(nodeMutex);
+    if (total && 0 == nodeBytesPerSec)
+    {
+      nodeTokens = total * 1000.0 / 8 * BURST_SECS;
+      nodeRefill = Clock::now();
+    }
+    nodeBytesPerSec = total * 1000.0 / 8;
+  }
+
+  std::lock_guard<std::mutex> lk(mutex);
+  limits.swap(parsed);
+  defaultLimits = parsedDefault;
+  totalKbps = total;
+  for (auto &it : tenants)
+  {
+    auto l = limits.find(it.first);
+    it.second->limits = l != limits.end() ? l->second : defaultLimits;
+  }
+  share();
+  return true;
+}
+
+Tenants::Tenant *Tenants::find(const std::string &customerId)
+{
+  auto it = tenants.find(customerId);
+  if (it != tenants.end())
+    return it->second.get();
+  auto l = limits.find(customerId);
+  Tenant *tenant = new Tenant(customerId, l != limits.end() ? l->second : defaultLimits);
+  tenants[customerId].reset(tenant);
+  return tenant;
+}
+
+void Tenants::share(void)
+{
+  unsigned int activeWeight = 0;
+  for (auto &it : tenants)
+  {
+    if (it.second->pipes)
+      activeWeight += it.second->limits.weight;
+  }
+  for (auto &it : tenants)
+  {
+    Tenant *tenant = it.second.get();
+    double bytesPerSec = tenant->limits.kbps * 1000.0 / 8;
+    if (totalKbps && tenant->pipes)
+    {
+      double share = totalKbps * 1000.0 / 8 * tenant->limits.weight / activeWeight;
+      bytesPerSec = bytesPerSec > 0 ? std::min(bytesPerSec, share) : share;
+    }
+    std::lock_guard<std::mutex> lk(tenant->mutex);
+    if (bytesPerSec > 0 && tenant->bytesPerSec == 0)
+      tenant->byteTokens = bytesPerSec * BURST_SECS;
+    tenant->bytesPerSec = bytesPerSec;
+  }
+}
+
+Tenants::Tenant *Tenants::acquire(const std::string &customerId, bool capped, std::string &error)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  Tenant *tenant = find(customerId);
+  if (capped && tenant->limits.maxPipes && tenant->pipes >= tenant->limits.maxPipes)
+  {
+    tenant->rejected++;
+    error = "customer " + customerId + " is at its limit of " + std::to_string(tenant->limits.maxPipes) + " pipes";
+    return nullptr;
+  }
+  // shares only change as tenants come and go
+  if (0 == tenant->pipes++ && totalKbps)
+    share();
+  return tenant;
+}
+
+void Tenants::release(Tenant *tenant)
+{
+  if (!tenant)
+    return;
+  std::lock_guard<std::mutex> lk(mutex);
+  if (0 == --tenant->pipes && totalKbps)
+    share();
+}
+
+Tenants::Clock::duration Tenants::connectWait(Tenant *tenant, Clock::time_point now)
+{
+  if (!tenant || !tenant->limits.connectsPerSec)
+    return Clock::duration::zero();
+  std::lock_guard<std::mutex> lk(tenant->mutex);
+  tenant->refill(now);
+  if (tenant->connectTokens >= 1)
+    return Clock::duration::zero();
+  tenant->connectsDeferred++;
+  return std::chrono::duration_cast<Clock::duration>(std::chrono::duration<double>((1 - tenant->connectTokens) / tenant->limits.connectsPerSec));
+}
+
+void Tenants::takeConnect(Tenant *tenant)
+{
+  if (!tenant)
+    return;
+  std::lock_guard<std::mutex> lk(tenant->mutex);
+  tenant->connects++;
+  if (tenant->limits.connectsPerSec)
+    tenant->connectTokens -= 1;
+}
+
+bool Tenants::chargeNode(Clock::time_point now, size_t len, bool borrowing)
+{
+  std::lock_guard<std::mutex> lk(nodeMutex);
+  if (0 == nodeBytesPerSec)
+    return !borrowing;
+  double secs = std::chrono::duration<double>(now - nodeRefill).count();
+  nodeRefill = now;
+  nodeTokens = std::min(nodeBytesPerSec * BURST_SECS, nodeTokens + secs * nodeBytesPerSec);
+  // tenants within their shares may take it below zero; borrowers then wait for them
+  if (borrowing && nodeTokens <= 0)
+    return false;
+  nodeTokens -= len;
+  return true;
+}
+
+bool Tenants::takeBytes(Tenant *tenant, size_t len)
+{
+  if (!tenant)
+    return true;
+  std::lock_guard<std::mutex> lk(tenant->mutex);
+  Clock::time_point now = Clock::now();
+  bool borrowing = false;
+  if (tenant->bytesPerSec > 0)
+  {
+    tenant->refill(now);
+    // out of its share: what the other tenants leave unused goes to whoever asks first
+    borrowing = tenant->byteTokens <= 0;
+    if (borrowing && ((tenant->limits.kbps && tenant->capTokens <= 0) || !chargeNode(now, len, true)))
+    {
+      tenant->writesDeferred++;
+      return false;
+    }
+    if (borrowing)
+      tenant->bytesBorrowed += len;
+    else
+      tenant->byteTokens -= len;
+    if (tenant->limits.kbps)
+      tenant->capTokens -= len;
+  }
+  if (!borrowing)
+    chargeNode(now, len, false);
+  tenant->bytes += len;
+  tenant->measure(now);
+  return true;
+}
+
+std::vector<Tenants::TenantStats> Tenants::getStats(void)
+{
+  std::vector<TenantStats> stats;
+  std::lock_guard<std::mutex> lk(mutex);
+  Clock::time_point now = Clock::now();
+  for (auto &it : tenants)
+  {
+    Tenant *tenant = it.second.get();
+    std::lock_guard<std::mutex> tlk(tenant->mutex);
+    TenantStats s;
+    s.name = tenant->name.empty() ? "(none)" : tenant->name;
+    s.pipes = tenant->pipes;
+    s.maxPipes = tenant->limits.maxPipes;
+    s.rejected = tenant->rejected;
+    s.connects = tenant->connects;
+    s.connectsDeferred = tenant->connectsDeferred;
+    s.bytes = tenant->bytes;
+    s.writesDeferred = tenant->writesDeferred;
+    s.bytesBorrowed = tenant->bytesBorrowed;
+    s.kbps = tenant->kbps(now);
+    s.allowedKbps = tenant->bytesPerSec * 8 / 1000;
+    stats.push_back(s);
+  }
+  return stats;
+}
@@ -0,0 +1,92 @@
+#ifndef __BODHI_TENANTS_HPP__
+#define __BODHI_TENANTS_HPP__
+
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace bodhi
+{
+
+  // Isolation between the customers sharing a node, keyed by customer id.  Each tenant may be
+  // held to a number of open pipes (checked when a session starts), a connect rate (checked as
+  // the transport admits queued connects) and an outbound rate (checked as the transport writes
+  // audio; frames over it stay buffered and go out on a later write).  With a node-wide
+  // outbound limit, the tenants with open pipes share it in proportion to their weights, so a
+  // busy tenant is slowed to its share before the others are.  The shares are guarantees, not
+  // ceilings: a tenant out of its own allowance may still send on what the others leave unused
+  // of the node's, up to its own kbps.
+  class Tenants
+  {
+  public:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Limits
+    {
+      unsigned int maxPipes;       // open at once; 0 for no cap
+      unsigned int connectsPerSec; // 0 for no pacing
+      unsigned int kbps;           // outbound, kilobits a second; 0 for no cap
+      unsigned int weight;         // share of the node-wide outbound limit
+    };
+
+    struct TenantStats
+    {
+      std::string name;
+      unsigned int pipes;
+      unsigned int maxPipes;
+      uint64_t rejected;         // sessions refused at the pipe cap
+      uint64_t connects;
+      uint64_t connectsDeferred; // admission passes that held a connect back for the rate
+      uint64_t bytes;
+      uint64_t writesDeferred;   // writes held back for the outbound rate
+      uint64_t bytesBorrowed;    // of bytes, sent beyond its share on the node's unused allowance
+      double kbps;               // sent over the last whole rate window
+      double allowedKbps;        // current outbound allowance; 0 for no cap
+    };
+
+    class Tenant;
+
+    // comma-separated <customer id>[;pipes=n][;cps=n][;kbps=n][;weight=n]; the limits for "*"
+    // apply to each customer not listed.  totalKbps is the node-wide outbound limit, 0 for none
+    static bool configure(const std::string &spec, unsigned int totalKbps, std::string &error);
+
+    // a pipe for customerId; nullptr (and error) when a capped acquire is over the tenant's
+    // pipe limit.  release() it when the pipe is gone
+    static Tenant *acquire(const std::string &customerId, bool capped, std::string &error);
+    static void release(Tenant *tenant);
+
+    // zero if the tenant may start a connect now, otherwise how long until it may; call
+    // takeConnect() when the connect does start
+    static Clock::duration connectWait(Tenant *tenant, Clock::time_point now);
+    static void takeConnect(Tenant *tenant);
+    // false if a frame of len bytes is to be held back; true charges it to the tenant
+    static bool takeBytes(Tenant *tenant, size_t len);
+
+    static std::vector<TenantStats> getStats(void);
+
+  private:
+    static Tenant *find(const std::string &customerId);
+    // with mutex held
+    static void share(void);
+    // charges a write to the node-wide bucket; borrowing, only if the bucket has some left
+    static bool chargeNode(Clock::time_point now, size_t len, bool borrowing);
+
+    static std::mutex mutex;
+    static std::unordered_map<std::string, std::unique_ptr<Tenant>> tenants;
+    static std::unordered_map<std::string, Limits> limits;
+    static Limits defaultLimits;
+    static unsigned int totalKbps;
+
+    // node-wide bucket at totalKbps, filled as it is charged
+    static std::mutex nodeMutex;
+    static double nodeBytesPerSec; // 0 for no node limit
+    static double nodeTokens;
+    static Clock::time_point nodeRefill;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,130 @@
+// bodhi_journal_reader.cpp
+//
+// Reads the transcript journal written by mod_bodhi_transcribe (MOD_AUDIO_FORK_JOURNAL_DIR).
+// Prints one line per result:
+//
+//   <received, usecs since epoch> <ms since connect> <call id> <segment id> <result json>
+//
+// With --follow it keeps reading as records are appended and new segments are created, like
+// tail -f.  --call restricts output to one call and --since skips records received earlier.
+// --summary prints only per-segment record counts, for a quick scan of a large journal.
+
+#include "journal.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+  static bool follow = false;
+  static bool summary = false;
+  static const char *callFilter = nullptr;
+  static uint64_t sinceUs = 0;
+
+  static void print(const bodhi::JournalReader::Record &rec)
+  {
+    const bodhi::JournalRecordHeader *h = rec.header;
+    if (h->recvUs < sinceUs)
+      return;
+    if (callFilter && (strlen(callFilter) != h->callIdLen || 0 != memcmp(callFilter, rec.callId, h->callIdLen)))
+      return;
+    printf("%llu %llu %.*s %d ", (unsigned long long)h->recvUs, (unsigned long long)h->callMs, (int)h->callIdLen, rec.callId, h->segmentId);
+    fwrite(rec.json, 1, h->jsonLen, stdout);
+    fputc('\n', stdout);
+  }
+
+  // read one segment to its current end; returns true once it is sealed
+  static bool drain(bodhi::JournalReader &reader, uint64_t &count)
+  {
+    bodhi::JournalReader::Record rec;
+    while (reader.next(rec))
+    {
+      count++;
+      if (!summary)
+        print(rec);
+    }
+    return reader.isSealed();
+  }
+
+  static void usage(const char *prog)
+  {
+    fprintf(stderr, "usage: %s [--follow] [--summary] [--call uuid] [--since unix-secs] <journal-dir>\n", prog);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  const char *dir = nullptr;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--follow")
+      follow = true;
+    else if (arg == "--summary")
+      summary = true;
+    else if (arg == "--call" && i + 1 < argc)
+      callFilter = argv[++i];
+    else if (arg == "--since" && i + 1 < argc)
+      sinceUs = strtoull(argv[++i], nullptr, 10) * 1000000ULL;
+    else if (arg[0] != '-' && !dir)
+      dir = argv[i];
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!dir)
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string last;
+  while (true)
+  {
+    std::vector<std::string> segments = bodhi::JournalReader::listSegments(dir);
+    bool progressed = false;
+    for (const std::string &path : segments)
+    {
+      if (!last.empty() && path <= last)
+        continue;
+
+      bodhi::JournalReader reader;
+      if (!reader.open(path))
+      {
+        fprintf(stderr, "%s: not a journal segment\n", path.c_str());
+        last = path;
+        continue;
+      }
+      uint64_t count = 0;
+      bool sealed = drain(reader, count);
+      while (follow && !sealed)
+      {
+        // the live segment: wait for more records, or for the writer to move on
+        fflush(stdout);
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        reader.refresh();
+        sealed = drain(reader, count);
+        // a newer segment means the writer has moved on even if this one was never sealed
+        if (!sealed && bodhi::JournalReader::listSegments(dir).back() != path)
+          break;
+      }
+      if (summary)
+        printf("%s %llu records%s\n", path.c_str(), (unsigned long long)count, sealed ? "" : " (open)");
+      last = path;
+      progressed = true;
+    }
+    if (!follow)
+      break;
+    if (!progressed)
+      std::this_thread::sleep_for(std::chrono::milliseconds(200));
+    fflush(stdout);
+  }
+  return 0;
+}
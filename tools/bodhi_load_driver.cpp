@@ -0,0 +1,450 @@
+// bodhi_load_driver.cpp
+//
+// Synthetic call driver for AudioPipe.  Opens sessions in steps against a bodhi endpoint
+// (normally tools/bodhi_mock_asr_server) and feeds WAV audio to every connected session at
+// real-time pace, using the same lockAudioBuffer/binaryWritePtr/binaryWritePtrAdd/
+// unlockAudioBuffer sequence that bodhi_transcribe_frame uses.
+//
+// With --loopback the sessions use the in-process LoopbackTransport instead of websockets, which
+// profiles the buffering/framing/result engine on its own at much larger session counts.
+//
+// After each step it reports feeder lag, buffer overruns, CPU per session and the result
+// latency distribution, and stops ramping at the first step that violates the latency or
+// pacing limits.  The last healthy step is reported as the max sustainable session count.
+
+#include "audio_pipe.hpp"
+#include "lws_transport.hpp"
+#include "loopback_transport.hpp"
+
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+namespace
+{
+  typedef std::chrono::steady_clock Clock;
+
+  struct DriverOptions
+  {
+    std::string host = "127.0.0.1";
+    unsigned int port = 8080;
+    bool tls = false;
+    bool loopback = false;
+    std::string wavFile;
+    std::string model = "hi-general-v2-8khz";
+    unsigned int maxSessions = 100;
+    unsigned int stepSessions = 10;
+    unsigned int stepSecs = 10;
+    unsigned int frameMs = 20;
+    unsigned int bufferSecs = 2;
+    unsigned int serviceThreads = 1;
+    unsigned int maxP99Ms = 1000;
+    int rawRate = 8000;
+    bool deflate = false;
+  };
+
+  struct Session
+  {
+    std::string uuid;
+    bodhi::AudioPipe *ap = nullptr;
+    std::atomic<int> state{0};
+    size_t cursor = 0;
+    Clock::time_point firstAudio;
+    bool started = false;
+  };
+
+  enum SessionState
+  {
+    SESSION_CONNECTING,
+    SESSION_CONNECTED,
+    SESSION_FAILED,
+    SESSION_CLOSED
+  };
+
+  struct StepStats
+  {
+    std::mutex mutex;
+    std::vector<uint32_t> latenciesMs;
+    uint64_t results = 0;
+    uint64_t connectFailures = 0;
+    uint64_t drops = 0;
+  };
+
+  static DriverOptions opts;
+  static std::vector<int16_t> samples;
+  static int sampleRate = 8000;
+  static int channels = 1;
+  static std::mutex sessionsMutex;
+  static std::unordered_map<std::string, Session *> sessionsById;
+  static StepStats stats;
+
+  static bool loadAudio(const std::string &path)
+  {
+    std::ifstream in(path, std::ios::binary);
+    if (!in)
+      return false;
+    std::vector<char> data((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+    size_t offset = 0, len = data.size();
+
+    if (len > 12 && 0 == memcmp(&data[0], "RIFF", 4) && 0 == memcmp(&data[8], "WAVE", 4))
+    {
+      size_t pos = 12;
+      len = 0;
+      while (pos + 8 <= data.size())
+      {
+        uint32_t chunkLen;
+        memcpy(&chunkLen, &data[pos + 4], 4);
+        if (0 == memcmp(&data[pos], "fmt ", 4) && chunkLen >= 16)
+        {
+          uint16_t format, nChannels, bits;
+          uint32_t rate;
+          memcpy(&format, &data[pos + 8], 2);
+          memcpy(&nChannels, &data[pos + 10], 2);
+          memcpy(&rate, &data[pos + 12], 4);
+          memcpy(&bits, &data[pos + 22], 2);
+          if (format != 1 || bits != 16 || nChannels < 1 || nChannels > 2)
+          {
+            fprintf(stderr, "%s: only 16-bit PCM mono/stereo wav files are supported\n", path.c_str());
+            return false;
+          }
+          sampleRate = rate;
+          channels = nChannels;
+        }
+        else if (0 == memcmp(&data[pos], "data", 4))
+        {
+          offset = pos + 8;
+          len = std::min<size_t>(chunkLen, data.size() - offset);
+          break;
+        }
+        pos += 8 + chunkLen + (chunkLen & 1);
+      }
+    }
+    else
+    {
+      sampleRate = opts.rawRate;
+    }
+
+    samples.resize(len / 2 / channels * channels);
+    memcpy(samples.data(), data.data() + offset, samples.size() * 2);
+    return samples.size() >= (size_t)channels;
+  }
+
+  static long extractNumber(const char *json, const char *key)
+  {
+    const char *p = strstr(json, key);
+    if (!p)
+      return -1;
+    p = strchr(p + strlen(key), ':');
+    return p ? ::strtol(p + 1, nullptr, 10) : -1;
+  }
+
+  static void eventCallback(const char *sessionId, void *userData, bodhi::AudioPipe::NotifyEvent_t event, const char *message, bool finished)
+  {
+    Session *s = nullptr;
+    {
+      std::lock_guard<std::mutex> lk(sessionsMutex);
+      auto it = sessionsById.find(sessionId);
+      if (it != sessionsById.end())
+        s = it->second;
+    }
+    if (!s)
+      return;
+
+    switch (event)
+    {
+    case bodhi::AudioPipe::CONNECT_SUCCESS:
+      s->state = SESSION_CONNECTED;
+      break;
+    case bodhi::AudioPipe::CONNECT_FAIL:
+    {
+      s->state = SESSION_FAILED;
+      std::lock_guard<std::mutex> lk(stats.mutex);
+      stats.connectFailures++;
+    }
+    break;
+    case bodhi::AudioPipe::CONNECTION_DROPPED:
+    case bodhi::AudioPipe::CONNECTION_CLOSED_GRACEFULLY:
+      s->state = SESSION_CLOSED;
+      break;
+    case bodhi::AudioPipe::MESSAGE:
+    {
+      long audioEndMs = extractNumber(message, "\"audio_end_ms\"");
+      if (audioEndMs < 0 || !s->started)
+        break;
+      // audio is fed in real time, so the audio at offset audioEndMs was sent at firstAudio + audioEndMs
+      auto sent = s->firstAudio + std::chrono::milliseconds(audioEndMs);
+      long latency = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - sent).count();
+      std::lock_guard<std::mutex> lk(stats.mutex);
+      stats.results++;
+      stats.latenciesMs.push_back(std::max(0L, latency));
+    }
+    break;
+    default:
+      break;
+    }
+  }
+
+  static void logger(int level, const char *line)
+  {
+    fprintf(stderr, "%s", line);
+  }
+
+  static Session *startSession(unsigned int idx)
+  {
+    Session *s = new Session();
+    s->uuid = "load-" + std::to_string(idx);
+
+    size_t frameBytes = sampleRate / 1000 * opts.frameMs * 2 * channels;
+    size_t buflen = LWS_PRE + sampleRate * 2 * channels * opts.bufferSecs;
+    s->ap = new bodhi::AudioPipe(s->uuid.c_str(), opts.host.c_str(), opts.port, "", buflen, frameBytes,
+                                 "load-test-key", "load-test-customer", sampleRate, opts.model.c_str(), eventCallback);
+    s->ap->setSslFlags(opts.tls ? LCCSCF_USE_SSL | LCCSCF_ALLOW_SELFSIGNED | LCCSCF_SKIP_SERVER_CERT_HOSTNAME_CHECK : 0);
+    s->ap->setDeflate(opts.deflate);
+    {
+      std::lock_guard<std::mutex> lk(sessionsMutex);
+      sessionsById[s->uuid] = s;
+    }
+    s->ap->connect();
+    return s;
+  }
+
+  // push one frame of audio into the session, exactly as bodhi_transcribe_frame does for a media bug read
+  static void feed(Session *s, size_t frameSamples)
+  {
+    bodhi::AudioPipe *ap = s->ap;
+    ap->lockAudioBuffer();
+    size_t frameBytes = frameSamples * 2;
+    if (ap->binarySpaceAvailable() < std::max(frameBytes, ap->binaryMinSpace()))
+    {
+      {
+        std::lock_guard<std::mutex> lk(stats.mutex);
+        stats.drops++;
+      }
+      ap->binaryMakeSpace(std::max(frameBytes, ap->binaryMinSpace()));
+    }
+    int16_t *out = (int16_t *)ap->binaryWritePtr();
+    for (size_t i = 0; i < frameSamples; i++)
+    {
+      out[i] = samples[s->cursor++];
+      if (s->cursor == samples.size())
+        s->cursor = 0;
+    }
+    ap->binaryWritePtrAdd(frameBytes);
+    ap->unlockAudioBuffer();
+    if (!s->started)
+    {
+      s->firstAudio = Clock::now();
+      s->started = true;
+    }
+  }
+
+  static uint32_t percentile(std::vector<uint32_t> &v, double pct)
+  {
+    if (v.empty())
+      return 0;
+    size_t idx = std::min(v.size() - 1, (size_t)(pct / 100.0 * v.size()));
+    return v[idx];
+  }
+
+  static double cpuSeconds()
+  {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec + (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+  }
+
+  static void usage(const char *prog)
+  {
+    fprintf(stderr,
+            "usage: %s --wav file [--host h] [--port n] [--tls] [--loopback] [--model name] [--max-sessions n]\n"
+            "          [--step n] [--step-secs n] [--frame-ms n] [--buffer-secs n] [--threads n]\n"
+            "          [--max-p99-ms n] [--raw-rate n] [--deflate]\n",
+            prog);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--host" && hasValue)
+      opts.host = argv[++i];
+    else if (arg == "--port" && hasValue)
+      opts.port = ::atoi(argv[++i]);
+    else if (arg == "--tls")
+      opts.tls = true;
+    else if (arg == "--loopback")
+      opts.loopback = true;
+    else if (arg == "--wav" && hasValue)
+      opts.wavFile = argv[++i];
+    else if (arg == "--model" && hasValue)
+      opts.model = argv[++i];
+    else if (arg == "--max-sessions" && hasValue)
+      opts.maxSessions = std::max(1, ::atoi(argv[++i]));
+    else if (arg == "--step" && hasValue)
+      opts.stepSessions = std::max(1, ::atoi(argv[++i]));
+    else if (arg == "--step-secs" && hasValue)
+      opts.stepSecs = std::max(2, ::atoi(argv[++i]));
+    else if (arg == "--frame-ms" && hasValue)
+      opts.frameMs = std::max(10, ::atoi(argv[++i]));
+    else if (arg == "--buffer-secs" && hasValue)
+      opts.bufferSecs = std::max(1, ::atoi(argv[++i]));
+    else if (arg == "--threads" && hasValue)
+      opts.serviceThreads = std::max(1, std::min(::atoi(argv[++i]), 10));
+    else if (arg == "--max-p99-ms" && hasValue)
+      opts.maxP99Ms = ::atoi(argv[++i]);
+    else if (arg == "--raw-rate" && hasValue)
+      opts.rawRate = ::atoi(argv[++i]);
+    else if (arg == "--deflate")
+      opts.deflate = true;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (opts.wavFile.empty() || !loadAudio(opts.wavFile))
+  {
+    usage(argv[0]);
+    return 1;
+  }
+
+  bodhi::LoopbackTransport::MockAsrPeer peer;
+  bodhi::LoopbackTransport *loopback = nullptr;
+  if (opts.loopback)
+  {
+    lws_set_log_level(LLL_ERR | LLL_WARN, logger);
+    loopback = new bodhi::LoopbackTransport(opts.serviceThreads, &peer);
+    bodhi::AudioPipe::setDefaultTransport(loopback);
+  }
+  else
+  {
+    bodhi::LwsTransport::initialize(opts.serviceThreads, LLL_ERR | LLL_WARN, logger);
+    bodhi::AudioPipe::setDefaultTransport(bodhi::LwsTransport::instance());
+    std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  }
+
+  const size_t frameSamples = sampleRate / 1000 * opts.frameMs * channels;
+  const auto period = std::chrono::milliseconds(opts.frameMs);
+  std::vector<Session *> sessions;
+  unsigned int maxSustainable = 0;
+
+  printf("# sessions connected failed drops max_lag_ms late_ticks cpu_pct_per_session results p50_ms p90_ms p99_ms max_ms\n");
+  while (sessions.size() < opts.maxSessions)
+  {
+    unsigned int target = std::min<unsigned int>(opts.maxSessions, sessions.size() + opts.stepSessions);
+    while (sessions.size() < target)
+      sessions.push_back(startSession(sessions.size()));
+
+    {
+      std::lock_guard<std::mutex> lk(stats.mutex);
+      stats.latenciesMs.clear();
+      stats.results = stats.connectFailures = stats.drops = 0;
+    }
+    double cpuStart = cpuSeconds();
+    auto stepStart = Clock::now();
+    auto stepEnd = stepStart + std::chrono::seconds(opts.stepSecs);
+    auto tick = stepStart;
+    long maxLagMs = 0;
+    unsigned int lateTicks = 0;
+
+    while (tick < stepEnd)
+    {
+      tick += period;
+      std::this_thread::sleep_until(tick);
+      long lag = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - tick).count();
+      maxLagMs = std::max(maxLagMs, lag);
+      if (lag >= (long)opts.frameMs)
+        lateTicks++;
+      for (Session *s : sessions)
+      {
+        if (s->state == SESSION_CONNECTED)
+          feed(s, frameSamples);
+      }
+    }
+
+    double elapsed = std::chrono::duration<double>(Clock::now() - stepStart).count();
+    unsigned int connected = 0, failed = 0;
+    for (Session *s : sessions)
+    {
+      if (s->state == SESSION_CONNECTED)
+        connected++;
+      else if (s->state == SESSION_FAILED)
+        failed++;
+    }
+    double cpuPct = connected ? 100.0 * (cpuSeconds() - cpuStart) / elapsed / connected : 0.0;
+
+    std::vector<uint32_t> latencies;
+    uint64_t results, drops;
+    {
+      std::lock_guard<std::mutex> lk(stats.mutex);
+      latencies.swap(stats.latenciesMs);
+      results = stats.results;
+      drops = stats.drops;
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint32_t p99 = percentile(latencies, 99);
+
+    printf("%zu %u %u %lu %ld %u %.3f %lu %u %u %u %u\n", sessions.size(), connected, failed, (unsigned long)drops,
+           maxLagMs, lateTicks, cpuPct, (unsigned long)results, percentile(latencies, 50), percentile(latencies, 90), p99,
+           latencies.empty() ? 0 : latencies.back());
+    fflush(stdout);
+
+    bool healthy = failed == 0 && drops == 0 && lateTicks == 0 && connected == sessions.size() && p99 <= opts.maxP99Ms;
+    if (!healthy)
+      break;
+    maxSustainable = sessions.size();
+  }
+
+  printf("max_sustainable_sessions %u\n", maxSustainable);
+
+  for (Session *s : sessions)
+  {
+    if (s->state == SESSION_CONNECTED)
+      s->ap->finish();
+  }
+  auto deadline = Clock::now() + std::chrono::seconds(5);
+  while (Clock::now() < deadline &&
+         std::any_of(sessions.begin(), sessions.end(), [](Session *s)
+                     { return s->state == SESSION_CONNECTED; }))
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+
+  // pipes that are still connected may yet be referenced by a service thread, so only those that closed are freed
+  for (Session *s : sessions)
+  {
+    if (s->state == SESSION_CLOSED || s->state == SESSION_FAILED)
+    {
+      delete s->ap;
+      delete s;
+    }
+  }
+
+  if (loopback)
+    printf("loopback_bytes_sent %lu\n", (unsigned long)loopback->getBytesSent());
+  else
+  {
+    if (bodhi::LwsTransport::deflateEnabled())
+    {
+      bodhi::LwsTransport::DeflateStats deflate = bodhi::LwsTransport::getDeflateStats();
+      printf("deflate negotiated %lu rx_wire_bytes %lu rx_bytes %lu tx_bytes %lu tx_wire_bytes %lu cpu_ms %lu\n",
+             (unsigned long)deflate.negotiated, (unsigned long)deflate.rxWireBytes, (unsigned long)deflate.rxBytes,
+             (unsigned long)deflate.txBytes, (unsigned long)deflate.txWireBytes, (unsigned long)(deflate.cpuUs / 1000));
+    }
+    bodhi::LwsTransport::deinitialize();
+  }
+  return 0;
+}
@@ -0,0 +1,257 @@
+// bodhi_microbench.cpp
+//
+// Microbenchmarks for the code that runs on every media frame or every result message:
+//
+//   frame_copy      - the no-resample path of bodhi_transcribe_frame (copy into the AudioPipe buffer)
+//   frame_resample  - the speex resample path of bodhi_transcribe_frame (down to 8 kHz, once, then copied
+//                     into 1 or MAX_PIPES_PER_SESSION pipes)
+//   has_json_key    - utils::hasJsonKey on real bodhi result payloads
+//   config_message  - JSON built in LWS_CALLBACK_CLIENT_ESTABLISHED
+//   connect_fail    - JSON built in LWS_CALLBACK_CLIENT_CONNECTION_ERROR
+//   encode_uri      - utils::encodeURIComponent
+//
+// Each benchmark prints one JSON object per line so that runs of different builds can be diffed
+// or loaded into a spreadsheet, e.g.
+//   {"bench":"frame_resample","params":"16000hz/1ch/1pipe","iterations":123456,"ns_per_op":812.4,"mb_per_sec":39.4}
+
+#include "audio_pipe.hpp"
+#include "loopback_transport.hpp"
+#include "utils.hpp"
+
+#include <speex/speex_resampler.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <vector>
+
+#define RTP_PACKETIZATION_PERIOD 20
+#define FRAME_SIZE_8000 320
+#define DESIRED_SAMPLING 8000
+#define RESAMPLE_QUALITY 2 /* SWITCH_RESAMPLE_QUALITY */
+#define RECOMMENDED_BUFFER_SIZE 8192 /* SWITCH_RECOMMENDED_BUFFER_SIZE */
+#define MAX_PIPES_PER_SESSION 4 /* mod_bodhi_transcribe.h */
+
+namespace
+{
+  typedef std::chrono::steady_clock Clock;
+
+  static double minSecs = 0.5;
+  static const char *filter = nullptr;
+  static volatile size_t sink;
+
+  static const char *partialResult =
+      "{\"call_id\": \"4f6d8d5a-2b9e-4c55-9a52-6a1f4a4b7c11\", \"segment_id\": \"3\", \"eos\": false, "
+      "\"type\": \"partial\", \"text\": \"namaste main aapki kya madad kar sakta hoon\"}";
+  static const char *completeResult =
+      "{\"call_id\": \"4f6d8d5a-2b9e-4c55-9a52-6a1f4a4b7c11\", \"segment_id\": \"3\", \"eos\": false, "
+      "\"type\": \"complete\", \"text\": \"namaste main aapki kya madad kar sakta hoon mujhe apne account ke "
+      "baare mein jaankari chahiye\", \"start_time\": 12.48, \"end_time\": 17.92}";
+  static const char *errorResult =
+      "{\"error\": \"Invalid model name hi-general-feb24-v9-8khz\", \"code\": 400}";
+
+  // run fn in batches until minSecs has elapsed, then report the per-op cost
+  static void run(const char *bench, const std::string &params, size_t bytesPerOp, const std::function<void()> &fn)
+  {
+    if (filter && !strstr(bench, filter))
+      return;
+
+    for (int i = 0; i < 100; i++)
+      fn();
+
+    uint64_t iterations = 0;
+    uint64_t batch = 64;
+    auto start = Clock::now();
+    double elapsed = 0;
+    while (elapsed < minSecs)
+    {
+      for (uint64_t i = 0; i < batch; i++)
+        fn();
+      iterations += batch;
+      if (batch < (1 << 20))
+        batch <<= 1;
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    double nsPerOp = elapsed * 1e9 / iterations;
+    printf("{\"bench\":\"%s\",\"params\":\"%s\",\"iterations\":%lu,\"ns_per_op\":%.1f", bench, params.c_str(),
+           (unsigned long)iterations, nsPerOp);
+    if (bytesPerOp)
+      printf(",\"mb_per_sec\":%.1f", bytesPerOp * iterations / elapsed / 1e6);
+    printf("}\n");
+    fflush(stdout);
+  }
+
+  static void notifyNothing(const char *, void *, bodhi::AudioPipe::NotifyEvent_t, const char *, bool) {}
+
+  static bodhi::LoopbackTransport::MockAsrPeer peer;
+  static bodhi::LoopbackTransport transport(1, &peer);
+
+  static bodhi::AudioPipe *makePipe(int channels, bodhi::AudioPipe::OverrunPolicy_t policy = bodhi::AudioPipe::OVERRUN_RESET)
+  {
+    // same sizing as fork_data_init; the pipe is never connected so unlockAudioBuffer does not schedule writes
+    size_t buflen = LWS_PRE + (FRAME_SIZE_8000 * DESIRED_SAMPLING / 8000 * channels * 1000 / RTP_PACKETIZATION_PERIOD * 2);
+    bodhi::AudioPipe *ap = new bodhi::AudioPipe("bench", "localhost", 443, "", buflen, FRAME_SIZE_8000 * channels, "key", "customer",
+                                                DESIRED_SAMPLING, "model", notifyNothing, &transport);
+    ap->setChannels(channels);
+    ap->setOverrunPolicy(policy, 1000, buflen);
+    return ap;
+  }
+
+  static std::vector<int16_t> makeFrame(int rate, int channels)
+  {
+    size_t samples = rate / 1000 * RTP_PACKETIZATION_PERIOD * channels;
+    std::vector<int16_t> frame(samples);
+    for (size_t i = 0; i < samples; i++)
+      frame[i] = (int16_t)(((i * 7919) % 65536) - 32768) / 4;
+    return frame;
+  }
+
+  static void benchFrameCopy(int rate, int channels)
+  {
+    bodhi::AudioPipe *ap = makePipe(channels);
+    std::vector<int16_t> frame = makeFrame(rate, channels);
+    size_t bytes = frame.size() * 2;
+
+    run("frame_copy", std::to_string(rate) + "hz/" + std::to_string(channels) + "ch", bytes, [&]()
+        {
+      ap->lockAudioBuffer();
+      ap->binaryMakeSpace(std::max(bytes, ap->binaryMinSpace()));
+      memcpy(ap->binaryWritePtr(), frame.data(), bytes);
+      ap->binaryWritePtrAdd(bytes);
+      ap->unlockAudioBuffer(); });
+    delete ap;
+  }
+
+  // a pipe whose peer has stopped reading: every frame overruns and the policy has to make room
+  static void benchFrameOverrun(bodhi::AudioPipe::OverrunPolicy_t policy)
+  {
+    bodhi::AudioPipe *ap = makePipe(1, policy);
+    std::vector<int16_t> frame = makeFrame(DESIRED_SAMPLING, 1);
+    size_t bytes = frame.size() * 2;
+
+    run("frame_overrun", bodhi::AudioPipe::overrunPolicyName(policy), bytes, [&]()
+        {
+      ap->lockAudioBuffer();
+      ap->binaryMakeSpace(bytes);
+      memcpy(ap->binaryWritePtr(), frame.data(), bytes);
+      ap->binaryWritePtrAdd(bytes);
+      ap->unlockAudioBuffer(); });
+    delete ap;
+  }
+
+  // as bodhi_transcribe_frame with a resampler: resample once into a local buffer, then copy
+  // the frame into each of the session's pipes the way write_to_pipe does
+  static void benchFrameResample(int rate, int channels, int npipes)
+  {
+    int err;
+    std::vector<bodhi::AudioPipe *> pipes;
+    for (int i = 0; i < npipes; i++)
+      pipes.push_back(makePipe(channels));
+    std::vector<int16_t> frame = makeFrame(rate, channels);
+    SpeexResamplerState *resampler = speex_resampler_init(channels, rate, DESIRED_SAMPLING, RESAMPLE_QUALITY, &err);
+    if (0 != err)
+    {
+      fprintf(stderr, "speex_resampler_init: %s\n", speex_resampler_strerror(err));
+      exit(1);
+    }
+
+    run("frame_resample", std::to_string(rate) + "hz/" + std::to_string(channels) + "ch/" + std::to_string(npipes) + (npipes == 1 ? "pipe" : "pipes"),
+        frame.size() * 2, [&]()
+        {
+      spx_int16_t resampled[RECOMMENDED_BUFFER_SIZE];
+      spx_uint32_t out_len = RECOMMENDED_BUFFER_SIZE / channels;
+      spx_uint32_t in_len = frame.size() / channels;
+      speex_resampler_process_interleaved_int(resampler, frame.data(), &in_len, resampled, &out_len);
+      size_t len = out_len * 2 * channels;
+      for (bodhi::AudioPipe *ap : pipes)
+      {
+        ap->lockAudioBuffer();
+        size_t needed = std::max(len, ap->binaryMinSpace());
+        if (ap->binarySpaceAvailable() < needed)
+          ap->binaryMakeSpace(needed);
+        size_t n = std::min(len, ap->binarySpaceAvailable());
+        memcpy(ap->binaryWritePtr(), resampled, n);
+        ap->binaryWritePtrAdd(n);
+        ap->unlockAudioBuffer();
+      } });
+    speex_resampler_destroy(resampler);
+    for (bodhi::AudioPipe *ap : pipes)
+      delete ap;
+  }
+
+  static void usage(const char *prog)
+  {
+    fprintf(stderr, "usage: %s [--min-secs n] [--filter substring]\n", prog);
+  }
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    if (arg == "--min-secs" && i + 1 < argc)
+      minSecs = atof(argv[++i]);
+    else if (arg == "--filter" && i + 1 < argc)
+      filter = argv[++i];
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  const int rates[] = {8000, 16000, 48000};
+  for (int rate : rates)
+  {
+    for (int channels = 1; channels <= 2; channels++)
+    {
+      benchFrameCopy(rate, channels);
+      if (rate != DESIRED_SAMPLING)
+      {
+        benchFrameResample(rate, channels, 1);
+        benchFrameResample(rate, channels, MAX_PIPES_PER_SESSION);
+      }
+    }
+  }
+  benchFrameOverrun(bodhi::AudioPipe::OVERRUN_RESET);
+  benchFrameOverrun(bodhi::AudioPipe::OVERRUN_DROP_OLDEST);
+  benchFrameOverrun(bodhi::AudioPipe::OVERRUN_MAX_AGE);
+
+  const struct
+  {
+    const char *name;
+    const char *json;
+    const char *key;
+  } payloads[] = {
+      {"partial", partialResult, "error"},
+      {"complete", completeResult, "error"},
+      {"error", errorResult, "error"},
+  };
+  for (auto &p : payloads)
+  {
+    run("has_json_key", p.name, strlen(p.json), [&]()
+        { sink += utils::hasJsonKey(p.json, p.key); });
+  }
+
+  std::string uuid = "4f6d8d5a-2b9e-4c55-9a52-6a1f4a4b7c11";
+  std::string model = "hi-general-feb24-v1-8khz";
+  run("config_message", "8000hz", 0, [&]()
+      { sink += utils::buildConfigMessage(DESIRED_SAMPLING, uuid, model).length(); });
+  run("connect_fail", "401", 0, [&]()
+      { sink += utils::buildConnectFailMessage(401).length(); });
+
+  std::string plain = "hi-general-feb24-v1-8khz";
+  std::string mixed = "customer id/with spaces&symbols=yes?x=1#frag";
+  run("encode_uri", "plain", plain.length(), [&]()
+      { sink += utils::encodeURIComponent(plain).length(); });
+  run("encode_uri", "mixed", mixed.length(), [&]()
+      { sink += utils::encodeURIComponent(mixed).length(); });
+
+  return 0;
+}
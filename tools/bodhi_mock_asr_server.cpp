@@ -0,0 +1,455 @@
+// bodhi_mock_asr_server.cpp
+//
+// Local stand-in for the bodhi streaming ASR endpoint, used for load testing AudioPipe
+// without a live FreeSWITCH box or network access to bodhi.navana.ai.
+//
+// It accepts the same protocol as the real service: a JSON config text frame, followed by
+// binary PCM frames and finally {"eof": "1"}.  Partial and complete results are emitted
+// based on the amount of audio received, delayed by a configurable latency.  Each result
+// carries "audio_end_ms" (the amount of audio consumed when it was produced) so that
+// clients can measure end-to-end result latency.
+//
+// With --instances n it listens on n consecutive ports, each an independent "gateway" with
+// its own latency, to exercise the module's endpoint pool: an instance can be made to reject
+// every handshake (--fail-instance), or to go away and come back (--down), which closes its
+// listener and drops its connections.
+
+#include <libwebsockets.h>
+
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <deque>
+#include <string>
+#include <vector>
+
+namespace
+{
+  struct MockOptions
+  {
+    int port = 8080;
+    const char *cert = nullptr;
+    const char *key = nullptr;
+    unsigned int instances = 1;
+    bool deflate = false;
+    std::vector<unsigned int> latencyMs{100}; // per instance, the last one repeating
+    unsigned int partialEveryMs = 500;
+    unsigned int segmentMs = 3000;
+    int logLevel = LLL_ERR | LLL_WARN | LLL_NOTICE;
+  };
+
+  struct MockInstance
+  {
+    int index = 0;
+    int port = 0;
+    unsigned int latencyMs = 0;
+    bool failing = false; // reject every handshake
+    long downAtSecs = -1; // take the listener away for a while
+    long upAtSecs = -1;
+    struct lws_vhost *vhost = nullptr;
+    std::string name;
+  };
+
+  struct PendingResult
+  {
+    std::chrono::steady_clock::time_point due;
+    std::string json;
+  };
+
+  struct MockSession
+  {
+    MockInstance *instance = nullptr;
+    bool configured = false;
+    bool eof = false;
+    std::string callId;
+    int sampleRate = 8000;
+    uint64_t audioBytes = 0;
+    uint64_t lastPartialMs = 0;
+    uint64_t segmentStartMs = 0;
+    unsigned int segment = 0;
+    std::string rx;
+    std::deque<PendingResult> results;
+  };
+
+  static MockOptions opts;
+  static std::vector<MockInstance> instances;
+  static volatile sig_atomic_t interrupted = 0;
+
+  static void sigint_handler(int)
+  {
+    interrupted = 1;
+  }
+
+  static std::string extractString(const std::string &json, const char *key)
+  {
+    std::string needle = std::string("\"") + key + "\"";
+    size_t pos = json.find(needle);
+    if (pos == std::string::npos)
+      return "";
+    pos = json.find('"', json.find(':', pos + needle.length()) + 1);
+    if (pos == std::string::npos)
+      return "";
+    size_t end = json.find('"', pos + 1);
+    return end == std::string::npos ? "" : json.substr(pos + 1, end - pos - 1);
+  }
+
+  static long extractNumber(const std::string &json, const char *key, long def)
+  {
+    std::string needle = std::string("\"") + key + "\"";
+    size_t pos = json.find(needle);
+    if (pos == std::string::npos)
+      return def;
+    pos = json.find(':', pos + needle.length());
+    return pos == std::string::npos ? def : ::strtol(json.c_str() + pos + 1, nullptr, 10);
+  }
+
+  static std::string hypothesis(uint64_t ms)
+  {
+    // one "word" for every 300ms of audio in the current segment
+    std::string text;
+    for (uint64_t i = 0; i < ms / 300; i++)
+    {
+      if (!text.empty())
+        text += ' ';
+      text += "word" + std::to_string(i);
+    }
+    return text;
+  }
+
+  static void scheduleNext(struct lws *wsi, MockSession *s)
+  {
+    if (s->results.empty())
+    {
+      if (s->eof)
+        lws_callback_on_writable(wsi);
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    auto due = s->results.front().due;
+    if (due <= now)
+      lws_callback_on_writable(wsi);
+    else
+      lws_set_timer_usecs(wsi, std::chrono::duration_cast<std::chrono::microseconds>(due - now).count());
+  }
+
+  static void queueResult(MockSession *s, const char *type, uint64_t audioMs, bool eos)
+  {
+    std::string json = "{\"call_id\": \"" + s->callId + "\", \"segment_id\": " + std::to_string(s->segment) +
+                       ", \"eos\": " + (eos ? "true" : "false") + ", \"type\": \"" + type + "\", \"text\": \"" +
+                       hypothesis(audioMs - s->segmentStartMs) + "\", \"audio_end_ms\": " + std::to_string(audioMs) + "}";
+    s->results.push_back({std::chrono::steady_clock::now() + std::chrono::milliseconds(s->instance->latencyMs), json});
+  }
+
+  static void handleAudio(MockSession *s, size_t len)
+  {
+    s->audioBytes += len;
+    uint64_t audioMs = s->audioBytes * 1000 / (s->sampleRate * 2);
+    if (audioMs - s->segmentStartMs >= opts.segmentMs)
+    {
+      queueResult(s, "complete", audioMs, false);
+      s->segment++;
+      s->segmentStartMs = s->lastPartialMs = audioMs;
+    }
+    else if (audioMs - s->lastPartialMs >= opts.partialEveryMs)
+    {
+      queueResult(s, "partial", audioMs, false);
+      s->lastPartialMs = audioMs;
+    }
+  }
+
+  static void handleText(MockSession *s, const std::string &msg)
+  {
+    if (!s->configured)
+    {
+      std::string model = extractString(msg, "model");
+      if (model.empty())
+      {
+        s->results.push_back({std::chrono::steady_clock::now(), "{\"error\": \"missing model in config\"}"});
+        s->eof = true;
+        return;
+      }
+      s->configured = true;
+      s->callId = extractString(msg, "transaction_id");
+      s->sampleRate = extractNumber(msg, "sample_rate", 8000);
+      if (s->sampleRate <= 0)
+        s->sampleRate = 8000;
+      return;
+    }
+    if (msg.find("\"eof\"") != std::string::npos)
+    {
+      uint64_t audioMs = s->audioBytes * 1000 / (s->sampleRate * 2);
+      queueResult(s, "complete", audioMs, true);
+      s->eof = true;
+    }
+  }
+
+  static int callback(struct lws *wsi, enum lws_callback_reasons reason, void *user, void *in, size_t len)
+  {
+    MockSession **ppS = (MockSession **)user;
+
+    switch (reason)
+    {
+    case LWS_CALLBACK_FILTER_PROTOCOL_CONNECTION:
+    {
+      MockInstance *instance = (MockInstance *)lws_vhost_user(lws_get_vhost(wsi));
+      if (instance && instance->failing)
+      {
+        lwsl_info("instance %d rejecting handshake\n", instance->index);
+        return -1;
+      }
+    }
+    break;
+
+    case LWS_CALLBACK_ESTABLISHED:
+      *ppS = new MockSession();
+      (*ppS)->instance = (MockInstance *)lws_vhost_user(lws_get_vhost(wsi));
+      break;
+
+    case LWS_CALLBACK_CLOSED:
+      delete *ppS;
+      *ppS = nullptr;
+      break;
+
+    case LWS_CALLBACK_RECEIVE:
+    {
+      MockSession *s = *ppS;
+      if (!s)
+        return -1;
+      if (lws_frame_is_binary(wsi))
+      {
+        if (s->configured && !s->eof)
+          handleAudio(s, len);
+      }
+      else
+      {
+        s->rx.append((const char *)in, len);
+        if (lws_is_final_fragment(wsi))
+        {
+          handleText(s, s->rx);
+          s->rx.clear();
+        }
+      }
+      scheduleNext(wsi, s);
+    }
+    break;
+
+    case LWS_CALLBACK_TIMER:
+      lws_callback_on_writable(wsi);
+      break;
+
+    case LWS_CALLBACK_SERVER_WRITEABLE:
+    {
+      MockSession *s = *ppS;
+      if (!s)
+        return -1;
+      if (!s->results.empty() && s->results.front().due <= std::chrono::steady_clock::now())
+      {
+        std::string &json = s->results.front().json;
+        uint8_t buf[LWS_PRE + json.length()];
+        memcpy(buf + LWS_PRE, json.c_str(), json.length());
+        if (lws_write(wsi, buf + LWS_PRE, json.length(), LWS_WRITE_TEXT) < (int)json.length())
+          return -1;
+        s->results.pop_front();
+      }
+      else if (s->results.empty() && s->eof)
+      {
+        lws_close_reason(wsi, LWS_CLOSE_STATUS_NORMAL, NULL, 0);
+        return -1;
+      }
+      scheduleNext(wsi, s);
+    }
+    break;
+
+    default:
+      break;
+    }
+    return lws_callback_http_dummy(wsi, reason, user, in, len);
+  }
+
+  static void usage(const char *prog)
+  {
+    fprintf(stderr,
+            "usage: %s [--port n] [--cert file --key file] [--latency-ms n[,n...]] [--partial-every-ms n]\n"
+            "          [--segment-ms n] [--instances n] [--fail-instance k] [--down k:from[:to]] [--deflate] [--verbose]\n"
+            "  --instances n       listen on n consecutive ports from --port\n"
+            "  --latency-ms a,b    result latency of each instance; the last value repeats\n"
+            "  --fail-instance k   instance k (from 0) rejects every handshake\n"
+            "  --down k:from:to    instance k stops listening and drops its calls from 'from' to 'to'\n"
+            "                      secs after start (for good if 'to' is left out)\n"
+            "  --deflate           accept permessage-deflate\n",
+            prog);
+  }
+
+  static std::vector<unsigned int> parseList(const char *arg)
+  {
+    std::vector<unsigned int> values;
+    for (const char *p = arg; p && *p; p = strchr(p, ','), p = p ? p + 1 : p)
+      values.push_back(::atoi(p));
+    return values;
+  }
+
+  static const struct lws_protocols protocols[] = {
+      {
+          "",
+          callback,
+          sizeof(void *),
+          64 * 1024,
+      },
+      {NULL, NULL, 0, 0}};
+
+  static const struct lws_extension extensions[] = {
+      {"permessage-deflate", lws_extension_callback_pm_deflate, "permessage-deflate"},
+      {NULL, NULL, NULL}};
+
+  static bool startInstance(struct lws_context *context, MockInstance &instance)
+  {
+    struct lws_context_creation_info info;
+    memset(&info, 0, sizeof info);
+    info.port = instance.port;
+    info.protocols = protocols;
+    info.vhost_name = instance.name.c_str();
+    info.user = &instance;
+    if (opts.deflate)
+      info.extensions = extensions;
+    if (opts.cert)
+    {
+      info.ssl_cert_filepath = opts.cert;
+      info.ssl_private_key_filepath = opts.key;
+    }
+    instance.vhost = lws_create_vhost(context, &info);
+    if (!instance.vhost)
+    {
+      fprintf(stderr, "failed listening on port %d\n", instance.port);
+      return false;
+    }
+    lwsl_notice("instance %d listening on port %d (%s), latency %ums%s\n", instance.index, instance.port, opts.cert ? "tls" : "plain",
+                instance.latencyMs, instance.failing ? ", rejecting handshakes" : "");
+    return true;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  std::vector<unsigned int> failing;
+  std::vector<std::vector<unsigned int>> downs;
+  for (int i = 1; i < argc; i++)
+  {
+    std::string arg = argv[i];
+    bool hasValue = i + 1 < argc;
+    if (arg == "--port" && hasValue)
+      opts.port = ::atoi(argv[++i]);
+    else if (arg == "--cert" && hasValue)
+      opts.cert = argv[++i];
+    else if (arg == "--key" && hasValue)
+      opts.key = argv[++i];
+    else if (arg == "--latency-ms" && hasValue)
+      opts.latencyMs = parseList(argv[++i]);
+    else if (arg == "--instances" && hasValue)
+      opts.instances = std::max(1, ::atoi(argv[++i]));
+    else if (arg == "--fail-instance" && hasValue)
+      failing.push_back(::atoi(argv[++i]));
+    else if (arg == "--down" && hasValue)
+      downs.push_back(parseList(argv[++i]));
+    else if (arg == "--partial-every-ms" && hasValue)
+      opts.partialEveryMs = std::max(20, ::atoi(argv[++i]));
+    else if (arg == "--segment-ms" && hasValue)
+      opts.segmentMs = std::max(20, ::atoi(argv[++i]));
+    else if (arg == "--deflate")
+      opts.deflate = true;
+    else if (arg == "--verbose")
+      opts.logLevel |= LLL_INFO;
+    else
+    {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!opts.cert != !opts.key)
+  {
+    fprintf(stderr, "--cert and --key must be given together\n");
+    return 1;
+  }
+  if (opts.latencyMs.empty())
+    opts.latencyMs.push_back(100);
+
+  instances.resize(opts.instances);
+  for (unsigned int k = 0; k < opts.instances; k++)
+  {
+    MockInstance &instance = instances[k];
+    instance.index = k;
+    instance.port = opts.port + k;
+    instance.latencyMs = opts.latencyMs[std::min<size_t>(k, opts.latencyMs.size() - 1)];
+    instance.name = "mock" + std::to_string(k);
+  }
+  for (unsigned int k : failing)
+  {
+    if (k < instances.size())
+      instances[k].failing = true;
+  }
+  for (const std::vector<unsigned int> &down : downs)
+  {
+    if (down.size() < 2 || down[0] >= instances.size())
+    {
+      usage(argv[0]);
+      return 1;
+    }
+    instances[down[0]].downAtSecs = down[1];
+    instances[down[0]].upAtSecs = down.size() > 2 ? (long)down[2] : -1;
+  }
+
+  signal(SIGINT, sigint_handler);
+  signal(SIGTERM, sigint_handler);
+  lws_set_log_level(opts.logLevel, NULL);
+
+  struct lws_context_creation_info info;
+  memset(&info, 0, sizeof info);
+  info.port = CONTEXT_PORT_NO_LISTEN;
+  info.options = LWS_SERVER_OPTION_EXPLICIT_VHOSTS;
+  if (opts.cert)
+    info.options |= LWS_SERVER_OPTION_DO_SSL_GLOBAL_INIT;
+
+  struct lws_context *context = lws_create_context(&info);
+  if (!context)
+  {
+    fprintf(stderr, "failed creating lws context\n");
+    return 1;
+  }
+  for (MockInstance &instance : instances)
+  {
+    if (!startInstance(context, instance))
+    {
+      lws_context_destroy(context);
+      return 1;
+    }
+  }
+  lwsl_notice("mock asr server: %u instance(s) from port %d, partial every %ums, segment %ums\n",
+              opts.instances, opts.port, opts.partialEveryMs, opts.segmentMs);
+
+  auto started = std::chrono::steady_clock::now();
+  while (!interrupted && lws_service(context, 0) >= 0)
+  {
+    // outages start and end at the next service wakeup, within about a second
+    long secs = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - started).count();
+    for (MockInstance &instance : instances)
+    {
+      if (instance.vhost && instance.downAtSecs >= 0 && secs >= instance.downAtSecs &&
+          (instance.upAtSecs < 0 || secs < instance.upAtSecs))
+      {
+        lwsl_notice("instance %d going down\n", instance.index);
+        lws_vhost_destroy(instance.vhost);
+        instance.vhost = nullptr;
+      }
+      else if (!instance.vhost && instance.upAtSecs >= 0 && secs >= instance.upAtSecs)
+      {
+        instance.downAtSecs = -1;
+        startInstance(context, instance);
+      }
+    }
+  }
+
+  lws_context_destroy(context);
+  return 0;
+}
@@ -0,0 +1,242 @@
+// bodhi_ring_bench.cpp
+//
+// Throughput of the shared-memory transcript ring (bodhi_ring.h).  Writer threads publish
+// synthetic results through bodhi::TranscriptRing as fast as they can while reader threads,
+// each with its own read-only mapping through the C reader library, follow the ring.  Each
+// reader checks every record's text against the segment it claims to be, so a torn read
+// shows up as "corrupt".  Prints one JSON object per line, as bodhi_microbench does:
+//
+//   {"bench":"ring_publish","writers":1,"records":123,"records_per_sec":456.0,"mb_per_sec":7.8}
+//   {"bench":"ring_read","reader":0,"records":120,"lost":3,"overruns":1,"corrupt":0,...}
+//
+// With --attach it instead follows a live ring (MOD_AUDIO_FORK_SHM_RING) and prints the
+// rate it is read at once a second.
+
+#include "bodhi_ring.h"
+#include "transcript_ring.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+  typedef std::chrono::steady_clock Clock;
+
+  static unsigned int writers = 1;
+  static unsigned int readers = 2;
+  static unsigned int secs = 3;
+  static size_t ringMb = 4;
+  static size_t textBytes = 64;
+  static std::atomic<bool> done(false);
+
+  struct ReaderResult
+  {
+    uint64_t records;
+    uint64_t bytes;
+    uint64_t lost;
+    uint64_t overruns;
+    uint64_t corrupt;
+    uint64_t latencyTotalUs;
+    uint64_t latencyMaxUs;
+  };
+
+  static uint64_t nowUs(void)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+
+  static void usage(const char *prog)
+  {
+    fprintf(stderr,
+            "usage: %s [--writers n] [--readers n] [--secs n] [--ring-mb n] [--text-bytes n]\n"
+            "       %s --attach name\n",
+            prog, prog);
+    exit(1);
+  }
+
+  // a result for segment n: its text is textBytes of one letter, picked by n
+  static std::string result(int n)
+  {
+    return "{\"call_id\":\"bench\",\"segment_id\":" + std::to_string(n) + ",\"eos\":false,\"type\":\"partial\",\"text\":\"" +
+           std::string(textBytes, 'a' + n % 26) + "\",\"audio_end_ms\":" + std::to_string(n * 100) + "}";
+  }
+
+  static void publisher(std::atomic<uint64_t> &published)
+  {
+    std::vector<std::string> results;
+    for (int n = 0; n < 26; n++)
+      results.push_back(result(n));
+    std::string callId = "00000000-0000-0000-0000-000000000000";
+    uint64_t count = 0;
+    while (!done)
+    {
+      const std::string &json = results[count % results.size()];
+      bodhi::TranscriptRing::publish(callId, count, json.data(), json.length());
+      count++;
+    }
+    published += count;
+  }
+
+  static bool intact(const bodhi_ring_result_t &r)
+  {
+    const bodhi_ring_record *rec = r.record;
+    if (rec->segment_id < 0 || rec->text_len != textBytes || rec->type != BODHI_RING_TYPE_PARTIAL)
+      return false;
+    char c = 'a' + rec->segment_id % 26;
+    for (uint32_t i = 0; i < rec->text_len; i++)
+    {
+      if (r.text[i] != c)
+        return false;
+    }
+    return rec->audio_end_ms == rec->segment_id * 100;
+  }
+
+  static void follower(const std::string &name, ReaderResult &out)
+  {
+    memset(&out, 0, sizeof(out));
+    bodhi_ring_reader_t *reader = bodhi_ring_attach(name.c_str());
+    if (!reader)
+    {
+      perror("bodhi_ring_attach");
+      return;
+    }
+    bodhi_ring_result_t r;
+    while (true)
+    {
+      int rc = bodhi_ring_next(reader, &r);
+      if (rc == 0)
+      {
+        if (done)
+          break;
+        std::this_thread::yield();
+        continue;
+      }
+      if (rc < 0)
+        continue;
+      out.records++;
+      out.bytes += r.record->length;
+      if (!intact(r))
+        out.corrupt++;
+      uint64_t latencyUs = nowUs() - r.record->recv_us;
+      out.latencyTotalUs += latencyUs;
+      out.latencyMaxUs = std::max(out.latencyMaxUs, latencyUs);
+    }
+    out.lost = bodhi_ring_lost(reader);
+    out.overruns = bodhi_ring_overruns(reader);
+    bodhi_ring_detach(reader);
+  }
+
+  static int attach(const char *name)
+  {
+    bodhi_ring_reader_t *reader = bodhi_ring_attach(name);
+    if (!reader)
+    {
+      perror("bodhi_ring_attach");
+      return 1;
+    }
+    const bodhi_ring_header *h = bodhi_ring_get_header(reader);
+    fprintf(stderr, "%s: %llu bytes, writer pid %llu\n", name, (unsigned long long)h->data_len, (unsigned long long)h->writer_pid);
+
+    bodhi_ring_result_t r;
+    uint64_t records = 0, bytes = 0;
+    Clock::time_point last = Clock::now();
+    while (!bodhi_ring_closed(reader))
+    {
+      int rc = bodhi_ring_next(reader, &r);
+      if (rc > 0)
+      {
+        records++;
+        bytes += r.record->length;
+      }
+      else if (rc == 0)
+        usleep(1000);
+
+      Clock::time_point now = Clock::now();
+      double elapsed = std::chrono::duration<double>(now - last).count();
+      if (elapsed >= 1)
+      {
+        printf("{\"bench\":\"ring_attach\",\"records_per_sec\":%.1f,\"kb_per_sec\":%.1f,\"lost\":%llu,\"overruns\":%llu}\n",
+               records / elapsed, bytes / 1024.0 / elapsed, (unsigned long long)bodhi_ring_lost(reader),
+               (unsigned long long)bodhi_ring_overruns(reader));
+        fflush(stdout);
+        records = bytes = 0;
+        last = now;
+      }
+    }
+    fprintf(stderr, "%s: closed by the writer\n", name);
+    bodhi_ring_detach(reader);
+    return 0;
+  }
+}
+
+int main(int argc, char **argv)
+{
+  for (int i = 1; i < argc; i++)
+  {
+    if (0 == strcmp(argv[i], "--attach") && i + 1 < argc)
+      return attach(argv[++i]);
+    else if (0 == strcmp(argv[i], "--writers") && i + 1 < argc)
+      writers = std::max(1, atoi(argv[++i]));
+    else if (0 == strcmp(argv[i], "--readers") && i + 1 < argc)
+      readers = std::max(0, atoi(argv[++i]));
+    else if (0 == strcmp(argv[i], "--secs") && i + 1 < argc)
+      secs = std::max(1, atoi(argv[++i]));
+    else if (0 == strcmp(argv[i], "--ring-mb") && i + 1 < argc)
+      ringMb = std::max(1, atoi(argv[++i]));
+    else if (0 == strcmp(argv[i], "--text-bytes") && i + 1 < argc)
+      textBytes = std::max(1, atoi(argv[++i]));
+    else
+      usage(argv[0]);
+  }
+
+  std::string name = "/bodhi-ring-bench-" + std::to_string(getpid());
+  if (!bodhi::TranscriptRing::open(name, ringMb * 1024 * 1024))
+  {
+    fprintf(stderr, "cannot create %s\n", name.c_str());
+    return 1;
+  }
+
+  std::vector<ReaderResult> results(readers);
+  std::vector<std::thread> threads;
+  for (unsigned int i = 0; i < readers; i++)
+    threads.emplace_back(follower, name, std::ref(results[i]));
+  // let the readers attach before anything is published
+  std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+  std::atomic<uint64_t> published(0);
+  Clock::time_point start = Clock::now();
+  std::vector<std::thread> writerThreads;
+  for (unsigned int i = 0; i < writers; i++)
+    writerThreads.emplace_back(publisher, std::ref(published));
+  std::this_thread::sleep_for(std::chrono::seconds(secs));
+  done = true;
+  for (auto &t : writerThreads)
+    t.join();
+  double elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  for (auto &t : threads)
+    t.join();
+
+  bodhi::TranscriptRing::Stats stats = bodhi::TranscriptRing::getStats();
+  printf("{\"bench\":\"ring_publish\",\"writers\":%u,\"text_bytes\":%zu,\"ring_bytes\":%llu,\"records\":%llu,\"records_per_sec\":%.1f,"
+         "\"mb_per_sec\":%.1f}\n",
+         writers, textBytes, (unsigned long long)stats.dataLen, (unsigned long long)stats.records, stats.records / elapsed,
+         stats.bytes / 1048576.0 / elapsed);
+  for (unsigned int i = 0; i < readers; i++)
+  {
+    const ReaderResult &r = results[i];
+    printf("{\"bench\":\"ring_read\",\"reader\":%u,\"records\":%llu,\"records_per_sec\":%.1f,\"mb_per_sec\":%.1f,\"lost\":%llu,"
+           "\"overruns\":%llu,\"corrupt\":%llu,\"avg_latency_us\":%.1f,\"max_latency_us\":%llu}\n",
+           i, (unsigned long long)r.records, r.records / elapsed, r.bytes / 1048576.0 / elapsed, (unsigned long long)r.lost,
+           (unsigned long long)r.overruns, (unsigned long long)r.corrupt, r.records ? (double)r.latencyTotalUs / r.records : 0.0,
+           (unsigned long long)r.latencyMaxUs);
+  }
+  bodhi::TranscriptRing::close();
+  return 0;
+}
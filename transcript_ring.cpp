@@ -0,0 +1,186 @@
+// transcript_ring.cpp
+#include "transcript_ring.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <libwebsockets.h>
+
+#include "utils.hpp"
+
+/* record data starts a page into the object */
+#define RING_HEADER_LEN 4096
+
+using namespace bodhi;
+
+std::mutex TranscriptRing::mutex;
+std::atomic<bool> TranscriptRing::opened(false);
+std::string TranscriptRing::name;
+bodhi_ring_header *TranscriptRing::header = nullptr;
+uint8_t *TranscriptRing::data = nullptr;
+size_t TranscriptRing::mapLen = 0;
+TranscriptRing::Stats TranscriptRing::stats = {0, 0, 0, 0, 0};
+
+namespace
+{
+  static uint64_t nowUs(void)
+  {
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  }
+}
+
+bool TranscriptRing::open(const std::string &requested, size_t bytes)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (opened)
+    return true;
+
+  size_t dataLen = 64 * 1024;
+  while (dataLen < bytes && dataLen < ((size_t)1 << 30))
+    dataLen <<= 1;
+  name = requested[0] == '/' ? requested : "/" + requested;
+
+  // readers still mapping a ring left by an earlier run keep it until they reattach
+  shm_unlink(name.c_str());
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if (fd < 0 || 0 != ftruncate(fd, RING_HEADER_LEN + dataLen))
+  {
+    lwsl_err("TranscriptRing::open %s: %s\n", name.c_str(), strerror(errno));
+    if (fd >= 0)
+    {
+      ::close(fd);
+      shm_unlink(name.c_str());
+    }
+    return false;
+  }
+  void *map = mmap(nullptr, RING_HEADER_LEN + dataLen, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  ::close(fd);
+  if (map == MAP_FAILED)
+  {
+    lwsl_err("TranscriptRing::open mmap %s: %s\n", name.c_str(), strerror(errno));
+    shm_unlink(name.c_str());
+    return false;
+  }
+
+  mapLen = RING_HEADER_LEN + dataLen;
+  header = (bodhi_ring_header *)map;
+  data = (uint8_t *)map + RING_HEADER_LEN;
+  header->version = BODHI_RING_VERSION;
+  header->header_len = RING_HEADER_LEN;
+  header->data_len = dataLen;
+  header->created_us = nowUs();
+  header->writer_pid = getpid();
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy(header->magic, BODHI_RING_MAGIC, sizeof(header->magic));
+
+  stats = {0, 0, 0, 0, dataLen};
+  opened = true;
+  return true;
+}
+
+void TranscriptRing::close(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!opened)
+    return;
+  opened = false;
+  __atomic_store_n(&header->closed, 1, __ATOMIC_RELEASE);
+  munmap(header, mapLen);
+  shm_unlink(name.c_str());
+  header = nullptr;
+  data = nullptr;
+}
+
+void TranscriptRing::publish(const std::string &callId, uint64_t callMs, const char *json, size_t len)
+{
+  static thread_local utils::ResultFields fields;
+  if (!utils::parseResult(json, len, fields))
+    return;
+
+  bodhi_ring_record rec;
+  memset(&rec, 0, sizeof(rec));
+  rec.type = fields.complete ? BODHI_RING_TYPE_COMPLETE : fields.partial ? BODHI_RING_TYPE_PARTIAL : BODHI_RING_TYPE_OTHER;
+  rec.eos = fields.eos;
+  rec.call_id_len = std::min(callId.length(), (size_t)UINT8_MAX);
+  rec.segment_id = fields.segmentId;
+  rec.text_len = fields.text.length();
+  rec.recv_us = nowUs();
+  rec.call_ms = callMs;
+  rec.audio_end_ms = fields.audioEndMs;
+  rec.length = BODHI_RING_ALIGN(sizeof(rec) + rec.call_id_len + rec.text_len);
+
+  std::lock_guard<std::mutex> lk(mutex);
+  if (!opened)
+    return;
+  if (rec.length > header->data_len / 4)
+  {
+    stats.dropped++;
+    return;
+  }
+  write(rec, callId.data(), fields.text);
+}
+
+void TranscriptRing::copyIn(uint64_t pos, const void *src, size_t len)
+{
+  uint64_t off = pos & (header->data_len - 1);
+  uint64_t first = header->data_len - off;
+  if (first >= len)
+    memcpy(data + off, src, len);
+  else
+  {
+    memcpy(data + off, src, first);
+    memcpy(data, (const uint8_t *)src + first, len - first);
+  }
+}
+
+void TranscriptRing::write(const bodhi_ring_record &r, const char *callId, const std::string &text)
+{
+  uint64_t dataLen = header->data_len;
+  uint64_t head = header->head;
+  uint64_t end = head + r.length;
+
+  // step the tail past the records this one overwrites; their lengths are still intact
+  uint64_t tail = header->tail;
+  while (end - tail > dataLen)
+  {
+    uint32_t length;
+    uint64_t off = tail & (dataLen - 1);
+    if (dataLen - off >= sizeof(length))
+      memcpy(&length, data + off, sizeof(length));
+    else
+    {
+      memcpy(&length, data + off, dataLen - off);
+      memcpy((uint8_t *)&length + (dataLen - off), data, sizeof(length) - (dataLen - off));
+    }
+    tail += length;
+    stats.overwritten++;
+  }
+  __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+
+  // readers check reserved after copying a record out: it has to move before the bytes do
+  __atomic_store_n(&header->reserved, end, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  bodhi_ring_record rec = r;
+  rec.seq = header->records;
+  copyIn(head, &rec, sizeof(rec));
+  copyIn(head + sizeof(rec), callId, rec.call_id_len);
+  copyIn(head + sizeof(rec) + rec.call_id_len, text.data(), rec.text_len);
+
+  __atomic_store_n(&header->records, rec.seq + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&header->head, end, __ATOMIC_RELEASE);
+  stats.records++;
+  stats.bytes += rec.length;
+}
+
+TranscriptRing::Stats TranscriptRing::getStats(void)
+{
+  std::lock_guard<std::mutex> lk(mutex);
+  return stats;
+}
@@ -0,0 +1,56 @@
+#ifndef __BODHI_TRANSCRIPT_RING_HPP__
+#define __BODHI_TRANSCRIPT_RING_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+#include "bodhi_ring.h"
+
+namespace bodhi
+{
+
+  // Writer side of the shared-memory transcript ring (format in bodhi_ring.h).  publish() is
+  // called from the transport's service threads with each result received; it parses the
+  // result outside the lock and then copies a fixed-header record into the ring, overwriting
+  // the oldest records.  Readers in other processes never block it.
+  class TranscriptRing
+  {
+  public:
+    struct Stats
+    {
+      uint64_t records;
+      uint64_t bytes;
+      uint64_t overwritten; // records a reader that fell a whole ring behind would have lost
+      uint64_t dropped;     // larger than a quarter of the ring
+      uint64_t dataLen;
+    };
+
+    // creates (replacing any left over) the POSIX shared memory object name, with bytes of
+    // record space rounded up to a power of two
+    static bool open(const std::string &name, size_t bytes);
+    // marks the ring closed for its readers and removes the name
+    static void close(void);
+    static bool isOpen(void) { return opened; }
+
+    static void publish(const std::string &callId, uint64_t callMs, const char *json, size_t len);
+    static Stats getStats(void);
+
+  private:
+    // with mutex held
+    static void write(const bodhi_ring_record &rec, const char *callId, const std::string &text);
+    static void copyIn(uint64_t pos, const void *src, size_t len);
+
+    static std::mutex mutex;
+    static std::atomic<bool> opened;
+    static std::string name;
+    static bodhi_ring_header *header;
+    static uint8_t *data;
+    static size_t mapLen;
+    static Stats stats;
+  };
+
+} // namespace bodhi
+#endif
@@ -0,0 +1,50 @@
+#ifndef __BODHI_TRANSPORT_HPP__
+#define __BODHI_TRANSPORT_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace bodhi
+{
+  class AudioPipe;
+
+  // Sink for outgoing frames, handed to AudioPipe::onWritable by a transport.
+  // buf always has LWS_PRE bytes of writable headroom in front of it.
+  class FrameWriter
+  {
+  public:
+    virtual ~FrameWriter() {}
+    // returns the number of bytes accepted, or a negative value on error
+    virtual int write(uint8_t *buf, size_t len, bool binary) = 0;
+  };
+
+  // A transport moves AudioPipe frames to and from the ASR service.  All calls are
+  // asynchronous: outcomes are reported back through the AudioPipe::on* handlers,
+  // from whichever thread services the connection.
+  class Transport
+  {
+  public:
+    virtual ~Transport() {}
+
+    virtual const char *name() const = 0;
+
+    // start connecting; ends in AudioPipe::onConnected or AudioPipe::onConnectFail, or in
+    // AudioPipe::onConnectCancelled if the pipe finishes while the connect is still queued
+    virtual void connect(AudioPipe *ap) = 0;
+
+    // the pipe has text or audio queued; the transport calls AudioPipe::onWritable when it can send
+    virtual void requestWrite(AudioPipe *ap) = 0;
+
+    // call AudioPipe::onTimer once, ms from now, replacing a timer already set; only called from
+    // the thread servicing the connection, and dropped when the connection closes
+    virtual void setTimer(AudioPipe *ap, unsigned int ms) = 0;
+
+    // the pipe is LWS_CLIENT_DISCONNECTING; close after pending text is sent, ends in AudioPipe::onClosed
+    virtual void disconnect(AudioPipe *ap) = 0;
+
+    // the pipe is being destroyed; free any per-pipe state
+    virtual void release(AudioPipe *ap) = 0;
+  };
+
+} // namespace bodhi
+#endif
@@ -1,7 +1,12 @@
 #include "utils.hpp"
 #include "jsmn.h"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <regex>
+#include <sstream>
 
 namespace utils {
 
@@ -55,4 +60,286 @@ bool hasJsonKey(const char* json, const char* keyName) {
     return false;
 }
 
+long getJsonInt(const char* json, size_t len, const char* keyName, long defaultValue) {
+    jsmn_parser parser;
+    jsmntok_t tokens[512];
+    int r, i;
+
+    jsmn_init(&parser);
+    r = jsmn_parse(&parser, json, len, tokens, sizeof(tokens)/sizeof(tokens[0]));
+    if (r < 1 || tokens[0].type != JSMN_OBJECT) {
+        return defaultValue;
+    }
+
+    int keyLen = std::strlen(keyName);
+    for (i = 1; i + 1 < r; i++) {
+        jsmntok_t key = tokens[i];
+        jsmntok_t value = tokens[i + 1];
+        if (key.type == JSMN_STRING && key.end - key.start == keyLen &&
+            std::strncmp(json + key.start, keyName, keyLen) == 0 &&
+            (value.type == JSMN_PRIMITIVE || value.type == JSMN_STRING)) {
+            // accept both 3 and "3"
+            char* end;
+            long n = std::strtol(json + value.start, &end, 10);
+            return end == json + value.end ? n : defaultValue;
+        }
+        // skip over the value, including any nested tokens
+        int valueEnd = value.end;
+        for (i += 1; i + 1 < r && tokens[i + 1].start < valueEnd; i++)
+            ;
+    }
+    return defaultValue;
+}
+
+static void unescapeJson(const char* json, int start, int end, std::string& out);
+
+bool getJsonString(const char* json, size_t len, const char* keyName, std::string& out) {
+    jsmn_parser parser;
+    jsmntok_t tokens[512];
+    int r, i;
+
+    jsmn_init(&parser);
+    r = jsmn_parse(&parser, json, len, tokens, sizeof(tokens)/sizeof(tokens[0]));
+    if (r < 1 || tokens[0].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    int keyLen = std::strlen(keyName);
+    for (i = 1; i + 1 < r; i++) {
+        jsmntok_t key = tokens[i];
+        jsmntok_t value = tokens[i + 1];
+        if (key.type == JSMN_STRING && key.end - key.start == keyLen &&
+            std::strncmp(json + key.start, keyName, keyLen) == 0 && value.type == JSMN_STRING) {
+            out.clear();
+            unescapeJson(json, value.start, value.end, out);
+            return true;
+        }
+        // skip over the value, including any nested tokens
+        int valueEnd = value.end;
+        for (i += 1; i + 1 < r && tokens[i + 1].start < valueEnd; i++)
+            ;
+    }
+    return false;
+}
+
+bool isSegmentFinal(const char* json, size_t len) {
+    jsmn_parser parser;
+    jsmntok_t tokens[512];
+    int r, i;
+
+    jsmn_init(&parser);
+    r = jsmn_parse(&parser, json, len, tokens, sizeof(tokens)/sizeof(tokens[0]));
+    if (r < 1 || tokens[0].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    for (i = 1; i + 1 < r; i++) {
+        jsmntok_t key = tokens[i];
+        jsmntok_t value = tokens[i + 1];
+        int keyLen = key.end - key.start;
+        int valueLen = value.end - value.start;
+        if (key.type == JSMN_STRING && keyLen == 3 && std::strncmp(json + key.start, "eos", 3) == 0 &&
+            value.type == JSMN_PRIMITIVE && valueLen == 4 && std::strncmp(json + value.start, "true", 4) == 0) {
+            return true;
+        }
+        if (key.type == JSMN_STRING && keyLen == 4 && std::strncmp(json + key.start, "type", 4) == 0 &&
+            value.type == JSMN_STRING && valueLen == 8 && std::strncmp(json + value.start, "complete", 8) == 0) {
+            return true;
+        }
+        // skip over the value, including any nested tokens
+        int valueEnd = value.end;
+        for (i += 1; i + 1 < r && tokens[i + 1].start < valueEnd; i++)
+            ;
+    }
+    return false;
+}
+
+// Appends the JSON string body json[start, end) to out with its escapes undone
+static void unescapeJson(const char* json, int start, int end, std::string& out) {
+    out.reserve(out.size() + end - start);
+    for (int i = start; i < end; i++) {
+        char c = json[i];
+        if (c != '\\' || i + 1 >= end) {
+            out += c;
+            continue;
+        }
+        c = json[++i];
+        switch (c) {
+            case 'b': out += '\b'; break;
+            case 'f': out += '\f'; break;
+            case 'n': out += '\n'; break;
+            case 'r': out += '\r'; break;
+            case 't': out += '\t'; break;
+            case 'u': {
+                if (i + 4 >= end)
+                    return;
+                unsigned long cp = std::strtoul(std::string(json + i + 1, 4).c_str(), nullptr, 16);
+                i += 4;
+                // a surrogate pair is two escapes
+                if (cp >= 0xd800 && cp < 0xdc00 && i + 6 < end && json[i + 1] == '\\' && json[i + 2] == 'u') {
+                    unsigned long lo = std::strtoul(std::string(json + i + 3, 4).c_str(), nullptr, 16);
+                    if (lo >= 0xdc00 && lo < 0xe000) {
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                        i += 6;
+                    }
+                }
+                if (cp < 0x80) {
+                    out += (char)cp;
+                }
+                else if (cp < 0x800) {
+                    out += (char)(0xc0 | (cp >> 6));
+                    out += (char)(0x80 | (cp & 0x3f));
+                }
+                else if (cp < 0x10000) {
+                    out += (char)(0xe0 | (cp >> 12));
+                    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+                    out += (char)(0x80 | (cp & 0x3f));
+                }
+                else {
+                    out += (char)(0xf0 | (cp >> 18));
+                    out += (char)(0x80 | ((cp >> 12) & 0x3f));
+                    out += (char)(0x80 | ((cp >> 6) & 0x3f));
+                    out += (char)(0x80 | (cp & 0x3f));
+                }
+                break;
+            }
+            default: out += c; break;  // \" \\ \/
+        }
+    }
+}
+
+bool parseResult(const char* json, size_t len, ResultFields& fields) {
+    jsmn_parser parser;
+    jsmntok_t tokens[512];
+    int r, i;
+
+    fields.segmentId = fields.audioEndMs = -1;
+    fields.eos = fields.partial = fields.complete = false;
+    fields.text.clear();
+    fields.textStart = fields.textEnd = -1;
+
+    jsmn_init(&parser);
+    r = jsmn_parse(&parser, json, len, tokens, sizeof(tokens)/sizeof(tokens[0]));
+    if (r < 1 || tokens[0].type != JSMN_OBJECT) {
+        return false;
+    }
+
+    for (i = 1; i + 1 < r; i++) {
+        jsmntok_t key = tokens[i];
+        jsmntok_t value = tokens[i + 1];
+        std::string name(json + key.start, key.end - key.start);
+        const char* v = json + value.start;
+        int valueLen = value.end - value.start;
+        if (key.type == JSMN_STRING && (value.type == JSMN_PRIMITIVE || value.type == JSMN_STRING)) {
+            if (name == "segment_id" || name == "audio_end_ms") {
+                char* end;
+                long n = std::strtol(v, &end, 10);
+                if (end == json + value.end)
+                    (name == "segment_id" ? fields.segmentId : fields.audioEndMs) = n;
+            }
+            else if (name == "eos") {
+                fields.eos = valueLen == 4 && std::strncmp(v, "true", 4) == 0;
+            }
+            else if (name == "type" && value.type == JSMN_STRING) {
+                fields.partial = valueLen == 7 && std::strncmp(v, "partial", 7) == 0;
+                fields.complete = valueLen == 8 && std::strncmp(v, "complete", 8) == 0;
+            }
+            else if (name == "text" && value.type == JSMN_STRING) {
+                unescapeJson(json, value.start, value.end, fields.text);
+                fields.textStart = value.start;
+                fields.textEnd = value.end;
+            }
+        }
+        // skip over the value, including any nested tokens
+        int valueEnd = value.end;
+        for (i += 1; i + 1 < r && tokens[i + 1].start < valueEnd; i++)
+            ;
+    }
+    return true;
+}
+
+size_t utf8CommonPrefix(const char* a, size_t aLen, const char* b, size_t bLen) {
+    size_t n = std::min(aLen, bLen);
+    size_t i = 0;
+    while (i < n && a[i] == b[i])
+        i++;
+    // back off to the lead byte of a character that differs part way through
+    while (i > 0 && ((i < aLen && (a[i] & 0xc0) == 0x80) || (i < bLen && (b[i] & 0xc0) == 0x80)))
+        i--;
+    return i;
+}
+
+std::string encodeURIComponent(const std::string& decoded) {
+    std::ostringstream oss;
+    std::regex r("[!'\\(\\)*-.0-9A-Za-z_~:]");
+
+    for (const char &c : decoded) {
+        if (std::regex_match((std::string){c}, r)) {
+            oss << c;
+        }
+        else {
+            oss << "%" << std::uppercase << std::hex << (0xff & c);
+        }
+    }
+    return oss.str();
+}
+
+bool splitHostPort(const std::string& hostPort, std::string& host, std::string& port) {
+    if (!hostPort.empty() && hostPort[0] == '[') {
+        size_t close = hostPort.find(']');
+        if (close == std::string::npos)
+            return false;
+        if (close + 1 < hostPort.length()) {
+            if (hostPort[close + 1] != ':')
+                return false;
+            port = hostPort.substr(close + 2);
+        }
+        host = hostPort.substr(1, close - 1);
+        return true;
+    }
+    size_t colon = hostPort.find(':');
+    if (colon == std::string::npos || hostPort.find(':', colon + 1) != std::string::npos) {
+        host = hostPort;
+        return true;
+    }
+    host = hostPort.substr(0, colon);
+    port = hostPort.substr(colon + 1);
+    return true;
+}
+
+std::string escapeJson(const std::string& s) {
+    std::string out;
+    out.reserve(s.length());
+    for (const char &c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        }
+        else if ((unsigned char)c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        }
+        else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+std::string buildConfigMessage(int sampleRate, const std::string& transactionId, const std::string& modelName) {
+    return "{\"config\": {\"sample_rate\": " + std::to_string(sampleRate) + ", \"transaction_id\": \"" + escapeJson(transactionId) +
+           "\", \"model\": \"" + escapeJson(modelName) + "\"}}";
+}
+
+std::string buildConnectFailMessage(int httpStatus) {
+    std::stringstream json;
+    json << "{"
+         << "\"message\":\"" << http_status_text(httpStatus) << "\","
+         << "\"code\":" << httpStatus << ","
+         << "\"timestamp\":\"" << getCurrentTimestamp() << "\""
+         << "}";
+    return json.str();
+}
+
 } // namespace utils
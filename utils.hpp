@@ -10,4 +10,49 @@ namespace utils {
     // Returns true if the top-level JSON object contains the specified key
     bool hasJsonKey(const char* json, const char* keyName);
 
+    // Value of an integer (or integer string) key in the top-level JSON object, or defaultValue
+    long getJsonInt(const char* json, size_t len, const char* keyName, long defaultValue);
+
+    // Unescaped value of a string key in the top-level JSON object; false if absent
+    bool getJsonString(const char* json, size_t len, const char* keyName, std::string& out);
+
+    // True for a result that closes a segment ("type": "complete" or "eos": true)
+    bool isSegmentFinal(const char* json, size_t len);
+
+    // The fields of a transcription result that are published outside of its JSON
+    struct ResultFields {
+        long segmentId;    // -1 if absent
+        long audioEndMs;   // -1 if absent
+        bool eos;
+        bool partial;      // "type": "partial"
+        bool complete;     // "type": "complete"
+        std::string text;  // unescaped UTF-8
+        int textStart;     // the escaped text inside json, -1 if absent
+        int textEnd;
+    };
+
+    // Fills fields from a result in one parse; false if json is not an object
+    bool parseResult(const char* json, size_t len, ResultFields& fields);
+
+    // Length in bytes of the longest common prefix of two UTF-8 strings that ends on a
+    // character boundary in both
+    size_t utf8CommonPrefix(const char* a, size_t aLen, const char* b, size_t bLen);
+
+    // Percent-encodes everything outside of [!'()*+,-.0-9A-Za-z_~:]
+    std::string encodeURIComponent(const std::string& decoded);
+
+    // Splits host[:port], or [IPv6 address][:port], into the host without brackets and the port
+    // (left as it is when absent); an unbracketed host with more than one colon is an IPv6
+    // address without a port.  False if a bracket is not closed or is followed by anything but :port
+    bool splitHostPort(const std::string& hostPort, std::string& host, std::string& port);
+
+    // Escapes quotes, backslashes and control characters for use inside a JSON string
+    std::string escapeJson(const std::string& s);
+
+    // Config message sent to bodhi once the websocket is established
+    std::string buildConfigMessage(int sampleRate, const std::string& transactionId, const std::string& modelName);
+
+    // Body of the connect_failed event for a failed websocket handshake
+    std::string buildConnectFailMessage(int httpStatus);
+
 }
\ No newline at end of file